@@ -0,0 +1,248 @@
+#include "image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Measures how fast the FAT32 parsing code of the fat32 server goes through a
+ * volume: how many directory entries it decodes per second while walking the
+ * whole tree, how many FAT entries it follows per second when walking every
+ * cluster chain, and how fast the data of all files can be read. Every pass is
+ * repeated a number of times, after a warm-up pass that also takes an
+ * inventory of the volume, so the image is normally in the page cache and the
+ * numbers are those of the code rather than of the disk. */
+
+#define READ_BUF_SIZE (1024 * 1024)
+
+typedef struct chain_t {
+	int first_cluster;
+	uint32_t size_bytes;
+	int is_directory;
+} chain_t;
+
+static chain_t *chains;
+static int nr_chains;
+static int max_chains;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_chain(int first_cluster, uint32_t size_bytes, int is_directory) {
+	if (nr_chains == max_chains) {
+		max_chains = max_chains ? max_chains * 2 : 1024;
+		chains = (chain_t*) realloc(chains, max_chains * sizeof(chain_t));
+		if (!chains) {
+			fprintf(stderr, "fatbench: out of memory\n");
+			exit(1);
+		}
+	}
+
+	chains[nr_chains].first_cluster = first_cluster;
+	chains[nr_chains].size_bytes = size_bytes;
+	chains[nr_chains].is_directory = is_directory;
+	nr_chains++;
+}
+
+/* Reads a directory and everything below it, returning the number of entries
+ * that were read or an error code. The chains found are recorded if
+ * inventory is set. */
+static long walk_dir(fat_image_t* image, int cluster_nr, int inventory) {
+	fat32_dirent_t entry;
+	fat_dir_t dir;
+	long nr_entries = 0;
+	int ret;
+
+	if ((ret = image_open_dir(image, cluster_nr, &dir)) != OK) {
+		return ret;
+	}
+
+	while ((ret = image_read_dir(&dir, &entry)) == TRUE) {
+		nr_entries++;
+
+		if (strcmp(entry.filename, ".") == 0 || strcmp(entry.filename, "..") == 0) {
+			continue;
+		}
+
+		int first_cluster = (int) entry.first_cluster;
+		int is_directory = entry.attributes & FAT32_ATTR_DIR;
+
+		if (inventory && first_cluster >= 2) {
+			add_chain(first_cluster, entry.size_bytes, is_directory);
+		}
+
+		if (is_directory && first_cluster >= 2) {
+			long sub_entries = walk_dir(image, first_cluster, inventory);
+			if (sub_entries < 0) {
+				image_close_dir(&dir);
+				return sub_entries;
+			}
+
+			nr_entries += sub_entries;
+		}
+	}
+
+	image_close_dir(&dir);
+	return ret < 0 ? ret : nr_entries;
+}
+
+/* Follows all recorded chains to their ends. Returns the number of hops. */
+static long walk_chains(fat_image_t* image) {
+	long nr_hops = 0;
+
+	for (int i = 0; i < nr_chains; i++) {
+		int cluster_nr = chains[i].first_cluster;
+		while (cluster_nr != -1) {
+			if (image_next_cluster(image, cluster_nr, &cluster_nr) != OK) {
+				return FAT32_ERR_INVALID_FAT;
+			}
+
+			nr_hops++;
+		}
+	}
+
+	return nr_hops;
+}
+
+/* Counts the free clusters in the FAT, as the server's free space scan does,
+ * building its bitmap. Returns the number of clusters looked at. */
+static long count_free(fat_image_t* image, uint32_t* bitmap, uint32_t* nr_free) {
+	uint32_t count = (uint32_t) image->info.total_clusters;
+
+	memset(bitmap, 0, (count + 31) / 32 * sizeof(uint32_t));
+	*nr_free = count_free_clusters(image->fat + 2, 2, count, bitmap);
+	return count;
+}
+
+/* Reads the data of all recorded files. Consecutive clusters are read with a
+ * single call, as the server does. Returns the number of bytes read. */
+static long long read_files(fat_image_t* image, char* buf) {
+	int max_run = READ_BUF_SIZE / image->info.bytes_per_cluster;
+	long long nr_bytes = 0;
+	int ret;
+
+	if (max_run < 1) {
+		max_run = 1;
+	}
+
+	for (int i = 0; i < nr_chains; i++) {
+		if (chains[i].is_directory) {
+			continue;
+		}
+
+		long long left = chains[i].size_bytes;
+		int cluster_nr = chains[i].first_cluster;
+		while (left > 0 && cluster_nr != -1) {
+			int run_start = cluster_nr;
+			int run_len = 0;
+			int next;
+
+			do {
+				if ((ret = image_next_cluster(image, cluster_nr, &next)) != OK) {
+					return ret;
+				}
+
+				run_len++;
+				cluster_nr = next;
+			} while (next == run_start + run_len && run_len < max_run &&
+					(long long) run_len * image->info.bytes_per_cluster < left);
+
+			if ((ret = image_read_clusters(image, run_start, run_len, buf)) != OK) {
+				return ret;
+			}
+
+			long long run_bytes = (long long) run_len * image->info.bytes_per_cluster;
+			left -= run_bytes;
+			nr_bytes += left < 0 ? run_bytes + left : run_bytes;
+		}
+	}
+
+	return nr_bytes;
+}
+
+static void report(const char* what, double count, const char* unit, double seconds) {
+	printf("%-18s %14.0f %-8s in %8.3f s: %14.0f %s/s\n", what, count, unit, seconds,
+			seconds > 0 ? count / seconds : 0, unit);
+}
+
+int main(int argc, char** argv) {
+	fat_image_t image;
+	int iterations = 5;
+	int ret;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s image [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	if (argc == 3 && (iterations = atoi(argv[2])) < 1) {
+		fprintf(stderr, "fatbench: bad number of iterations: %s\n", argv[2]);
+		return 1;
+	}
+
+	if ((ret = image_open(&image, argv[1])) != OK) {
+		fprintf(stderr, "fatbench: can't open %s as FAT32 (%d)\n", argv[1], ret);
+		return 1;
+	}
+
+	char *buf = (char*) malloc(READ_BUF_SIZE > image.info.bytes_per_cluster ?
+			READ_BUF_SIZE : image.info.bytes_per_cluster);
+	uint32_t *bitmap = (uint32_t*) malloc((image.info.total_clusters + 31) / 32 *
+			sizeof(uint32_t));
+	if (!buf || !bitmap) {
+		fprintf(stderr, "fatbench: out of memory\n");
+		return 1;
+	}
+
+	// The root directory has a chain of its own too.
+	add_chain(image.header.ebr.root_cluster_nr, 0, TRUE);
+	long nr_entries = walk_dir(&image, image.header.ebr.root_cluster_nr, TRUE);
+	long long nr_bytes = read_files(&image, buf);
+	uint32_t nr_free;
+	count_free(&image, bitmap, &nr_free);
+	if (nr_entries < 0 || nr_bytes < 0) {
+		fprintf(stderr, "fatbench: error reading %s (%d)\n", argv[1],
+				(int) (nr_entries < 0 ? nr_entries : nr_bytes));
+		return 1;
+	}
+
+	printf("%s: %d byte clusters, %d clusters (%u free), %ld entries, %d chains\n",
+			argv[1], image.info.bytes_per_cluster, image.info.total_clusters, nr_free,
+			nr_entries, nr_chains);
+
+	double start = now();
+	double total = 0;
+	for (int i = 0; i < iterations; i++) {
+		total += walk_dir(&image, image.header.ebr.root_cluster_nr, FALSE);
+	}
+	report("directory entries", total, "entries", now() - start);
+
+	start = now();
+	total = 0;
+	for (int i = 0; i < iterations; i++) {
+		total += walk_chains(&image);
+	}
+	report("chain hops", total, "hops", now() - start);
+
+	start = now();
+	total = 0;
+	for (int i = 0; i < iterations; i++) {
+		total += count_free(&image, bitmap, &nr_free);
+	}
+	report("free clusters", total, "clusters", now() - start);
+
+	start = now();
+	total = 0;
+	for (int i = 0; i < iterations; i++) {
+		total += read_files(&image, buf);
+	}
+	report("file data", total / (1024 * 1024), "MB", now() - start);
+
+	free(buf);
+	free(bitmap);
+	free(chains);
+	image_close(&image);
+	return 0;
+}
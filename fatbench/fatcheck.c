@@ -0,0 +1,418 @@
+/* fatcheck - check the parsing code of the fat32 server on the host.
+ *
+ * Runs tables of cases through the functions of fat32.c that don't need a
+ * volume: the UTF-16 and UTF-8 codecs, the parser of directory slots, the
+ * making of 8.3 names and the matching of names. Run
+ * it with "make check"; it prints the cases that fail and exits with 1 if
+ * there are any. */
+
+#include "fat32.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static int nr_checks;
+static int nr_failed;
+
+static void check(int ok, const char* what, const char* got, const char* expected) {
+	nr_checks++;
+	if (!ok) {
+		nr_failed++;
+		printf("FAIL: %s: got \"%s\", expected \"%s\"\n", what, got, expected);
+	}
+}
+
+static void check_int(const char* what, int got, int expected) {
+	char got_s[16], expected_s[16];
+
+	snprintf(got_s, sizeof(got_s), "%d", got);
+	snprintf(expected_s, sizeof(expected_s), "%d", expected);
+	check(got == expected, what, got_s, expected_s);
+}
+
+/* UTF-16 to UTF-8. The units end at the first 0. */
+static const struct {
+	const char *what;
+	uint16_t units[8];
+	size_t dest_size;
+	const char *expected;
+} utf16_cases[] = {
+	{ "ascii", { 'a', 'b', 'c' }, 16, "abc" },
+	{ "two bytes", { 0x00e9 }, 16, "\xc3\xa9" },
+	{ "three bytes", { 0x20ac }, 16, "\xe2\x82\xac" },
+	{ "surrogate pair", { 0xd83d, 0xde00 }, 16, "\xf0\x9f\x98\x80" },
+	{ "unpaired high surrogate", { 0xd800, 'a' }, 16, "?a" },
+	{ "unpaired low surrogate", { 0xdc00 }, 16, "?" },
+	{ "reversed surrogates", { 0xde00, 0xd83d }, 16, "??" },
+	{ "cut at the end", { 'a', 'b', 'c' }, 3, "ab" },
+	{ "cut before a character", { 'a', 0x20ac }, 3, "a" },
+};
+
+static void check_utf16_to_utf8(void) {
+	char dest[16];
+
+	for (size_t i = 0; i < sizeof(utf16_cases) / sizeof(utf16_cases[0]); i++) {
+		size_t len = fat32_utf16_to_utf8(utf16_cases[i].units, 8, dest,
+				utf16_cases[i].dest_size);
+
+		check(strcmp(dest, utf16_cases[i].expected) == 0 && len == strlen(dest),
+				utf16_cases[i].what, dest, utf16_cases[i].expected);
+	}
+}
+
+/* UTF-8 to UTF-16. nr_units is -1 for names that must be refused. */
+static const struct {
+	const char *what;
+	const char *name;
+	size_t dest_units;
+	int nr_units;
+	uint16_t units[4];
+} utf8_cases[] = {
+	{ "ascii", "ab", 8, 2, { 'a', 'b' } },
+	{ "two bytes", "\xc3\xa9", 8, 1, { 0x00e9 } },
+	{ "three bytes", "\xe2\x82\xac", 8, 1, { 0x20ac } },
+	{ "four bytes", "\xf0\x9f\x98\x80", 8, 2, { 0xd83d, 0xde00 } },
+	{ "truncated sequence", "\xc3", 8, -1 },
+	{ "stray continuation", "\x80", 8, -1 },
+	{ "invalid byte", "\xff", 8, -1 },
+	{ "overlong", "\xc0\xaf", 8, -1 },
+	{ "too long", "abc", 2, -1 },
+	{ "pair too long", "a\xf0\x9f\x98\x80", 2, -1 },
+};
+
+static void check_utf8_to_utf16(void) {
+	uint16_t units[8];
+
+	for (size_t i = 0; i < sizeof(utf8_cases) / sizeof(utf8_cases[0]); i++) {
+		int n = fat32_utf8_to_utf16(utf8_cases[i].name, units, utf8_cases[i].dest_units);
+
+		if (n != utf8_cases[i].nr_units) {
+			check_int(utf8_cases[i].what, n, utf8_cases[i].nr_units);
+			continue;
+		}
+
+		check(n < 0 || memcmp(units, utf8_cases[i].units, n * sizeof(uint16_t)) == 0,
+				utf8_cases[i].what, "other units", "the same units");
+	}
+}
+
+/* What is done to the long name slots of an entry before it is parsed. */
+typedef enum slot_change_t {
+	SLOTS_AS_MADE,
+	SLOTS_NONE,          // A short entry only
+	SLOTS_BAD_CHECKSUM,  // The slots are for another short entry
+	SLOTS_ORPHANED,      // The slot with the end of the name is gone
+	SLOTS_SWAPPED,       // Two slots are out of order
+	SLOTS_ORD_0,         // An extra slot with ord 0 (0x80) follows the last one
+	SLOTS_DELETED        // The entry and its slots were deleted
+} slot_change_t;
+
+static const struct {
+	const char *what;
+	const char *long_name;
+	const char *filename_83;
+	slot_change_t change;
+	int result;          // Of the short entry
+	const char *expected;
+} parse_cases[] = {
+	{ "long name", "Long file name.txt", "LONGFI~1TXT", SLOTS_AS_MADE,
+		FAT32_PARSE_ENTRY, "Long file name.txt" },
+	{ "one slot", "short.c", "SHORT   C  ", SLOTS_AS_MADE,
+		FAT32_PARSE_ENTRY, "short.c" },
+	{ "non-ascii", "r\xc3\xa9sum\xc3\xa9.doc", "R_SUM_~1DOC", SLOTS_AS_MADE,
+		FAT32_PARSE_ENTRY, "r\xc3\xa9sum\xc3\xa9.doc" },
+	{ "short entry only", NULL, "README     ", SLOTS_NONE,
+		FAT32_PARSE_ENTRY, "README" },
+	{ "bad checksum", "Long file name.txt", "LONGFI~1TXT", SLOTS_BAD_CHECKSUM,
+		FAT32_PARSE_ENTRY, "LONGFI~1.TXT" },
+	{ "orphaned slots", "Long file name.txt", "LONGFI~1TXT", SLOTS_ORPHANED,
+		FAT32_PARSE_ENTRY, "LONGFI~1.TXT" },
+	{ "slots out of order", "A name that takes three slots", "ANAMET~1   ", SLOTS_SWAPPED,
+		FAT32_PARSE_ENTRY, "ANAMET~1" },
+	{ "ord 0 after the last slot", "short.c", "SHORT   C  ", SLOTS_ORD_0,
+		FAT32_PARSE_ENTRY, "SHORT.C" },
+	{ "deleted", "Long file name.txt", "LONGFI~1TXT", SLOTS_DELETED,
+		FAT32_PARSE_MORE, "" },
+};
+
+/* The parser, with room around it that it must leave alone. */
+static struct {
+	uint8_t before[64];
+	fat32_entry_parser_t parser;
+	uint8_t after[64];
+} guarded;
+
+static void check_parse(void) {
+	fat32_any_direntry_t slots[FAT32_LFN_MAX_SLOTS + 2];
+	fat32_direntry_t short_entry;
+	uint16_t units[FAT32_LFN_MAX_SLOTS * FAT32_LFN_CHARS];
+	uint8_t guard[64];
+	char name[FAT32_MAX_NAME_LEN];
+
+	memset(guard, 0xa5, sizeof(guard));
+	for (size_t i = 0; i < sizeof(parse_cases) / sizeof(parse_cases[0]); i++) {
+		int nr_slots = 0, result = -1;
+
+		memset(slots, 0, sizeof(slots));
+		if (parse_cases[i].change != SLOTS_NONE) {
+			int nr_units = fat32_utf8_to_utf16(parse_cases[i].long_name, units,
+					FAT32_LFN_MAX_SLOTS * FAT32_LFN_CHARS);
+			nr_slots = fat32_make_lfn_slots(units, nr_units,
+					fat32_lfn_checksum((const uint8_t*) parse_cases[i].filename_83),
+					&slots[0].long_entry);
+		}
+
+		switch (parse_cases[i].change) {
+			case SLOTS_BAD_CHECKSUM:
+				for (int j = 0; j < nr_slots; j++) {
+					slots[j].long_entry.checksum++;
+				}
+				break;
+
+			case SLOTS_ORPHANED:
+				memmove(&slots[0], &slots[1], (nr_slots - 1) * sizeof(slots[0]));
+				nr_slots--;
+				break;
+
+			case SLOTS_SWAPPED: {
+				fat32_any_direntry_t slot = slots[1];
+				slots[1] = slots[2];
+				slots[2] = slot;
+				break;
+			}
+
+			case SLOTS_ORD_0:
+				slots[nr_slots] = slots[nr_slots - 1];
+				slots[nr_slots].long_entry.ord = 0x80;
+				nr_slots++;
+				break;
+
+			case SLOTS_DELETED:
+				for (int j = 0; j < nr_slots; j++) {
+					slots[j].long_entry.ord = 0xe5;
+				}
+				break;
+
+			default:
+				break;
+		}
+
+		memcpy(slots[nr_slots].short_entry.filename_83, parse_cases[i].filename_83, 11);
+		slots[nr_slots].short_entry.attributes = FAT32_ATTR_ARCHIVE;
+		if (parse_cases[i].change == SLOTS_DELETED) {
+			slots[nr_slots].short_entry.filename_83[0] = 0xe5;
+		}
+
+		memset(guarded.before, 0xa5, sizeof(guarded.before));
+		memset(guarded.after, 0xa5, sizeof(guarded.after));
+		fat32_parser_reset(&guarded.parser);
+		name[0] = '\0';
+		for (int j = 0; j <= nr_slots; j++) {
+			result = fat32_parse_slot(&guarded.parser, &slots[j], &short_entry, name);
+		}
+
+		check_int(parse_cases[i].what, result, parse_cases[i].result);
+		if (result == FAT32_PARSE_ENTRY) {
+			check(strcmp(name, parse_cases[i].expected) == 0, parse_cases[i].what, name,
+					parse_cases[i].expected);
+		}
+
+		check(memcmp(guarded.before, guard, sizeof(guard)) == 0 &&
+				memcmp(guarded.after, guard, sizeof(guard)) == 0,
+				parse_cases[i].what, "memory around the parser changed", "left alone");
+	}
+
+	// The end of the directory.
+	memset(slots, 0, sizeof(slots));
+	fat32_parser_reset(&guarded.parser);
+	check_int("end of directory", fat32_parse_slot(&guarded.parser, &slots[0],
+				&short_entry, name), FAT32_PARSE_FREE);
+}
+
+/* The 8.3 names of new entries, and whether they need a long name. */
+static const struct {
+	const char *name;
+	const char *filename_83;
+	int is_exact;
+} short_name_cases[] = {
+	{ "FOO.TXT", "FOO     TXT", TRUE },
+	{ "README", "README     ", TRUE },
+	{ "foo.txt", "FOO     TXT", FALSE },
+	{ "Long file name.text", "LONGFILETEX", FALSE },
+	{ ".bashrc", "BASHRC     ", FALSE },
+	{ "a.b.c", "AB      C  ", FALSE },
+	{ "a+b[1].c", "A_B_1_  C  ", FALSE },
+	{ "r\xc3\xa9sum\xc3\xa9.doc", "R_SUM_  DOC", FALSE },
+	{ "..", "_          ", FALSE },
+};
+
+static void check_short_names(void) {
+	uint8_t filename_83[12];
+
+	for (size_t i = 0; i < sizeof(short_name_cases) / sizeof(short_name_cases[0]); i++) {
+		int is_exact = fat32_make_short_name(short_name_cases[i].name, filename_83);
+
+		filename_83[11] = '\0';
+		check(strcmp((char*) filename_83, short_name_cases[i].filename_83) == 0,
+				short_name_cases[i].name, (char*) filename_83,
+				short_name_cases[i].filename_83);
+		check_int(short_name_cases[i].name, is_exact, short_name_cases[i].is_exact);
+	}
+}
+
+/* Numeric tails: the name fat32_set_short_tail makes from a basis, and what
+ * fat32_short_tail says of an 8.3 name. */
+static const struct {
+	const char *basis;
+	int n;
+	const char *filename_83;
+} set_tail_cases[] = {
+	{ "LONGFILETXT", 1, "LONGFI~1TXT" },
+	{ "LONGFILETXT", 12, "LONGF~12TXT" },
+	{ "LONGFILETXT", 9999, "LON~9999TXT" },
+	{ "AB      C  ", 7, "AB~7    C  " },
+};
+
+static const struct {
+	const char *what;
+	const char *filename_83;
+	const char *basis;
+	int n;
+} tail_cases[] = {
+	{ "one digit", "LONGFI~1TXT", "LONGFILETXT", 1 },
+	{ "four digits", "LON~9999TXT", "LONGFILETXT", 9999 },
+	{ "short basis", "AB~7    C  ", "AB      C  ", 7 },
+	{ "five digits", "AB~12345TXT", "AB      TXT", 0 },
+	{ "leading zero", "LONGF~01TXT", "LONGFILETXT", 0 },
+	{ "no digits", "LONGFIL~TXT", "LONGFILETXT", 0 },
+	{ "no tilde", "LONGFILETXT", "LONGFILETXT", 0 },
+	{ "other extension", "LONGFI~1DOC", "LONGFILETXT", 0 },
+	{ "other basis", "OTHERF~1TXT", "LONGFILETXT", 0 },
+	{ "tail too far", "LON~1   TXT", "LONGFILETXT", 0 },
+	{ "blank name", "        TXT", "LONGFILETXT", 0 },
+	{ "one character", "~       TXT", "LONGFILETXT", 0 },
+};
+
+static void check_short_tails(void) {
+	uint8_t filename_83[12];
+
+	for (size_t i = 0; i < sizeof(set_tail_cases) / sizeof(set_tail_cases[0]); i++) {
+		fat32_set_short_tail(filename_83, (const uint8_t*) set_tail_cases[i].basis,
+				set_tail_cases[i].n);
+		filename_83[11] = '\0';
+		check(strcmp((char*) filename_83, set_tail_cases[i].filename_83) == 0,
+				set_tail_cases[i].basis, (char*) filename_83, set_tail_cases[i].filename_83);
+	}
+
+	for (size_t i = 0; i < sizeof(tail_cases) / sizeof(tail_cases[0]); i++) {
+		check_int(tail_cases[i].what,
+				fat32_short_tail((const uint8_t*) tail_cases[i].filename_83,
+					(const uint8_t*) tail_cases[i].basis), tail_cases[i].n);
+	}
+}
+
+static const struct {
+	const char *pattern;
+	const char *name;
+	int matches;
+} glob_cases[] = {
+	{ "*.txt", "notes.TXT", TRUE },
+	{ "*.txt", "notes.txt.bak", FALSE },
+	{ "a?c", "abc", TRUE },
+	{ "a?c", "ac", FALSE },
+	{ "a*b*c", "aXXbYYc", TRUE },
+	{ "a*b", "a", FALSE },
+	{ "**x", "x", TRUE },
+	{ "*", "", TRUE },
+	{ "", "", TRUE },
+	{ "", "a", FALSE },
+	{ "FILE", "file", TRUE },
+};
+
+/* Long names compared with fat32_long_name_match, as units of the name looked
+ * for against the entry that was parsed last. */
+static const struct {
+	const char *long_name;
+	const char *name;
+	int is_prefix;
+	int matches;
+} long_match_cases[] = {
+	{ "Long file name.txt", "Long file name.txt", FALSE, TRUE },
+	{ "Long file name.txt", "LONG FILE NAME.TXT", FALSE, TRUE },
+	{ "Long file name.txt", "Long file", FALSE, FALSE },
+	{ "Long file name.txt", "Long file", TRUE, TRUE },
+	{ "Long file name.txt", "long FILE", TRUE, TRUE },
+	{ "Long file name.txt", "Long file name.txt2", FALSE, FALSE },
+	{ "Long file name.txt", "Long file name.txt2", TRUE, FALSE },
+	{ "A name that takes three slots", "A name that takes three slots", FALSE, TRUE },
+	{ "A name that takes three slots", "A name that takes three", TRUE, TRUE },
+	{ "r\xc3\xa9sum\xc3\xa9.doc", "R\xc3\xa9SUM\xc3\xa9.DOC", FALSE, TRUE },
+	{ "r\xc3\xa9sum\xc3\xa9.doc", "R\xc3\x89SUM\xc3\x89.DOC", FALSE, FALSE },
+};
+
+static const struct {
+	const char *a;
+	const char *b;
+	int equal;
+} short_equal_cases[] = {
+	{ "FOO     TXT", "FOO     TXT", TRUE },
+	{ "foo     txt", "FOO     TXT", TRUE },
+	{ "FOO     TXT", "FOO     TX ", FALSE },
+	{ "F\xe9O     TXT", "F\xc9O     TXT", FALSE },
+};
+
+static void check_matches(void) {
+	fat32_any_direntry_t slots[FAT32_LFN_MAX_SLOTS + 1];
+	fat32_entry_parser_t parser;
+	fat32_direntry_t short_entry;
+	uint16_t units[FAT32_LFN_MAX_SLOTS * FAT32_LFN_CHARS];
+	const uint8_t *filename_83 = (const uint8_t*) "LONGFI~1TXT";
+
+	for (size_t i = 0; i < sizeof(glob_cases) / sizeof(glob_cases[0]); i++) {
+		check_int(glob_cases[i].pattern, fat32_glob_match(glob_cases[i].pattern,
+					glob_cases[i].name), glob_cases[i].matches);
+	}
+
+	for (size_t i = 0; i < sizeof(long_match_cases) / sizeof(long_match_cases[0]); i++) {
+		int nr_units = fat32_utf8_to_utf16(long_match_cases[i].long_name, units,
+				FAT32_LFN_MAX_SLOTS * FAT32_LFN_CHARS);
+		int nr_slots = fat32_make_lfn_slots(units, nr_units, fat32_lfn_checksum(filename_83),
+				&slots[0].long_entry);
+		int result = -1;
+
+		memset(&slots[nr_slots], 0, sizeof(slots[nr_slots]));
+		memcpy(slots[nr_slots].short_entry.filename_83, filename_83, 11);
+		fat32_parser_reset(&parser);
+		for (int j = 0; j <= nr_slots; j++) {
+			result = fat32_parse_entry(&parser, &slots[j], &short_entry);
+		}
+
+		if (result != FAT32_PARSE_ENTRY || parser.name_slots == 0) {
+			check(FALSE, long_match_cases[i].long_name, "no long name", "a long name");
+			continue;
+		}
+
+		nr_units = fat32_utf8_to_utf16(long_match_cases[i].name, units,
+				FAT32_LFN_MAX_SLOTS * FAT32_LFN_CHARS);
+		check_int(long_match_cases[i].name, fat32_long_name_match(&parser, units, nr_units,
+					long_match_cases[i].is_prefix), long_match_cases[i].matches);
+	}
+
+	for (size_t i = 0; i < sizeof(short_equal_cases) / sizeof(short_equal_cases[0]); i++) {
+		check_int(short_equal_cases[i].a, fat32_short_name_equal(
+					(const uint8_t*) short_equal_cases[i].a,
+					(const uint8_t*) short_equal_cases[i].b), short_equal_cases[i].equal);
+	}
+}
+
+int main(void) {
+	check_utf16_to_utf8();
+	check_utf8_to_utf16();
+	check_parse();
+	check_short_names();
+	check_short_tails();
+	check_matches();
+
+	printf("%d checks, %d failed\n", nr_checks, nr_failed);
+	return nr_failed > 0 ? 1 : 0;
+}
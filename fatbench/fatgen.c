@@ -0,0 +1,679 @@
+/* fatgen - write synthetic FAT32 images for benchmarks and tests.
+ *
+ * The image holds a tree of directories and files whose shape is given on the
+ * command line: the number of files, the number of entries per directory,
+ * the share of names that need long name entries and how the cluster chains
+ * are laid out on the volume. Everything is derived from a seed, so the same
+ * options always give the same image. Next to the image a manifest lists
+ * every directory and file with its size, the CRC-32 of its contents and the
+ * number of fragments its chain is in, which is what a reader of the image
+ * should find. */
+
+#include "fat32.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SECTOR_SIZE         512
+#define RESERVED_SECTORS    32
+#define FSINFO_SECTOR       1
+#define BACKUP_BOOT_SECTOR  6
+#define ROOT_CLUSTER        2
+#define MIN_CLUSTERS        65536   /* a few more than FAT32 needs */
+#define FAT_EOC             0x0FFFFFFF
+#define NAME_LEN            64
+
+/* All timestamps are 2020-01-01 12:00:00. */
+#define FAT_DATE    (((2020 - 1980) << 9) | (1 << 5) | 1)
+#define FAT_TIME    (12 << 11)
+
+typedef enum profile_t {
+	PROFILE_CONTIGUOUS,
+	PROFILE_INTERLEAVED,
+	PROFILE_SCATTERED
+} profile_t;
+
+static const char *profile_names[] = { "contiguous", "interleaved", "scattered" };
+
+typedef struct node_t {
+	int parent;             // -1 for the root directory
+	int first_child;
+	int next_sibling;
+	int is_dir;
+	int has_long;           // Whether the name needs long name entries
+	char name[NAME_LEN];
+	uint8_t short_name[11];
+	uint32_t size;          // Of the data; directories are sized by their entries
+	int nr_clusters;
+	int *chain;
+} node_t;
+
+static node_t *nodes;
+static int nr_nodes;
+
+static int cluster_size = 4096;
+static int nr_files = 1000;
+static int fanout = 16;
+static int long_ratio = 50;
+static uint32_t max_size = 64 * 1024;
+static profile_t profile = PROFILE_CONTIGUOUS;
+static uint64_t seed = 1;
+static long image_mb;
+static int no_free_count;
+
+static int total_clusters;
+static uint32_t *fat;
+
+static uint64_t rng_state;
+
+/* xorshift64*, so that images don't depend on the C library's rand(). */
+static uint64_t rng(void) {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+static uint32_t crc_table[256];
+
+static void crc32_init(void) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) {
+			c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		}
+
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t* buf, size_t len) {
+	crc = ~crc;
+	while (len--) {
+		crc = crc_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
+
+/* The contents of file nr at a given offset. */
+static void fill_data(int nr, uint32_t offset, uint8_t* buf, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		uint32_t pos = offset + (uint32_t) i;
+		buf[i] = (uint8_t) ((pos * 131) ^ (pos >> 9) ^ ((uint32_t) nr * 7));
+	}
+}
+
+static int new_node(int parent, int is_dir) {
+	static int max_nodes;
+
+	if (nr_nodes == max_nodes) {
+		max_nodes = max_nodes ? max_nodes * 2 : 1024;
+		nodes = (node_t*) realloc(nodes, max_nodes * sizeof(node_t));
+		if (!nodes) {
+			err(1, "realloc");
+		}
+	}
+
+	node_t *n = &nodes[nr_nodes];
+	memset(n, 0, sizeof(*n));
+	n->parent = parent;
+	n->first_child = -1;
+	n->next_sibling = -1;
+	n->is_dir = is_dir;
+
+	// Keep the children in the order they were made.
+	if (parent != -1) {
+		int *link = &nodes[parent].first_child;
+		while (*link != -1) {
+			link = &nodes[*link].next_sibling;
+		}
+
+		*link = nr_nodes;
+	}
+
+	// Every name is unique in the image, as its number is part of it.
+	int is_long = (int) (rng() % 100) < long_ratio;
+	char short_name[12];
+	n->has_long = is_long;
+	if (is_dir) {
+		snprintf(n->name, NAME_LEN, is_long ? "directory number %d" : "D%07d", nr_nodes);
+		snprintf(short_name, sizeof(short_name), "%c%07d   ", is_long ? 'X' : 'D', nr_nodes);
+	} else {
+		snprintf(n->name, NAME_LEN, is_long ? "a file with a long name %d.dat" : "F%07d.DAT",
+				nr_nodes);
+		snprintf(short_name, sizeof(short_name), "%c%07dDAT", is_long ? 'L' : 'F', nr_nodes);
+		n->size = (uint32_t) (rng() % ((uint64_t) max_size + 1));
+	}
+
+	memcpy(n->short_name, short_name, sizeof(n->short_name));
+
+	return nr_nodes++;
+}
+
+/* Makes the directories below dir so that there are `leaves` directories at
+ * the bottom, `levels` levels down, each of which gets files later. */
+static void make_dirs(int dir, int leaves, int levels) {
+	if (levels == 0) {
+		return;
+	}
+
+	int per_child = 1;
+	for (int i = 1; i < levels; i++) {
+		per_child *= fanout;
+	}
+
+	while (leaves > 0) {
+		int n = leaves < per_child ? leaves : per_child;
+		make_dirs(new_node(dir, TRUE), n, levels - 1);
+		leaves -= n;
+	}
+}
+
+/* Puts up to fanout files in every directory without subdirectories. */
+static void make_files(void) {
+	int left = nr_files;
+
+	for (int i = 0, count = nr_nodes; i < count && left > 0; i++) {
+		if (!nodes[i].is_dir || nodes[i].first_child != -1) {
+			continue;
+		}
+
+		for (int k = 0; k < fanout && left > 0; k++, left--) {
+			new_node(i, FALSE);
+		}
+	}
+}
+
+static int lfn_slots(node_t* n) {
+	return n->has_long ? ((int) strlen(n->name) + 12) / 13 : 0;
+}
+
+static void size_chains(void) {
+	for (int i = 0; i < nr_nodes; i++) {
+		node_t *n = &nodes[i];
+		if (n->is_dir) {
+			int slots = n->parent == -1 ? 0 : 2;
+			for (int c = n->first_child; c != -1; c = nodes[c].next_sibling) {
+				slots += 1 + lfn_slots(&nodes[c]);
+			}
+
+			n->nr_clusters = (slots * 32 + cluster_size - 1) / cluster_size;
+			if (n->nr_clusters == 0) {
+				n->nr_clusters = 1;
+			}
+		} else {
+			n->nr_clusters = (int) (((uint64_t) n->size + cluster_size - 1) / cluster_size);
+		}
+
+		if (n->nr_clusters > 0 && !(n->chain = (int*) malloc(n->nr_clusters * sizeof(int)))) {
+			err(1, "malloc");
+		}
+	}
+}
+
+/* Hands out free clusters in the order the profile wants them in. */
+static int *free_order;
+static int next_free;
+
+static void init_allocator(void) {
+	int nr = total_clusters - 1;    // All but the root's first cluster
+
+	if (!(free_order = (int*) malloc(nr * sizeof(int)))) {
+		err(1, "malloc");
+	}
+
+	for (int i = 0; i < nr; i++) {
+		free_order[i] = ROOT_CLUSTER + 1 + i;
+	}
+
+	if (profile == PROFILE_SCATTERED) {
+		for (int i = nr - 1; i > 0; i--) {
+			int k = (int) (rng() % (uint64_t) (i + 1));
+			int tmp = free_order[i];
+			free_order[i] = free_order[k];
+			free_order[k] = tmp;
+		}
+	}
+}
+
+static int alloc_cluster(void) {
+	return free_order[next_free++];
+}
+
+static void alloc_chain(node_t* n) {
+	for (int i = 0; i < n->nr_clusters; i++) {
+		n->chain[i] = alloc_cluster();
+	}
+}
+
+/* Allocates the chains of a directory and of everything below it. */
+static void alloc_tree(int dir) {
+	node_t *d = &nodes[dir];
+	int c;
+
+	if (d->parent == -1) {
+		d->chain[0] = ROOT_CLUSTER;
+		for (int i = 1; i < d->nr_clusters; i++) {
+			d->chain[i] = alloc_cluster();
+		}
+	} else {
+		alloc_chain(d);
+	}
+
+	if (profile == PROFILE_INTERLEAVED) {
+		// Hand out clusters to the files of this directory in turn, so
+		// that their chains are woven into each other.
+		for (int round = 0, more = TRUE; more; round++) {
+			more = FALSE;
+			for (c = d->first_child; c != -1; c = nodes[c].next_sibling) {
+				if (!nodes[c].is_dir && round < nodes[c].nr_clusters) {
+					nodes[c].chain[round] = alloc_cluster();
+					more = TRUE;
+				}
+			}
+		}
+	} else {
+		for (c = d->first_child; c != -1; c = nodes[c].next_sibling) {
+			if (!nodes[c].is_dir) {
+				alloc_chain(&nodes[c]);
+			}
+		}
+	}
+
+	for (c = d->first_child; c != -1; c = nodes[c].next_sibling) {
+		if (nodes[c].is_dir) {
+			alloc_tree(c);
+		}
+	}
+}
+
+static void link_chains(void) {
+	for (int i = 0; i < nr_nodes; i++) {
+		node_t *n = &nodes[i];
+		for (int k = 0; k < n->nr_clusters; k++) {
+			fat[n->chain[k]] = k + 1 < n->nr_clusters ? (uint32_t) n->chain[k + 1] : FAT_EOC;
+		}
+	}
+}
+
+static int first_cluster(node_t* n) {
+	return n->nr_clusters > 0 ? n->chain[0] : 0;
+}
+
+static int fragments(node_t* n) {
+	int nr = n->nr_clusters > 0 ? 1 : 0;
+	for (int k = 1; k < n->nr_clusters; k++) {
+		if (n->chain[k] != n->chain[k - 1] + 1) {
+			nr++;
+		}
+	}
+
+	return nr;
+}
+
+static uint32_t fat_size_sectors(int clusters) {
+	return (uint32_t) (((uint64_t) clusters + 2) * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+}
+
+static uint64_t cluster_pos(int cluster_nr) {
+	uint32_t data_sector = RESERVED_SECTORS + 2 * fat_size_sectors(total_clusters);
+	return ((uint64_t) data_sector + (uint64_t) (cluster_nr - 2) *
+			(cluster_size / SECTOR_SIZE)) * SECTOR_SIZE;
+}
+
+static void write_at(int fd, uint64_t pos, const void* buf, size_t len) {
+	if (pwrite(fd, buf, len, (off_t) pos) != (ssize_t) len) {
+		err(1, "write");
+	}
+}
+
+static void write_boot_sectors(int fd) {
+	uint8_t sector[SECTOR_SIZE];
+	fat32_header_t *h = (fat32_header_t*) sector;
+	uint32_t fat_size = fat_size_sectors(total_clusters);
+	uint32_t total_sectors = RESERVED_SECTORS + 2 * fat_size +
+		(uint32_t) total_clusters * (cluster_size / SECTOR_SIZE);
+
+	memset(sector, 0, sizeof(sector));
+	h->bpb.header[0] = 0xEB;
+	h->bpb.header[1] = 0x58;
+	h->bpb.header[2] = 0x90;
+	memcpy(h->bpb.oem_id, "FATGEN  ", 8);
+	h->bpb.bytes_per_sector = SECTOR_SIZE;
+	h->bpb.sectors_per_cluster = (uint8_t) (cluster_size / SECTOR_SIZE);
+	h->bpb.reserved_sectors = RESERVED_SECTORS;
+	h->bpb.tables = 2;
+	h->bpb.media_descriptor_type = 0xF8;
+	h->bpb.sectors_per_track = 32;
+	h->bpb.heads_or_sides = 64;
+	h->bpb.total_sectors_32 = total_sectors;
+	h->ebr.sectors_per_table_32 = fat_size;
+	h->ebr.root_cluster_nr = ROOT_CLUSTER;
+	h->ebr.fsinfo_cluster_nr = FSINFO_SECTOR;
+	h->ebr.backup_boot_cluster_nr = BACKUP_BOOT_SECTOR;
+	h->ebr.drive_nr = 0x80;
+	h->ebr.unused_3 = 0x29;     // Extended boot signature
+	h->ebr.volume_id = (uint32_t) seed;
+	memcpy(h->ebr.volume_label, "FATGEN     ", 11);
+	memcpy(h->ebr.fat_type_label, "FAT32   ", 8);
+	sector[510] = 0x55;
+	sector[511] = 0xAA;
+	write_at(fd, 0, sector, sizeof(sector));
+	write_at(fd, BACKUP_BOOT_SECTOR * SECTOR_SIZE, sector, sizeof(sector));
+
+	// 0xFFFFFFFF means that the free count is unknown and has to be
+	// computed from the FAT.
+	uint32_t free_clusters = no_free_count ? 0xFFFFFFFF :
+		(uint32_t) (total_clusters - 1 - next_free);
+	uint32_t next_hint = ROOT_CLUSTER + 1;
+	uint32_t sig;
+
+	memset(sector, 0, sizeof(sector));
+	sig = 0x41615252;
+	memcpy(sector, &sig, 4);
+	sig = 0x61417272;
+	memcpy(sector + 484, &sig, 4);
+	memcpy(sector + 488, &free_clusters, 4);
+	memcpy(sector + 492, &next_hint, 4);
+	sig = 0xAA550000;
+	memcpy(sector + 508, &sig, 4);
+	write_at(fd, FSINFO_SECTOR * SECTOR_SIZE, sector, sizeof(sector));
+	write_at(fd, (BACKUP_BOOT_SECTOR + 1) * SECTOR_SIZE, sector, sizeof(sector));
+
+	// Make the image as long as the volume; free clusters stay holes.
+	if (ftruncate(fd, (off_t) total_sectors * SECTOR_SIZE) != 0) {
+		err(1, "ftruncate");
+	}
+}
+
+static void write_fats(int fd) {
+	size_t len = (size_t) fat_size_sectors(total_clusters) * SECTOR_SIZE;
+
+	for (int i = 0; i < 2; i++) {
+		write_at(fd, (uint64_t) (RESERVED_SECTORS + i * fat_size_sectors(total_clusters)) *
+				SECTOR_SIZE, fat, len);
+	}
+}
+
+static uint8_t lfn_checksum(const uint8_t* short_name) {
+	uint8_t sum = 0;
+	for (int i = 0; i < 11; i++) {
+		sum = (uint8_t) (((sum & 1) << 7) + (sum >> 1) + short_name[i]);
+	}
+
+	return sum;
+}
+
+static void put_short(uint8_t* slot, const uint8_t* name, int is_dir, int cluster_nr,
+		uint32_t size)
+{
+	fat32_direntry_t *e = (fat32_direntry_t*) slot;
+	uint16_t date = FAT_DATE, time = FAT_TIME;
+
+	memcpy(e->filename_83, name, 11);
+	e->attributes = is_dir ? FAT32_ATTR_DIR : FAT32_ATTR_ARCHIVE;
+	memcpy(&e->creation_time, &time, 2);
+	memcpy(&e->creation_date, &date, 2);
+	memcpy(&e->last_access_date, &date, 2);
+	memcpy(&e->last_modified_time, &time, 2);
+	memcpy(&e->last_modified_date, &date, 2);
+	e->first_cluster_nr_high = (uint16_t) (cluster_nr >> 16);
+	e->first_cluster_nr_low = (uint16_t) (cluster_nr & 0xffff);
+	e->size_bytes = size;
+}
+
+/* Writes the long name slots of a node, which come last piece first. Returns
+ * the number of slots. */
+static int put_long(uint8_t* slot, node_t* n) {
+	int len = (int) strlen(n->name);
+	int nr = lfn_slots(n);
+	uint8_t sum = lfn_checksum(n->short_name);
+
+	for (int i = 0; i < nr; i++) {
+		fat32_lfn_direntry_t *e = (fat32_lfn_direntry_t*) (slot + 32 * i);
+		int piece = nr - 1 - i;
+		uint16_t chars[13];
+
+		for (int k = 0; k < 13; k++) {
+			int pos = piece * 13 + k;
+			chars[k] = pos < len ? (uint8_t) n->name[pos] : pos == len ? 0 : 0xFFFF;
+		}
+
+		memset(e, 0, sizeof(*e));
+		e->ord = (uint8_t) ((piece + 1) | (piece == nr - 1 ? 0x40 : 0));
+		e->attributes = 0x0F;
+		e->checksum = sum;
+		memcpy(e->chars_1, chars, sizeof(e->chars_1));
+		memcpy(e->chars_2, chars + 5, sizeof(e->chars_2));
+		memcpy(e->chars_3, chars + 11, sizeof(e->chars_3));
+	}
+
+	return nr;
+}
+
+static void write_dir(int fd, node_t* d) {
+	size_t len = (size_t) d->nr_clusters * cluster_size;
+	uint8_t *buf = (uint8_t*) calloc(1, len);
+	uint8_t *slot = buf;
+	static const uint8_t dot[11] = ".          ", dotdot[11] = "..         ";
+
+	if (!buf) {
+		err(1, "calloc");
+	}
+
+	if (d->parent != -1) {
+		node_t *p = &nodes[d->parent];
+		put_short(slot, dot, TRUE, first_cluster(d), 0);
+		put_short(slot + 32, dotdot, TRUE, p->parent == -1 ? 0 : first_cluster(p), 0);
+		slot += 64;
+	}
+
+	for (int c = d->first_child; c != -1; c = nodes[c].next_sibling) {
+		node_t *n = &nodes[c];
+		slot += 32 * put_long(slot, n);
+		put_short(slot, n->short_name, n->is_dir, first_cluster(n), n->is_dir ? 0 : n->size);
+		slot += 32;
+	}
+
+	for (int k = 0; k < d->nr_clusters; k++) {
+		write_at(fd, cluster_pos(d->chain[k]), buf + (size_t) k * cluster_size, cluster_size);
+	}
+
+	free(buf);
+}
+
+/* Writes the data of a file, returning its CRC-32. */
+static uint32_t write_file(int fd, int nr, uint8_t* buf) {
+	node_t *n = &nodes[nr];
+	uint32_t crc = 0;
+
+	for (int k = 0; k < n->nr_clusters; k++) {
+		uint32_t offset = (uint32_t) k * cluster_size;
+		size_t len = n->size - offset < (uint32_t) cluster_size ? n->size - offset : cluster_size;
+
+		memset(buf, 0, cluster_size);
+		fill_data(nr, offset, buf, len);
+		crc = crc32_update(crc, buf, len);
+		write_at(fd, cluster_pos(n->chain[k]), buf, cluster_size);
+	}
+
+	return crc;
+}
+
+static void write_tree(int fd, FILE* manifest, int dir, char* path, size_t path_len,
+		uint8_t* buf)
+{
+	node_t *d = &nodes[dir];
+
+	write_dir(fd, d);
+	fprintf(manifest, "d\t0\t-\t%d\t%s\n", fragments(d), path_len ? path : "/");
+
+	for (int c = d->first_child; c != -1; c = nodes[c].next_sibling) {
+		node_t *n = &nodes[c];
+		size_t len = path_len + 1 + strlen(n->name);
+
+		path[path_len] = '/';
+		strcpy(path + path_len + 1, n->name);
+		if (n->is_dir) {
+			write_tree(fd, manifest, c, path, len, buf);
+		} else {
+			uint32_t crc = write_file(fd, c, buf);
+			fprintf(manifest, "f\t%u\t%08x\t%d\t%s\n", n->size, crc, fragments(n), path);
+		}
+
+		path[path_len] = '\0';
+	}
+}
+
+static void usage(void) {
+	fprintf(stderr,
+		"Usage: fatgen [-c cluster_size] [-n files] [-f fanout] [-l long_percent]\n"
+		"              [-s max_file_size] [-p contiguous|interleaved|scattered]\n"
+		"              [-r seed] [-S image_mb] [-m manifest] [-F] image\n");
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	const char *manifest_path = NULL;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "c:n:f:l:s:p:r:S:m:F")) != -1) {
+		switch (ch) {
+		case 'c': cluster_size = atoi(optarg); break;
+		case 'n': nr_files = atoi(optarg); break;
+		case 'f': fanout = atoi(optarg); break;
+		case 'l': long_ratio = atoi(optarg); break;
+		case 's': max_size = (uint32_t) strtoul(optarg, NULL, 0); break;
+		case 'r': seed = strtoull(optarg, NULL, 0); break;
+		case 'S': image_mb = atol(optarg); break;
+		case 'm': manifest_path = optarg; break;
+		case 'F': no_free_count = TRUE; break;
+		case 'p':
+			for (profile = PROFILE_CONTIGUOUS; profile <= PROFILE_SCATTERED; profile++) {
+				if (strcmp(optarg, profile_names[profile]) == 0) {
+					break;
+				}
+			}
+
+			if (profile > PROFILE_SCATTERED) {
+				usage();
+			}
+			break;
+		default: usage();
+		}
+	}
+
+	if (argc - optind != 1) {
+		usage();
+	}
+
+	if (cluster_size < SECTOR_SIZE || cluster_size > 32768 ||
+			(cluster_size & (cluster_size - 1)) != 0) {
+		errx(1, "the cluster size must be a power of two from 512 to 32768");
+	}
+
+	if (nr_files < 0 || fanout < 2 || long_ratio < 0 || long_ratio > 100) {
+		usage();
+	}
+
+	const char *image_path = argv[optind];
+	char default_manifest[PATH_MAX];
+	if (!manifest_path) {
+		snprintf(default_manifest, sizeof(default_manifest), "%s.manifest", image_path);
+		manifest_path = default_manifest;
+	}
+
+	rng_state = seed ? seed : 1;
+	crc32_init();
+
+	// Lay out the tree: enough directories at the bottom to hold all files,
+	// fanout entries to a directory.
+	int leaves = (nr_files + fanout - 1) / fanout;
+	int levels = 0;
+	for (long cap = 1; cap < leaves; cap *= fanout) {
+		levels++;
+	}
+
+	new_node(-1, TRUE);
+	strcpy(nodes[0].name, "/");
+	make_dirs(0, leaves, levels);
+	make_files();
+	size_chains();
+
+	long used = 0;
+	for (int i = 0; i < nr_nodes; i++) {
+		used += nodes[i].nr_clusters;
+	}
+
+	if (image_mb > 0) {
+		long sectors = image_mb * (1024 * 1024 / SECTOR_SIZE);
+		total_clusters = (int) ((sectors - RESERVED_SECTORS) / (cluster_size / SECTOR_SIZE));
+		while (RESERVED_SECTORS + 2 * (long) fat_size_sectors(total_clusters) +
+				(long) total_clusters * (cluster_size / SECTOR_SIZE) > sectors) {
+			total_clusters--;
+		}
+
+		if (total_clusters < MIN_CLUSTERS || total_clusters < used) {
+			errx(1, "%ld MB is too small for %ld clusters of %d bytes", image_mb,
+					used > MIN_CLUSTERS ? used : (long) MIN_CLUSTERS, cluster_size);
+		}
+	} else {
+		// Leave a quarter free, so that scattered chains are spread out.
+		total_clusters = (int) (used + used / 4 + 16);
+		if (total_clusters < MIN_CLUSTERS) {
+			total_clusters = MIN_CLUSTERS;
+		}
+	}
+
+	size_t fat_len = (size_t) fat_size_sectors(total_clusters) * SECTOR_SIZE;
+	if (!(fat = (uint32_t*) calloc(1, fat_len))) {
+		err(1, "calloc");
+	}
+
+	fat[0] = 0x0FFFFFF8;
+	fat[1] = FAT_EOC;
+	init_allocator();
+	alloc_tree(0);
+	link_chains();
+
+	int fd = open(image_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		err(1, "%s", image_path);
+	}
+
+	FILE *manifest = fopen(manifest_path, "w");
+	if (!manifest) {
+		err(1, "%s", manifest_path);
+	}
+
+	fprintf(manifest, "# fatgen -c %d -n %d -f %d -l %d -s %u -p %s -r %llu\n",
+			cluster_size, nr_files, fanout, long_ratio, max_size,
+			profile_names[profile], (unsigned long long) seed);
+	fprintf(manifest, "# clusters %d used %ld\n", total_clusters, used);
+	fprintf(manifest, "# type\tsize\tcrc32\tfragments\tpath\n");
+
+	uint8_t *buf = (uint8_t*) malloc(cluster_size);
+	char *path = (char*) malloc((size_t) (levels + 2) * (NAME_LEN + 1));
+	if (!buf || !path) {
+		err(1, "malloc");
+	}
+
+	path[0] = '\0';
+	write_boot_sectors(fd);
+	write_fats(fd);
+	write_tree(fd, manifest, 0, path, 0, buf);
+
+	if (fclose(manifest) != 0 || close(fd) != 0) {
+		err(1, "close");
+	}
+
+	printf("%s: %d files in %d directories, %ld of %d clusters of %d bytes used\n",
+			image_path, nr_files, nr_nodes - nr_files, used, total_clusters, cluster_size);
+	return 0;
+}
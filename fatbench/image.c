@@ -0,0 +1,158 @@
+#include "image.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int read_at(fat_image_t* image, uint64_t pos, void* buf, size_t len) {
+	ssize_t nread = pread(image->fd, buf, len, (off_t) pos);
+	if (nread < 0 || (size_t) nread != len) {
+		return FAT32_ERR_IO;
+	}
+
+	return OK;
+}
+
+int image_open(fat_image_t* image, const char* path) {
+	char sector[FAT32_MIN_SECTOR_SIZE];
+	int ret;
+
+	memset(image, 0, sizeof(*image));
+	image->fd = open(path, O_RDONLY);
+	if (image->fd < 0) {
+		return FAT32_ERR_IO;
+	}
+
+	if ((ret = read_at(image, 0, sector, sizeof(sector))) != OK) {
+		image_close(image);
+		return ret;
+	}
+
+	memcpy(&image->header, sector, sizeof(fat32_header_t));
+	if ((ret = build_fat_info(&image->header, &image->info)) != OK) {
+		image_close(image);
+		return ret;
+	}
+
+	size_t fat_len = (size_t) image->info.fat_size_sectors *
+		image->header.bpb.bytes_per_sector;
+	image->fat = (uint32_t*) malloc(fat_len);
+	if (!image->fat) {
+		image_close(image);
+		return FAT32_ERR_INTERNAL;
+	}
+
+	ret = read_at(image, (uint64_t) image->info.first_fat_sector *
+			image->header.bpb.bytes_per_sector, image->fat, fat_len);
+	if (ret != OK) {
+		image_close(image);
+		return ret;
+	}
+
+	return OK;
+}
+
+void image_close(fat_image_t* image) {
+	free(image->fat);
+	image->fat = NULL;
+
+	if (image->fd >= 0) {
+		close(image->fd);
+	}
+
+	image->fd = -1;
+}
+
+int image_next_cluster(fat_image_t* image, int cluster_nr, int* next_cluster_nr) {
+	if (cluster_nr < 2 || cluster_nr >= image->info.total_clusters + 2) {
+		return FAT32_ERR_INVALID_FAT;
+	}
+
+	decode_fat_entry(image->fat[cluster_nr], next_cluster_nr);
+	return OK;
+}
+
+int image_read_clusters(fat_image_t* image, int cluster_nr, int count, char* buf) {
+	if (cluster_nr < 2 || cluster_nr + count > image->info.total_clusters + 2) {
+		return FAT32_ERR_INVALID_FAT;
+	}
+
+	return read_at(image, cluster_offset(&image->header, &image->info, cluster_nr),
+			buf, (size_t) count * image->info.bytes_per_cluster);
+}
+
+int image_open_dir(fat_image_t* image, int cluster_nr, fat_dir_t* dir) {
+	int ret;
+
+	memset(dir, 0, sizeof(*dir));
+	dir->image = image;
+	dir->cluster = cluster_nr;
+	fat32_parser_reset(&dir->parser);
+
+	dir->buf = (char*) malloc(image->info.bytes_per_cluster);
+	if (!dir->buf) {
+		return FAT32_ERR_INTERNAL;
+	}
+
+	if ((ret = image_read_clusters(image, cluster_nr, 1, dir->buf)) != OK) {
+		image_close_dir(dir);
+		return ret;
+	}
+
+	return OK;
+}
+
+void image_close_dir(fat_dir_t* dir) {
+	free(dir->buf);
+	dir->buf = NULL;
+}
+
+/* Moves on to the next cluster of the directory, if there is one. */
+static int advance_dir(fat_dir_t* dir) {
+	int ret;
+
+	if ((ret = image_next_cluster(dir->image, dir->cluster, &dir->cluster)) != OK) {
+		return ret;
+	}
+
+	dir->offset = 0;
+	if (dir->cluster == -1) {
+		return OK;
+	}
+
+	return image_read_clusters(dir->image, dir->cluster, 1, dir->buf);
+}
+
+int image_read_dir(fat_dir_t* dir, fat32_dirent_t* dst) {
+	fat32_direntry_t short_entry;
+	char name[FAT32_MAX_NAME_LEN];
+	int ret;
+
+	while (dir->cluster != -1) {
+		if (dir->offset + 32 > dir->image->info.bytes_per_cluster) {
+			if ((ret = advance_dir(dir)) != OK) {
+				return ret;
+			}
+
+			continue;
+		}
+
+		fat32_any_direntry_t *slot = (fat32_any_direntry_t*) &dir->buf[dir->offset];
+		dir->offset += 32;
+
+		int result = fat32_parse_slot(&dir->parser, slot, &short_entry, name);
+		if (result == FAT32_PARSE_FREE) {
+			dir->cluster = -1;
+		} else if (result == FAT32_PARSE_ENTRY) {
+			if (short_entry.filename_83[0] == 0xE5 ||
+					(short_entry.attributes & FAT32_ATTR_VOLUMEID)) {
+				continue;
+			}
+
+			convert_entry(&short_entry, name, dst);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
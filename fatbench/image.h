@@ -0,0 +1,41 @@
+#pragma once
+
+#include "fat32.h"
+
+/* FAT32 volumes in image files, read with the parsing code of the fat32
+ * server (fat32.c). This plays the part of device.c and fatcache.c on the
+ * host: the whole first FAT is loaded into memory when the image is opened. */
+
+typedef struct fat_image_t {
+	int fd;
+	fat32_header_t header;
+	fat32_info_t info;
+	uint32_t *fat;
+} fat_image_t;
+
+/* A directory being read from an image, one entry at a time. */
+typedef struct fat_dir_t {
+	fat_image_t *image;
+	int cluster;        // -1 once the end of the directory was reached
+	int offset;         // Offset of the next slot in buf
+	char *buf;          // The cluster being read
+	fat32_entry_parser_t parser;
+} fat_dir_t;
+
+/* Opens an image and checks that it holds a FAT32 filesystem. */
+int image_open(fat_image_t* image, const char* path);
+void image_close(fat_image_t* image);
+
+/* Same as get_next_cluster in the server. */
+int image_next_cluster(fat_image_t* image, int cluster_nr, int* next_cluster_nr);
+
+/* Reads count consecutive clusters starting at cluster_nr. */
+int image_read_clusters(fat_image_t* image, int cluster_nr, int count, char* buf);
+
+int image_open_dir(fat_image_t* image, int cluster_nr, fat_dir_t* dir);
+void image_close_dir(fat_dir_t* dir);
+
+/* Reads the next entry of a directory into *dst, skipping deleted entries and
+ * the volume label. Returns TRUE if an entry was read, FALSE at the end of the
+ * directory or an error code. */
+int image_read_dir(fat_dir_t* dir, fat32_dirent_t* dst);
@@ -7,6 +7,14 @@ extern "C" {
 
 using namespace std;
 
+static_assert(FAT32_STATS_REQUEST_TYPES == FAT32_NR_REQUEST_TYPES,
+		"fat32::stats is out of sync with the server");
+static_assert(fat32::space::FREE_SCAN == FAT32_FREE_SCAN &&
+		fat32::space::SCAN_FAILED == FAT32_SCAN_FAILED,
+		"fat32::space is out of sync with the server");
+static_assert(fat32::dir::MATCH_GLOB == FAT32_MATCH_GLOB,
+		"fat32::dir is out of sync with the server");
+
 int check_ret(int ret, message* m) {
 	if (ret != 0) {
 		throw fat32::exception(m->m_type);
@@ -37,8 +45,79 @@ unique_ptr<fat32::dir> fat32::fs::open_root_dir() {
 	return unique_ptr<fat32::dir>(new fat32::dir(m.m_fat32_io_handle.handle));
 }
 
-fat32::maybe<fat32::entry> fat32::dir::next_entry() {
-	fat32::entry my_entry;
+int fat32::fs::open_path(const string& path, int flags, dirent* dest) {
+	message m;
+	memset(&m, 0, sizeof(m));
+	m.m_fat32_open_path.handle = handle;
+	m.m_fat32_open_path.path = (void*) path.c_str();
+	m.m_fat32_open_path.path_len = path.length();
+	m.m_fat32_open_path.dest = dest;
+	m.m_fat32_open_path.flags = flags;
+	check_ret(_syscall(FAT32_PROC_NR, FAT32_OPEN_PATH, &m), &m);
+
+	return m.m_fat32_io_handle.handle;
+}
+
+fat32::maybe<fat32::dirent> fat32::fs::stat_path(const string& path) {
+	dirent e;
+	try {
+		open_path(path, FAT32_OPEN_PATH_STAT, &e);
+	} catch (fat32::exception& ex) {
+		if (ex.ret == ENOENT) {
+			return fat32::maybe<fat32::dirent>();
+		}
+
+		throw;
+	}
+
+	return fat32::maybe<fat32::dirent>(e);
+}
+
+unique_ptr<fat32::dir> fat32::fs::open_dir_path(const string& path) {
+	return unique_ptr<fat32::dir>(new fat32::dir(open_path(path, FAT32_OPEN_PATH_DIR, nullptr)));
+}
+
+unique_ptr<fat32::file> fat32::fs::open_file_path(const string& path) {
+	int file_handle = open_path(path, FAT32_OPEN_PATH_FILE, nullptr);
+	return unique_ptr<fat32::file>(new fat32::file(file_handle, FAT32_MAX_CLUSTER_SIZE));
+}
+
+unique_ptr<fat32::file> fat32::fs::create_file(const string& path, uint32_t size_hint) {
+	message m;
+	memset(&m, 0, sizeof(m));
+	m.m_fat32_create.handle = handle;
+	m.m_fat32_create.path = (void*) path.c_str();
+	m.m_fat32_create.path_len = path.length();
+	m.m_fat32_create.size_hint = size_hint;
+	check_ret(_syscall(FAT32_PROC_NR, FAT32_CREATE_FILE, &m), &m);
+
+	return unique_ptr<fat32::file>(new fat32::file(m.m_fat32_io_handle.handle,
+				FAT32_MAX_CLUSTER_SIZE));
+}
+
+unique_ptr<fat32::file> fat32::fs::open_file_for_writing(const string& path) {
+	int file_handle = open_path(path, FAT32_OPEN_PATH_WRITE, nullptr);
+	return unique_ptr<fat32::file>(new fat32::file(file_handle, FAT32_MAX_CLUSTER_SIZE));
+}
+
+void fat32::fs::unlink(const string& path) {
+	message m;
+	memset(&m, 0, sizeof(m));
+	m.m_fat32_open_path.handle = handle;
+	m.m_fat32_open_path.path = (void*) path.c_str();
+	m.m_fat32_open_path.path_len = path.length();
+	check_ret(_syscall(FAT32_PROC_NR, FAT32_UNLINK, &m), &m);
+}
+
+void fat32::fs::sync() {
+	message m;
+	memset(&m, 0, sizeof(m));
+	m.m_fat32_io_handle.handle = handle;
+	check_ret(_syscall(FAT32_PROC_NR, FAT32_SYNC, &m), &m);
+}
+
+fat32::maybe<fat32::dirent> fat32::dir::next_entry() {
+	fat32::dirent my_entry;
 	
 	message m;
 	memset(&m, 0, sizeof(m));
@@ -47,10 +126,10 @@ fat32::maybe<fat32::entry> fat32::dir::next_entry() {
 	check_ret(_syscall(FAT32_PROC_NR, FAT32_READ_DIR_ENTRY, &m), &m);
 
 	if (m.m_fat32_ret.ret == 0) {
-		return fat32::maybe<fat32::entry>();
+		return fat32::maybe<fat32::dirent>();
 	} else {
 		last_buf_size = m.m_fat32_ret.ret;
-		return fat32::maybe<fat32::entry>(my_entry);
+		return fat32::maybe<fat32::dirent>(my_entry);
 	}
 }
 
@@ -89,11 +168,196 @@ fat32::maybe<std::vector<uint8_t>> fat32::file::read_block() {
 	}
 }
 
+fat32::maybe<std::vector<uint8_t>> fat32::file::read(size_t max_len) {
+	std::vector<uint8_t> buf(max_len);
+	message m;
+	memset(&m, 0, sizeof(m));
+	m.m_fat32_read_block.handle = handle;
+	m.m_fat32_read_block.buf_size = max_len;
+	m.m_fat32_read_block.buf_ptr = &buf[0];
+	check_ret(_syscall(FAT32_PROC_NR, FAT32_READ_FILE_RANGE, &m), &m);
+
+	buf.resize(m.m_fat32_ret.ret);
+	if (m.m_fat32_ret.ret == 0) {
+		return maybe<std::vector<uint8_t>>();
+	} else {
+		return maybe<std::vector<uint8_t>>(std::move(buf));
+	}
+}
+
+fat32::maybe<std::vector<uint8_t>> fat32::file::pread(uint64_t offset, size_t max_len) {
+	std::vector<uint8_t> buf(max_len);
+	message m;
+	memset(&m, 0, sizeof(m));
+	m.m_fat32_pread.handle = handle;
+	m.m_fat32_pread.offset = offset;
+	m.m_fat32_pread.buf_size = max_len;
+	m.m_fat32_pread.buf_ptr = &buf[0];
+	check_ret(_syscall(FAT32_PROC_NR, FAT32_PREAD_FILE, &m), &m);
+
+	buf.resize(m.m_fat32_ret.ret);
+	if (m.m_fat32_ret.ret == 0) {
+		return maybe<std::vector<uint8_t>>();
+	} else {
+		return maybe<std::vector<uint8_t>>(std::move(buf));
+	}
+}
+
+void fat32::file::seek(uint64_t offset) {
+	message m;
+	memset(&m, 0, sizeof(m));
+	m.m_fat32_pread.handle = handle;
+	m.m_fat32_pread.offset = offset;
+	check_ret(_syscall(FAT32_PROC_NR, FAT32_SEEK_FILE, &m), &m);
+}
+
+size_t fat32::file::write(const void* data, size_t len, bool append) {
+	message m;
+	memset(&m, 0, sizeof(m));
+	m.m_fat32_write.handle = handle;
+	m.m_fat32_write.buf_ptr = (void*) data;
+	m.m_fat32_write.buf_size = len;
+	m.m_fat32_write.flags = append ? FAT32_WRITE_APPEND : 0;
+	check_ret(_syscall(FAT32_PROC_NR, FAT32_WRITE_FILE, &m), &m);
+
+	return m.m_fat32_ret.ret;
+}
+
+void fat32::file::truncate(uint64_t size) {
+	message m;
+	memset(&m, 0, sizeof(m));
+	m.m_fat32_pread.handle = handle;
+	m.m_fat32_pread.offset = size;
+	check_ret(_syscall(FAT32_PROC_NR, FAT32_TRUNCATE_FILE, &m), &m);
+}
+
+static struct tm fat_to_tm(uint16_t date, uint16_t time) {
+	struct tm t;
+	memset(&t, 0, sizeof(t));
+
+	t.tm_year = (date >> 9) + 80;
+	t.tm_mon = ((date >> 5) & 0x0f) - 1;
+	t.tm_mday = date & 0x1f;
+
+	t.tm_hour = time >> 11;
+	t.tm_min = (time >> 5) & 0x3f;
+	t.tm_sec = (time & 0x1f) * 2;
+
+	return t;
+}
+
+struct tm fat32::dirent::creation() const {
+	return fat_to_tm(creation_date, creation_time);
+}
+
+struct tm fat32::dirent::access() const {
+	return fat_to_tm(access_date, 0);
+}
+
+struct tm fat32::dirent::modification() const {
+	return fat_to_tm(modification_date, modification_time);
+}
+
+static time_t fat_to_time_t(uint16_t date, uint16_t time) {
+	struct tm t = fat_to_tm(date, time);
+	t.tm_isdst = -1;
+	return mktime(&t);
+}
+
+time_t fat32::dirent::created() const {
+	return fat_to_time_t(creation_date, creation_time);
+}
+
+time_t fat32::dirent::accessed() const {
+	return fat_to_time_t(access_date, 0);
+}
+
+time_t fat32::dirent::modified() const {
+	return fat_to_time_t(modification_date, modification_time);
+}
+
+bool fat32::dir::has_current() {
+	if (batch_pos < batch_count) {
+		return true;
+	}
+
+	// Leave a whole dirent of room after the batch, so that the last record
+	// can be copied as a dirent even if its name is short.
+	batch.resize(FAT32_DIRENT_BATCH_SIZE + sizeof(dirent));
+	message m;
+	memset(&m, 0, sizeof(m));
+	if (filter_match >= 0) {
+		m.m_fat32_read_filter.handle = handle;
+		m.m_fat32_read_filter.buf_size = FAT32_DIRENT_BATCH_SIZE;
+		m.m_fat32_read_filter.buf_ptr = &batch[0];
+		m.m_fat32_read_filter.pattern = (void*) filter_pattern.c_str();
+		m.m_fat32_read_filter.pattern_len = filter_pattern.length();
+		m.m_fat32_read_filter.match = filter_match;
+		m.m_fat32_read_filter.attr_set = filter_attr_set;
+		m.m_fat32_read_filter.attr_clear = filter_attr_clear;
+		check_ret(_syscall(FAT32_PROC_NR, FAT32_READ_DIR_FILTER, &m), &m);
+	} else {
+		m.m_fat32_read_block.handle = handle;
+		m.m_fat32_read_block.buf_size = FAT32_DIRENT_BATCH_SIZE;
+		m.m_fat32_read_block.buf_ptr = &batch[0];
+		check_ret(_syscall(FAT32_PROC_NR, FAT32_READ_DIR_BATCH, &m), &m);
+	}
+
+	batch_count = m.m_fat32_ret.ret;
+	batch_pos = 0;
+	batch_offset = 0;
+	return batch_count > 0;
+}
+
+void fat32::dir::filter(const string& pattern, int match, uint8_t attr_set,
+		uint8_t attr_clear)
+{
+	filter_pattern = pattern;
+	filter_match = match;
+	filter_attr_set = attr_set;
+	filter_attr_clear = attr_clear;
+}
+
+fat32::dir::iterator fat32::dir::begin() {
+	return iterator(has_current() ? this : nullptr);
+}
+
+fat32::dir::iterator& fat32::dir::iterator::operator++() {
+	d->batch_offset += d->current().record_size();
+	d->batch_pos++;
+	if (!d->has_current()) {
+		d = nullptr;
+	}
+
+	return *this;
+}
+
+int fat32::dir::open_entry(const dirent& e) {
+	message m;
+	memset(&m, 0, sizeof(m));
+	m.m_fat32_open_entry.handle = handle;
+	m.m_fat32_open_entry.first_cluster = e.first_cluster;
+	m.m_fat32_open_entry.size_bytes = e.size_bytes;
+	m.m_fat32_open_entry.attributes = e.attributes;
+	check_ret(_syscall(FAT32_PROC_NR, FAT32_OPEN_ENTRY, &m), &m);
+
+	return m.m_fat32_io_handle.handle;
+}
+
+unique_ptr<fat32::dir> fat32::dir::open_subdir(const dirent& e) {
+	return unique_ptr<fat32::dir>(new fat32::dir(open_entry(e)));
+}
+
+unique_ptr<fat32::file> fat32::dir::open_file(const dirent& e) {
+	int buf_size = last_buf_size ? last_buf_size : FAT32_MAX_CLUSTER_SIZE;
+	return unique_ptr<fat32::file>(new fat32::file(open_entry(e), buf_size));
+}
+
 fat32::file::~file() {
 	message m;
 	memset(&m, 0, sizeof(m));
 	m.m_fat32_io_handle.handle = handle;
-	_syscall(FAT32_PROC_NR, FAT32_CLOSE_DIR, &m);
+	_syscall(FAT32_PROC_NR, FAT32_CLOSE_FILE, &m);
 }
 
 fat32::dir::~dir() {
@@ -110,3 +374,27 @@ fat32::fs::~fs() {
 	_syscall(FAT32_PROC_NR, FAT32_CLOSE_FS, &m);
 }
 
+fat32::space fat32::fs::get_space(bool scan) {
+	space s;
+	message m;
+	memset(&m, 0, sizeof(m));
+	m.m_fat32_statvfs.handle = handle;
+	m.m_fat32_statvfs.dest = &s;
+	m.m_fat32_statvfs.size = sizeof(s);
+	m.m_fat32_statvfs.flags = scan ? FAT32_STATVFS_SCAN : 0;
+	check_ret(_syscall(FAT32_PROC_NR, FAT32_STATVFS, &m), &m);
+
+	return s;
+}
+
+fat32::stats fat32::get_stats(bool reset) {
+	stats s;
+	message m;
+	memset(&m, 0, sizeof(m));
+	m.m_fat32_get_stats.dest = &s;
+	m.m_fat32_get_stats.size = sizeof(s);
+	m.m_fat32_get_stats.flags = reset ? FAT32_STATS_RESET : 0;
+	check_ret(_syscall(FAT32_PROC_NR, FAT32_GET_STATS, &m), &m);
+
+	return s;
+}
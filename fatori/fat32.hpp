@@ -3,10 +3,22 @@
 #include <memory>
 #include <vector>
 #include <ctime>
+#include <cstddef>
 #include <exception>
 
 #define FAT32_MAX_NAME_LEN			256
 
+// The largest cluster size FAT32 allows, used for buffers when the actual
+// cluster size isn't known.
+#define FAT32_MAX_CLUSTER_SIZE		(64 * 1024)
+
+// How many bytes of entries a directory asks for in a single batched read.
+#define FAT32_DIRENT_BATCH_SIZE		(32 * 1024)
+
+// The number of request types the server keeps statistics for. Must match
+// FAT32_NR_REQUEST_TYPES in <minix/com.h>.
+#define FAT32_STATS_REQUEST_TYPES	26
+
 namespace fat32 {
 
 	template<typename T>
@@ -40,30 +52,105 @@ namespace fat32 {
 		}
 	};
 
-	struct entry {
-		char filename[FAT32_MAX_NAME_LEN];
-		int is_directory;
-		int is_readonly;
-		int is_hidden;
-		int is_system;
+	// The compact entry format the server returns directory entries in. The
+	// layout must match fat32_dirent_t in the server. Times are kept in their
+	// raw FAT encoding and are only decoded when asked for. The server only
+	// copies the first record_size() bytes, as the rest of the name is unused.
+	struct dirent {
+		uint32_t first_cluster;
+		uint32_t size_bytes;
+		uint16_t creation_time;
+		uint16_t creation_date;
+		uint16_t access_date;
+		uint16_t modification_time;
+		uint16_t modification_date;
+		uint8_t  attributes;
+		uint8_t  name_len;
+		char     filename[FAT32_MAX_NAME_LEN];
+
+		bool is_directory() const { return attributes & 0x10; }
+		bool is_readonly() const { return attributes & 0x01; }
+		bool is_hidden() const { return attributes & 0x02; }
+		bool is_system() const { return attributes & 0x04; }
+
+		struct tm creation() const;
+		struct tm access() const;
+		struct tm modification() const;
+
+		// The same times as time_t, taking them as local time like the
+		// rest of the system does.
+		std::time_t created() const;
+		std::time_t accessed() const;
+		std::time_t modified() const;
 
-		// Only tm_mon, tm_mday, tm_year, tm_sec, tm_hour and tm_sec
-		// are set.
-		struct tm creation;
+		// Must match FAT32_DIRENT_SIZE in the server.
+		size_t record_size() const {
+			return (offsetof(dirent, filename) + name_len + 1 + 3) & ~(size_t) 3;
+		}
+	};
+
+	// The server's counters, as returned by get_stats(). The layout must match
+	// fat32_stats_t in the server. The per-request tables are indexed by the
+	// request type minus FAT32_BASE.
+	struct stats {
+		uint64_t requests[FAT32_STATS_REQUEST_TYPES];
+		uint64_t errors[FAT32_STATS_REQUEST_TYPES];
+		uint64_t service_us[FAT32_STATS_REQUEST_TYPES];
+		uint64_t dev_reads;
+		uint64_t dev_read_bytes;
+		uint64_t fat_lookups;
+		uint64_t fat_cache_hits;
+		uint64_t fat_cache_misses;
+		uint64_t cluster_cache_hits;
+		uint64_t cluster_cache_misses;
+		uint64_t cluster_cache_evictions;
+		uint64_t clusters_prefetched;
+		uint64_t dentry_hits;
+		uint64_t dentry_misses;
+		uint64_t dirindex_lookups;
+		uint64_t dirindex_builds;
+		uint64_t dirindex_evictions;
+		uint64_t dev_writes;
+		uint64_t dev_write_bytes;
+		uint64_t fat_sectors_written;
+		uint64_t clusters_allocated;
+		uint64_t clusters_freed;
+		uint64_t syncs;
+		uint64_t clusters_written_back;
+		uint64_t dev_mapped_bytes;
+		uint32_t open_fs;
+		uint32_t open_dirs;
+		uint32_t open_files;
+		uint32_t uptime_s;
+	};
 
-		// Only tm_mon, tm_mday and tm_year set.
-		struct tm access;
+	// Gets the counters of the server, which cover all clients and
+	// filesystems. If reset is set, the server zeroes them afterwards.
+	stats get_stats(bool reset = false);
 
-		// Only tm_mon, tm_mday, tm_year, tm_sec, tm_hour and tm_sec
-		// are set.
-		struct tm modification;
+	// The free space of a filesystem, as returned by fs::get_space(). The
+	// layout must match fat32_statvfs_t in the server, and the values of
+	// source and scan_state those of FAT32_FREE_* and FAT32_SCAN_*.
+	struct space {
+		enum { FREE_UNKNOWN, FREE_FSINFO, FREE_SCAN };
+		enum { SCAN_NONE, SCAN_RUNNING, SCAN_DONE, SCAN_FAILED };
 
-		int size_bytes;
+		uint32_t bytes_per_cluster;
+		uint32_t total_clusters;
+		uint32_t free_clusters;
+		uint32_t next_free;
+		uint32_t source;
+		uint32_t scan_state;
+		uint32_t scan_clusters;
+		uint32_t scan_dev_reads;
+		uint64_t scan_bytes;
+		uint64_t scan_us;
 	};
 
 	class file {
 	private:
 		friend class dir;
+		friend class fs;
 		int handle;
 		int buf_size;
 		file(int _handle, int _buf_size) : handle(_handle), buf_size(_buf_size) {
@@ -71,6 +158,16 @@ namespace fat32 {
 	
 	public:
 		maybe<std::vector<uint8_t>> read_block();
+		maybe<std::vector<uint8_t>> read(size_t max_len);
+		maybe<std::vector<uint8_t>> pread(uint64_t offset, size_t max_len);
+		void seek(uint64_t offset);
+
+		// Only for files opened with fs::create_file() or
+		// fs::open_file_for_writing(). write() writes at the current
+		// position, or at the end if append is set, and returns how much
+		// was written, which is less than len only if the volume is full.
+		size_t write(const void* data, size_t len, bool append = false);
+		void truncate(uint64_t size);
 		~file();
 	};
 
@@ -79,22 +176,101 @@ namespace fat32 {
 		friend class fs;
 		int handle;
 		int last_buf_size;
-		dir(int _handle) : handle(_handle) {}
+		// The records of the last batch, packed back to back.
+		std::vector<char> batch;
+		size_t batch_count;
+		size_t batch_pos;
+		size_t batch_offset;
+		// Set by filter(); filter_match is -1 if there is no filter.
+		std::string filter_pattern;
+		int filter_match;
+		uint8_t filter_attr_set;
+		uint8_t filter_attr_clear;
+		dir(int _handle) : handle(_handle), last_buf_size(0), batch_count(0),
+			batch_pos(0), batch_offset(0), filter_match(-1), filter_attr_set(0),
+			filter_attr_clear(0) {}
+
+		bool has_current();
+		const dirent& current() const {
+			return *reinterpret_cast<const dirent*>(&batch[batch_offset]);
+		}
+		int open_entry(const dirent& e);
 
 	public:
-		maybe<entry> next_entry();
+		// How filter() matches names, ignoring the case of ASCII letters.
+		// Must match FAT32_MATCH_* in <minix/com.h>.
+		enum { MATCH_ALL, MATCH_EXACT, MATCH_PREFIX, MATCH_GLOB };
+
+		// Limits the entries that iterating returns from then on to those
+		// whose name matches pattern and that have all of the attributes
+		// in attr_set and none of those in attr_clear. The server skips
+		// the others, so looking for a few names in a large directory is
+		// much cheaper than listing it.
+		void filter(const std::string& pattern, int match, uint8_t attr_set = 0,
+				uint8_t attr_clear = 0);
+
+		// Iterates over the remaining entries of the directory, fetching them
+		// from the server in batches as needed. Only one iterator should be
+		// used at a time, as they all advance the same directory.
+		class iterator {
+		private:
+			dir* d;
+
+		public:
+			iterator(dir* _d) : d(_d) {
+			}
+
+			const dirent& operator*() const { return d->current(); }
+			const dirent* operator->() const { return &d->current(); }
+			iterator& operator++();
+			bool operator==(const iterator& other) const { return d == other.d; }
+			bool operator!=(const iterator& other) const { return d != other.d; }
+		};
+
+		iterator begin();
+		iterator end() { return iterator(nullptr); }
+
+		maybe<dirent> next_entry();
 		std::unique_ptr<dir> open_subdir();
 		std::unique_ptr<file> open_file();
+		std::unique_ptr<dir> open_subdir(const dirent& e);
+		std::unique_ptr<file> open_file(const dirent& e);
 		~dir();
 	};
 
 	class fs {
 	private:
 		int handle;
+		int open_path(const std::string& path, int flags, dirent* dest);
 
 	public:
 		fs(std::string device);
 		std::unique_ptr<dir> open_root_dir();
+
+		// Paths are relative to the root directory and resolved by the
+		// server, which caches the lookups. Opening a path that doesn't exist
+		// or has the wrong type throws.
+		maybe<dirent> stat_path(const std::string& path);
+		std::unique_ptr<dir> open_dir_path(const std::string& path);
+		std::unique_ptr<file> open_file_path(const std::string& path);
+
+		// Creates a file, which mustn't exist yet, and opens it for writing.
+		// If the size it will have is known, passing it lets the server
+		// allocate the whole file at once.
+		std::unique_ptr<file> create_file(const std::string& path, uint32_t size_hint = 0);
+		std::unique_ptr<file> open_file_for_writing(const std::string& path);
+		void unlink(const std::string& path);
+
+		// Writes the changes the server holds for the filesystem to the
+		// device. They are written back on their own after a while, and when
+		// the filesystem is closed.
+		void sync();
+
+		// Gets the size and free space of the filesystem. If the FSInfo
+		// sector has no free count, or scan is set, the first call starts a
+		// scan of the FAT in the server and returns at once; later calls
+		// return its progress, and the count once it's done.
+		space get_space(bool scan = false);
 		~fs();
 	};
 }
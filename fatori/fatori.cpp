@@ -1,34 +1,15 @@
 #include "fat32.hpp"
 #include <iostream>
+#include <cerrno>
+#include <cstdlib>
 using namespace std;
 using namespace fat32;
 
-maybe<pair<entry, unique_ptr<dir>>> find_path(unique_ptr<dir> d, string path) {
-	size_t p = path.find('/');
-	string to_find = path;
-	string to_pass = "";
+// How much of a file `cat` asks the server for at once.
+const size_t CAT_BUFFER_SIZE = 1024 * 1024;
 
-	if (p != string::npos) {
-		to_find = path.substr(0, p);
-		to_pass = path.substr(p + 1);
-	}
-
-	maybe<entry> e;
-	while ((e = d->next_entry()).is_some) {
-		if (string(e.value.filename) == to_find) {
-			if (p != string::npos) {
-				if (e.value.is_directory) {
-					unique_ptr<dir> subdir = d->open_subdir();
-					return find_path(move(subdir), to_pass);
-				}
-			} else {
-				return maybe<pair<entry, unique_ptr<dir>>>(move(make_pair(e.value, move(d))));
-			}
-		}
-	}
-
-	return maybe<pair<entry, unique_ptr<dir>>>();
-}
+// How much of a local file `put` sends to the server at once.
+const size_t PUT_BUFFER_SIZE = 1024 * 1024;
 
 void out_flag(char c, bool on) {
 	cout << c << '[' << (on ? 'x' : ' ') << "]  ";
@@ -42,118 +23,231 @@ void out_time(struct tm t) {
 }
 
 void do_stat(string path, fs& f) {
-	unique_ptr<dir> root = f.open_root_dir();
-	auto ret = find_path(move(root), path);
+	maybe<dirent> ret = f.stat_path(path);
 	if (ret.is_some) {
-		entry e = ret.value.first;
+		const dirent& e = ret.value;
 
 		cout << "Attributes:    ";
-		out_flag('D', e.is_directory);
-		out_flag('R', e.is_readonly);
-		out_flag('H', e.is_hidden);
-		out_flag('S', e.is_system);
+		out_flag('D', e.is_directory());
+		out_flag('R', e.is_readonly());
+		out_flag('H', e.is_hidden());
+		out_flag('S', e.is_system());
 		cout << endl;
 
 		cout << "File name:     " << e.filename << endl;
 		cout << "Size (bytes):  " << e.size_bytes << endl;
 
 		cout << "Created:       ";
-		out_time(e.creation);
+		out_time(e.creation());
 		cout << endl;
 
 		cout << "Modified:      ";
-		out_time(e.modification);
+		out_time(e.modification());
 		cout << endl;
 
 		cout << "Accessed:      ";
-		out_time(e.access);
+		out_time(e.access());
 		cout << endl;
 	} else {
 		cerr << "Path not found." << endl;
 	}
 }
 
-void do_ls(string path, fs& f) {
-	unique_ptr<dir> root = f.open_root_dir();
-	if (path.empty()) {
-		maybe<entry> e2;
-		while ((e2 = root->next_entry()).is_some) {
-			cout << '[' << (e2.value.is_directory ? 'd' : 'f') << "] " << e2.value.filename << endl;
-		}
+void list_dir(dir& d) {
+	for (const dirent& e : d) {
+		cout << '[' << (e.is_directory() ? 'd' : 'f') << "] " << e.filename << endl;
+	}
+}
 
+void do_ls(string path, fs& f) {
+	// A last component with wildcards is a pattern for the server to filter
+	// the directory with.
+	size_t slash = path.rfind('/');
+	string last = slash == string::npos ? path : path.substr(slash + 1);
+	if (last.find_first_of("*?") == string::npos) {
+		unique_ptr<dir> d = f.open_dir_path(path);
+		list_dir(*d);
 		return;
 	}
 
-	auto ret = find_path(move(root), path);
-	if (ret.is_some) {
-		entry e = ret.value.first;
-		if (!e.is_directory) {
-			cerr << "Path is not a directory." << endl;
-			return;
-		}
+	unique_ptr<dir> d = f.open_dir_path(slash == string::npos ? "" : path.substr(0, slash));
+	d->filter(last, dir::MATCH_GLOB);
+	list_dir(*d);
+}
 
-		unique_ptr<dir> subdir = ret.value.second->open_subdir();
-		maybe<entry> e2;
-		while ((e2 = subdir->next_entry()).is_some) {
-			cout << '[' << (e2.value.is_directory ? 'd' : 'f') << "] " << e2.value.filename << endl;
-		}
-	} else {
-		cerr << "Path not found." << endl;
+void do_cat(string path, fs& f) {
+	unique_ptr<file> fp = f.open_file_path(path);
+	maybe<vector<uint8_t>> e2;
+	while ((e2 = fp->read(CAT_BUFFER_SIZE)).is_some) {
+		fwrite(&e2.value[0], e2.value.size(), 1, stdout);
 	}
 }
 
-void do_cat(string path, fs& f) {
-	unique_ptr<dir> root = f.open_root_dir();
-	auto ret = find_path(move(root), path);
-	if (ret.is_some) {
-		if (ret.value.first.is_directory) {
-			cerr << "The specified path is a directory." << endl;
-			return;
+// Splits the argument of a command that takes a path and something else.
+bool split_arg(string& param, string& arg) {
+	size_t space = param.find(' ');
+	if (space == string::npos) {
+		return false;
+	}
+
+	arg = param.substr(space + 1);
+	param = param.substr(0, space);
+	return true;
+}
+
+void do_put(string path, string local, fs& f) {
+	FILE* in = fopen(local.c_str(), "rb");
+	if (!in) {
+		cerr << "Can't open " << local << "." << endl;
+		return;
+	}
+
+	// Telling the server the size up front lets it allocate the file in one
+	// piece.
+	fseek(in, 0, SEEK_END);
+	long size = ftell(in);
+	fseek(in, 0, SEEK_SET);
+
+	unique_ptr<file> fp;
+	try {
+		try {
+			fp = f.create_file(path, size > 0 ? (uint32_t) size : 0);
+		} catch (fat32::exception& e) {
+			if (e.ret != EEXIST) {
+				throw;
+			}
+
+			fp = f.open_file_for_writing(path);
+			fp->truncate(0);
 		}
+	} catch (fat32::exception& e) {
+		fclose(in);
+		throw;
+	}
 
-		unique_ptr<file> fp = ret.value.second->open_file();
-		maybe<vector<uint8_t>> e2;
-		while ((e2 = fp->read_block()).is_some) {
-			fwrite(&e2.value[0], e2.value.size(), 1, stdout);
+	vector<uint8_t> buf(PUT_BUFFER_SIZE);
+	size_t n, total = 0;
+	while ((n = fread(&buf[0], 1, buf.size(), in)) > 0) {
+		size_t written = fp->write(&buf[0], n);
+		total += written;
+		if (written < n) {
+			cerr << "The volume is full." << endl;
+			break;
 		}
-	} else {
-		cerr << "Path not found." << endl;
 	}
+
+	fclose(in);
+	cout << "Wrote " << total << " bytes." << endl;
+}
+
+void do_truncate(string path, string size, fs& f) {
+	unique_ptr<file> fp = f.open_file_for_writing(path);
+	fp->truncate(strtoull(size.c_str(), nullptr, 10));
 }
 
 void print_tree(unique_ptr<dir> d, int level) {
-	maybe<entry> e;
-	while ((e = d->next_entry()).is_some) {
+	for (const dirent& e : *d) {
 		for (int i = 0; i < level * 4; i++) {
 			cout << ((i % 4 == 0) ? '|' : '-');
 		}
 
-		cout << (level == 0 ? '|' : ' ') << e.value.filename << endl;
-		if (e.value.is_directory && e.value.filename[0] != '.') {
-			unique_ptr<dir> subdir = d->open_subdir();
+		cout << (level == 0 ? '|' : ' ') << e.filename << endl;
+		if (e.is_directory() && e.filename[0] != '.') {
+			unique_ptr<dir> subdir = d->open_subdir(e);
 			print_tree(move(subdir), level + 1);
 		}
 	}
 }
 
 void do_tree(string path, fs& f) {
-	unique_ptr<dir> root = f.open_root_dir();
-	if (path.empty()) {
-		print_tree(move(root), 0);
-	} else {
-		auto ret = find_path(move(root), path);
-		if (ret.is_some) {
-			entry e = ret.value.first;
-			if (!e.is_directory) {
-				cerr << "Path is not a directory." << endl;
-				return;
-			}
+	print_tree(f.open_dir_path(path), 0);
+}
 
-			unique_ptr<dir> subdir = ret.value.second->open_subdir();
-			print_tree(move(subdir), 0);
-		} else {
-			cerr << "Path not found." << endl;
+// Names of the server's requests, indexed by type - FAT32_BASE.
+const char* request_names[FAT32_STATS_REQUEST_TYPES] = {
+	"", "open_fs", "open_rootdir", "open_dir", "open_file", "read_file_block",
+	"read_dir_entry", "close_file", "close_dir", "close_fs", "read_file_range",
+	"seek_file", "pread_file", "read_dir_batch", "open_entry", "open_path",
+	"get_stats", "trace_ctl", "trace_get", "statvfs", "create_file", "write_file",
+	"truncate_file", "unlink", "sync", "read_dir_filter"
+};
+
+void out_ratio(const char* name, uint64_t hits, uint64_t misses) {
+	uint64_t total = hits + misses;
+	printf("%-20s %12llu hits %12llu misses  %5.1f%%\n", name,
+			(unsigned long long) hits, (unsigned long long) misses,
+			total ? 100.0 * hits / total : 0.0);
+}
+
+void do_stats(bool reset) {
+	stats s = get_stats(reset);
+
+	printf("Counting for %u s. Open: %u filesystems, %u directories, %u files.\n\n",
+			s.uptime_s, s.open_fs, s.open_dirs, s.open_files);
+
+	printf("%-16s %12s %8s %14s %10s\n", "request", "count", "errors", "total ms", "avg us");
+	for (int i = 1; i < FAT32_STATS_REQUEST_TYPES; i++) {
+		if (s.requests[i] == 0) {
+			continue;
 		}
+
+		printf("%-16s %12llu %8llu %14.1f %10.1f\n", request_names[i],
+				(unsigned long long) s.requests[i], (unsigned long long) s.errors[i],
+				s.service_us[i] / 1000.0, (double) s.service_us[i] / s.requests[i]);
+	}
+
+	printf("\n%-20s %12llu reads %12llu bytes\n", "device",
+			(unsigned long long) s.dev_reads, (unsigned long long) s.dev_read_bytes);
+	printf("%-20s %12llu writes %11llu bytes\n", "",
+			(unsigned long long) s.dev_writes, (unsigned long long) s.dev_write_bytes);
+	if (s.dev_mapped_bytes > 0) {
+		printf("%-20s %12llu bytes from mapped images\n", "",
+				(unsigned long long) s.dev_mapped_bytes);
+	}
+	printf("%-20s %12llu lookups %9llu sectors written\n", "FAT",
+			(unsigned long long) s.fat_lookups, (unsigned long long) s.fat_sectors_written);
+	printf("%-20s %12llu allocated %7llu freed\n", "clusters",
+			(unsigned long long) s.clusters_allocated, (unsigned long long) s.clusters_freed);
+	printf("%-20s %12llu syncs %11llu clusters written back\n", "write-back",
+			(unsigned long long) s.syncs, (unsigned long long) s.clusters_written_back);
+	out_ratio("FAT cache", s.fat_cache_hits, s.fat_cache_misses);
+	out_ratio("cluster cache", s.cluster_cache_hits, s.cluster_cache_misses);
+	printf("%-20s %12llu evictions %7llu prefetched\n", "",
+			(unsigned long long) s.cluster_cache_evictions,
+			(unsigned long long) s.clusters_prefetched);
+	out_ratio("name cache", s.dentry_hits, s.dentry_misses);
+	printf("%-20s %12llu lookups %9llu built %9llu evicted\n", "directory index",
+			(unsigned long long) s.dirindex_lookups,
+			(unsigned long long) s.dirindex_builds,
+			(unsigned long long) s.dirindex_evictions);
+
+	if (reset) {
+		printf("\nCounters reset.\n");
+	}
+}
+
+void do_df(fs& f, bool scan) {
+	space s = f.get_space(scan);
+	uint64_t cluster = s.bytes_per_cluster;
+
+	printf("%u clusters of %u bytes, %llu MB\n", s.total_clusters, s.bytes_per_cluster,
+			(unsigned long long) (s.total_clusters * cluster >> 20));
+
+	if (s.source == space::FREE_UNKNOWN) {
+		printf("Free space not known yet.\n");
+	} else {
+		printf("%u clusters free, %llu MB (%.1f%%), from %s\n", s.free_clusters,
+				(unsigned long long) (s.free_clusters * cluster >> 20),
+				s.total_clusters ? 100.0 * s.free_clusters / s.total_clusters : 0.0,
+				s.source == space::FREE_SCAN ? "a scan of the FAT" : "the FSInfo sector");
+	}
+
+	const char* states[] = { "not done", "running", "done", "failed" };
+	if (s.scan_state != space::SCAN_NONE && s.scan_state <= space::SCAN_FAILED) {
+		printf("FAT scan %s: %u of %u clusters, %llu KB in %u reads, %.1f ms\n",
+				states[s.scan_state], s.scan_clusters, s.total_clusters,
+				(unsigned long long) (s.scan_bytes / 1024), s.scan_dev_reads,
+				s.scan_us / 1000.0);
 	}
 }
 
@@ -184,9 +278,39 @@ int main(int argc, char** argv) {
 				break;
 			}
 
+			if (input == "df" || input == "df scan") {
+				try {
+					do_df(my_fs, input == "df scan");
+				} catch (fat32::exception& e) {
+					cerr << "Error: " << e.what() << endl;
+				}
+
+				continue;
+			}
+
+			if (input == "sync") {
+				try {
+					my_fs.sync();
+				} catch (fat32::exception& e) {
+					cerr << "Error: " << e.what() << endl;
+				}
+
+				continue;
+			}
+
+			if (input == "stats" || input == "stats reset") {
+				try {
+					do_stats(input == "stats reset");
+				} catch (fat32::exception& e) {
+					cerr << "Error: " << e.what() << endl;
+				}
+
+				continue;
+			}
+
 			size_t space = input.find(' ');
 			if (space == string::npos) {
-				cerr << "Unrecognized command/format. Allowed: stat ls cat tree exit" << endl;
+				cerr << "Unrecognized command/format. Allowed: stat ls cat tree put rm truncate df sync stats exit" << endl;
 				continue;
 			}
 
@@ -208,11 +332,36 @@ int main(int argc, char** argv) {
 					do_cat(param, my_fs);
 				} else if (command == "tree") {
 					do_tree(param, my_fs);
+				} else if (command == "rm") {
+					my_fs.unlink(param);
+				} else if (command == "put" || command == "truncate") {
+					string arg;
+					if (!split_arg(param, arg)) {
+						cerr << "Usage: put /path localfile, truncate /path size" << endl;
+					} else if (command == "put") {
+						do_put(param, arg, my_fs);
+					} else {
+						do_truncate(param, arg, my_fs);
+					}
 				} else {
-					cerr << "Unrecognized command. Allowed: stat ls cat tree exit" << endl;
+					cerr << "Unrecognized command. Allowed: stat ls cat tree put rm truncate df sync stats exit" << endl;
 				}
 			} catch (fat32::exception& e) {
-				cerr << "Error: " << e.what() << endl;
+				if (e.ret == ENOENT) {
+					cerr << "Path not found." << endl;
+				} else if (e.ret == ENOTDIR) {
+					cerr << "Path is not a directory." << endl;
+				} else if (e.ret == EISDIR) {
+					cerr << "The specified path is a directory." << endl;
+				} else if (e.ret == EEXIST) {
+					cerr << "Path already exists." << endl;
+				} else if (e.ret == EROFS) {
+					cerr << "The volume is read-only." << endl;
+				} else if (e.ret == EBUSY) {
+					cerr << "The file is open." << endl;
+				} else {
+					cerr << "Error: " << e.what() << endl;
+				}
 			}
 		}
 	} catch (fat32::exception& e) {
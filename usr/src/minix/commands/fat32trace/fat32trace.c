@@ -0,0 +1,270 @@
+/* fat32 server request trace command line tool */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <lib.h>
+#include <minix/com.h>
+#include <minix/fat32trace.h>
+
+static fat32_trace_entry buf[FAT32_TRACE_BUF_SIZE];
+
+/* Names of the requests, indexed by type - FAT32_BASE. */
+static const char *req_names[FAT32_NR_REQUEST_TYPES] = {
+  "?", "open_fs", "open_rootdir", "open_dir", "open_file",
+  "read_file_block", "read_dir_entry", "close_file", "close_dir",
+  "close_fs", "read_file_range", "seek_file", "pread_file",
+  "read_dir_batch", "open_entry", "open_path", "get_stats",
+  "trace_ctl", "trace_get", "statvfs", "create_file", "write_file",
+  "truncate_file", "unlink", "sync", "read_dir_filter"
+};
+
+static void usage(char *name)
+{
+  printf("usage:\n"
+    "%s start <nr_entries>\n"
+    "%s stop <file>\n"
+    "%s reset\n"
+    "%s dump <file>\n"
+    "%s summary <file>\n",
+    name, name, name, name, name);
+
+  exit(EXIT_FAILURE);
+}
+
+static int trace_ctl(int ctl, size_t size, int *ret)
+{
+  message m;
+  int r;
+
+  memset(&m, 0, sizeof(m));
+  m.m_fat32_trace_ctl.ctl = ctl;
+  m.m_fat32_trace_ctl.size = size;
+
+  if ((r = _syscall(FAT32_PROC_NR, FAT32_TRACE_CTL, &m)) < 0)
+	return r;
+
+  if (ret != NULL)
+	*ret = m.m_fat32_ret.ret;
+
+  return 0;
+}
+
+static const char *req_name(u32_t request)
+{
+  if (request >= FAT32_NR_REQUEST_TYPES) return "?";
+
+  return req_names[request];
+}
+
+static void fat32trace_start(int nr_entries)
+{
+  if (trace_ctl(FAT32_TRACE_START, nr_entries, NULL) < 0) {
+	perror("FAT32_TRACE_CTL");
+	exit(EXIT_FAILURE);
+  }
+}
+
+static void fat32trace_stop(char *file)
+{
+  message m;
+  int r, outfd, lost;
+  size_t size;
+
+  if ((outfd = open(file, O_CREAT|O_TRUNC|O_WRONLY, 0600)) < 0) {
+	perror("file open");
+	exit(EXIT_FAILURE);
+  }
+
+  if (trace_ctl(FAT32_TRACE_STOP, 0, &lost) < 0) {
+	perror("FAT32_TRACE_CTL");
+	exit(EXIT_FAILURE);
+  }
+
+  if (lost > 0)
+	fprintf(stderr, "%d older entries were overwritten\n", lost);
+
+  for (;;) {
+	memset(&m, 0, sizeof(m));
+	m.m_fat32_trace_get.dest = buf;
+	m.m_fat32_trace_get.size = sizeof(buf);
+
+	if ((r = _syscall(FAT32_PROC_NR, FAT32_TRACE_GET, &m)) < 0) {
+		perror("FAT32_TRACE_GET");
+		break;
+	}
+
+	if (m.m_fat32_ret.ret == 0) break;
+
+	size = m.m_fat32_ret.ret * sizeof(buf[0]);
+	if ((r = write(outfd, (char *) buf, size)) != size) {
+		if (r < 0) perror("write");
+		else fputs("short write\n", stderr);
+	}
+  }
+
+  close(outfd);
+
+  if (trace_ctl(FAT32_TRACE_FREE, 0, NULL) < 0) {
+	perror("FAT32_TRACE_CTL");
+	exit(EXIT_FAILURE);
+  }
+}
+
+static void fat32trace_reset(void)
+{
+  if (trace_ctl(FAT32_TRACE_FREE, 0, NULL) < 0) {
+	perror("FAT32_TRACE_CTL");
+	exit(EXIT_FAILURE);
+  }
+}
+
+static fat32_trace_entry *load(char *file, size_t *count)
+{
+  fat32_trace_entry *entries;
+  off_t size;
+  int fd;
+
+  if ((fd = open(file, O_RDONLY)) < 0) {
+	perror("file open");
+	exit(EXIT_FAILURE);
+  }
+
+  size = lseek(fd, 0, SEEK_END);
+  *count = size / sizeof(fat32_trace_entry);
+
+  if ((entries = malloc(*count * sizeof(fat32_trace_entry) + 1)) == NULL) {
+	perror("malloc");
+	exit(EXIT_FAILURE);
+  }
+
+  if (pread(fd, entries, *count * sizeof(fat32_trace_entry), 0) !=
+	(ssize_t) (*count * sizeof(fat32_trace_entry))) {
+	perror("read");
+	exit(EXIT_FAILURE);
+  }
+
+  close(fd);
+
+  return entries;
+}
+
+static void fat32trace_dump(char *file)
+{
+  fat32_trace_entry *entries, *entry;
+  size_t i, count;
+
+  entries = load(file, &count);
+
+  printf("%10s %10s %8s %2s %-16s %8s %10s %10s %s\n", "start", "finish",
+	"us", "w", "request", "handle", "cluster", "bytes", "result");
+
+  for (i = 0; i < count; i++) {
+	entry = &entries[i];
+
+	printf("%10u %10u %8u %2u %-16s %8u %10u %10u %d\n",
+		entry->start_time, entry->finish_time,
+		entry->finish_time - entry->start_time, entry->worker,
+		req_name(entry->request), entry->handle, entry->cluster,
+		entry->bytes, entry->result);
+  }
+
+  free(entries);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+  u32_t x = *(const u32_t *) a, y = *(const u32_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+static void fat32trace_summary(char *file)
+{
+  fat32_trace_entry *entries;
+  u32_t *lat;
+  size_t i, n, count;
+  u32_t req;
+  double total;
+  unsigned long errors;
+
+  entries = load(file, &count);
+
+  if ((lat = malloc(count * sizeof(u32_t) + 1)) == NULL) {
+	perror("malloc");
+	exit(EXIT_FAILURE);
+  }
+
+  printf("%-16s %8s %6s %8s %8s %8s %8s %8s %8s\n", "request", "count",
+	"errors", "avg", "p50", "p90", "p99", "p99.9", "max");
+
+  /* Gather the latencies of each request type and sort them to get the
+   * percentiles, all in microseconds.
+   */
+  for (req = 0; req < FAT32_NR_REQUEST_TYPES; req++) {
+	n = 0;
+	total = 0;
+	errors = 0;
+
+	for (i = 0; i < count; i++) {
+		if (entries[i].request != req) continue;
+
+		lat[n] = entries[i].finish_time - entries[i].start_time;
+		total += lat[n];
+		if (entries[i].result < 0) errors++;
+		n++;
+	}
+
+	if (n == 0) continue;
+
+	qsort(lat, n, sizeof(u32_t), cmp_u32);
+
+	printf("%-16s %8lu %6lu %8.0f %8u %8u %8u %8u %8u\n", req_name(req),
+		(unsigned long) n, errors, total / n, lat[n / 2], lat[n * 9 / 10],
+		lat[n * 99 / 100], lat[n * 999 / 1000], lat[n - 1]);
+  }
+
+  free(lat);
+  free(entries);
+}
+
+int main(int argc, char **argv)
+{
+  int num;
+  char *name = argv[0];
+
+  if (argc < 2) usage(name);
+
+  if (!strcmp(argv[1], "start")) {
+	if (argc < 3) usage(name);
+
+	num = atoi(argv[2]);
+
+	if (num <= 0) usage(name);
+
+	fat32trace_start(num);
+  }
+  else if (!strcmp(argv[1], "stop")) {
+	if (argc < 3) usage(name);
+
+	fat32trace_stop(argv[2]);
+  }
+  else if (!strcmp(argv[1], "reset")) {
+	fat32trace_reset();
+  }
+  else if (!strcmp(argv[1], "dump")) {
+	if (argc < 3) usage(name);
+
+	fat32trace_dump(argv[2]);
+  }
+  else if (!strcmp(argv[1], "summary")) {
+	if (argc < 3) usage(name);
+
+	fat32trace_summary(argv[2]);
+  }
+  else usage(name);
+
+  return EXIT_SUCCESS;
+}
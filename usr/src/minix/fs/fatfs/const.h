@@ -0,0 +1,28 @@
+#define NR_INODES	256	/* # slots in the in-core inode table */
+#define INODE_HASH_SIZE	64	/* # hash chains for in-core inodes, power of 2 */
+
+#define FAT_MAX_BLOCK_SIZE 32768 /* largest block size used for the cache */
+
+#define DIRENT_SIZE	32	/* size of an on-disk directory entry */
+
+#define SLOT_FREE	0x00	/* first name byte: no more entries follow */
+#define SLOT_DELETED	0xE5	/* first name byte: entry was deleted */
+#define ATTR_LFN	0x0F	/* attributes that mark a long name entry */
+
+#define FAT_ENTRY_MASK	0x0FFFFFFF	/* FAT32 entries only use 28 bits */
+#define FAT_EOC		0x0FFFFFF8	/* this and above end a cluster chain */
+
+/* Directories are numbered by their first cluster and files by the position
+ * of their directory entry on disk, so that every inode can be loaded again
+ * from its number alone. File numbers get the top bit of the 64-bit ino_t set
+ * to keep the two apart; cluster numbers never go above 28 bits, and entry
+ * positions divided by 32 never reach it.
+ */
+#define FILE_INO_FLAG	((ino_t) 1 << 63)
+#define IS_FILE_INO(i)	(((i) & FILE_INO_FLAG) != 0)
+
+#define DIR_MODE	(I_DIRECTORY | 0555)	/* mode of all directories */
+#define FILE_MODE	(I_REGULAR | 0555)	/* mode of all files */
+
+#define SYS_UID  ((uid_t) 0)	/* everything is owned by root */
+#define SYS_GID  ((gid_t) 0)	/* group operator */
@@ -0,0 +1,30 @@
+#define _SYSTEM		1	/* get OK and negative error codes */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <lib.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <minix/callnr.h>
+#include <minix/config.h>
+#include <minix/type.h>
+#include <minix/const.h>
+#include <minix/com.h>
+#include <minix/syslib.h>
+#include <minix/sysutil.h>
+#include <minix/bdev.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "fat32.h"
+#include "const.h"
+#include "super.h"
+#include "inode.h"
+#include "proto.h"
+#include "glo.h"
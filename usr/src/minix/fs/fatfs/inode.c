@@ -0,0 +1,268 @@
+/* This file manages the in-core inode table. FAT has no inodes, so they are
+ * made up from directory entries; see const.h for how they are numbered.
+ */
+
+#include "inc.h"
+
+static LIST_HEAD(ihashhead, inode) hash_inodes[INODE_HASH_SIZE];
+static TAILQ_HEAD(unused_inodes_t, inode) unused_inodes;
+
+static int load_inode(struct inode *rip, ino_t ino);
+
+/*===========================================================================*
+ *				init_inode_cache			     *
+ *===========================================================================*/
+void init_inode_cache(void)
+{
+  struct inode *rip;
+  int i;
+
+  for (i = 0; i < INODE_HASH_SIZE; i++)
+	LIST_INIT(&hash_inodes[i]);
+
+  TAILQ_INIT(&unused_inodes);
+  for (rip = &inode[0]; rip < &inode[NR_INODES]; rip++) {
+	rip->i_num = 0;
+	rip->i_count = 0;
+	TAILQ_INSERT_TAIL(&unused_inodes, rip, i_unused);
+  }
+}
+
+/*===========================================================================*
+ *				find_inode				     *
+ *===========================================================================*/
+struct inode *find_inode(ino_t ino)
+{
+/* Find an inode that is in use, without loading it. */
+  struct inode *rip;
+
+  LIST_FOREACH(rip, &hash_inodes[ino & (INODE_HASH_SIZE - 1)], i_hash) {
+	if (rip->i_num == ino && rip->i_count > 0)
+		return(rip);
+  }
+
+  return(NULL);
+}
+
+/*===========================================================================*
+ *				get_inode				     *
+ *===========================================================================*/
+struct inode *get_inode(ino_t ino)
+{
+/* Find an inode in the table or load it from the disk, and take a reference
+ * to it. Sets err_code and returns NULL if that fails.
+ */
+  struct inode *rip;
+  int r;
+
+  LIST_FOREACH(rip, &hash_inodes[ino & (INODE_HASH_SIZE - 1)], i_hash) {
+	if (rip->i_num == ino) {
+		if (rip->i_count == 0)
+			TAILQ_REMOVE(&unused_inodes, rip, i_unused);
+		rip->i_count++;
+		return(rip);
+	}
+  }
+
+  /* Take the least recently used inode that nobody holds. */
+  if ((rip = TAILQ_FIRST(&unused_inodes)) == NULL) {
+	err_code = ENFILE;
+	return(NULL);
+  }
+
+  TAILQ_REMOVE(&unused_inodes, rip, i_unused);
+  if (rip->i_num != 0)
+	LIST_REMOVE(rip, i_hash);
+  rip->i_num = 0;
+
+  if ((r = load_inode(rip, ino)) != OK) {
+	/* Give the slot back, it's the first to be taken again. */
+	TAILQ_INSERT_HEAD(&unused_inodes, rip, i_unused);
+	err_code = r;
+	return(NULL);
+  }
+
+  rip->i_num = ino;
+  rip->i_count = 1;
+  rip->i_mountpoint = FALSE;
+  rip->i_map_index = 0;
+  rip->i_map_cluster = 0;
+  LIST_INSERT_HEAD(&hash_inodes[ino & (INODE_HASH_SIZE - 1)], rip, i_hash);
+
+  return(rip);
+}
+
+/*===========================================================================*
+ *				put_inode				     *
+ *===========================================================================*/
+void put_inode(struct inode *rip)
+{
+/* Drop a reference to an inode. Unused inodes stay hashed until their slot is
+ * needed for another one.
+ */
+  if (rip == NULL)
+	return;
+
+  if (--rip->i_count == 0) {
+	rip->i_mountpoint = FALSE;
+	TAILQ_INSERT_TAIL(&unused_inodes, rip, i_unused);
+  }
+}
+
+/*===========================================================================*
+ *				entry_ino				     *
+ *===========================================================================*/
+ino_t entry_ino(fat32_direntry_t *dep, u64_t disk_pos)
+{
+/* Get the number of the inode a directory entry at a given position on the
+ * disk refers to.
+ */
+  u32_t cluster;
+
+  if (dep->attributes & FAT32_ATTR_DIR) {
+	cluster = ((u32_t) dep->first_cluster_nr_high << 16) |
+		dep->first_cluster_nr_low;
+
+	/* The '..' entries of top level directories point at cluster 0. */
+	return(cluster == 0 ? (ino_t) sb.s_root_cluster : (ino_t) cluster);
+  }
+
+  return(FILE_INO_FLAG | (ino_t) (disk_pos / DIRENT_SIZE));
+}
+
+/*===========================================================================*
+ *				load_file				     *
+ *===========================================================================*/
+static int load_file(struct inode *rip, ino_t ino)
+{
+/* Fill in a file inode from the directory entry it is numbered by. */
+  fat32_direntry_t dent;
+  struct buf *bp;
+  u64_t pos;
+
+  pos = (ino & ~FILE_INO_FLAG) * DIRENT_SIZE;
+  if ((bp = fetch_block((block_t) (pos / sb.s_block_size))) == NULL)
+	return(EIO);
+
+  memcpy(&dent, b_data(bp) + pos % sb.s_block_size, sizeof(dent));
+  put_block(bp, DIRECTORY_BLOCK);
+
+  /* The number may be stale, if it didn't come from a lookup. */
+  if (dent.filename_83[0] == SLOT_FREE || dent.filename_83[0] == SLOT_DELETED ||
+	dent.attributes == ATTR_LFN ||
+	(dent.attributes & (FAT32_ATTR_DIR | FAT32_ATTR_VOLUMEID)))
+	return(ENOENT);
+
+  rip->i_mode = FILE_MODE;
+  rip->i_size = dent.size_bytes;
+  rip->i_first_cluster = ((u32_t) dent.first_cluster_nr_high << 16) |
+	dent.first_cluster_nr_low;
+  rip->i_parent = 0;
+  rip->i_mtime = fat_time(dent.last_modified_date, dent.last_modified_time);
+  rip->i_atime = fat_time(dent.last_access_date, dent.last_modified_time);
+  rip->i_ctime = fat_time(dent.creation_date, dent.creation_time);
+
+  return(OK);
+}
+
+/*===========================================================================*
+ *				load_dir				     *
+ *===========================================================================*/
+static int load_dir(struct inode *rip, u32_t cluster)
+{
+/* Fill in a directory inode from its first cluster. Every directory but the
+ * root starts with '.', which has its times, and '..', which points to its
+ * parent.
+ */
+  fat32_direntry_t dents[2];
+  struct buf *bp;
+  u32_t nr_clusters, next;
+  u64_t pos;
+  int r;
+
+  if (cluster < 2 || cluster >= sb.s_total_clusters + 2)
+	return(ENOENT);
+
+  rip->i_mode = DIR_MODE;
+  rip->i_first_cluster = cluster;
+  rip->i_mtime = rip->i_atime = rip->i_ctime = 0;
+
+  if (cluster == sb.s_root_cluster) {
+	rip->i_parent = cluster;
+  } else {
+	pos = cluster_pos(cluster);
+	if ((bp = fetch_block((block_t) (pos / sb.s_block_size))) == NULL)
+		return(EIO);
+
+	memcpy(dents, b_data(bp) + pos % sb.s_block_size, sizeof(dents));
+	put_block(bp, DIRECTORY_BLOCK);
+
+	if (memcmp(dents[0].filename_83, ".          ", 11) != 0 ||
+		memcmp(dents[1].filename_83, "..         ", 11) != 0)
+		return(ENOENT);	/* not the start of a directory */
+
+	rip->i_parent = entry_ino(&dents[1], 0);
+	rip->i_mtime = fat_time(dents[0].last_modified_date,
+		dents[0].last_modified_time);
+	rip->i_atime = fat_time(dents[0].last_access_date,
+		dents[0].last_modified_time);
+	rip->i_ctime = fat_time(dents[0].creation_date,
+		dents[0].creation_time);
+  }
+
+  /* Directories have no size in their entries; count their clusters. */
+  nr_clusters = 1;
+  for (next = cluster; ; nr_clusters++) {
+	if ((r = next_cluster(next, &next)) != OK)
+		return(r);
+	if (next == 0)
+		break;
+	if (nr_clusters >= sb.s_total_clusters)
+		return(EIO);	/* the chain has a loop */
+  }
+
+  rip->i_size = (off_t) nr_clusters * sb.s_cluster_size;
+
+  return(OK);
+}
+
+/*===========================================================================*
+ *				load_inode				     *
+ *===========================================================================*/
+static int load_inode(struct inode *rip, ino_t ino)
+{
+  if (IS_FILE_INO(ino))
+	return(load_file(rip, ino));
+
+  return(load_dir(rip, (u32_t) ino));
+}
+
+/*===========================================================================*
+ *				fs_putnode				     *
+ *===========================================================================*/
+int fs_putnode(void)
+{
+/* Find the inode specified by the request message and decrease its counter. */
+  struct inode *rip;
+  int count;
+
+  rip = find_inode(fs_m_in.m_vfs_fs_putnode.inode);
+  if (rip == NULL) {
+	printf("FATFS: put_node: inode %llu not found\n",
+		fs_m_in.m_vfs_fs_putnode.inode);
+	return(EINVAL);
+  }
+
+  count = fs_m_in.m_vfs_fs_putnode.count;
+  if (count <= 0 || count > rip->i_count) {
+	printf("FATFS: put_node: bad count %d (have %d)\n", count,
+		rip->i_count);
+	return(EINVAL);
+  }
+
+  /* Decrease the reference count, releasing the inode on the last one. */
+  rip->i_count -= count - 1;
+  put_inode(rip);
+
+  return(OK);
+}
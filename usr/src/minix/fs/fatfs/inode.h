@@ -0,0 +1,27 @@
+/* In-core inodes. FAT has no inodes on disk; they are built from directory
+ * entries when a file is looked up and kept around while VFS holds them.
+ * Inodes that are no longer in use stay hashed on the unused list, so that
+ * they can be found again without going to the disk, until their slot is
+ * taken for another inode.
+ */
+EXTERN struct inode {
+  ino_t i_num;			/* inode number, see const.h */
+  int i_count;			/* # times inode used; 0 means slot is free */
+  mode_t i_mode;		/* file type and permissions */
+  off_t i_size;			/* size in bytes; whole clusters for dirs */
+  u32_t i_first_cluster;	/* first cluster, 0 for empty files */
+  ino_t i_parent;		/* parent directory, only set for dirs */
+  time_t i_mtime;		/* time of last modification */
+  time_t i_atime;		/* date of last access */
+  time_t i_ctime;		/* time of creation */
+  char i_mountpoint;		/* true if something is mounted on this */
+
+  /* The last cluster mapped, so that sequential access doesn't have to walk
+   * the cluster chain from its start every time.
+   */
+  u32_t i_map_index;		/* index of the cluster within the file */
+  u32_t i_map_cluster;		/* its cluster number, 0 if none mapped */
+
+  LIST_ENTRY(inode) i_hash;	/* hash chain */
+  TAILQ_ENTRY(inode) i_unused;	/* free and unused list */
+} inode[NR_INODES];
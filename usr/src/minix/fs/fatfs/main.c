@@ -0,0 +1,144 @@
+/* This file contains the main loop of the FAT32 file system server. It waits
+ * for a request from VFS, handles it and sends the reply.
+ */
+
+#include "inc.h"
+#include <assert.h>
+
+/* Declare some local functions. */
+static void get_work(message *m_in);
+static void reply(endpoint_t who, message *m_out);
+
+/* SEF functions and variables. */
+static void sef_local_startup(void);
+static int sef_cb_init_fresh(int type, sef_init_info_t *info);
+static void sef_cb_signal_handler(int signo);
+
+/*===========================================================================*
+ *				main                                         *
+ *===========================================================================*/
+int main(void)
+{
+  int error, ind, transid;
+
+  /* SEF local startup. */
+  sef_local_startup();
+
+  for (;;) {
+	/* Wait for request message. */
+	get_work(&fs_m_in);
+
+	transid = TRNS_GET_ID(fs_m_in.m_type);
+	fs_m_in.m_type = TRNS_DEL_ID(fs_m_in.m_type);
+	if (fs_m_in.m_type == 0) {
+		assert(!IS_VFS_FS_TRANSID(transid));
+		fs_m_in.m_type = transid;	/* Backwards compat. */
+		transid = 0;
+	} else
+		assert(IS_VFS_FS_TRANSID(transid));
+
+	caller_uid = INVAL_UID;	/* To trap errors */
+	caller_gid = INVAL_GID;
+
+	req_nr = fs_m_in.m_type;
+	if (req_nr < FS_BASE) {
+		fs_m_in.m_type += FS_BASE;
+		req_nr = fs_m_in.m_type;
+	}
+
+	ind = req_nr - FS_BASE;
+
+	if (ind < 0 || ind >= NREQS)
+		error = EINVAL;
+	else
+		error = (*fs_call_vec[ind])();
+
+	fs_m_out.m_type = error;
+	if (IS_VFS_FS_TRANSID(transid)) {
+		/* If a transaction ID was set, reset it */
+		fs_m_out.m_type = TRNS_ADD_ID(fs_m_out.m_type, transid);
+	}
+	reply(fs_m_in.m_source, &fs_m_out);
+  }
+}
+
+/*===========================================================================*
+ *			       sef_local_startup			     *
+ *===========================================================================*/
+static void sef_local_startup(void)
+{
+  /* Register init callbacks. */
+  sef_setcb_init_fresh(sef_cb_init_fresh);
+  sef_setcb_init_restart(sef_cb_init_fail);
+
+  /* No live update support for now. */
+
+  /* Register signal callbacks. */
+  sef_setcb_signal_handler(sef_cb_signal_handler);
+
+  /* Let SEF perform startup. */
+  sef_startup();
+}
+
+/*===========================================================================*
+ *		            sef_cb_init_fresh                                *
+ *===========================================================================*/
+static int sef_cb_init_fresh(int UNUSED(type), sef_init_info_t *UNUSED(info))
+{
+/* Initialize the FAT32 file system server. */
+
+  setenv("TZ", "", 1);		/* FAT times are taken to be UTC */
+
+  /* File data may be shared with VM, so that it can be mapped. */
+  lmfs_may_use_vmcache(1);
+
+  init_inode_cache();
+
+  /* just a small number before we find out the block size at mount time */
+  lmfs_buf_pool(10);
+
+  return(OK);
+}
+
+/*===========================================================================*
+ *				sef_cb_signal_handler			     *
+ *===========================================================================*/
+static void sef_cb_signal_handler(int signo)
+{
+  /* Only check for termination signal, ignore anything else. */
+  if (signo != SIGTERM) return;
+
+  /* No need to do a sync, as this is a read-only file system. */
+
+  /* If the file system has already been unmounted, exit immediately.
+   * We might not get another message.
+   */
+  if (unmountdone) exit(0);
+}
+
+/*===========================================================================*
+ *				get_work                                     *
+ *===========================================================================*/
+static void get_work(message *m_in)
+{
+  int r;
+
+  for (;;) {
+	if ((r = sef_receive(ANY, m_in)) != OK)	/* wait for message */
+		panic("sef_receive failed: %d", r);
+
+	if (m_in->m_source == VFS_PROC_NR)
+		return;
+
+	printf("FATFS: unexpected source %d\n", m_in->m_source);
+  }
+}
+
+/*===========================================================================*
+ *				reply					     *
+ *===========================================================================*/
+static void reply(endpoint_t who, message *m_out)
+{
+  if (OK != ipc_send(who, m_out))	/* send the message */
+	printf("FATFS(%d) was unable to send reply\n", sef_self());
+}
@@ -0,0 +1,110 @@
+#include "inc.h"
+
+/*===========================================================================*
+ *				fs_readsuper				     *
+ *===========================================================================*/
+int fs_readsuper(void)
+{
+/* Mount the file system. It is always mounted read-only, whatever VFS asks
+ * for; requests that would change it fail with EROFS.
+ */
+  struct inode *root_ip;
+  cp_grant_id_t label_gid;
+  size_t label_len;
+  int r;
+
+  fs_dev    = fs_m_in.m_vfs_fs_readsuper.device;
+  label_gid = fs_m_in.m_vfs_fs_readsuper.grant;
+  label_len = fs_m_in.m_vfs_fs_readsuper.path_len;
+
+  if (label_len > sizeof(fs_dev_label))
+	return(EINVAL);
+
+  r = sys_safecopyfrom(fs_m_in.m_source, label_gid, 0,
+	(vir_bytes) fs_dev_label, label_len);
+  if (r != OK) {
+	printf("FATFS %s:%d safecopyfrom failed: %d\n", __FILE__, __LINE__, r);
+	return(EINVAL);
+  }
+
+  /* Map the driver label for this major */
+  bdev_driver(fs_dev, fs_dev_label);
+
+  /* Open the device the file system lives on in read only mode */
+  if (bdev_open(fs_dev, BDEV_R_BIT) != OK)
+	return(EINVAL);
+
+  /* Read the boot sector */
+  if ((r = read_super(fs_dev)) != OK) {
+	bdev_close(fs_dev);
+	return(r);
+  }
+
+  lmfs_set_blocksize(sb.s_block_size, major(fs_dev));
+
+  /* Get the root inode of the mounted file system. */
+  if ((root_ip = get_inode(sb.s_root_cluster)) == NULL) {
+	printf("FATFS: couldn't get the root directory (%d)\n", err_code);
+	bdev_close(fs_dev);
+	return(EINVAL);
+  }
+
+  /* Return some root inode properties */
+  fs_m_out.m_fs_vfs_readsuper.inode = root_ip->i_num;
+  fs_m_out.m_fs_vfs_readsuper.mode = root_ip->i_mode;
+  fs_m_out.m_fs_vfs_readsuper.file_size = root_ip->i_size;
+  fs_m_out.m_fs_vfs_readsuper.uid = SYS_UID;
+  fs_m_out.m_fs_vfs_readsuper.gid = SYS_GID;
+  fs_m_out.m_fs_vfs_readsuper.flags = RES_HASPEEK;
+
+  return(OK);
+}
+
+/*===========================================================================*
+ *				fs_mountpoint				     *
+ *===========================================================================*/
+int fs_mountpoint(void)
+{
+/* This function looks up the mount point, it checks the condition whether
+ * the partition can be mounted on the inode or not.
+ */
+  struct inode *rip;
+  int r = OK;
+
+  /* Temporarily open the file. */
+  if ((rip = get_inode(fs_m_in.m_vfs_fs_mountpoint.inode)) == NULL)
+	return(EINVAL);
+
+  if (rip->i_mountpoint)
+	r = EBUSY;
+
+  /* If the inode is not a dir returns error */
+  if ((rip->i_mode & I_TYPE) != I_DIRECTORY)
+	r = ENOTDIR;
+
+  if (r == OK)
+	rip->i_mountpoint = TRUE;
+
+  put_inode(rip);
+
+  return(r);
+}
+
+/*===========================================================================*
+ *				fs_unmount				     *
+ *===========================================================================*/
+int fs_unmount(void)
+{
+/* Unmount the file system. */
+  struct inode *root_ip;
+
+  /* Drop the reference VFS had to the root directory. */
+  if ((root_ip = find_inode(sb.s_root_cluster)) != NULL)
+	put_inode(root_ip);
+
+  lmfs_invalidate(fs_dev);
+  bdev_close(fs_dev);
+  unmountdone = TRUE;
+
+  return(OK);
+}
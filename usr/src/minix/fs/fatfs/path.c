@@ -0,0 +1,256 @@
+#include "inc.h"
+#include <strings.h>
+
+static char *get_name(char *name, char string[NAME_MAX+1]);
+static int search_dir(struct inode *ldir_ptr, char string[NAME_MAX+1],
+	ino_t *numb);
+static int parse_path(ino_t dir_ino, ino_t root_ino, struct inode
+	**res_inop, size_t *offsetp);
+
+/*===========================================================================*
+ *				fs_lookup				     *
+ *===========================================================================*/
+int fs_lookup(void)
+{
+  cp_grant_id_t grant;
+  int r, len;
+  size_t offset;
+  ino_t dir_ino, root_ino;
+  struct inode *rip;
+
+  grant		= fs_m_in.m_vfs_fs_lookup.grant_path;
+  len		= fs_m_in.m_vfs_fs_lookup.path_len;	/* including terminating nul */
+  dir_ino	= fs_m_in.m_vfs_fs_lookup.dir_ino;
+  root_ino	= fs_m_in.m_vfs_fs_lookup.root_ino;
+  caller_uid	= fs_m_in.m_vfs_fs_lookup.uid;
+  caller_gid	= fs_m_in.m_vfs_fs_lookup.gid;
+
+  /* Check length. */
+  if (len > sizeof(user_path)) return(E2BIG);	/* too big for buffer */
+  if (len < 1) return(EINVAL);			/* too small */
+
+  /* Copy the pathname */
+  r = sys_safecopyfrom(VFS_PROC_NR, grant, 0, (vir_bytes) user_path,
+	(phys_bytes) len);
+  if (r != OK) {
+	printf("FATFS %s:%d sys_safecopyfrom failed: %d\n",
+		__FILE__, __LINE__, r);
+	return(r);
+  }
+
+  /* Verify this is a null-terminated path. */
+  if (user_path[len-1] != '\0') return(EINVAL);
+
+  /* Lookup inode */
+  rip = NULL;
+  offset = 0;
+  r = parse_path(dir_ino, root_ino, &rip, &offset);
+
+  if (r == ELEAVEMOUNT) {
+	/* Report offset and the error */
+	fs_m_out.m_fs_vfs_lookup.offset = offset;
+	fs_m_out.m_fs_vfs_lookup.symloop = 0;
+	return(r);
+  }
+
+  if (r != OK && r != EENTERMOUNT) return(r);
+
+  fs_m_out.m_fs_vfs_lookup.inode	= rip->i_num;
+  fs_m_out.m_fs_vfs_lookup.mode		= rip->i_mode;
+  fs_m_out.m_fs_vfs_lookup.file_size	= rip->i_size;
+  fs_m_out.m_fs_vfs_lookup.symloop	= 0;
+  fs_m_out.m_fs_vfs_lookup.uid		= SYS_UID;
+  fs_m_out.m_fs_vfs_lookup.gid		= SYS_GID;
+
+  /* VFS keeps the reference to the inode, unless it goes on to another
+   * file system.
+   */
+  if (r == EENTERMOUNT) {
+	fs_m_out.m_fs_vfs_lookup.offset = offset;
+	put_inode(rip);
+  }
+
+  return(r);
+}
+
+/*===========================================================================*
+ *				search_dir				     *
+ *===========================================================================*/
+static int search_dir(ldir_ptr, string, numb)
+struct inode *ldir_ptr;			/* directory to search */
+char string[NAME_MAX+1];		/* component to search for */
+ino_t *numb;				/* pointer to inode number */
+{
+/* Look up a name in a directory and return the number of its inode. Names
+ * are compared without regard to case, as FAT does.
+ */
+  struct fat_dirent fd;
+  off_t pos;
+  int r;
+
+  if ((ldir_ptr->i_mode & I_TYPE) != I_DIRECTORY)
+	return(ENOTDIR);
+
+  if (strcmp(string, ".") == 0) {
+	*numb = ldir_ptr->i_num;
+	return(OK);
+  }
+
+  if (strcmp(string, "..") == 0) {
+	*numb = ldir_ptr->i_parent;
+	return(OK);
+  }
+
+  pos = 0;
+  while ((r = read_dirent(ldir_ptr, &pos, &fd)) == OK) {
+	if (strcasecmp(fd.d_name, string) == 0) {
+		*numb = fd.d_ino;
+		return(OK);
+	}
+  }
+
+  return(r == END_OF_FILE ? ENOENT : r);
+}
+
+/*===========================================================================*
+ *				parse_path				     *
+ *===========================================================================*/
+static int parse_path(dir_ino, root_ino, res_inop, offsetp)
+ino_t dir_ino;
+ino_t root_ino;
+struct inode **res_inop;
+size_t *offsetp;
+{
+  int r;
+  char string[NAME_MAX+1];
+  char *cp, *ncp;
+  ino_t numb;
+  struct inode *start_dir, *old_dir;
+
+  /* Find starting inode according to the request message */
+  if ((start_dir = find_inode(dir_ino)) == NULL) {
+	printf("FATFS: couldn't find starting inode %llu\n", dir_ino);
+	return(ENOENT);
+  }
+  start_dir->i_count++;
+
+  cp = user_path;
+
+  /* Scan the path component by component. */
+  while (TRUE) {
+	if (cp[0] == '\0') {
+		/* Empty path */
+		*res_inop = start_dir;
+		*offsetp += cp - user_path;
+
+		/* Return EENTERMOUNT if we are at a mount point */
+		if (start_dir->i_mountpoint)
+			return(EENTERMOUNT);
+
+		return(OK);
+	}
+
+	if (cp[0] == '/') {
+		/* Special case code. If the remaining path consists of just
+		 * slashes, we need to look up '.'
+		 */
+		while (cp[0] == '/')
+			cp++;
+		if (cp[0] == '\0') {
+			strlcpy(string, ".", NAME_MAX + 1);
+			ncp = cp;
+		} else
+			ncp = get_name(cp, string);
+	} else
+		/* Just get the first component */
+		ncp = get_name(cp, string);
+
+	/* Special code for '..'. A process is not allowed to leave a chrooted
+	 * environment. A lookup of '..' at the root of a mounted filesystem
+	 * has to return ELEAVEMOUNT.
+	 */
+	if (strcmp(string, "..") == 0) {
+		if (start_dir->i_num == root_ino) {
+			cp = ncp;
+			continue;	/* Just ignore the '..' at a process'
+					 * root.
+					 */
+		}
+
+		if (start_dir->i_num == sb.s_root_cluster) {
+			/* Climbing up mountpoint */
+			put_inode(start_dir);
+			*res_inop = NULL;
+			*offsetp += cp - user_path;
+			return(ELEAVEMOUNT);
+		}
+	} else {
+		/* Only check for a mount point if we are not looking for '..'. */
+		if (start_dir->i_mountpoint) {
+			*res_inop = start_dir;
+			*offsetp += cp - user_path;
+			return(EENTERMOUNT);
+		}
+	}
+
+	/* There is more path.  Keep parsing. */
+	old_dir = start_dir;
+
+	r = search_dir(old_dir, string, &numb);
+	if (r == OK && (start_dir = get_inode(numb)) == NULL)
+		r = err_code;
+
+	put_inode(old_dir);
+	if (r != OK)
+		return(r);
+
+	cp = ncp;
+  }
+}
+
+/*===========================================================================*
+ *				get_name				     *
+ *===========================================================================*/
+static char *get_name(path_name, string)
+char *path_name;		/* path name to parse */
+char string[NAME_MAX+1];	/* component extracted from 'old_name' */
+{
+/* Given a pointer to a path name in fs space, 'path_name', copy the first
+ * component to 'string' (truncated if necessary, always nul terminated).
+ * A pointer to the string after the first component of the name as yet
+ * unparsed is returned.  Roughly speaking,
+ * 'get_name' = 'path_name' - 'string'.
+ *
+ * This routine follows the standard convention that /usr/ast, /usr//ast,
+ * //usr///ast and /usr/ast/ are all equivalent.
+ */
+  size_t len;
+  char *cp, *ep;
+
+  cp = path_name;
+
+  /* Skip leading slashes */
+  while (cp[0] == '/')
+	cp++;
+
+  /* Find the end of the first component */
+  ep = cp;
+  while (ep[0] != '\0' && ep[0] != '/')
+	ep++;
+
+  len = ep - cp;
+
+  /* Truncate the amount to be copied if it exceeds NAME_MAX */
+  if (len > NAME_MAX)
+	len = NAME_MAX;
+
+  /* Special case of the string at cp is empty */
+  if (len == 0)
+	strlcpy(string, ".", NAME_MAX + 1);	/* Return "." */
+  else {
+	memcpy(string, cp, len);
+	string[len] = '\0';
+  }
+
+  return(ep);
+}
@@ -0,0 +1,62 @@
+/* Function prototypes for the FAT32 file system. */
+
+#include <minix/libminixfs.h>
+
+#define get_block(n) lmfs_get_block(fs_dev, n, NORMAL)
+#define put_block(bp, t) lmfs_put_block(bp, t)
+#define b_data(bp) ((char *) (bp->data))
+
+/* A directory entry as found by read_dirent. */
+struct fat_dirent {
+  char d_name[NAME_MAX+1];	/* long name if there is one, else 8.3 name */
+  fat32_direntry_t d_entry;	/* the short entry */
+  ino_t d_ino;			/* number of the inode it refers to */
+  off_t d_start;		/* position of its first (long name) entry */
+};
+
+/* main.c */
+int main(void);
+
+/* inode.c */
+void init_inode_cache(void);
+struct inode *get_inode(ino_t ino);
+struct inode *find_inode(ino_t ino);
+void put_inode(struct inode *rip);
+ino_t entry_ino(fat32_direntry_t *dep, u64_t disk_pos);
+int fs_putnode(void);
+
+/* misc.c */
+int fs_sync(void);
+int fs_new_driver(void);
+int fs_bpeek(void);
+
+/* mount.c */
+int fs_readsuper(void);
+int fs_mountpoint(void);
+int fs_unmount(void);
+
+/* path.c */
+int fs_lookup(void);
+
+/* read.c */
+int fs_readwrite(void);
+int fs_bread(void);
+int fs_getdents(void);
+block_t read_map(struct inode *rip, off_t position);
+int read_dirent(struct inode *dir, off_t *pos, struct fat_dirent *dp);
+
+/* stadir.c */
+int fs_stat(void);
+int fs_statvfs(void);
+
+/* super.c */
+int read_super(dev_t dev);
+struct buf *fetch_block(block_t b);
+int next_cluster(u32_t cluster, u32_t *next);
+u64_t cluster_pos(u32_t cluster);
+
+/* utility.c */
+int do_noop(void);
+int no_sys(void);
+int read_only(void);
+time_t fat_time(fat32_date_t date, fat32_time_t time);
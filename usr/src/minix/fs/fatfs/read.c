@@ -0,0 +1,447 @@
+#include "inc.h"
+#include <sys/dirent.h>
+#include <assert.h>
+
+static struct buf *rahead(struct inode *rip, block_t baseblock, off_t
+	position, unsigned bytes_ahead);
+static int rw_chunk(struct inode *rip, off_t position, unsigned off,
+	unsigned chunk, unsigned left, int rw_flag, cp_grant_id_t gid, unsigned
+	buf_off);
+
+/*===========================================================================*
+ *				fs_readwrite				     *
+ *===========================================================================*/
+int fs_readwrite(void)
+{
+  int r, rw_flag;
+  cp_grant_id_t gid;
+  off_t position, f_size;
+  unsigned int off, cum_io, chunk, block_size;
+  size_t nrbytes;
+  struct inode *rip;
+
+  /* Find the inode referred */
+  if ((rip = find_inode(fs_m_in.m_vfs_fs_readwrite.inode)) == NULL)
+	return(EINVAL);
+
+  switch (fs_m_in.m_type) {
+  case REQ_READ: rw_flag = READING; break;
+  case REQ_PEEK: rw_flag = PEEKING; break;
+  default: return(EROFS);
+  }
+
+  gid = fs_m_in.m_vfs_fs_readwrite.grant;
+  position = fs_m_in.m_vfs_fs_readwrite.seek_pos;
+  nrbytes = fs_m_in.m_vfs_fs_readwrite.nbytes;
+  block_size = sb.s_block_size;
+  f_size = rip->i_size;
+
+  r = OK;
+  cum_io = 0;
+  /* Split the transfer into chunks that don't span two blocks. */
+  while (nrbytes != 0 && position < f_size) {
+	off = (unsigned int) (position % block_size);	/* offset in blk */
+	chunk = MIN(nrbytes, block_size - off);
+	if (chunk > f_size - position)
+		chunk = (unsigned int) (f_size - position);
+
+	r = rw_chunk(rip, position, off, chunk, nrbytes, rw_flag, gid, cum_io);
+	if (r != OK) break;
+
+	/* Update counters and pointers. */
+	nrbytes -= chunk;	/* bytes yet to be read */
+	cum_io += chunk;	/* bytes read so far */
+	position += chunk;	/* position within the file */
+  }
+
+  fs_m_out.m_fs_vfs_readwrite.seek_pos = position;
+  fs_m_out.m_fs_vfs_readwrite.nbytes = cum_io;
+
+  return(r);
+}
+
+/*===========================================================================*
+ *				fs_bread				     *
+ *===========================================================================*/
+int fs_bread(void)
+{
+/* Read from the device the file system lives on, through the cache. */
+  int r;
+  cp_grant_id_t gid;
+  u64_t position;
+  unsigned int off, cum_io, chunk, block_size;
+  size_t nrbytes;
+  struct buf *bp;
+
+  gid = fs_m_in.m_vfs_fs_breadwrite.grant;
+  position = fs_m_in.m_vfs_fs_breadwrite.seek_pos;
+  nrbytes = fs_m_in.m_vfs_fs_breadwrite.nbytes;
+  block_size = sb.s_block_size;
+
+  r = OK;
+  cum_io = 0;
+  while (nrbytes != 0) {
+	off = (unsigned int) (position % block_size);
+	chunk = MIN(nrbytes, block_size - off);
+
+	if ((bp = fetch_block((block_t) (position / block_size))) == NULL) {
+		r = EIO;
+		break;
+	}
+
+	r = sys_safecopyto(VFS_PROC_NR, gid, (vir_bytes) cum_io,
+		(vir_bytes) (b_data(bp) + off), (size_t) chunk);
+	put_block(bp, off + chunk == block_size ? FULL_DATA_BLOCK :
+		PARTIAL_DATA_BLOCK);
+	if (r != OK) break;
+
+	nrbytes -= chunk;
+	cum_io += chunk;
+	position += chunk;
+  }
+
+  fs_m_out.m_fs_vfs_breadwrite.seek_pos = position;
+  fs_m_out.m_fs_vfs_breadwrite.nbytes = cum_io;
+
+  /* A partial read is still a success. */
+  return(cum_io > 0 ? OK : r);
+}
+
+/*===========================================================================*
+ *				rw_chunk				     *
+ *===========================================================================*/
+static int rw_chunk(rip, position, off, chunk, left, rw_flag, gid, buf_off)
+struct inode *rip;		/* pointer to inode for file to be read */
+off_t position;			/* position within file to read */
+unsigned off;			/* off within the current block */
+unsigned chunk;			/* number of bytes to read */
+unsigned left;			/* max number of bytes wanted after position */
+int rw_flag;			/* READING or PEEKING */
+cp_grant_id_t gid;		/* grant */
+unsigned buf_off;		/* offset in grant */
+{
+/* Read (part of) a block, or only bring it into the cache when peeking. */
+  struct buf *bp;
+  block_t b;
+  int r;
+
+  /* Files are read within their size, so the chain can't end before. */
+  if ((b = read_map(rip, position)) == NO_BLOCK)
+	return(EIO);
+
+  bp = rahead(rip, b, position, left);
+  if (lmfs_dev(bp) == NO_DEV) {
+	put_block(bp, FULL_DATA_BLOCK);
+	return(EIO);
+  }
+
+  r = OK;
+  if (rw_flag == READING) {
+	/* Copy a chunk from the block buffer to user space. */
+	r = sys_safecopyto(VFS_PROC_NR, gid, (vir_bytes) buf_off,
+		(vir_bytes) (b_data(bp) + off), (size_t) chunk);
+  }
+
+  put_block(bp, off + chunk == sb.s_block_size ? FULL_DATA_BLOCK :
+	PARTIAL_DATA_BLOCK);
+
+  return(r);
+}
+
+/*===========================================================================*
+ *				read_map				     *
+ *===========================================================================*/
+block_t read_map(struct inode *rip, off_t position)
+{
+/* Given an inode and a position within the corresponding file, locate the
+ * block number in which that position is to be found. The last cluster found
+ * is remembered, so that sequential access doesn't walk the cluster chain from
+ * its start every time. Returns NO_BLOCK past the end of the chain.
+ */
+  u32_t index, i, cluster;
+  u64_t pos;
+
+  if (rip->i_first_cluster == 0)
+	return(NO_BLOCK);
+
+  index = (u32_t) (position / sb.s_cluster_size);
+  if (rip->i_map_cluster != 0 && index >= rip->i_map_index) {
+	i = rip->i_map_index;
+	cluster = rip->i_map_cluster;
+  } else {
+	i = 0;
+	cluster = rip->i_first_cluster;
+  }
+
+  for (; i < index; i++) {
+	if (next_cluster(cluster, &cluster) != OK || cluster == 0)
+		return(NO_BLOCK);
+  }
+
+  rip->i_map_index = index;
+  rip->i_map_cluster = cluster;
+
+  pos = cluster_pos(cluster) + position % sb.s_cluster_size;
+  return((block_t) (pos / sb.s_block_size));
+}
+
+/*===========================================================================*
+ *				rahead					     *
+ *===========================================================================*/
+static struct buf *rahead(rip, baseblock, position, bytes_ahead)
+struct inode *rip;		/* pointer to inode for file to be read */
+block_t baseblock;		/* block at current position */
+off_t position;			/* position within file */
+unsigned bytes_ahead;		/* bytes beyond position for immediate use */
+{
+/* Fetch a block from the cache or the device. If a physical read is
+ * required, prefetch as many more blocks of the file as convenient into the
+ * cache, following its cluster chain, so that they go to the driver in one
+ * scattered request.
+ */
+/* Minimum number of blocks to prefetch. */
+# define BLOCKS_MINIMUM		(nr_bufs < 50 ? 18 : 32)
+  int nr_bufs = lmfs_nr_bufs();
+  static struct buf *read_q[NR_IOREQS];
+  unsigned int blocks_ahead, blocks_left, fragment, block_size;
+  int read_q_size;
+  block_t block;
+  off_t base_pos;
+  ino_t ino;
+  struct buf *bp;
+
+  block_size = sb.s_block_size;
+
+  /* Only file data goes into the VM cache; directory blocks are read without
+   * an inode elsewhere.
+   */
+  ino = ((rip->i_mode & I_TYPE) == I_REGULAR) ? rip->i_num : VMC_NO_INODE;
+
+  fragment = position % block_size;
+  position -= fragment;
+  base_pos = position;
+  bytes_ahead += fragment;
+  blocks_ahead = (bytes_ahead + block_size - 1) / block_size;
+
+  bp = lmfs_get_block_ino(fs_dev, baseblock, PREFETCH, ino, position);
+  assert(bp != NULL);
+  if (lmfs_dev(bp) != NO_DEV) return(bp);
+
+  blocks_left = (unsigned int) ((rip->i_size - position + block_size - 1) /
+	block_size);
+
+  /* No more than the maximum request, but at least the minimum. */
+  if (blocks_ahead > NR_IOREQS) blocks_ahead = NR_IOREQS;
+  if (blocks_ahead < BLOCKS_MINIMUM) blocks_ahead = BLOCKS_MINIMUM;
+
+  /* Can't go past end of file. */
+  if (blocks_ahead > blocks_left) blocks_ahead = blocks_left;
+
+  read_q_size = 0;
+
+  /* Acquire block buffers. */
+  for (;;) {
+	read_q[read_q_size++] = bp;
+
+	if (--blocks_ahead == 0) break;
+
+	/* Don't trash the cache, leave 4 free. */
+	if (lmfs_bufs_in_use() >= nr_bufs - 4) break;
+
+	position += block_size;
+	if ((block = read_map(rip, position)) == NO_BLOCK) break;
+
+	bp = lmfs_get_block_ino(fs_dev, block, PREFETCH, ino, position);
+	if (lmfs_dev(bp) != NO_DEV) {
+		/* Oops, block already in the cache, get out. */
+		put_block(bp, FULL_DATA_BLOCK);
+		break;
+	}
+  }
+  lmfs_rw_scattered(fs_dev, read_q, read_q_size, READING);
+
+  return(lmfs_get_block_ino(fs_dev, baseblock, NORMAL, ino, base_pos));
+}
+
+/*===========================================================================*
+ *				read_dirent				     *
+ *===========================================================================*/
+int read_dirent(struct inode *dir, off_t *pos, struct fat_dirent *dp)
+{
+/* Read the directory entry at or after *pos, skipping deleted entries and
+ * volume labels, and put it together with its long name if it has one. *pos
+ * is left right after the entry. Returns END_OF_FILE if there are no more.
+ */
+  fat32_any_direntry_t *ep;
+  struct buf *bp;
+  block_t b;
+  fat32_entry_parser_t parser;
+  off_t p;
+  unsigned int off;
+  int in_lfn;
+
+  fat32_parser_reset(&parser);
+  in_lfn = FALSE;
+  p = *pos;
+  while (p < dir->i_size) {
+	if ((b = read_map(dir, p)) == NO_BLOCK)
+		return(EIO);
+	if ((bp = fetch_block(b)) == NULL)
+		return(EIO);
+
+	for (off = p % sb.s_block_size; off < sb.s_block_size;
+		off += DIRENT_SIZE, p += DIRENT_SIZE) {
+		ep = (fat32_any_direntry_t *) (b_data(bp) + off);
+
+		if (ep->short_entry.filename_83[0] == SLOT_FREE) {
+			/* Nothing follows. */
+			put_block(bp, DIRECTORY_BLOCK);
+			*pos = p;
+			return(END_OF_FILE);
+		}
+
+		if (ep->short_entry.filename_83[0] == SLOT_DELETED) {
+			fat32_parser_reset(&parser);
+			in_lfn = FALSE;
+			continue;
+		}
+
+		if (ep->short_entry.attributes == ATTR_LFN) {
+			/* The long name comes in pieces, last one first. The
+			 * parser checks them and decodes the name, as in the
+			 * service.
+			 */
+			if (!in_lfn) {
+				dp->d_start = p;
+				in_lfn = TRUE;
+			}
+			fat32_parse_slot(&parser, ep, &dp->d_entry, dp->d_name);
+			continue;
+		}
+
+		if (ep->short_entry.attributes & FAT32_ATTR_VOLUMEID) {
+			fat32_parser_reset(&parser);
+			in_lfn = FALSE;
+			continue;
+		}
+
+		/* A short entry finishes the entry. */
+		fat32_parse_slot(&parser, ep, &dp->d_entry, dp->d_name);
+		if (!in_lfn)
+			dp->d_start = p;
+		dp->d_ino = entry_ino(&dp->d_entry,
+			(u64_t) b * sb.s_block_size + off);
+
+		put_block(bp, DIRECTORY_BLOCK);
+		*pos = p + DIRENT_SIZE;
+		return(OK);
+	}
+
+	put_block(bp, DIRECTORY_BLOCK);
+  }
+
+  *pos = p;
+  return(END_OF_FILE);
+}
+
+/*===========================================================================*
+ *				fs_getdents				     *
+ *===========================================================================*/
+int fs_getdents(void)
+{
+#define GETDENTS_BUFSIZE	(sizeof(struct dirent) + NAME_MAX + 1)
+#define GETDENTS_ENTRIES	8
+  static char getdents_buf[GETDENTS_BUFSIZE * GETDENTS_ENTRIES];
+  struct fat_dirent fd;
+  struct inode *rip;
+  struct dirent *dep;
+  int r, done;
+  unsigned int len, reclen;
+  cp_grant_id_t gid;
+  size_t size, tmpbuf_off, userbuf_off;
+  off_t pos;
+
+  gid = fs_m_in.m_vfs_fs_getdents.grant;
+  size = fs_m_in.m_vfs_fs_getdents.mem_size;
+  pos = fs_m_in.m_vfs_fs_getdents.seek_pos;
+
+  /* Check whether the position is properly aligned */
+  if (pos % DIRENT_SIZE)
+	return(ENOENT);
+
+  if ((rip = get_inode(fs_m_in.m_vfs_fs_getdents.inode)) == NULL)
+	return(EINVAL);
+
+  memset(getdents_buf, '\0', sizeof(getdents_buf));  /* Avoid leaking any data */
+  tmpbuf_off = 0;	/* Offset in getdents_buf */
+  userbuf_off = 0;	/* Offset in the user's buffer */
+  done = FALSE;
+
+  while ((r = read_dirent(rip, &pos, &fd)) == OK) {
+	len = strlen(fd.d_name);
+
+	/* Compute record length, incl alignment. */
+	reclen = _DIRENT_RECLEN(dep, len);
+
+	if (userbuf_off + tmpbuf_off + reclen >= size) {
+		/* The user has no space for one more record. Have the next
+		 * request start with it.
+		 */
+		done = TRUE;
+		pos = fd.d_start;
+		break;
+	}
+
+	if (tmpbuf_off + reclen >= sizeof(getdents_buf)) {
+		r = sys_safecopyto(VFS_PROC_NR, gid, (vir_bytes) userbuf_off,
+			(vir_bytes) getdents_buf, tmpbuf_off);
+		if (r != OK) {
+			put_inode(rip);
+			return(r);
+		}
+		userbuf_off += tmpbuf_off;
+		tmpbuf_off = 0;
+	}
+
+	dep = (struct dirent *) &getdents_buf[tmpbuf_off];
+	if (strcmp(fd.d_name, ".") == 0)
+		dep->d_fileno = rip->i_num;
+	else if (strcmp(fd.d_name, "..") == 0)
+		dep->d_fileno = rip->i_parent;
+	else
+		dep->d_fileno = fd.d_ino;
+	dep->d_reclen = (unsigned short) reclen;
+	dep->d_namlen = len;
+	memcpy(dep->d_name, fd.d_name, len);
+	dep->d_name[len] = '\0';
+	dep->d_type = (fd.d_entry.attributes & FAT32_ATTR_DIR) ? DT_DIR : DT_REG;
+	tmpbuf_off += reclen;
+  }
+
+  if (r != OK && r != END_OF_FILE) {
+	put_inode(rip);
+	return(r);
+  }
+
+  if (tmpbuf_off != 0) {
+	r = sys_safecopyto(VFS_PROC_NR, gid, (vir_bytes) userbuf_off,
+		(vir_bytes) getdents_buf, tmpbuf_off);
+	if (r != OK) {
+		put_inode(rip);
+		return(r);
+	}
+
+	userbuf_off += tmpbuf_off;
+  }
+
+  if (done && userbuf_off == 0)
+	r = EINVAL;		/* The user's buffer is too small */
+  else {
+	fs_m_out.m_fs_vfs_getdents.nbytes = userbuf_off;
+	fs_m_out.m_fs_vfs_getdents.seek_pos = pos;
+	r = OK;
+  }
+
+  put_inode(rip);
+  return(r);
+}
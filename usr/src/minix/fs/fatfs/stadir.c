@@ -0,0 +1,68 @@
+#include "inc.h"
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+/*===========================================================================*
+ *				fs_stat					     *
+ *===========================================================================*/
+int fs_stat(void)
+{
+  struct stat statbuf;
+  struct inode *rip;
+  int r;
+
+  if ((rip = get_inode(fs_m_in.m_vfs_fs_stat.inode)) == NULL)
+	return(EINVAL);
+
+  memset(&statbuf, 0, sizeof(struct stat));
+
+  statbuf.st_dev = fs_dev;
+  statbuf.st_ino = rip->i_num;
+  statbuf.st_mode = rip->i_mode;
+  statbuf.st_nlink = 1;
+  statbuf.st_uid = SYS_UID;
+  statbuf.st_gid = SYS_GID;
+  statbuf.st_rdev = NO_DEV;
+  statbuf.st_size = rip->i_size;
+  statbuf.st_atime = rip->i_atime;
+  statbuf.st_mtime = rip->i_mtime;
+  statbuf.st_ctime = rip->i_ctime;
+  statbuf.st_blksize = sb.s_block_size;
+
+  /* Files take up whole clusters; count them in 512 byte units. */
+  statbuf.st_blocks = roundup(rip->i_size, sb.s_cluster_size) / 512;
+
+  /* Copy the struct to user space. */
+  r = sys_safecopyto(fs_m_in.m_source, fs_m_in.m_vfs_fs_stat.grant, 0,
+	(vir_bytes) &statbuf, (size_t) sizeof(statbuf));
+
+  put_inode(rip);
+  return(r);
+}
+
+/*===========================================================================*
+ *				fs_statvfs				     *
+ *===========================================================================*/
+int fs_statvfs(void)
+{
+  struct statvfs st;
+  u64_t used;
+  int r;
+
+  memset(&st, 0, sizeof(st));
+
+  fs_blockstats(&st.f_blocks, &st.f_bfree, &used);
+  st.f_bavail = st.f_bfree;
+
+  st.f_flag = ST_RDONLY | ST_NOTRUNC;
+  st.f_bsize = sb.s_block_size;
+  st.f_frsize = sb.s_block_size;
+  st.f_iosize = sb.s_block_size;
+  st.f_namemax = NAME_MAX;
+
+  /* Copy the struct to user space. */
+  r = sys_safecopyto(fs_m_in.m_source, fs_m_in.m_vfs_fs_statvfs.grant, 0,
+	(vir_bytes) &st, (phys_bytes) sizeof(st));
+
+  return(r);
+}
@@ -0,0 +1,162 @@
+/* This file deals with the geometry of the file system and with its FAT.
+ * The boot sector is parsed by build_fat_info, shared with the fat32 server.
+ */
+
+#include "inc.h"
+
+/*===========================================================================*
+ *				choose_block_size			     *
+ *===========================================================================*/
+static unsigned int choose_block_size(void)
+{
+/* Clusters are the unit of allocation, but the data area need not start on a
+ * cluster boundary. Use the largest block size that divides both, so that no
+ * block ever straddles two clusters.
+ */
+  unsigned int size;
+
+  size = MIN(sb.s_cluster_size, FAT_MAX_BLOCK_SIZE);
+  while (size > sb.s_header.bpb.bytes_per_sector &&
+	(sb.s_data_offset % size) != 0)
+	size >>= 1;
+
+  return(size);
+}
+
+/*===========================================================================*
+ *				read_super				     *
+ *===========================================================================*/
+int read_super(dev_t dev)
+{
+/* Read the boot sector and check that this is a FAT32 file system that we
+ * can handle. The cache isn't set up yet, so go to the driver directly.
+ */
+  static char sbbuf[FAT32_MIN_SECTOR_SIZE];
+  fat32_header_t *hp = &sb.s_header;
+  fat32_info_t info;
+  u32_t next_free;
+  ssize_t r;
+
+  r = bdev_read(dev, 0, sbbuf, sizeof(sbbuf), BDEV_NOFLAGS);
+  if (r != sizeof(sbbuf)) {
+	printf("FATFS: unable to read the boot sector (%d)\n", (int) r);
+	return(EIO);
+  }
+
+  memcpy(hp, sbbuf, sizeof(*hp));
+
+  if (build_fat_info(hp, &info) != OK)
+	return(EINVAL);
+
+  /* On top of that, the cluster size has to be a power of two, or blocks
+   * can't map onto clusters, and there must be no fixed root directory area.
+   */
+  if ((hp->bpb.sectors_per_cluster & (hp->bpb.sectors_per_cluster - 1)) != 0 ||
+	hp->bpb.root_direntries != 0)
+	return(EINVAL);
+
+  sb.s_total_clusters = info.total_clusters;
+  sb.s_cluster_size = info.bytes_per_cluster;
+  sb.s_fat_offset = (u64_t) info.first_fat_sector * hp->bpb.bytes_per_sector;
+  sb.s_data_offset = (u64_t) info.first_data_sector * hp->bpb.bytes_per_sector;
+  sb.s_root_cluster = hp->ebr.root_cluster_nr;
+  if (sb.s_root_cluster < 2 || sb.s_root_cluster >= sb.s_total_clusters + 2)
+	return(EINVAL);
+
+  sb.s_block_size = choose_block_size();
+
+  /* The FSInfo sector may know how much space is free. Since the volume is
+   * never written to, its count stays as good as it was at mount time.
+   */
+  sb.s_free_clusters = FAT32_FSINFO_UNKNOWN;
+  if (hp->ebr.fsinfo_cluster_nr != 0 && hp->ebr.fsinfo_cluster_nr != 0xFFFF &&
+	hp->bpb.bytes_per_sector == FAT32_MIN_SECTOR_SIZE) {
+	r = bdev_read(dev, (u64_t) hp->ebr.fsinfo_cluster_nr *
+		FAT32_MIN_SECTOR_SIZE, sbbuf, sizeof(sbbuf), BDEV_NOFLAGS);
+	if (r == sizeof(sbbuf))
+		parse_fsinfo((fat32_fsinfo_t *) sbbuf, &info,
+			&sb.s_free_clusters, &next_free);
+  }
+
+  return(OK);
+}
+
+/*===========================================================================*
+ *				fetch_block				     *
+ *===========================================================================*/
+struct buf *fetch_block(block_t b)
+{
+/* Get a block from the cache, reading it in if needed. Returns NULL if it
+ * couldn't be read.
+ */
+  struct buf *bp;
+
+  bp = get_block(b);
+  if (lmfs_dev(bp) == NO_DEV) {
+	put_block(bp, FULL_DATA_BLOCK);
+	return(NULL);
+  }
+
+  return(bp);
+}
+
+/*===========================================================================*
+ *				cluster_pos				     *
+ *===========================================================================*/
+u64_t cluster_pos(u32_t cluster)
+{
+/* Get the position of a cluster on the device. */
+  return(sb.s_data_offset + (u64_t) (cluster - 2) * sb.s_cluster_size);
+}
+
+/*===========================================================================*
+ *				next_cluster				     *
+ *===========================================================================*/
+int next_cluster(u32_t cluster, u32_t *next)
+{
+/* Look up the successor of a cluster in the FAT. The FAT is read through the
+ * block cache like everything else. Sets *next to 0 at the end of the chain.
+ */
+  struct buf *bp;
+  u64_t pos;
+  u32_t entry;
+
+  if (cluster < 2 || cluster >= sb.s_total_clusters + 2)
+	return(EIO);
+
+  pos = sb.s_fat_offset + (u64_t) cluster * sizeof(entry);
+  bp = fetch_block((block_t) (pos / sb.s_block_size));
+  if (bp == NULL)
+	return(EIO);
+
+  memcpy(&entry, b_data(bp) + pos % sb.s_block_size, sizeof(entry));
+  put_block(bp, MAP_BLOCK);
+
+  entry &= FAT_ENTRY_MASK;
+  if (entry >= FAT_EOC)
+	*next = 0;
+  else if (entry < 2 || entry >= sb.s_total_clusters + 2)
+	return(EIO);		/* free or bad cluster in a chain */
+  else
+	*next = entry;
+
+  return(OK);
+}
+
+/*===========================================================================*
+ *				fs_blockstats				     *
+ *===========================================================================*/
+void fs_blockstats(u64_t *blocks, u64_t *free, u64_t *used)
+{
+/* Report the size of the data area to libminixfs, which sizes its cache
+ * after it. The free space is only known if the FSInfo sector has it, as
+ * finding it otherwise takes a scan of the whole FAT.
+ */
+  u64_t per_cluster = sb.s_cluster_size / sb.s_block_size;
+
+  *blocks = (u64_t) sb.s_total_clusters * per_cluster;
+  *free = 0;
+  if (sb.s_free_clusters != FAT32_FSINFO_UNKNOWN)
+	*free = (u64_t) sb.s_free_clusters * per_cluster;
+  *used = *blocks - *free;
+}
@@ -0,0 +1,13 @@
+/* Geometry of the mounted file system, derived from its boot sector. All
+ * offsets are in bytes from the start of the device.
+ */
+EXTERN struct fat_super {
+  fat32_header_t s_header;	/* boot sector, as read from the disk */
+  unsigned int s_block_size;	/* size of the blocks in the cache */
+  unsigned int s_cluster_size;	/* bytes per cluster */
+  u64_t s_fat_offset;		/* start of the first FAT */
+  u64_t s_data_offset;		/* start of cluster 2 */
+  u32_t s_total_clusters;	/* # data clusters on the volume */
+  u32_t s_root_cluster;		/* first cluster of the root directory */
+  u32_t s_free_clusters;	/* FSInfo free count, or FAT32_FSINFO_UNKNOWN */
+} sb;
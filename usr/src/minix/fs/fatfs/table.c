@@ -0,0 +1,44 @@
+/* This file contains the table used to map system call numbers onto the
+ * routines that perform them.
+ */
+
+#define _TABLE
+
+#include "inc.h"
+
+int (*fs_call_vec[])(void) = {
+  no_sys,			/* 0: not used */
+  no_sys,			/* 1: not used */
+  fs_putnode,			/* 2 */
+  read_only,			/* 3: slink */
+  read_only,			/* 4: ftrunc */
+  read_only,			/* 5: chown */
+  read_only,			/* 6: chmod */
+  do_noop,			/* 7: inhibread */
+  fs_stat,			/* 8 */
+  read_only,			/* 9: utime */
+  fs_statvfs,			/* 10 */
+  fs_bread,			/* 11 */
+  read_only,			/* 12: bwrite */
+  read_only,			/* 13: unlink */
+  read_only,			/* 14: rmdir */
+  fs_unmount,			/* 15 */
+  fs_sync,			/* 16 */
+  fs_new_driver,		/* 17 */
+  do_noop,			/* 18: flush */
+  fs_readwrite,			/* 19 */
+  read_only,			/* 20: write */
+  read_only,			/* 21: mknod */
+  read_only,			/* 22: mkdir */
+  read_only,			/* 23: create */
+  read_only,			/* 24: link */
+  read_only,			/* 25: rename */
+  fs_lookup,			/* 26 */
+  fs_mountpoint,		/* 27 */
+  fs_readsuper,			/* 28 */
+  no_sys,			/* 29: not used */
+  no_sys,			/* 30: rdlink, there are no symlinks */
+  fs_getdents,			/* 31 */
+  fs_readwrite,			/* 32: peek */
+  fs_bpeek,			/* 33 */
+};
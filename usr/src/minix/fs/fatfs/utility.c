@@ -0,0 +1,54 @@
+#include "inc.h"
+#include <time.h>
+
+/*===========================================================================*
+ *				do_noop					     *
+ *===========================================================================*/
+int do_noop(void)
+{
+/* Do not do anything. */
+  return(OK);
+}
+
+/*===========================================================================*
+ *				no_sys					     *
+ *===========================================================================*/
+int no_sys(void)
+{
+/* Somebody has used an illegal system call number */
+  return(EINVAL);
+}
+
+/*===========================================================================*
+ *				read_only				     *
+ *===========================================================================*/
+int read_only(void)
+{
+/* Somebody tried to modify the file system, which is mounted read-only. */
+  return(EROFS);
+}
+
+/*===========================================================================*
+ *				fat_time				     *
+ *===========================================================================*/
+time_t fat_time(fat32_date_t date, fat32_time_t time)
+{
+/* Convert a FAT date and time to a time_t. FAT stores local time without a
+ * time zone; it is taken to be UTC, as TZ is cleared at startup.
+ */
+  struct tm tm;
+
+  if (date.month == 0 || date.day == 0)
+	return(0);	/* not set */
+
+  memset(&tm, 0, sizeof(tm));
+  tm.tm_year = date.year + 80;
+  tm.tm_mon = date.month - 1;
+  tm.tm_mday = date.day;
+  tm.tm_hour = time.hours;
+  tm.tm_min = time.minutes;
+  tm.tm_sec = time.seconds * 2;
+  tm.tm_isdst = 0;
+
+  return(mktime(&tm));
+}
@@ -977,7 +977,60 @@
 #define FAT32_CLOSE_FILE            (FAT32_BASE + 7)
 #define FAT32_CLOSE_DIR             (FAT32_BASE + 8)
 #define FAT32_CLOSE_FS              (FAT32_BASE + 9)
-#define FAT32_END                   (FAT32_BASE + 10)
+#define FAT32_READ_FILE_RANGE       (FAT32_BASE + 10)
+#define FAT32_SEEK_FILE             (FAT32_BASE + 11)
+#define FAT32_PREAD_FILE            (FAT32_BASE + 12)
+#define FAT32_READ_DIR_BATCH        (FAT32_BASE + 13)
+#define FAT32_OPEN_ENTRY            (FAT32_BASE + 14)
+#define FAT32_OPEN_PATH             (FAT32_BASE + 15)
+#define FAT32_GET_STATS             (FAT32_BASE + 16)
+#define FAT32_TRACE_CTL             (FAT32_BASE + 17)
+#define FAT32_TRACE_GET             (FAT32_BASE + 18)
+#define FAT32_STATVFS               (FAT32_BASE + 19)
+#define FAT32_CREATE_FILE           (FAT32_BASE + 20)
+#define FAT32_WRITE_FILE            (FAT32_BASE + 21)
+#define FAT32_TRUNCATE_FILE         (FAT32_BASE + 22)
+#define FAT32_UNLINK                (FAT32_BASE + 23)
+#define FAT32_SYNC                  (FAT32_BASE + 24)
+#define FAT32_READ_DIR_FILTER       (FAT32_BASE + 25)
+#define FAT32_END                   (FAT32_BASE + 26)
+
+/* Number of slots in per-request-type tables, indexed by type - FAT32_BASE. */
+#define FAT32_NR_REQUEST_TYPES      (FAT32_END - FAT32_BASE)
+
+/* What FAT32_OPEN_PATH should do with the entry it finds. */
+#define FAT32_OPEN_PATH_STAT        0   /* only return the entry */
+#define FAT32_OPEN_PATH_DIR         1   /* open it as a directory */
+#define FAT32_OPEN_PATH_FILE        2   /* open it as a file */
+#define FAT32_OPEN_PATH_WRITE       3   /* open it as a file, for writing */
+
+/* How FAT32_READ_DIR_FILTER matches names, ignoring the case of ASCII
+ * letters. */
+#define FAT32_MATCH_ALL             0   /* every name */
+#define FAT32_MATCH_EXACT           1   /* the pattern itself */
+#define FAT32_MATCH_PREFIX          2   /* names that start with the pattern */
+#define FAT32_MATCH_GLOB            3   /* * and ? in the pattern are wildcards */
+
+/* Flags of FAT32_WRITE_FILE. */
+#define FAT32_WRITE_APPEND          0x1 /* write at the end of the file */
+
+/* Flags of FAT32_GET_STATS. */
+#define FAT32_STATS_RESET           0x1 /* zero the counters after copying */
+
+/* Flags of FAT32_STATVFS. */
+#define FAT32_STATVFS_SCAN          0x1 /* count free clusters even if the
+					 * FSInfo sector has a count */
+
+/* Where the free cluster count of FAT32_STATVFS comes from. */
+#define FAT32_FREE_UNKNOWN          0   /* nowhere yet; a scan is running */
+#define FAT32_FREE_FSINFO           1   /* the FSInfo sector */
+#define FAT32_FREE_SCAN             2   /* a scan of the FAT */
+
+/* States of the FAT scan of FAT32_STATVFS. */
+#define FAT32_SCAN_NONE             0   /* never started */
+#define FAT32_SCAN_RUNNING          1
+#define FAT32_SCAN_DONE             2
+#define FAT32_SCAN_FAILED           3
 
 #define FAT32_ERR_NOT_FAT           -6000
 #define FAT32_ERR_INVALID_FAT       -6001
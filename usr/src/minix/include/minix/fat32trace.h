@@ -0,0 +1,38 @@
+#ifndef _MINIX_FAT32TRACE_H
+#define _MINIX_FAT32TRACE_H
+
+/* Request tracing of the fat32 server, controlled with FAT32_TRACE_CTL and
+ * read out with FAT32_TRACE_GET. The server keeps the most recent entries in a
+ * ring buffer; older ones are overwritten. See commands/fat32trace.
+ */
+
+/* Control directives. */
+enum {
+  FAT32_TRACE_START,		/* allocate a buffer of `size` entries, start */
+  FAT32_TRACE_STOP,		/* stop; the entries can then be read out */
+  FAT32_TRACE_FREE		/* stop and free the buffer */
+};
+
+/* Special result codes. */
+#define FAT32_TRACE_INPROGRESS	(-997)
+
+/* Request trace entry. Entries are added when requests finish, so they are in
+ * order of finish time.
+ */
+typedef struct {
+  u32_t request;		/* request type, minus FAT32_BASE */
+  u32_t handle;			/* handle the request was for, or 0 */
+  u32_t cluster;		/* first cluster the request used, or 0 */
+  u32_t bytes;			/* bytes returned to the caller */
+  i32_t result;			/* OK or an error code */
+  u32_t worker;			/* worker thread that handled the request */
+  u32_t start_time;		/* request service start time (us) */
+  u32_t finish_time;		/* request service completion time (us) */
+} fat32_trace_entry;		/* (32 bytes) */
+
+/* This is the number of fat32_trace_entry structures copied out at once by the
+ * fat32trace tool.
+ */
+#define FAT32_TRACE_BUF_SIZE	1024
+
+#endif /* _MINIX_FAT32TRACE_H */
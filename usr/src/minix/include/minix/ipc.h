@@ -2036,6 +2036,15 @@ typedef struct {
 } mess_fat32_read_block;
 _ASSERT_MSG_SIZE(mess_fat32_read_block);
 
+typedef struct {
+	uint64_t offset;
+	uint32_t handle;
+	void     *buf_ptr;
+	uint32_t buf_size;
+	char     padding[36];
+} mess_fat32_pread;
+_ASSERT_MSG_SIZE(mess_fat32_pread);
+
 typedef struct {
 	uint32_t handle;
 	void     *dest;
@@ -2043,6 +2052,87 @@ typedef struct {
 } mess_fat32_read_direntry;
 _ASSERT_MSG_SIZE(mess_fat32_read_direntry);
 
+typedef struct {
+	uint32_t handle;
+	uint32_t first_cluster;
+	uint32_t size_bytes;
+	uint8_t  attributes;
+	char     padding[43];
+} mess_fat32_open_entry;
+_ASSERT_MSG_SIZE(mess_fat32_open_entry);
+
+typedef struct {
+	uint32_t handle;
+	void     *path;
+	uint32_t path_len;
+	void     *dest;
+	uint32_t flags;
+	char     padding[36];
+} mess_fat32_open_path;
+_ASSERT_MSG_SIZE(mess_fat32_open_path);
+
+typedef struct {
+	uint32_t handle;
+	void     *path;
+	uint32_t path_len;
+	uint32_t size_hint;
+	char     padding[40];
+} mess_fat32_create;
+_ASSERT_MSG_SIZE(mess_fat32_create);
+
+typedef struct {
+	uint32_t handle;
+	void     *buf_ptr;
+	uint32_t buf_size;
+	uint32_t flags;
+	char     padding[40];
+} mess_fat32_write;
+_ASSERT_MSG_SIZE(mess_fat32_write);
+
+typedef struct {
+	uint32_t handle;
+	void     *buf_ptr;
+	uint32_t buf_size;
+	void     *pattern;
+	uint32_t pattern_len;
+	uint32_t match;
+	uint8_t  attr_set;
+	uint8_t  attr_clear;
+	char     padding[30];
+} mess_fat32_read_filter;
+_ASSERT_MSG_SIZE(mess_fat32_read_filter);
+
+typedef struct {
+	void     *dest;
+	uint32_t size;
+	uint32_t flags;
+	char     padding[44];
+} mess_fat32_get_stats;
+_ASSERT_MSG_SIZE(mess_fat32_get_stats);
+
+typedef struct {
+	uint32_t handle;
+	void     *dest;
+	uint32_t size;
+	uint32_t flags;
+	char     padding[40];
+} mess_fat32_statvfs;
+_ASSERT_MSG_SIZE(mess_fat32_statvfs);
+
+typedef struct {
+	uint32_t ctl;
+	uint32_t size;
+	char     padding[48];
+} mess_fat32_trace_ctl;
+_ASSERT_MSG_SIZE(mess_fat32_trace_ctl);
+
+typedef struct {
+	void     *dest;
+	uint32_t size;
+	char     padding[48];
+} mess_fat32_trace_get;
+_ASSERT_MSG_SIZE(mess_fat32_trace_get);
+
 typedef struct {
 	uint32_t handle;
 	char padding[52];
@@ -2286,7 +2376,17 @@ typedef struct {
 
 		mess_fat32_open_fs m_fat32_open_fs;
 		mess_fat32_read_block m_fat32_read_block;
+		mess_fat32_pread m_fat32_pread;
 		mess_fat32_read_direntry m_fat32_read_direntry;
+		mess_fat32_open_entry m_fat32_open_entry;
+		mess_fat32_open_path m_fat32_open_path;
+		mess_fat32_create m_fat32_create;
+		mess_fat32_write m_fat32_write;
+		mess_fat32_read_filter m_fat32_read_filter;
+		mess_fat32_get_stats m_fat32_get_stats;
+		mess_fat32_statvfs m_fat32_statvfs;
+		mess_fat32_trace_ctl m_fat32_trace_ctl;
+		mess_fat32_trace_get m_fat32_trace_get;
 		mess_fat32_io_handle m_fat32_io_handle;
 		mess_fat32_ret m_fat32_ret;
 
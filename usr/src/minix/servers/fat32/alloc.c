@@ -0,0 +1,314 @@
+#include "inc.h"
+#include "fat32.h"
+#include "mini-printf.h"
+
+/* The cluster allocator. Free clusters are kept as a sorted list of runs (see
+ * freespace.c), so that a file can be given as many consecutive clusters as it
+ * needs at once: a file that grows takes the clusters right after its last
+ * one if they are free, and otherwise the first run that is long enough for
+ * the whole request. Only when no run is, the longest one is taken and the
+ * rest comes from the following ones. Files written that way stay in a few
+ * extents, and reading them back takes a few large device reads.
+ *
+ * The allocator changes the FAT through the FAT cache, which writes it out to
+ * every copy when the request is done, and keeps the free cluster count and
+ * the next free cluster hint that go into the FSInfo sector. Requests that
+ * allocate hold the write lock of their filesystem, so there is only one
+ * allocation going on at a time. */
+
+/* The FAT entry that ends a chain. */
+#define FAT32_EOC 0x0fffffff
+
+/* Finds the first run that ends after the given cluster. */
+static int find_run(fat32_freespace_t* fsp, uint32_t cluster_nr) {
+	int lo = 0, hi = fsp->nr_runs;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (fsp->runs[mid].start + fsp->runs[mid].length <= cluster_nr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/* Keeps the counts and hints for the FSInfo sector in line with the runs. The
+ * first free cluster is as good a hint as any, and it is the one first fit
+ * looks at first. */
+static void update_hints(fat32_freespace_t* fsp) {
+	fsp->fsinfo_free = fsp->scan_free;
+	fsp->fsinfo_next = fsp->nr_runs > 0 ? fsp->runs[0].start : FAT32_FSINFO_UNKNOWN;
+	fsp->fsinfo_dirty = TRUE;
+}
+
+/* Takes length clusters starting at start out of run i, which holds them. */
+static int take_from_run(fat32_freespace_t* fsp, int i, uint32_t start, uint32_t length) {
+	fat32_free_run_t *run = &fsp->runs[i];
+	uint32_t end = start + length;
+	uint32_t run_end = run->start + run->length;
+
+	if (start == run->start && end == run_end) {
+		memmove(&fsp->runs[i], &fsp->runs[i + 1],
+				(fsp->nr_runs - i - 1) * sizeof(fat32_free_run_t));
+		fsp->nr_runs--;
+	} else if (start == run->start) {
+		run->start = end;
+		run->length = run_end - end;
+	} else if (end == run_end) {
+		run->length = start - run->start;
+	} else {
+		// The clusters are in the middle of the run, which splits it in two.
+		if (fsp->nr_runs == fsp->max_runs) {
+			int max = fsp->max_runs * 2;
+			fat32_free_run_t *runs = (fat32_free_run_t*) realloc(fsp->runs,
+					max * sizeof(fat32_free_run_t));
+			if (runs == NULL) {
+				return ENOMEM;
+			}
+
+			fsp->runs = runs;
+			fsp->max_runs = max;
+			run = &fsp->runs[i];
+		}
+
+		memmove(&fsp->runs[i + 2], &fsp->runs[i + 1],
+				(fsp->nr_runs - i - 1) * sizeof(fat32_free_run_t));
+		fsp->nr_runs++;
+
+		run->length = start - run->start;
+		fsp->runs[i + 1].start = end;
+		fsp->runs[i + 1].length = run_end - end;
+	}
+
+	fsp->scan_free -= length;
+	update_hints(fsp);
+	return OK;
+}
+
+int alloc_run(fat32_fs_t* fs, int goal, int count, int* start, int* length) {
+	fat32_freespace_t *fsp = &fs->freespace;
+	int i, best = -1, ret;
+
+	if ((ret = freespace_runs(fs)) != OK) {
+		return ret;
+	}
+
+	if (fsp->nr_runs == 0) {
+		return ENOSPC;
+	}
+
+	// Right after the end of the file, if that's free.
+	if (goal >= 2) {
+		i = find_run(fsp, (uint32_t) goal);
+		if (i < fsp->nr_runs && fsp->runs[i].start <= (uint32_t) goal) {
+			uint32_t left = fsp->runs[i].start + fsp->runs[i].length - goal;
+
+			*start = goal;
+			*length = (uint32_t) count < left ? count : (int) left;
+			return take_from_run(fsp, i, *start, *length);
+		}
+	}
+
+	// Otherwise the first run that takes all of it, or else the longest one.
+	for (i = 0; i < fsp->nr_runs; i++) {
+		if (fsp->runs[i].length >= (uint32_t) count) {
+			best = i;
+			break;
+		}
+
+		if (best == -1 || fsp->runs[i].length > fsp->runs[best].length) {
+			best = i;
+		}
+	}
+
+	*start = fsp->runs[best].start;
+	*length = fsp->runs[best].length < (uint32_t) count ? (int) fsp->runs[best].length : count;
+	return take_from_run(fsp, best, *start, *length);
+}
+
+void alloc_release(fat32_fs_t* fs, int start, int length) {
+	fat32_freespace_t *fsp = &fs->freespace;
+	uint32_t end = (uint32_t) start + length;
+
+	// Nothing has been allocated yet, but the counts must still go up. A
+	// finished scan will build the runs from its bitmap, so the clusters go
+	// in there; one that is still running reads them from the FAT itself.
+	if (fsp->runs == NULL) {
+		if (fsp->scan_state == FAT32_SCAN_DONE) {
+			if (fsp->bitmap != NULL) {
+				for (uint32_t c = (uint32_t) start - 2; c < end - 2; c++) {
+					fsp->bitmap[c / 32] |= (uint32_t) 1 << (c % 32);
+				}
+			}
+
+			fsp->scan_free += length;
+			fsp->fsinfo_free = fsp->scan_free;
+		} else if (fsp->fsinfo_free != FAT32_FSINFO_UNKNOWN) {
+			fsp->fsinfo_free += length;
+		}
+
+		fsp->fsinfo_dirty = TRUE;
+		return;
+	}
+
+	int i = find_run(fsp, (uint32_t) start);
+	int joins_prev = i > 0 && fsp->runs[i - 1].start + fsp->runs[i - 1].length == (uint32_t) start;
+	int joins_next = i < fsp->nr_runs && fsp->runs[i].start == end;
+
+	if (joins_prev && joins_next) {
+		fsp->runs[i - 1].length += length + fsp->runs[i].length;
+		memmove(&fsp->runs[i], &fsp->runs[i + 1],
+				(fsp->nr_runs - i - 1) * sizeof(fat32_free_run_t));
+		fsp->nr_runs--;
+	} else if (joins_prev) {
+		fsp->runs[i - 1].length += length;
+	} else if (joins_next) {
+		fsp->runs[i].start = start;
+		fsp->runs[i].length += length;
+	} else {
+		if (fsp->nr_runs == fsp->max_runs) {
+			int max = fsp->max_runs * 2;
+			fat32_free_run_t *runs = (fat32_free_run_t*) realloc(fsp->runs,
+					max * sizeof(fat32_free_run_t));
+
+			// The clusters are still free in the FAT, so all that is lost
+			// without memory is the chance to use them before the next
+			// scan.
+			if (runs == NULL) {
+				FAT_LOG_PRINTF(warn, "No memory to free %d clusters at %d of fs %d",
+						length, start, fs->nr);
+				return;
+			}
+
+			fsp->runs = runs;
+			fsp->max_runs = max;
+		}
+
+		memmove(&fsp->runs[i + 1], &fsp->runs[i],
+				(fsp->nr_runs - i) * sizeof(fat32_free_run_t));
+		fsp->runs[i].start = start;
+		fsp->runs[i].length = length;
+		fsp->nr_runs++;
+	}
+
+	fsp->scan_free += length;
+	update_hints(fsp);
+}
+
+int extend_chain(fat32_fs_t* fs, fat32_extent_map_t* map, int count) {
+	int last = -1, ret;
+
+	if (map->nr_extents > 0) {
+		fat32_extent_t *e = &map->extents[map->nr_extents - 1];
+		last = e->start_cluster + e->length - 1;
+	}
+
+	while (count > 0) {
+		int start, length;
+
+		if ((ret = alloc_run(fs, last + 1, count, &start, &length)) != OK) {
+			return ret;
+		}
+
+		// Link the run together and end the chain with it, then hang it
+		// off the old end, so that the chain is whole at every step.
+		for (int i = 0; i < length && ret == OK; i++) {
+			ret = fat_cache_set(fs, start + i, i == length - 1 ? FAT32_EOC : start + i + 1);
+		}
+
+		if (ret == OK && last != -1) {
+			ret = fat_cache_set(fs, last, start);
+		}
+
+		if (ret == OK) {
+			ret = extent_map_append_run(map, start, length);
+		}
+
+		// Unlink the run again before giving it back, so that neither the
+		// chain nor the free space ends up with it twice. There is nothing
+		// more to be done if that fails too.
+		if (ret != OK) {
+			for (int i = 0; i < length; i++) {
+				(void) fat_cache_set(fs, start + i, 0);
+			}
+
+			if (last != -1) {
+				(void) fat_cache_set(fs, last, FAT32_EOC);
+			}
+
+			alloc_release(fs, start, length);
+			return ret;
+		}
+
+		fat32_stats.clusters_allocated += length;
+		last = start + length - 1;
+		count -= length;
+	}
+
+	return OK;
+}
+
+/* Marks count consecutive clusters as free in the FAT and gives them back. */
+static int free_run(fat32_fs_t* fs, int start, int count) {
+	int ret;
+
+	for (int i = 0; i < count; i++) {
+		if ((ret = fat_cache_set(fs, start + i, 0)) != OK) {
+			return ret;
+		}
+	}
+
+	// What the cache still holds of them must not be written back over
+	// whatever they are used for next.
+	cluster_cache_discard(fs, start, count);
+	alloc_release(fs, start, count);
+	fat32_stats.clusters_freed += count;
+	return OK;
+}
+
+int shrink_chain(fat32_fs_t* fs, fat32_extent_map_t* map, int nr_clusters) {
+	int cluster_nr, run_left, ret;
+
+	if (nr_clusters >= map->nr_clusters) {
+		return OK;
+	}
+
+	if (nr_clusters > 0) {
+		extent_map_lookup(map, nr_clusters - 1, &cluster_nr, &run_left);
+		if ((ret = fat_cache_set(fs, cluster_nr, FAT32_EOC)) != OK) {
+			return ret;
+		}
+	}
+
+	for (int i = nr_clusters; i < map->nr_clusters; ) {
+		extent_map_lookup(map, i, &cluster_nr, &run_left);
+		if ((ret = free_run(fs, cluster_nr, run_left + 1)) != OK) {
+			return ret;
+		}
+
+		i += run_left + 1;
+	}
+
+	extent_map_truncate(map, nr_clusters);
+	return OK;
+}
+
+int free_chain(fat32_fs_t* fs, int first_cluster) {
+	fat32_extent_map_t map;
+	int ret;
+
+	if (first_cluster < 2) {
+		return OK;
+	}
+
+	memset(&map, 0, sizeof(map));
+	if ((ret = extent_map_build(fs, first_cluster, fs->info.total_clusters, &map)) == OK) {
+		ret = shrink_chain(fs, &map, 0);
+	}
+
+	extent_map_free(&map);
+	return ret;
+}
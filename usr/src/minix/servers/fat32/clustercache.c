@@ -0,0 +1,704 @@
+#include "inc.h"
+#include "fat32.h"
+#include "mini-printf.h"
+#include <minix/bdev.h>
+
+/* The cluster cache keeps recently used clusters of a filesystem in memory, so
+ * that several handles reading the same directory (or the same small file)
+ * share a single copy instead of each reading it from the device. Handles pin
+ * the clusters they are using; only unpinned clusters are on the LRU list and
+ * can be evicted. If every slot is pinned, a private copy that doesn't take
+ * part in the cache is handed out instead, so a request never fails just
+ * because the cache is too small.
+ *
+ * A cluster that is being read in is already in the hash table, marked as
+ * loading, so that whoever else wants it waits for that read instead of
+ * starting another one. On block devices, read-ahead reads several clusters
+ * straight into their slots with a single asynchronous gather request, and
+ * nobody waits for it unless they need one of those clusters.
+ *
+ * Large writes of whole clusters go to the device right away, and the copies
+ * of them in the cache are brought up to date after. Smaller ones change the
+ * cached cluster, which stays dirty (and can't be evicted) until it is written
+ * back. Write-back sorts the dirty clusters and writes each run of adjacent
+ * ones at once, so a file appended to a little at a time still reaches the
+ * device in a few large writes. Long reads that go past the cache copy the
+ * dirty clusters over what they read.
+ *
+ * Filesystems on mapped images don't use the cache at all: the clusters that
+ * are handed out point into the mapping. */
+
+/* A read-ahead request on its way to the driver. */
+typedef struct prefetch_t {
+	fat32_fs_t *fs;
+	int count;
+	fat32_cluster_t *clusters[NR_IOREQS];
+	iovec_t vec[NR_IOREQS];
+} prefetch_t;
+
+static int cluster_hash(fat32_cluster_cache_t* cache, int cluster_nr) {
+	return cluster_nr & cache->hash_mask;
+}
+
+static void lru_unlink(fat32_cluster_cache_t* cache, fat32_cluster_t* cluster) {
+	if (cluster->lru_prev) {
+		cluster->lru_prev->lru_next = cluster->lru_next;
+	} else {
+		cache->lru_head = cluster->lru_next;
+	}
+
+	if (cluster->lru_next) {
+		cluster->lru_next->lru_prev = cluster->lru_prev;
+	} else {
+		cache->lru_tail = cluster->lru_prev;
+	}
+
+	cluster->lru_prev = cluster->lru_next = NULL;
+}
+
+static void lru_push_front(fat32_cluster_cache_t* cache, fat32_cluster_t* cluster) {
+	cluster->lru_prev = NULL;
+	cluster->lru_next = cache->lru_head;
+	if (cache->lru_head) {
+		cache->lru_head->lru_prev = cluster;
+	} else {
+		cache->lru_tail = cluster;
+	}
+
+	cache->lru_head = cluster;
+}
+
+static void lru_push_back(fat32_cluster_cache_t* cache, fat32_cluster_t* cluster) {
+	cluster->lru_next = NULL;
+	cluster->lru_prev = cache->lru_tail;
+	if (cache->lru_tail) {
+		cache->lru_tail->lru_next = cluster;
+	} else {
+		cache->lru_head = cluster;
+	}
+
+	cache->lru_tail = cluster;
+}
+
+static void hash_remove(fat32_cluster_cache_t* cache, fat32_cluster_t* cluster) {
+	fat32_cluster_t **pp = &cache->hash[cluster_hash(cache, cluster->cluster_nr)];
+	while (*pp && *pp != cluster) {
+		pp = &(*pp)->hash_next;
+	}
+
+	if (*pp) {
+		*pp = cluster->hash_next;
+	}
+
+	cluster->hash_next = NULL;
+}
+
+int cluster_cache_init(fat32_fs_t* fs, size_t budget_bytes) {
+	fat32_cluster_cache_t *cache = &fs->cluster_cache;
+	int bpc = fs->info.bytes_per_cluster;
+
+	memset(cache, 0, sizeof(*cache));
+	if (mthread_mutex_init(&cache->wait_mutex, NULL) != 0) {
+		return ENOMEM;
+	}
+
+	if (mthread_cond_init(&cache->loaded, NULL) != 0) {
+		mthread_mutex_destroy(&cache->wait_mutex);
+		return ENOMEM;
+	}
+
+	long nr_slots = budget_bytes / bpc;
+	if (nr_slots > fs->info.total_clusters) {
+		nr_slots = fs->info.total_clusters;
+	}
+
+	if (nr_slots < 1) {
+		nr_slots = 1;
+	}
+
+	int nr_buckets = 1;
+	while (nr_buckets < nr_slots) {
+		nr_buckets <<= 1;
+	}
+
+	cache->slots = (fat32_cluster_t*) calloc(nr_slots, sizeof(fat32_cluster_t));
+	cache->hash = (fat32_cluster_t**) calloc(nr_buckets, sizeof(fat32_cluster_t*));
+	cache->data = (char*) malloc((size_t) nr_slots * bpc);
+	if (!cache->slots || !cache->hash || !cache->data) {
+		cluster_cache_free(fs);
+		return ENOMEM;
+	}
+
+	cache->nr_slots = (int) nr_slots;
+	cache->hash_mask = nr_buckets - 1;
+	for (int i = 0; i < cache->nr_slots; i++) {
+		cache->slots[i].cluster_nr = -1;
+		cache->slots[i].data = cache->data + (size_t) i * bpc;
+	}
+
+	FAT_LOG_PRINTF(debug, "Cluster cache for fs %d holds %d clusters", fs->nr, cache->nr_slots);
+	return OK;
+}
+
+void cluster_cache_free(fat32_fs_t* fs) {
+	fat32_cluster_cache_t *cache = &fs->cluster_cache;
+
+	free(cache->slots);
+	free(cache->hash);
+	free(cache->data);
+	mthread_cond_destroy(&cache->loaded);
+	mthread_mutex_destroy(&cache->wait_mutex);
+
+	cache->slots = NULL;
+	cache->hash = NULL;
+	cache->data = NULL;
+	cache->lru_head = cache->lru_tail = NULL;
+	cache->nr_slots = cache->nr_used = cache->nr_resident = cache->nr_dirty = 0;
+}
+
+/* Makes a zeroed copy of a cluster that the cache doesn't know about, for when
+ * all of its slots are pinned. */
+static fat32_cluster_t* new_private_cluster(fat32_fs_t* fs, int cluster_nr) {
+	fat32_cluster_t *cluster;
+
+	cluster = (fat32_cluster_t*) calloc(1, sizeof(fat32_cluster_t));
+	if (!cluster) {
+		return NULL;
+	}
+
+	if ((cluster->data = (char*) calloc(1, fs->info.bytes_per_cluster)) == NULL) {
+		free(cluster);
+		return NULL;
+	}
+
+	cluster->cluster_nr = cluster_nr;
+	cluster->refcount = 1;
+	cluster->is_private = TRUE;
+
+	return cluster;
+}
+
+/* Points a private cluster at the copy of a cluster in a mapped image, which
+ * takes the place of the cache for it. The data must not be changed. */
+static int get_mapped_cluster(fat32_fs_t* fs, int cluster_nr, fat32_cluster_t** dst) {
+	fat32_cluster_t *cluster;
+	char *data;
+
+	data = dev_map(&fs->dev, cluster_offset(&fs->header, &fs->info, cluster_nr),
+			fs->info.bytes_per_cluster);
+	if (data == NULL) {
+		return FAT32_ERR_IO;
+	}
+
+	if ((cluster = (fat32_cluster_t*) calloc(1, sizeof(fat32_cluster_t))) == NULL) {
+		return ENOMEM;
+	}
+
+	cluster->cluster_nr = cluster_nr;
+	cluster->refcount = 1;
+	cluster->is_private = TRUE;
+	cluster->is_mapped = TRUE;
+	cluster->data = data;
+
+	*dst = cluster;
+	return OK;
+}
+
+/* Reads a cluster into memory that the cache doesn't know about, for when all
+ * of its slots are pinned. */
+static int get_private_cluster(fat32_fs_t* fs, int cluster_nr, fat32_cluster_t** dst) {
+	fat32_cluster_t *cluster;
+	int ret;
+
+	if ((cluster = new_private_cluster(fs, cluster_nr)) == NULL) {
+		return ENOMEM;
+	}
+
+	if ((ret = read_cluster(&fs->header, &fs->info, &fs->dev, cluster_nr,
+					cluster->data)) != OK) {
+		cluster_cache_put(fs, cluster);
+		return ret;
+	}
+
+	*dst = cluster;
+	return OK;
+}
+
+static fat32_cluster_t* hash_find(fat32_cluster_cache_t* cache, int cluster_nr) {
+	fat32_cluster_t *cluster;
+
+	for (cluster = cache->hash[cluster_hash(cache, cluster_nr)]; cluster;
+			cluster = cluster->hash_next) {
+		if (cluster->cluster_nr == cluster_nr) {
+			return cluster;
+		}
+	}
+
+	return NULL;
+}
+
+static void hash_insert(fat32_cluster_cache_t* cache, fat32_cluster_t* cluster,
+		int cluster_nr)
+{
+	cluster->cluster_nr = cluster_nr;
+	cluster->hash_next = cache->hash[cluster_hash(cache, cluster_nr)];
+	cache->hash[cluster_hash(cache, cluster_nr)] = cluster;
+	cache->nr_resident++;
+}
+
+static void pin(fat32_cluster_cache_t* cache, fat32_cluster_t* cluster) {
+	if (cluster->refcount++ == 0) {
+		lru_unlink(cache, cluster);
+	}
+}
+
+/* Takes an unused slot, or the least recently used unpinned one that is
+ * clean. Returns NULL if there is none. The slot is not on the LRU list
+ * afterwards. */
+static fat32_cluster_t* take_slot(fat32_cluster_cache_t* cache) {
+	fat32_cluster_t *cluster;
+
+	if (cache->nr_used < cache->nr_slots) {
+		return &cache->slots[cache->nr_used++];
+	}
+
+	for (cluster = cache->lru_tail; cluster != NULL && cluster->dirty;
+			cluster = cluster->lru_prev)
+		;
+
+	if (cluster == NULL) {
+		return NULL;
+	}
+
+	lru_unlink(cache, cluster);
+	if (cluster->cluster_nr != -1) {
+		hash_remove(cache, cluster);
+		cache->nr_resident--;
+		cache->evictions++;
+		fat32_stats.cluster_cache_evictions++;
+	}
+
+	cluster->cluster_nr = -1;
+	return cluster;
+}
+
+/* Marks a cluster that was being read in as done. If the read failed, the
+ * slot is taken out of the hash table, to be reused once the last reference
+ * to it is gone. */
+static void finish_load(fat32_cluster_cache_t* cache, fat32_cluster_t* cluster, int ok) {
+	if (!ok) {
+		hash_remove(cache, cluster);
+		cache->nr_resident--;
+		cluster->cluster_nr = -1;
+	}
+
+	cluster->is_loading = FALSE;
+	mthread_cond_broadcast(&cache->loaded);
+}
+
+/* Waits until a cluster that someone else is reading in is there. Returns
+ * FALSE if their read failed. */
+static int wait_loaded(fat32_cluster_cache_t* cache, fat32_cluster_t* cluster,
+		int cluster_nr)
+{
+	mthread_mutex_lock(&cache->wait_mutex);
+	while (cluster->is_loading) {
+		mthread_cond_wait(&cache->loaded, &cache->wait_mutex);
+	}
+
+	mthread_mutex_unlock(&cache->wait_mutex);
+	return cluster->cluster_nr == cluster_nr;
+}
+
+int cluster_cache_get(fat32_fs_t* fs, int cluster_nr, fat32_cluster_t** dst) {
+	fat32_cluster_cache_t *cache = &fs->cluster_cache;
+	fat32_cluster_t *cluster;
+	int ret;
+
+	if (fs->dev.map != NULL) {
+		return get_mapped_cluster(fs, cluster_nr, dst);
+	}
+
+	while ((cluster = hash_find(cache, cluster_nr)) != NULL) {
+		cache->hits++;
+		fat32_stats.cluster_cache_hits++;
+		pin(cache, cluster);
+		if (!cluster->is_loading || wait_loaded(cache, cluster, cluster_nr)) {
+			*dst = cluster;
+			return OK;
+		}
+
+		// Whoever was reading it in failed, so try again ourselves.
+		cluster_cache_put(fs, cluster);
+	}
+
+	cache->misses++;
+	fat32_stats.cluster_cache_misses++;
+	if ((cluster = take_slot(cache)) == NULL) {
+		return get_private_cluster(fs, cluster_nr, dst);
+	}
+
+	cluster->refcount = 1;
+	cluster->is_loading = TRUE;
+	hash_insert(cache, cluster, cluster_nr);
+
+	ret = read_cluster(&fs->header, &fs->info, &fs->dev, cluster_nr, cluster->data);
+	finish_load(cache, cluster, ret == OK);
+	if (ret != OK) {
+		cluster_cache_put(fs, cluster);
+		return ret;
+	}
+
+	*dst = cluster;
+	return OK;
+}
+
+fat32_cluster_t* cluster_cache_find(fat32_fs_t* fs, int cluster_nr) {
+	fat32_cluster_cache_t *cache = &fs->cluster_cache;
+	fat32_cluster_t *cluster;
+
+	if ((cluster = hash_find(cache, cluster_nr)) == NULL) {
+		return NULL;
+	}
+
+	cache->hits++;
+	fat32_stats.cluster_cache_hits++;
+	pin(cache, cluster);
+	if (cluster->is_loading && !wait_loaded(cache, cluster, cluster_nr)) {
+		cluster_cache_put(fs, cluster);
+		return NULL;
+	}
+
+	return cluster;
+}
+
+int cluster_cache_contains(fat32_fs_t* fs, int cluster_nr) {
+	return hash_find(&fs->cluster_cache, cluster_nr) != NULL;
+}
+
+void cluster_cache_fill(fat32_fs_t* fs, int cluster_nr, const char* data) {
+	fat32_cluster_cache_t *cache = &fs->cluster_cache;
+	fat32_cluster_t *cluster;
+
+	if (hash_find(cache, cluster_nr) || (cluster = take_slot(cache)) == NULL) {
+		return;
+	}
+
+	memcpy(cluster->data, data, fs->info.bytes_per_cluster);
+	cluster->refcount = 0;
+	cluster->is_loading = FALSE;
+	hash_insert(cache, cluster, cluster_nr);
+	lru_push_front(cache, cluster);
+	cache->prefetched++;
+	fat32_stats.clusters_prefetched++;
+}
+
+void cluster_cache_update(fat32_fs_t* fs, int cluster_nr, int count, const char* data) {
+	fat32_cluster_cache_t *cache = &fs->cluster_cache;
+	size_t bpc = fs->info.bytes_per_cluster;
+
+	for (int i = 0; i < count; i++) {
+		fat32_cluster_t *cluster = hash_find(cache, cluster_nr + i);
+		if (cluster == NULL) {
+			continue;
+		}
+
+		// A read of the old contents that is still going would overwrite
+		// the new ones when it's done, so wait for it.
+		pin(cache, cluster);
+		if (!cluster->is_loading || wait_loaded(cache, cluster, cluster_nr + i)) {
+			memcpy(cluster->data, data + i * bpc, bpc);
+			if (cluster->dirty) {
+				cluster->dirty = 0;
+				cache->nr_dirty--;
+			}
+		}
+
+		cluster_cache_put(fs, cluster);
+	}
+}
+
+int cluster_cache_zero(fat32_fs_t* fs, int cluster_nr, fat32_cluster_t** dst) {
+	fat32_cluster_cache_t *cache = &fs->cluster_cache;
+	fat32_cluster_t *cluster;
+
+	while ((cluster = hash_find(cache, cluster_nr)) != NULL) {
+		pin(cache, cluster);
+		if (!cluster->is_loading || wait_loaded(cache, cluster, cluster_nr)) {
+			memset(cluster->data, 0, fs->info.bytes_per_cluster);
+			*dst = cluster;
+			return OK;
+		}
+
+		cluster_cache_put(fs, cluster);
+	}
+
+	if ((cluster = take_slot(cache)) == NULL) {
+		if ((cluster = new_private_cluster(fs, cluster_nr)) == NULL) {
+			return ENOMEM;
+		}
+
+		*dst = cluster;
+		return OK;
+	}
+
+	memset(cluster->data, 0, fs->info.bytes_per_cluster);
+	cluster->refcount = 1;
+	cluster->is_loading = FALSE;
+	hash_insert(cache, cluster, cluster_nr);
+
+	*dst = cluster;
+	return OK;
+}
+
+int cluster_cache_dirty(fat32_fs_t* fs, fat32_cluster_t* cluster, int kind) {
+	int ret;
+
+	// A private cluster can't wait, so it is written through. Directory
+	// entries still have to come after the FAT sectors they point into,
+	// and those after the data.
+	if (cluster->is_private) {
+		if (kind == FAT32_DIRTY_DIR && (ret = writeback_sync(fs)) != OK) {
+			return ret;
+		}
+
+		return write_clusters(&fs->header, &fs->info, &fs->dev, cluster->cluster_nr, 1,
+				cluster->data);
+	}
+
+	if (!cluster->dirty) {
+		cluster->dirty = kind;
+		fs->cluster_cache.nr_dirty++;
+	}
+
+	return OK;
+}
+
+void cluster_cache_discard(fat32_fs_t* fs, int cluster_nr, int count) {
+	fat32_cluster_cache_t *cache = &fs->cluster_cache;
+
+	for (int i = 0; i < count && cache->nr_dirty > 0; i++) {
+		fat32_cluster_t *cluster = hash_find(cache, cluster_nr + i);
+		if (cluster != NULL && cluster->dirty) {
+			cluster->dirty = 0;
+			cache->nr_dirty--;
+		}
+	}
+}
+
+void cluster_cache_overlay(fat32_fs_t* fs, int cluster_nr, int count, char* buf) {
+	fat32_cluster_cache_t *cache = &fs->cluster_cache;
+	size_t bpc = fs->info.bytes_per_cluster;
+
+	for (int i = 0; i < count && cache->nr_dirty > 0; i++) {
+		fat32_cluster_t *cluster = hash_find(cache, cluster_nr + i);
+		if (cluster != NULL && cluster->dirty) {
+			memcpy(buf + i * bpc, cluster->data, bpc);
+		}
+	}
+}
+
+static int compare_clusters(const void* a, const void* b) {
+	return *(const int*) a - *(const int*) b;
+}
+
+int cluster_cache_flush(fat32_fs_t* fs, int kind) {
+	fat32_cluster_cache_t *cache = &fs->cluster_cache;
+	size_t bpc = fs->info.bytes_per_cluster;
+	int max_run = FAT32_READ_BUFFER_SIZE / bpc;
+	int nr_dirty = 0, ret = OK;
+	int *clusters;
+	char *buf;
+
+	if (cache->nr_dirty == 0) {
+		return OK;
+	}
+
+	if (max_run < 1) {
+		max_run = 1;
+	}
+
+	clusters = (int*) malloc(cache->nr_dirty * sizeof(int));
+	buf = (char*) malloc(max_run * bpc);
+	if (!clusters || !buf) {
+		free(clusters);
+		free(buf);
+		return ENOMEM;
+	}
+
+	for (int i = 0; i < cache->nr_used; i++) {
+		if (cache->slots[i].dirty == kind) {
+			clusters[nr_dirty++] = cache->slots[i].cluster_nr;
+		}
+	}
+
+	qsort(clusters, nr_dirty, sizeof(int), compare_clusters);
+
+	int i = 0;
+	while (i < nr_dirty) {
+		fat32_cluster_t *cluster = hash_find(cache, clusters[i]);
+		int count = 1;
+
+		// Clusters may have been written or freed (and evicted) while we
+		// waited for the device.
+		if (cluster == NULL || cluster->dirty != kind) {
+			i++;
+			continue;
+		}
+
+		while (i + count < nr_dirty && count < max_run &&
+				clusters[i + count] == clusters[i] + count &&
+				(cluster = hash_find(cache, clusters[i + count])) != NULL &&
+				cluster->dirty == kind) {
+			count++;
+		}
+
+		// Take a copy of the run and mark it clean before writing, as it
+		// may change again while we wait for the device.
+		for (int j = 0; j < count; j++) {
+			cluster = hash_find(cache, clusters[i + j]);
+			memcpy(buf + j * bpc, cluster->data, bpc);
+			cluster->dirty = 0;
+			cache->nr_dirty--;
+		}
+
+		if ((ret = write_clusters(&fs->header, &fs->info, &fs->dev, clusters[i], count,
+						buf)) != OK) {
+			break;
+		}
+
+		fat32_stats.clusters_written_back += count;
+		i += count;
+	}
+
+	if (ret != OK) {
+		FAT_LOG_PRINTF(warn, "Writing back cluster %d of fs %d failed: %d", clusters[i],
+				fs->nr, ret);
+
+		// Whatever wasn't written is dirty again, unless it changed since.
+		for (; i < nr_dirty; i++) {
+			fat32_cluster_t *cluster = hash_find(cache, clusters[i]);
+			if (cluster != NULL && !cluster->dirty) {
+				cluster->dirty = kind;
+				cache->nr_dirty++;
+			}
+		}
+	}
+
+	free(clusters);
+	free(buf);
+	return ret;
+}
+
+/* Called by libbdev from the main thread when a read-ahead request is done. */
+static void prefetch_done(dev_t dev, bdev_id_t id, bdev_param_t param, int result) {
+	prefetch_t *prefetch = (prefetch_t*) param;
+	fat32_fs_t *fs = prefetch->fs;
+	fat32_cluster_cache_t *cache = &fs->cluster_cache;
+	ssize_t bpc = fs->info.bytes_per_cluster;
+
+	for (int i = 0; i < prefetch->count; i++) {
+		// A short read only fills the first few clusters.
+		int ok = result >= 0 && result >= (i + 1) * bpc;
+		if (ok) {
+			cache->prefetched++;
+			fat32_stats.clusters_prefetched++;
+		}
+
+		finish_load(cache, prefetch->clusters[i], ok);
+		cluster_cache_put(fs, prefetch->clusters[i]);
+	}
+
+	if (result < 0) {
+		FAT_LOG_PRINTF(debug, "Read-ahead of %d clusters failed: %d", prefetch->count, result);
+	}
+
+	cache->nr_in_flight--;
+	free(prefetch);
+}
+
+int cluster_cache_prefetch(fat32_fs_t* fs, int cluster_nr, int count) {
+	fat32_cluster_cache_t *cache = &fs->cluster_cache;
+	prefetch_t *prefetch;
+	bdev_id_t id;
+	int i;
+
+	if (count > NR_IOREQS) {
+		count = NR_IOREQS;
+	}
+
+	if ((prefetch = (prefetch_t*) malloc(sizeof(prefetch_t))) == NULL) {
+		return ENOMEM;
+	}
+
+	// Reserve slots for as many of the clusters as we can, stopping at the
+	// first one that is already cached. The request holds a reference to
+	// each of them until it's done.
+	for (i = 0; i < count; i++) {
+		fat32_cluster_t *cluster;
+		if (hash_find(cache, cluster_nr + i) || (cluster = take_slot(cache)) == NULL) {
+			break;
+		}
+
+		cluster->refcount = 1;
+		cluster->is_loading = TRUE;
+		hash_insert(cache, cluster, cluster_nr + i);
+
+		prefetch->clusters[i] = cluster;
+		prefetch->vec[i].iov_addr = (vir_bytes) cluster->data;
+		prefetch->vec[i].iov_size = fs->info.bytes_per_cluster;
+	}
+
+	prefetch->fs = fs;
+	prefetch->count = i;
+	if (prefetch->count == 0) {
+		free(prefetch);
+		return 0;
+	}
+
+	id = dev_gather_async(&fs->dev, cluster_offset(&fs->header, &fs->info, cluster_nr),
+			prefetch->vec, prefetch->count, prefetch_done, prefetch);
+	if (id < 0) {
+		for (i = 0; i < prefetch->count; i++) {
+			finish_load(cache, prefetch->clusters[i], FALSE);
+			cluster_cache_put(fs, prefetch->clusters[i]);
+		}
+
+		free(prefetch);
+		return id;
+	}
+
+	cache->nr_in_flight++;
+	return prefetch->count;
+}
+
+void cluster_cache_drain(fat32_fs_t* fs) {
+	fat32_cluster_cache_t *cache = &fs->cluster_cache;
+
+	mthread_mutex_lock(&cache->wait_mutex);
+	while (cache->nr_in_flight > 0) {
+		mthread_cond_wait(&cache->loaded, &cache->wait_mutex);
+	}
+
+	mthread_mutex_unlock(&cache->wait_mutex);
+}
+
+void cluster_cache_put(fat32_fs_t* fs, fat32_cluster_t* cluster) {
+	if (cluster->is_private) {
+		if (!cluster->is_mapped) {
+			free(cluster->data);
+		}
+		free(cluster);
+		return;
+	}
+
+	if (--cluster->refcount == 0) {
+		// A slot whose read failed holds nothing, so it goes to the cold end
+		// of the list to be reused first.
+		if (cluster->cluster_nr == -1) {
+			lru_push_back(&fs->cluster_cache, cluster);
+		} else {
+			lru_push_front(&fs->cluster_cache, cluster);
+		}
+	}
+}
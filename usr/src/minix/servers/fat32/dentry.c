@@ -0,0 +1,177 @@
+#include "inc.h"
+#include "fat32.h"
+#include "mini-printf.h"
+#include <strings.h>
+#include <sys/queue.h>
+
+/* The dentry cache remembers the results of name lookups done while resolving
+ * paths, keyed by (filesystem, parent directory cluster, name), so that hot
+ * paths can be resolved without scanning any directories. It is modeled on the
+ * name hashtable of libsffs. Names are compared case-insensitively, as FAT
+ * does. Entries go away when they are evicted, when their directory is changed
+ * or when their filesystem is closed. */
+
+typedef struct fat32_dentry_t {
+	int fs_nr; // -1 if the slot is unused
+	int parent_cluster;
+	char name[FAT32_MAX_NAME_LEN];
+	fat32_dirent_t entry;
+	int slot_cluster; // Where its short entry is
+	int slot_offset;
+	LIST_ENTRY(fat32_dentry_t) hash;
+	TAILQ_ENTRY(fat32_dentry_t) lru;
+} fat32_dentry_t;
+
+static fat32_dentry_t dentries[FAT32_DENTRY_CACHE_SIZE];
+static LIST_HEAD(dentry_hash_head, fat32_dentry_t) dentry_hash[FAT32_DENTRY_HASH_SLOTS];
+static TAILQ_HEAD(dentry_lru_head, fat32_dentry_t) dentry_lru;
+
+static unsigned int dentry_hits;
+static unsigned int dentry_misses;
+
+unsigned int hash_name(const char* name) {
+	// djb2 string hash algorithm, XOR variant, over the upper-cased name so
+	// that all spellings of a name end up in the same slot.
+	unsigned int val = 5381;
+	for (const char *p = name; *p; p++) {
+		char c = *p;
+		if (c >= 'a' && c <= 'z') {
+			c -= 'a' - 'A';
+		}
+
+		val = ((val << 5) + val) ^ (unsigned char) c;
+	}
+
+	return val;
+}
+
+static unsigned int hash_dentry(int fs_nr, int parent_cluster, const char* name) {
+	// Mix with the parent, as the same names occur in many directories.
+	return (hash_name(name) ^ (unsigned int) parent_cluster ^ ((unsigned int) fs_nr << 16)) %
+		FAT32_DENTRY_HASH_SLOTS;
+}
+
+void init_dentry(void) {
+	for (int i = 0; i < FAT32_DENTRY_HASH_SLOTS; i++) {
+		LIST_INIT(&dentry_hash[i]);
+	}
+
+	// All slots start out unused at the front of the LRU list, so that they
+	// are the first to be taken.
+	TAILQ_INIT(&dentry_lru);
+	for (int i = 0; i < FAT32_DENTRY_CACHE_SIZE; i++) {
+		dentries[i].fs_nr = -1;
+		TAILQ_INSERT_TAIL(&dentry_lru, &dentries[i], lru);
+	}
+}
+
+int lookup_dentry(fat32_fs_t* fs, int parent_cluster, const char* name,
+		fat32_dirent_t* dst)
+{
+	unsigned int slot = hash_dentry(fs->nr, parent_cluster, name);
+	fat32_dentry_t *d;
+
+	LIST_FOREACH(d, &dentry_hash[slot], hash) {
+		if (d->fs_nr == fs->nr && d->parent_cluster == parent_cluster &&
+				strcasecmp(d->name, name) == 0) {
+			break;
+		}
+	}
+
+	if (d == NULL) {
+		dentry_misses++;
+		fat32_stats.dentry_misses++;
+		return FALSE;
+	}
+
+	dentry_hits++;
+	fat32_stats.dentry_hits++;
+	TAILQ_REMOVE(&dentry_lru, d, lru);
+	TAILQ_INSERT_TAIL(&dentry_lru, d, lru);
+
+	*dst = d->entry;
+	return TRUE;
+}
+
+void add_dentry(fat32_fs_t* fs, int parent_cluster, const char* name,
+		fat32_dirent_t* entry, int slot_cluster, int slot_offset)
+{
+	fat32_dentry_t *d;
+
+	if (strlen(name) >= FAT32_MAX_NAME_LEN) {
+		return;
+	}
+
+	// Another worker may have looked up the same name while we were
+	// scanning the directory.
+	LIST_FOREACH(d, &dentry_hash[hash_dentry(fs->nr, parent_cluster, name)], hash) {
+		if (d->fs_nr == fs->nr && d->parent_cluster == parent_cluster &&
+				strcasecmp(d->name, name) == 0) {
+			return;
+		}
+	}
+
+	// Reuse the least recently used slot, which is an unused one if there
+	// are any left.
+	d = TAILQ_FIRST(&dentry_lru);
+	TAILQ_REMOVE(&dentry_lru, d, lru);
+	if (d->fs_nr != -1) {
+		LIST_REMOVE(d, hash);
+	}
+
+	d->fs_nr = fs->nr;
+	d->parent_cluster = parent_cluster;
+	strlcpy(d->name, name, sizeof(d->name));
+	d->entry = *entry;
+	d->slot_cluster = slot_cluster;
+	d->slot_offset = slot_offset;
+
+	LIST_INSERT_HEAD(&dentry_hash[hash_dentry(fs->nr, parent_cluster, name)], d, hash);
+	TAILQ_INSERT_TAIL(&dentry_lru, d, lru);
+}
+
+/* Frees a slot, putting it where it is taken again first. */
+static void drop_dentry(fat32_dentry_t* d) {
+	LIST_REMOVE(d, hash);
+	d->fs_nr = -1;
+
+	TAILQ_REMOVE(&dentry_lru, d, lru);
+	TAILQ_INSERT_HEAD(&dentry_lru, d, lru);
+}
+
+void purge_dentries(fat32_fs_t* fs) {
+	for (int i = 0; i < FAT32_DENTRY_CACHE_SIZE; i++) {
+		if (dentries[i].fs_nr == fs->nr) {
+			drop_dentry(&dentries[i]);
+		}
+	}
+
+	FAT_LOG_PRINTF(debug, "Dentry cache: %u hits, %u misses", dentry_hits, dentry_misses);
+}
+
+void update_dentries(fat32_fs_t* fs, int parent_cluster, int slot_cluster, int slot_offset,
+		fat32_direntry_t* entry)
+{
+	char name[FAT32_MAX_NAME_LEN];
+
+	// An entry can be cached under every spelling of its name.
+	for (int i = 0; i < FAT32_DENTRY_CACHE_SIZE; i++) {
+		fat32_dentry_t *d = &dentries[i];
+
+		if (d->fs_nr == fs->nr && d->parent_cluster == parent_cluster &&
+				d->slot_cluster == slot_cluster && d->slot_offset == slot_offset) {
+			memcpy(name, d->entry.filename, d->entry.name_len);
+			name[d->entry.name_len] = '\0';
+			convert_entry(entry, name, &d->entry);
+		}
+	}
+}
+
+void purge_dir_dentries(fat32_fs_t* fs, int parent_cluster) {
+	// Entries are hashed by name, so all of them have to be looked at.
+	for (int i = 0; i < FAT32_DENTRY_CACHE_SIZE; i++) {
+		if (dentries[i].fs_nr == fs->nr && dentries[i].parent_cluster == parent_cluster) {
+			drop_dentry(&dentries[i]);
+		}
+	}
+}
@@ -0,0 +1,336 @@
+#include "inc.h"
+#include "fat32.h"
+#include "mini-printf.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <minix/bdev.h>
+#include <minix/dmap.h>
+#include "vfs/dmap.h"
+
+/* Filesystems on block devices are read and written by talking to the block
+ * driver directly through libbdev, which skips the VFS read() path and the
+ * copy into the root file server's cache that comes with it. Image files (and
+ * block devices whose driver we can't find) go through VFS as before; as
+ * those reads block the whole server, block devices are much preferable when
+ * there are several clients.
+ *
+ * Image files that are only read are mapped into memory instead, and reads
+ * copy from the mapping. VM pages them in from the file as they are touched
+ * and drops them again when memory runs short, so they need neither a read
+ * call per cluster nor room in the cluster cache. */
+
+int image_mmap;
+
+/* Called by libbdev from the main thread when the driver has answered. */
+static void dev_io_done(dev_t dev, bdev_id_t id, bdev_param_t param, int result) {
+	worker_io_done((fat32_worker_t*) param, result);
+}
+
+/* Reads from a block device. Workers send the request asynchronously and
+ * sleep until the reply comes in, so that the other workers can keep going in
+ * the meantime. */
+static ssize_t dev_read_bdev(fat32_dev_t* dev, uint64_t pos, char* buf, size_t len) {
+	fat32_worker_t *worker = worker_self();
+	bdev_id_t id;
+
+	if (!worker) {
+		return bdev_read(dev->dev, pos, buf, len, BDEV_NOFLAGS);
+	}
+
+	id = bdev_read_asyn(dev->dev, pos, buf, len, BDEV_NOFLAGS, dev_io_done,
+			(bdev_param_t) worker);
+	if (id < 0) {
+		return id;
+	}
+
+	return worker_wait_io(worker);
+}
+
+/* Writes to a block device, in the same way. */
+static ssize_t dev_write_bdev(fat32_dev_t* dev, uint64_t pos, const char* buf, size_t len) {
+	fat32_worker_t *worker = worker_self();
+	bdev_id_t id;
+
+	if (!worker) {
+		return bdev_write(dev->dev, pos, (char*) buf, len, BDEV_NOFLAGS);
+	}
+
+	id = bdev_write_asyn(dev->dev, pos, (char*) buf, len, BDEV_NOFLAGS, dev_io_done,
+			(bdev_param_t) worker);
+	if (id < 0) {
+		return id;
+	}
+
+	return worker_wait_io(worker);
+}
+
+/* Finds the label of the driver handling the given block device in VFS's
+ * device table. */
+static int find_driver_label(dev_t dev, char* label, size_t len) {
+	static struct dmap dmap[NR_DEVICES];
+	int major = major(dev);
+
+	if (major < 0 || major >= NR_DEVICES) {
+		return EINVAL;
+	}
+
+	if (getsysinfo(VFS_PROC_NR, SI_DMAP_TAB, dmap, sizeof(dmap)) != OK) {
+		return EIO;
+	}
+
+	if (dmap[major].dmap_driver == NONE || dmap[major].dmap_label[0] == '\0') {
+		return ENXIO;
+	}
+
+	strlcpy(label, dmap[major].dmap_label, len);
+	return OK;
+}
+
+static int dev_open_bdev(fat32_dev_t* dev, dev_t rdev) {
+	char label[LABEL_MAX];
+	int ret;
+
+	if ((ret = find_driver_label(rdev, label, sizeof(label))) != OK) {
+		return ret;
+	}
+
+	// The device is written through the same driver, if it lets us.
+	bdev_driver(rdev, label);
+	if (dev->is_writable && bdev_open(rdev, BDEV_R_BIT | BDEV_W_BIT) != OK) {
+		dev->is_writable = FALSE;
+	}
+
+	if (!dev->is_writable && (ret = bdev_open(rdev, BDEV_R_BIT)) != OK) {
+		return ret;
+	}
+
+	dev->dev = rdev;
+	dev->is_bdev = TRUE;
+
+	FAT_LOG_PRINTF(debug, "Reading device %d through driver %s", (int) rdev, label);
+	return OK;
+}
+
+static int dev_open_map(fat32_dev_t* dev, off_t size) {
+	void *map;
+
+	if (size <= 0 || (uint64_t) size > SIZE_MAX) {
+		return EFBIG;
+	}
+
+	map = mmap(NULL, (size_t) size, PROT_READ, MAP_PRIVATE, dev->fd, 0);
+	if (map == MAP_FAILED) {
+		return ENOMEM;
+	}
+
+	dev->map = (char*) map;
+	dev->map_size = (size_t) size;
+
+	FAT_LOG_PRINTF(debug, "Mapped %u bytes of the image", (unsigned int) dev->map_size);
+	return OK;
+}
+
+int dev_open(fat32_dev_t* dev, const char* path) {
+	struct stat st;
+	int ret;
+
+	// Volumes are opened for writing where we are allowed to, and are
+	// read-only otherwise.
+	memset(dev, 0, sizeof(*dev));
+	dev->is_writable = TRUE;
+	if ((dev->fd = open(path, O_RDWR)) < 0) {
+		dev->is_writable = FALSE;
+		dev->fd = open(path, O_RDONLY);
+	}
+
+	if (dev->fd < 0) {
+		return FAT32_ERR_IO;
+	}
+
+	if (fstat(dev->fd, &st) != 0) {
+		return OK;
+	}
+
+	dev->file_dev = st.st_dev;
+	dev->file_ino = st.st_ino;
+
+	if (S_ISBLK(st.st_mode)) {
+		if ((ret = dev_open_bdev(dev, st.st_rdev)) != OK) {
+			FAT_LOG_PRINTF(warn, "Can't access the driver of %s directly (%d), "
+					"falling back to VFS", path, ret);
+		}
+	} else if (S_ISREG(st.st_mode) && (image_mmap || !dev->is_writable)) {
+		// Writes to the file wouldn't show in the mapping, so a mapped
+		// image is only ever read.
+		if ((ret = dev_open_map(dev, st.st_size)) == OK) {
+			dev->is_writable = FALSE;
+		} else {
+			FAT_LOG_PRINTF(warn, "Can't map %s (%d), falling back to VFS", path, ret);
+		}
+	}
+
+	return OK;
+}
+
+char* dev_map(fat32_dev_t* dev, uint64_t pos, size_t len) {
+	if (dev->map == NULL || pos > dev->map_size || len > dev->map_size - pos) {
+		return NULL;
+	}
+
+	fat32_stats.dev_mapped_bytes += len;
+	return dev->map + pos;
+}
+
+int dev_read(fat32_dev_t* dev, uint64_t pos, char* buf, size_t len) {
+	ssize_t nread;
+	char *src;
+
+	if (dev->map != NULL) {
+		if ((src = dev_map(dev, pos, len)) == NULL) {
+			FAT_LOG_PRINTF(debug, "Read at %u is past the end of the image",
+					(unsigned int) pos);
+			return FAT32_ERR_IO;
+		}
+
+		memcpy(buf, src, len);
+		return OK;
+	}
+
+	if (dev->is_bdev) {
+		nread = dev_read_bdev(dev, pos, buf, len);
+	} else {
+		if (lseek(dev->fd, (off_t) pos, SEEK_SET) != (off_t) pos) {
+			return FAT32_ERR_IO;
+		}
+
+		nread = read(dev->fd, buf, len);
+	}
+
+	fat32_stats.dev_reads++;
+	if (nread > 0) {
+		fat32_stats.dev_read_bytes += nread;
+	}
+
+	if (nread < 0 || (size_t) nread != len) {
+		FAT_LOG_PRINTF(debug, "Short read at %u: %d of %d bytes",
+				(unsigned int) pos, (int) nread, (int) len);
+		return FAT32_ERR_IO;
+	}
+
+	return OK;
+}
+
+int dev_write(fat32_dev_t* dev, uint64_t pos, const char* buf, size_t len) {
+	ssize_t nwritten;
+
+	if (!dev->is_writable) {
+		return EROFS;
+	}
+
+	if (dev->is_bdev) {
+		nwritten = dev_write_bdev(dev, pos, buf, len);
+	} else {
+		if (lseek(dev->fd, (off_t) pos, SEEK_SET) != (off_t) pos) {
+			return FAT32_ERR_IO;
+		}
+
+		nwritten = write(dev->fd, buf, len);
+	}
+
+	fat32_stats.dev_writes++;
+	if (nwritten > 0) {
+		fat32_stats.dev_write_bytes += nwritten;
+	}
+
+	if (nwritten < 0 || (size_t) nwritten != len) {
+		FAT_LOG_PRINTF(warn, "Short write at %u: %d of %d bytes",
+				(unsigned int) pos, (int) nwritten, (int) len);
+		return FAT32_ERR_IO;
+	}
+
+	return OK;
+}
+
+int dev_gather_async(fat32_dev_t* dev, uint64_t pos, iovec_t* vec, int count,
+		bdev_callback_t done, bdev_param_t param)
+{
+	if (!dev->is_bdev) {
+		return ENOSYS;
+	}
+
+	// Counted when it's sent rather than when it's done, as only the
+	// caller's callback sees the result.
+	fat32_stats.dev_reads++;
+	for (int i = 0; i < count; i++) {
+		fat32_stats.dev_read_bytes += vec[i].iov_size;
+	}
+
+	return bdev_gather_asyn(dev->dev, pos, vec, count, BDEV_NOFLAGS, done, param);
+}
+
+int read_fat_header(fat32_dev_t* dev, fat32_header_t* header) {
+	// Block devices can only be read a whole sector at a time, so read the
+	// entire boot sector and take the header from its start.
+	char sector[FAT32_MIN_SECTOR_SIZE];
+	if (dev_read(dev, 0, sector, sizeof(sector)) != OK) {
+		return FAT32_ERR_IO;
+	}
+
+	memcpy(header, sector, sizeof(fat32_header_t));
+	return OK;
+}
+
+int read_cluster(fat32_header_t* header, fat32_info_t* info, fat32_dev_t* dev,
+		int cluster_nr, char* buf)
+{
+	return read_clusters(header, info, dev, cluster_nr, 1, buf);
+}
+
+int read_clusters(fat32_header_t* header, fat32_info_t* info, fat32_dev_t* dev,
+		int cluster_nr, int count, char* buf)
+{
+	return dev_read(dev, cluster_offset(header, info, cluster_nr), buf,
+			(size_t) count * info->bytes_per_cluster);
+}
+
+int write_clusters(fat32_header_t* header, fat32_info_t* info, fat32_dev_t* dev,
+		int cluster_nr, int count, const char* buf)
+{
+	return dev_write(dev, cluster_offset(header, info, cluster_nr), buf,
+			(size_t) count * info->bytes_per_cluster);
+}
+
+int read_fat_sector(fat32_header_t* header, fat32_info_t* info, fat32_dev_t* dev,
+		int sector_nr, char* buf)
+{
+	uint64_t offset =
+		((uint64_t) info->first_fat_sector + sector_nr) * header->bpb.bytes_per_sector;
+
+	FAT_LOG_PRINTF(debug, "Reading FAT sector %d", sector_nr);
+	int ret = dev_read(dev, offset, buf, header->bpb.bytes_per_sector);
+	if (ret != OK) {
+		FAT_LOG_PRINTF(warn, "Reading FAT sector %d failed: %d.", sector_nr, ret);
+	}
+
+	return ret;
+}
+
+void dev_close(fat32_dev_t* dev) {
+	if (dev->is_bdev) {
+		bdev_close(dev->dev);
+	}
+
+	if (dev->map != NULL) {
+		munmap(dev->map, dev->map_size);
+	}
+
+	if (dev->fd >= 0) {
+		close(dev->fd);
+	}
+
+	dev->fd = -1;
+	dev->is_bdev = FALSE;
+	dev->map = NULL;
+}
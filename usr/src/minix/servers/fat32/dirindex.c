@@ -0,0 +1,349 @@
+#include "inc.h"
+#include "fat32.h"
+#include "mini-printf.h"
+#include <strings.h>
+#include <sys/queue.h>
+
+/* Directory indexes let name lookups in large directories skip the linear scan
+ * of their slots. The first lookup that misses in a directory scans all of it
+ * and records every name, with the position of its short entry and a copy of
+ * that entry, in a hashtable keyed by name. Later lookups in that directory,
+ * for any name, only hash. Indexes are keyed by (filesystem, first cluster of
+ * the directory) and carry the generation of their filesystem from when they
+ * were built, so that they are dropped when the volume has changed since. A
+ * directory that gains or loses names loses its index until it is next looked
+ * up in; entries that only change in place are updated in it. They share a memory budget and the least recently used ones are evicted
+ * to stay within it. */
+
+typedef struct fat32_dirindex_entry_t {
+	uint32_t hash;
+	int32_t next;           // Next entry in the same bucket, -1 if none
+	uint32_t name_offset;   // Offset of the name in the name pool
+	uint32_t slot_cluster;  // Cluster holding the short entry
+	uint32_t slot_offset;   // Offset of the short entry in that cluster
+	fat32_direntry_t short_entry;
+} fat32_dirindex_entry_t;
+
+struct fat32_dirindex_t {
+	int fs_nr;
+	int dir_cluster;
+	uint32_t generation;
+	int is_stale;           // The directory changed while it was being built
+
+	fat32_dirindex_entry_t *entries;
+	int nr_entries;
+	int max_entries;
+
+	char *names;
+	size_t names_used;
+	size_t names_size;
+
+	int32_t *buckets;       // Power of two many, -1 if empty
+	int nr_buckets;
+
+	LIST_ENTRY(fat32_dirindex_t) hash; // Or the list of those being built
+	TAILQ_ENTRY(fat32_dirindex_t) lru;
+};
+
+static LIST_HEAD(dirindex_hash_head, fat32_dirindex_t) dirindex_hash[FAT32_DIRINDEX_HASH_SLOTS];
+static TAILQ_HEAD(dirindex_lru_head, fat32_dirindex_t) dirindex_lru;
+static LIST_HEAD(dirindex_building_head, fat32_dirindex_t) dirindex_building;
+
+size_t dirindex_budget;
+static size_t dirindex_used;
+
+static unsigned int hash_dirindex(int fs_nr, int dir_cluster) {
+	return ((unsigned int) dir_cluster ^ ((unsigned int) fs_nr << 16)) %
+		FAT32_DIRINDEX_HASH_SLOTS;
+}
+
+static size_t dirindex_size(fat32_dirindex_t* index) {
+	return sizeof(*index) + index->max_entries * sizeof(fat32_dirindex_entry_t) +
+		index->names_size + index->nr_buckets * sizeof(int32_t);
+}
+
+void init_dirindex(void) {
+	for (int i = 0; i < FAT32_DIRINDEX_HASH_SLOTS; i++) {
+		LIST_INIT(&dirindex_hash[i]);
+	}
+
+	TAILQ_INIT(&dirindex_lru);
+	LIST_INIT(&dirindex_building);
+	dirindex_used = 0;
+}
+
+static fat32_dirindex_t* find_dirindex(fat32_fs_t* fs, int dir_cluster) {
+	fat32_dirindex_t *index;
+
+	LIST_FOREACH(index, &dirindex_hash[hash_dirindex(fs->nr, dir_cluster)], hash) {
+		if (index->fs_nr == fs->nr && index->dir_cluster == dir_cluster) {
+			return index;
+		}
+	}
+
+	return NULL;
+}
+
+static void free_dirindex(fat32_dirindex_t* index) {
+	free(index->entries);
+	free(index->names);
+	free(index->buckets);
+	free(index);
+}
+
+static void drop_dirindex(fat32_dirindex_t* index) {
+	LIST_REMOVE(index, hash);
+	TAILQ_REMOVE(&dirindex_lru, index, lru);
+	dirindex_used -= dirindex_size(index);
+	free_dirindex(index);
+}
+
+int lookup_dirindex(fat32_fs_t* fs, int dir_cluster, const char* name,
+		fat32_dirent_t* dst, int* found, int* slot_cluster, int* slot_offset)
+{
+	fat32_dirindex_t *index = find_dirindex(fs, dir_cluster);
+
+	*found = FALSE;
+	if (index == NULL) {
+		return FALSE;
+	}
+
+	if (index->generation != fs->generation) {
+		drop_dirindex(index);
+		return FALSE;
+	}
+
+	TAILQ_REMOVE(&dirindex_lru, index, lru);
+	TAILQ_INSERT_TAIL(&dirindex_lru, index, lru);
+	fat32_stats.dirindex_lookups++;
+
+	uint32_t hash = hash_name(name);
+	int32_t i = index->buckets[hash & (index->nr_buckets - 1)];
+	for (; i != -1; i = index->entries[i].next) {
+		fat32_dirindex_entry_t *e = &index->entries[i];
+		const char *entry_name = &index->names[e->name_offset];
+
+		if (e->hash == hash && strcasecmp(entry_name, name) == 0) {
+			convert_entry(&e->short_entry, entry_name, dst);
+			*slot_cluster = (int) e->slot_cluster;
+			*slot_offset = (int) e->slot_offset;
+			*found = TRUE;
+			break;
+		}
+	}
+
+	return TRUE;
+}
+
+fat32_dirindex_t* dirindex_begin(fat32_fs_t* fs, int dir_cluster) {
+	fat32_dirindex_t *index;
+
+	if (dirindex_budget == 0) {
+		return NULL;
+	}
+
+	if ((index = (fat32_dirindex_t*) calloc(1, sizeof(*index))) == NULL) {
+		return NULL;
+	}
+
+	index->fs_nr = fs->nr;
+	index->dir_cluster = dir_cluster;
+	index->generation = fs->generation;
+	LIST_INSERT_HEAD(&dirindex_building, index, hash);
+	return index;
+}
+
+int dirindex_add(fat32_dirindex_t* index, const char* name,
+		fat32_direntry_t* short_entry, int slot_cluster, int slot_offset)
+{
+	size_t len = strlen(name) + 1;
+
+	// Grow the arrays by doubling, giving up on the index once it could no
+	// longer fit into the budget.
+	if (index->nr_entries == index->max_entries) {
+		int max = index->max_entries ? index->max_entries * 2 : 16;
+		fat32_dirindex_entry_t *entries;
+
+		if ((size_t) max * sizeof(*entries) > dirindex_budget ||
+				(entries = (fat32_dirindex_entry_t*) realloc(index->entries,
+					max * sizeof(*entries))) == NULL) {
+			return ENOMEM;
+		}
+
+		index->entries = entries;
+		index->max_entries = max;
+	}
+
+	if (index->names_used + len > index->names_size) {
+		size_t size = index->names_size ? index->names_size * 2 : 256;
+		char *names;
+
+		while (size < index->names_used + len) {
+			size *= 2;
+		}
+
+		if (size > dirindex_budget ||
+				(names = (char*) realloc(index->names, size)) == NULL) {
+			return ENOMEM;
+		}
+
+		index->names = names;
+		index->names_size = size;
+	}
+
+	fat32_dirindex_entry_t *e = &index->entries[index->nr_entries++];
+	e->hash = hash_name(name);
+	e->next = -1;
+	e->name_offset = (uint32_t) index->names_used;
+	e->slot_cluster = (uint32_t) slot_cluster;
+	e->slot_offset = (uint32_t) slot_offset;
+	e->short_entry = *short_entry;
+
+	memcpy(&index->names[index->names_used], name, len);
+	index->names_used += len;
+
+	return OK;
+}
+
+void dirindex_abort(fat32_dirindex_t* index) {
+	LIST_REMOVE(index, hash);
+	free_dirindex(index);
+}
+
+void dirindex_commit(fat32_fs_t* fs, fat32_dirindex_t* index) {
+	int nr_buckets = 16;
+
+	// Another worker may have indexed the same directory while we were
+	// scanning it, or the volume may have changed.
+	LIST_REMOVE(index, hash);
+	if (index->generation != fs->generation || index->is_stale ||
+			find_dirindex(fs, index->dir_cluster)) {
+		free_dirindex(index);
+		return;
+	}
+
+	// Give back what the doubling left unused.
+	if (index->nr_entries > 0 && index->nr_entries < index->max_entries) {
+		fat32_dirindex_entry_t *entries = (fat32_dirindex_entry_t*) realloc(
+				index->entries, index->nr_entries * sizeof(*entries));
+		if (entries != NULL) {
+			index->entries = entries;
+			index->max_entries = index->nr_entries;
+		}
+	}
+
+	if (index->names_used > 0 && index->names_used < index->names_size) {
+		char *names = (char*) realloc(index->names, index->names_used);
+		if (names != NULL) {
+			index->names = names;
+			index->names_size = index->names_used;
+		}
+	}
+
+	while (nr_buckets < index->nr_entries) {
+		nr_buckets *= 2;
+	}
+
+	index->nr_buckets = nr_buckets;
+	if ((index->buckets = (int32_t*) malloc(nr_buckets * sizeof(int32_t))) == NULL) {
+		free_dirindex(index);
+		return;
+	}
+
+	for (int i = 0; i < nr_buckets; i++) {
+		index->buckets[i] = -1;
+	}
+
+	// Chain the entries in reverse, so that when a name occurs twice the
+	// first one, which a scan would find, comes first.
+	for (int i = index->nr_entries - 1; i >= 0; i--) {
+		fat32_dirindex_entry_t *e = &index->entries[i];
+		int32_t *bucket = &index->buckets[e->hash & (nr_buckets - 1)];
+
+		e->next = *bucket;
+		*bucket = i;
+	}
+
+	size_t size = dirindex_size(index);
+	if (size > dirindex_budget) {
+		free_dirindex(index);
+		return;
+	}
+
+	while (dirindex_used + size > dirindex_budget) {
+		fat32_stats.dirindex_evictions++;
+		drop_dirindex(TAILQ_FIRST(&dirindex_lru));
+	}
+
+	LIST_INSERT_HEAD(&dirindex_hash[hash_dirindex(index->fs_nr, index->dir_cluster)],
+			index, hash);
+	TAILQ_INSERT_TAIL(&dirindex_lru, index, lru);
+	dirindex_used += size;
+	fat32_stats.dirindex_builds++;
+
+	FAT_LOG_PRINTF(debug, "Indexed %d names of directory %d, %d KB in use",
+			index->nr_entries, index->dir_cluster, (int) (dirindex_used / 1024));
+}
+
+void drop_dir_dirindex(fat32_fs_t* fs, int dir_cluster) {
+	fat32_dirindex_t *index = find_dirindex(fs, dir_cluster);
+
+	if (index != NULL) {
+		drop_dirindex(index);
+	}
+
+	LIST_FOREACH(index, &dirindex_building, hash) {
+		if (index->fs_nr == fs->nr && index->dir_cluster == dir_cluster) {
+			index->is_stale = TRUE;
+		}
+	}
+}
+
+/* Updates the copy of the entry at the given slot position in an index. */
+static void update_entry_copy(fat32_dirindex_t* index, int slot_cluster, int slot_offset,
+		fat32_direntry_t* entry)
+{
+	for (int i = 0; i < index->nr_entries; i++) {
+		fat32_dirindex_entry_t *e = &index->entries[i];
+
+		if (e->slot_cluster == (uint32_t) slot_cluster &&
+				e->slot_offset == (uint32_t) slot_offset) {
+			e->short_entry = *entry;
+			return;
+		}
+	}
+}
+
+void update_dir_dirindex(fat32_fs_t* fs, int dir_cluster, int slot_cluster, int slot_offset,
+		fat32_direntry_t* entry)
+{
+	fat32_dirindex_t *index = find_dirindex(fs, dir_cluster);
+
+	if (index != NULL) {
+		update_entry_copy(index, slot_cluster, slot_offset, entry);
+	}
+
+	// Those being built may have copied the entry already.
+	LIST_FOREACH(index, &dirindex_building, hash) {
+		if (index->fs_nr == fs->nr && index->dir_cluster == dir_cluster) {
+			update_entry_copy(index, slot_cluster, slot_offset, entry);
+		}
+	}
+}
+
+void purge_dirindexes(fat32_fs_t* fs) {
+	fat32_dirindex_t *index, *next;
+
+	LIST_FOREACH(index, &dirindex_building, hash) {
+		if (index->fs_nr == fs->nr) {
+			index->is_stale = TRUE;
+		}
+	}
+
+	for (index = TAILQ_FIRST(&dirindex_lru); index != NULL; index = next) {
+		next = TAILQ_NEXT(index, lru);
+		if (index->fs_nr == fs->nr) {
+			drop_dirindex(index);
+		}
+	}
+}
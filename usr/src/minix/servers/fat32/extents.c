@@ -0,0 +1,144 @@
+#include "inc.h"
+#include "fat32.h"
+#include "mini-printf.h"
+
+/* Most files on a FAT32 volume are (almost) contiguous, so instead of following
+ * the cluster chain one FAT entry at a time for every read, open files record
+ * their chain once as a short list of (start cluster, length) runs. */
+
+#define EXTENT_MAP_INITIAL_CAPACITY 8
+
+static int extent_map_append(fat32_extent_map_t* map, int file_index, int cluster_nr) {
+	if (map->nr_extents > 0) {
+		fat32_extent_t *last = &map->extents[map->nr_extents - 1];
+		if (last->start_cluster + last->length == cluster_nr) {
+			last->length++;
+			return OK;
+		}
+	}
+
+	if (map->nr_extents == map->capacity) {
+		int capacity = map->capacity ? map->capacity * 2 : EXTENT_MAP_INITIAL_CAPACITY;
+		fat32_extent_t *extents =
+			(fat32_extent_t*) realloc(map->extents, capacity * sizeof(fat32_extent_t));
+		if (!extents) {
+			return ENOMEM;
+		}
+
+		map->extents = extents;
+		map->capacity = capacity;
+	}
+
+	fat32_extent_t *extent = &map->extents[map->nr_extents++];
+	extent->file_index = file_index;
+	extent->start_cluster = cluster_nr;
+	extent->length = 1;
+
+	return OK;
+}
+
+int extent_map_build(fat32_fs_t* fs, int first_cluster, int max_clusters,
+		fat32_extent_map_t* map)
+{
+	int ret, cluster_nr = first_cluster;
+
+	extent_map_free(map);
+	for (int i = 0; i < max_clusters && cluster_nr != -1; i++) {
+		if (cluster_nr < 2) {
+			FAT_LOG_PRINTF(warn, "Invalid cluster %d in chain starting at %d",
+					cluster_nr, first_cluster);
+			extent_map_free(map);
+			return FAT32_ERR_INVALID_FAT;
+		}
+
+		if ((ret = extent_map_append(map, i, cluster_nr)) != OK) {
+			extent_map_free(map);
+			return ret;
+		}
+
+		map->nr_clusters++;
+		if (map->nr_clusters == max_clusters) {
+			break;
+		}
+
+		if ((ret = get_next_cluster(fs, cluster_nr, &cluster_nr)) != OK) {
+			extent_map_free(map);
+			return ret;
+		}
+	}
+
+	map->is_built = TRUE;
+	FAT_LOG_PRINTF(debug, "Chain at cluster %d has %d clusters in %d extents",
+			first_cluster, map->nr_clusters, map->nr_extents);
+
+	return OK;
+}
+
+int extent_map_append_run(fat32_extent_map_t* map, int cluster_nr, int count) {
+	int ret;
+
+	// The first cluster may continue the last extent; the rest of the run
+	// then does too.
+	if ((ret = extent_map_append(map, map->nr_clusters, cluster_nr)) != OK) {
+		return ret;
+	}
+
+	map->extents[map->nr_extents - 1].length += count - 1;
+	map->nr_clusters += count;
+	return OK;
+}
+
+void extent_map_truncate(fat32_extent_map_t* map, int nr_clusters) {
+	if (nr_clusters >= map->nr_clusters) {
+		return;
+	}
+
+	while (map->nr_extents > 0 &&
+			map->extents[map->nr_extents - 1].file_index >= nr_clusters) {
+		map->nr_extents--;
+	}
+
+	if (map->nr_extents > 0) {
+		fat32_extent_t *last = &map->extents[map->nr_extents - 1];
+		last->length = nr_clusters - last->file_index;
+	}
+
+	map->nr_clusters = nr_clusters;
+}
+
+void extent_map_free(fat32_extent_map_t* map) {
+	free(map->extents);
+	memset(map, 0, sizeof(*map));
+}
+
+void extent_map_lookup(fat32_extent_map_t* map, int index, int* cluster_nr,
+		int* run_left)
+{
+	*cluster_nr = -1;
+	if (run_left) {
+		*run_left = 0;
+	}
+
+	if (index < 0 || index >= map->nr_clusters) {
+		return;
+	}
+
+	// Find the last extent that starts at or before the index.
+	int lo = 0, hi = map->nr_extents - 1;
+	while (lo < hi) {
+		int mid = lo + (hi - lo + 1) / 2;
+		if (map->extents[mid].file_index <= index) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	fat32_extent_t *extent = &map->extents[lo];
+	int offset = index - extent->file_index;
+
+	*cluster_nr = extent->start_cluster + offset;
+	if (run_left) {
+		*run_left = extent->length - offset - 1;
+	}
+}
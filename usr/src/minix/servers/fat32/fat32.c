@@ -1,20 +1,25 @@
-#include "proto.h"
 #include "fat32.h"
-#include "mini-printf.h"
-#include <unistd.h>
-#include <minix/com.h>
 #include <string.h>
-
-#define OK 0
+#include <time.h>
 
 /* Refer to the FAT32 documentation for details on the implementation of some of
- * these functions and some magic numbers used. */
+ * these functions and some magic numbers used. This file must stay free of
+ * anything MINIX-specific (including logging), as it is also built on the host
+ * by fatbench. */
 
 int build_fat_info(fat32_header_t* header, fat32_info_t *dst_info) {
 	if (header->bpb.header[0] != 0xEB || header->bpb.header[2] != 0x90) {
 		return FAT32_ERR_NOT_FAT;
 	}
 
+	// Sectors must be a power of two no smaller than what the device can
+	// read, or we'd have to read them piecewise.
+	uint16_t bps = header->bpb.bytes_per_sector;
+	if (bps < FAT32_MIN_SECTOR_SIZE || bps > 4096 || (bps & (bps - 1)) != 0 ||
+			header->bpb.sectors_per_cluster == 0) {
+		return FAT32_ERR_INVALID_FAT;
+	}
+
 	dst_info->bytes_per_cluster =
 		header->bpb.bytes_per_sector * header->bpb.sectors_per_cluster;
 
@@ -47,115 +52,625 @@ int build_fat_info(fat32_header_t* header, fat32_info_t *dst_info) {
 		return FAT32_ERR_NOT_FAT;
 	}
 
+	dst_info->total_clusters = total_clusters;
 	return OK;
 }
 
-int read_fat_header(int fd, fat32_header_t* header) {
-	size_t nread = read(fd, header, sizeof(fat32_header_t));
-	if (nread < sizeof(fat32_header_t)) {
-		return FAT32_ERR_IO;
+uint64_t cluster_offset(fat32_header_t* header, fat32_info_t* info, int cluster_nr)
+{
+	uint64_t first_sector_of_cluster =
+		((uint64_t) (cluster_nr - 2) * header->bpb.sectors_per_cluster) +
+		info->first_data_sector;
+
+	return first_sector_of_cluster * header->bpb.bytes_per_sector;
+}
+
+void decode_fat_entry(uint32_t entry, int* next_cluster_nr) {
+	entry &= 0x0fffffff;
+	if (entry >= 0x0ffffff8) {
+		// Signal that this is the end of the cluster chain.
+		*next_cluster_nr = -1;
+	} else {
+		*next_cluster_nr = (int) entry;
+	}
+}
+
+int parse_fsinfo(const fat32_fsinfo_t* fsinfo, const fat32_info_t* info,
+		uint32_t* free_clusters, uint32_t* next_free)
+{
+	*free_clusters = FAT32_FSINFO_UNKNOWN;
+	*next_free = FAT32_FSINFO_UNKNOWN;
+
+	if (fsinfo->lead_signature != FAT32_FSINFO_LEAD_SIGNATURE ||
+			fsinfo->struct_signature != FAT32_FSINFO_STRUCT_SIGNATURE ||
+			fsinfo->trail_signature != FAT32_FSINFO_TRAIL_SIGNATURE) {
+		return FALSE;
 	}
 
-	return OK;
+	if (fsinfo->free_clusters <= (uint32_t) info->total_clusters) {
+		*free_clusters = fsinfo->free_clusters;
+	}
+
+	if (fsinfo->next_free_cluster >= 2 &&
+			fsinfo->next_free_cluster < (uint32_t) info->total_clusters + 2) {
+		*next_free = fsinfo->next_free_cluster;
+	}
+
+	return TRUE;
 }
 
-int seek_cluster(fat32_header_t* header, fat32_info_t* info, int fd, int
-		cluster_nr)
+uint32_t count_free_clusters(const uint32_t* fat, uint32_t first_cluster,
+		uint32_t count, uint32_t* bitmap)
 {
-	int first_sector_of_cluster =
-		((cluster_nr - 2) * header->bpb.sectors_per_cluster) +
-		info->first_data_sector;
+	uint32_t nr_free = 0;
 
-	int first_byte_of_sector = first_sector_of_cluster * header->bpb.bytes_per_sector;
+	if (bitmap == NULL) {
+		for (uint32_t i = 0; i < count; i++) {
+			nr_free += (fat[i] & 0x0fffffff) == 0;
+		}
 
-	off_t ret = lseek(fd, (off_t) first_byte_of_sector, SEEK_SET);
-	if (ret != (off_t) first_byte_of_sector) {
-		return FAT32_ERR_IO;
+		return nr_free;
 	}
 
-	return OK;
+	for (uint32_t i = 0; i < count; i++) {
+		if ((fat[i] & 0x0fffffff) == 0) {
+			uint32_t bit = first_cluster + i - 2;
+			bitmap[bit / 32] |= (uint32_t) 1 << (bit % 32);
+			nr_free++;
+		}
+	}
+
+	return nr_free;
 }
 
-int seek_read_cluster(fat32_header_t* header, fat32_info_t* info, int fd, int
-		cluster_nr, char* buf)
+size_t convert_entry(fat32_direntry_t* entry, const char* name, fat32_dirent_t* dest) {
+	size_t len = strlen(name);
+	size_t size = FAT32_DIRENT_SIZE(len);
+
+	dest->first_cluster =
+		((uint32_t) entry->first_cluster_nr_high << 16) | entry->first_cluster_nr_low;
+	dest->size_bytes = entry->size_bytes;
+	dest->attributes = entry->attributes;
+
+	memcpy(&dest->creation_time, &entry->creation_time, sizeof(uint16_t));
+	memcpy(&dest->creation_date, &entry->creation_date, sizeof(uint16_t));
+	memcpy(&dest->access_date, &entry->last_access_date, sizeof(uint16_t));
+	memcpy(&dest->modification_time, &entry->last_modified_time, sizeof(uint16_t));
+	memcpy(&dest->modification_date, &entry->last_modified_date, sizeof(uint16_t));
+
+	// Clear the padding after the name as well, as it is copied out.
+	dest->name_len = (uint8_t) len;
+	memmove(dest->filename, name, len);
+	memset(dest->filename + len, 0, size - offsetof(fat32_dirent_t, filename) - len);
+
+	return size;
+}
+
+void filename_83_to_string(char* filename_83, char* dest) {
+	// Copy the filename portion to the new string.
+	strncpy(dest, filename_83, 8);
+
+	// Find the first space in the filename and put a dot after it.
+	int first_space;
+	for (first_space = 0;
+		 first_space < 8 && filename_83[first_space] != ' ';
+		 first_space++)
+		;
+
+	dest[first_space] = '.';
+
+	// Copy the extension right after the dot.
+	strncpy(dest + first_space + 1, filename_83 + 8, 3);
+
+	// Find the first space in the extension and put a null terminator after
+	// it.
+	int dot_position = first_space;
+	for (first_space = 8;
+		 first_space < 11 && filename_83[first_space] != ' ';
+		 first_space++)
+		;
+
+	// If there's no extension, don't put the dot, just overwrite it with
+	// a null terminator.
+	if (first_space == 8) {
+		dest[dot_position] = '\0';
+	} else {
+		dest[dot_position + first_space - 8 + 1] = '\0';
+	}
+}
+
+uint8_t fat32_lfn_checksum(const uint8_t* filename_83) {
+	uint8_t sum = 0;
+	for (int i = 0; i < 11; i++) {
+		sum = (uint8_t) (((sum & 1) << 7) + (sum >> 1) + filename_83[i]);
+	}
+
+	return sum;
+}
+
+size_t fat32_utf16_to_utf8(const uint16_t* src, size_t nr_units, char* dest,
+		size_t dest_size)
 {
-	int ret;
-	if ((ret = seek_cluster(header, info, fd, cluster_nr)) != OK) {
-		return ret;
+	size_t i = 0, len = 0;
+
+	while (i < nr_units && src[i] != 0) {
+		// Most names are plain ASCII, which goes over a unit at a time.
+		if (src[i] < 0x80) {
+			if (len + 1 >= dest_size) {
+				break;
+			}
+
+			dest[len++] = (char) src[i++];
+			continue;
+		}
+
+		uint32_t c = src[i++];
+		if (c >= 0xd800 && c < 0xdc00 && i < nr_units &&
+				src[i] >= 0xdc00 && src[i] < 0xe000) {
+			c = 0x10000 + ((c - 0xd800) << 10) + (src[i++] - 0xdc00);
+		} else if (c >= 0xd800 && c < 0xe000) {
+			c = '?';
+		}
+
+		size_t n = c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+		if (len + n >= dest_size) {
+			break;
+		}
+
+		switch (n) {
+			case 1:
+				dest[len++] = (char) c;
+				break;
+			case 2:
+				dest[len++] = (char) (0xc0 | (c >> 6));
+				dest[len++] = (char) (0x80 | (c & 0x3f));
+				break;
+			case 3:
+				dest[len++] = (char) (0xe0 | (c >> 12));
+				dest[len++] = (char) (0x80 | ((c >> 6) & 0x3f));
+				dest[len++] = (char) (0x80 | (c & 0x3f));
+				break;
+			default:
+				dest[len++] = (char) (0xf0 | (c >> 18));
+				dest[len++] = (char) (0x80 | ((c >> 12) & 0x3f));
+				dest[len++] = (char) (0x80 | ((c >> 6) & 0x3f));
+				dest[len++] = (char) (0x80 | (c & 0x3f));
+				break;
+		}
 	}
 
-	size_t nread = read(fd, buf, info->bytes_per_cluster);
-	if (nread != info->bytes_per_cluster) {
-		return FAT32_ERR_IO;
+	dest[len] = '\0';
+	return len;
+}
+
+int fat32_utf8_to_utf16(const char* src, uint16_t* dest, size_t dest_units) {
+	static const uint32_t min_value[] = { 0, 0x80, 0x800, 0x10000 };
+	const uint8_t *p = (const uint8_t*) src;
+	size_t len = 0;
+
+	while (*p) {
+		uint32_t c = *p++;
+		int more;
+
+		if (c < 0x80) {
+			more = 0;
+		} else if (c >= 0xc0 && c < 0xe0) {
+			c &= 0x1f;
+			more = 1;
+		} else if (c >= 0xe0 && c < 0xf0) {
+			c &= 0x0f;
+			more = 2;
+		} else if (c >= 0xf0 && c < 0xf8) {
+			c &= 0x07;
+			more = 3;
+		} else {
+			return -1;
+		}
+
+		int nr_bytes = more;
+		for (; more > 0; more--) {
+			if ((*p & 0xc0) != 0x80) {
+				return -1;
+			}
+
+			c = (c << 6) | (*p++ & 0x3f);
+		}
+
+		// Overlong encodings and surrogates aren't valid UTF-8.
+		if (c < min_value[nr_bytes] || (c >= 0xd800 && c < 0xe000) || c > 0x10ffff) {
+			return -1;
+		}
+
+		if (c >= 0x10000) {
+			if (len + 2 > dest_units) {
+				return -1;
+			}
+
+			c -= 0x10000;
+			dest[len++] = (uint16_t) (0xd800 + (c >> 10));
+			dest[len++] = (uint16_t) (0xdc00 + (c & 0x3ff));
+		} else {
+			if (len + 1 > dest_units) {
+				return -1;
+			}
+
+			dest[len++] = (uint16_t) c;
+		}
 	}
 
-	return OK;
+	return (int) len;
+}
+
+int fat32_valid_name(const char* name) {
+	size_t len = strlen(name);
+
+	if (len == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+			name[len - 1] == '.' || name[len - 1] == ' ') {
+		return FALSE;
+	}
+
+	for (const char *p = name; *p; p++) {
+		if ((unsigned char) *p < 0x20 || strchr("\"*/:<>?\\|", *p) != NULL) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+int fat32_make_short_name(const char* name, uint8_t* filename_83) {
+	const char *dot = strrchr(name, '.');
+	int is_exact = TRUE;
+	int len = 0;
+
+	memset(filename_83, ' ', 11);
+
+	// Leading dots don't start an extension, they are dropped.
+	while (*name == '.') {
+		name++;
+		is_exact = FALSE;
+	}
+
+	if (dot != NULL && dot < name) {
+		dot = NULL;
+	}
+
+	for (const char *p = name; *p; p++) {
+		unsigned char c = (unsigned char) *p;
+		int max = 8;
+
+		if (p == dot) {
+			len = 8;
+			continue;
+		}
+
+		if (dot != NULL && p > dot) {
+			max = 11;
+		}
+
+		if (c == ' ' || c == '.') {
+			is_exact = FALSE;
+			continue;
+		}
+
+		// Lower case names need a long name to keep their case.
+		if (c >= 'a' && c <= 'z') {
+			c -= 'a' - 'A';
+			is_exact = FALSE;
+		} else if (c >= 0x80 || strchr("+,;=[]", c) != NULL) {
+			c = '_';
+			is_exact = FALSE;
+
+			// The rest of a UTF-8 sequence goes with its first byte.
+			while ((p[1] & 0xc0) == 0x80) {
+				p++;
+			}
+		}
+
+		if (len >= max) {
+			is_exact = FALSE;
+			continue;
+		}
+
+		filename_83[len++] = c;
+	}
+
+	if (filename_83[0] == ' ') {
+		filename_83[0] = '_';
+		is_exact = FALSE;
+	}
+
+	return is_exact;
+}
+
+/* Gets the length of the name part of an 8.3 name, without its padding. */
+static int short_name_len(const uint8_t* filename_83) {
+	int len = 8;
+	while (len > 0 && filename_83[len - 1] == ' ') {
+		len--;
+	}
+
+	return len;
 }
 
-int get_next_cluster(fat32_header_t* header, fat32_info_t* info, int fd, int
-		cluster_nr, int* next_cluster_nr)
+static int nr_digits(int n) {
+	int digits = 1;
+	for (; n >= 10; n /= 10) {
+		digits++;
+	}
+
+	return digits;
+}
+
+void fat32_set_short_tail(uint8_t* filename_83, const uint8_t* basis, int n) {
+	int digits = nr_digits(n);
+	int len = short_name_len(basis);
+
+	if (len > 8 - 1 - digits) {
+		len = 8 - 1 - digits;
+	}
+
+	memset(filename_83, ' ', 8);
+	memcpy(filename_83, basis, len);
+	memcpy(filename_83 + 8, basis + 8, 3);
+	filename_83[len] = '~';
+	for (int i = len + digits; i > len; i--, n /= 10) {
+		filename_83[i] = (uint8_t) ('0' + n % 10);
+	}
+}
+
+int fat32_short_tail(const uint8_t* filename_83, const uint8_t* basis) {
+	int len = short_name_len(filename_83);
+	int tilde = len - 1;
+	int n = 0;
+
+	// Too short for a tail, which also covers blank names on bad volumes.
+	if (len < 2 || memcmp(filename_83 + 8, basis + 8, 3) != 0) {
+		return 0;
+	}
+
+	while (tilde > 0 && filename_83[tilde] >= '0' && filename_83[tilde] <= '9') {
+		tilde--;
+	}
+
+	if (filename_83[tilde] != '~' || tilde == len - 1 || filename_83[tilde + 1] == '0') {
+		return 0;
+	}
+
+	for (int i = tilde + 1; i < len; i++) {
+		n = n * 10 + (filename_83[i] - '0');
+	}
+
+	// Tails past the ones we make (such as ~12345) can't collide with them.
+	if (n >= FAT32_MAX_SHORT_TAIL) {
+		return 0;
+	}
+
+	// The tail must be where fat32_set_short_tail would put it.
+	int basis_len = short_name_len(basis);
+	if (basis_len > 8 - 1 - (len - tilde - 1)) {
+		basis_len = 8 - 1 - (len - tilde - 1);
+	}
+
+	if (tilde != basis_len || memcmp(filename_83, basis, basis_len) != 0) {
+		return 0;
+	}
+
+	return n;
+}
+
+int fat32_make_lfn_slots(const uint16_t* units, int nr_units, uint8_t checksum,
+		fat32_lfn_direntry_t* slots)
 {
-	// This can be cached for better speedz.
-	uint32_t next_cluster;
-	int fat_offset = cluster_nr * 4;
-	int fat_entry_offset =
-		(info->first_fat_sector * header->bpb.bytes_per_sector) +
-		fat_offset;
+	uint16_t padded[FAT32_LFN_MAX_SLOTS * FAT32_LFN_CHARS];
+	int nr_slots = (nr_units + FAT32_LFN_CHARS - 1) / FAT32_LFN_CHARS;
+
+	// The name is terminated if there is room, and the rest of its last
+	// slot is filled with 0xFFFF.
+	memcpy(padded, units, nr_units * sizeof(uint16_t));
+	for (int i = nr_units; i < nr_slots * FAT32_LFN_CHARS; i++) {
+		padded[i] = i == nr_units ? 0 : 0xffff;
+	}
 
-	FAT_LOG_PRINTF(debug, "Seeking to offset %d", fat_entry_offset);
-	off_t ret = lseek(fd, (off_t) fat_entry_offset, SEEK_SET);
-	if (ret != (off_t) fat_entry_offset) {
-		FAT_LOG_PRINTF(warn, "Seek to FAT at %d failed: %d.", fat_entry_offset, (int)ret);
-		return FAT32_ERR_IO;
+	for (int i = 0; i < nr_slots; i++) {
+		int ord = nr_slots - i;
+		fat32_lfn_direntry_t *lfn = &slots[i];
+		uint16_t *part = &padded[(ord - 1) * FAT32_LFN_CHARS];
+
+		memset(lfn, 0, sizeof(*lfn));
+		lfn->ord = (uint8_t) (i == 0 ? ord | FAT32_LFN_LAST : ord);
+		lfn->attributes = 0x0f;
+		lfn->checksum = checksum;
+		memcpy(lfn->chars_1, part, sizeof(lfn->chars_1));
+		memcpy(lfn->chars_2, part + 5, sizeof(lfn->chars_2));
+		memcpy(lfn->chars_3, part + 11, sizeof(lfn->chars_3));
 	}
 
-	size_t nread = read(fd, &next_cluster, sizeof(uint32_t));
-	if (nread != sizeof(uint32_t)) {
-		FAT_LOG_PRINTF(warn, "Reading FAT entry at %d failed: %d.", fat_entry_offset, (int)nread);
-		return FAT32_ERR_IO;
+	return nr_slots;
+}
+
+void fat32_encode_time(time_t t, uint16_t* fat_time, uint16_t* fat_date) {
+	struct tm tm;
+
+	// FAT dates start in 1980 and can't go past 2107.
+	if (localtime_r(&t, &tm) == NULL || tm.tm_year < 80) {
+		*fat_time = 0;
+		*fat_date = (1 << 5) | 1;
+		return;
 	}
 
-	next_cluster &= 0x0fffffff;
-	if (next_cluster >= 0x0ffffff8) {
-		// Signal that this is the end of the cluster chain.
-		FAT_LOG_PRINTF(debug, "No cluster follows cluster %d", cluster_nr);
-		*next_cluster_nr = -1;
-	} else {
-		FAT_LOG_PRINTF(debug, "Cluster %d follows cluster %d", next_cluster, cluster_nr);
-		*next_cluster_nr = next_cluster;
+	if (tm.tm_year > 80 + 127) {
+		tm.tm_year = 80 + 127;
 	}
 
-	return OK;
+	*fat_time = (uint16_t) ((tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2));
+	*fat_date = (uint16_t) (((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday);
+}
+
+void fat32_parser_reset(fat32_entry_parser_t* parser) {
+	parser->nr_slots = 0;
+	parser->next_ord = 0;
+	parser->checksum = 0;
+	parser->name_slots = 0;
 }
 
-void fat32_time_to_tm(fat32_time_t time, struct tm* t) {
-	t->tm_hour = time.hours;
-	t->tm_min = time.minutes;
-	t->tm_sec = time.seconds * 2;
+int fat32_parse_entry(fat32_entry_parser_t* parser, fat32_any_direntry_t* slot,
+		fat32_direntry_t* short_dst)
+{
+	if (slot->short_entry.filename_83[0] == '\0') {
+		return FAT32_PARSE_FREE;
+	}
+
+	if (slot->short_entry.attributes == 0x0f) {
+		fat32_lfn_direntry_t *lfn = &slot->long_entry;
+		int ord = lfn->ord & (FAT32_LFN_LAST - 1);
+
+		if (lfn->ord & FAT32_LFN_LAST) {
+			// The end of a name, which starts a new one. Deleted slots
+			// (0xE5) also land here, with an ord that is too big.
+			if (ord == 0 || ord > FAT32_LFN_MAX_SLOTS) {
+				parser->nr_slots = 0;
+				return FAT32_PARSE_MORE;
+			}
+
+			parser->nr_slots = ord;
+			parser->checksum = lfn->checksum;
+		} else if (parser->nr_slots == 0 || ord == 0 || ord > parser->nr_slots ||
+				ord != parser->next_ord || lfn->checksum != parser->checksum) {
+			// An orphaned slot, or one past the start of the name (which
+			// would land in front of units), so forget the name.
+			parser->nr_slots = 0;
+			return FAT32_PARSE_MORE;
+		}
+
+		// The pieces of the name are scattered around the slot.
+		uint16_t *units = &parser->units[(ord - 1) * FAT32_LFN_CHARS];
+		memcpy(units, lfn->chars_1, sizeof(lfn->chars_1));
+		memcpy(units + 5, lfn->chars_2, sizeof(lfn->chars_2));
+		memcpy(units + 11, lfn->chars_3, sizeof(lfn->chars_3));
+		parser->next_ord = ord - 1;
+
+		return FAT32_PARSE_MORE;
+	}
+
+	// A deleted entry, whose long name slots (if it had any) were deleted
+	// along with it.
+	if (slot->short_entry.filename_83[0] == 0xE5) {
+		fat32_parser_reset(parser);
+		return FAT32_PARSE_MORE;
+	}
+
+	*short_dst = slot->short_entry;
+
+	// The units stay where they are until the next slot comes, so that the
+	// name can be decoded (or compared) only if it's wanted.
+	int name_slots = 0;
+	if (parser->nr_slots != 0 && parser->next_ord == 0 && parser->units[0] != 0 &&
+			parser->checksum == fat32_lfn_checksum(short_dst->filename_83)) {
+		name_slots = parser->nr_slots;
+	}
+
+	fat32_parser_reset(parser);
+	parser->name_slots = name_slots;
+	return FAT32_PARSE_ENTRY;
 }
 
-void fat32_date_to_tm(fat32_date_t date, struct tm* t) {
-	t->tm_year = date.year + 80;
-	t->tm_mon = date.month - 1;
-	t->tm_mday = date.day;
+size_t fat32_entry_name(const fat32_entry_parser_t* parser, const fat32_direntry_t* entry,
+		char* name)
+{
+	if (parser->name_slots == 0) {
+		filename_83_to_string((char*) entry->filename_83, name);
+		return strlen(name);
+	}
+
+	return fat32_utf16_to_utf8(parser->units, parser->name_slots * FAT32_LFN_CHARS, name,
+			FAT32_MAX_NAME_LEN);
 }
 
-void convert_entry(fat32_direntry_t* entry, fat32_entry_t* dest) {
-	dest->is_directory = entry->attributes & FAT32_ATTR_DIR;
-	dest->is_readonly = entry->attributes & FAT32_ATTR_READONLY;
-	dest->is_hidden = entry->attributes & FAT32_ATTR_HIDDEN;
-	dest->is_system = entry->attributes & FAT32_ATTR_SYSTEM;
+int fat32_parse_slot(fat32_entry_parser_t* parser, fat32_any_direntry_t* slot,
+		fat32_direntry_t* short_dst, char* name)
+{
+	int result = fat32_parse_entry(parser, slot, short_dst);
 
-	dest->size_bytes = entry->size_bytes;
+	if (result == FAT32_PARSE_ENTRY) {
+		fat32_entry_name(parser, short_dst, name);
+	}
+
+	return result;
+}
 
-	memset(&dest->modification, 0, sizeof(struct tm));
-	fat32_date_to_tm(entry->last_modified_date, &dest->modification);
-	fat32_time_to_tm(entry->last_modified_time, &dest->modification);
+static int fold_ascii(int c) {
+	return c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c;
+}
 
-	memset(&dest->access, 0, sizeof(struct tm));
-	fat32_date_to_tm(entry->last_access_date, &dest->access);
+int fat32_short_name_equal(const uint8_t* a, const uint8_t* b) {
+	for (int i = 0; i < 11; i++) {
+		if (fold_ascii(a[i]) != fold_ascii(b[i])) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+int fat32_long_name_match(const fat32_entry_parser_t* parser, const uint16_t* units,
+		int nr_units, int is_prefix)
+{
+	int max_units = parser->name_slots * FAT32_LFN_CHARS;
+
+	if (nr_units > max_units) {
+		return FALSE;
+	}
+
+	for (int i = 0; i < nr_units; i++) {
+		if (fold_ascii(parser->units[i]) != fold_ascii(units[i])) {
+			return FALSE;
+		}
+	}
+
+	// The name ends at a 0 unit, or where its slots do.
+	return is_prefix || nr_units == max_units || parser->units[nr_units] == 0;
+}
+
+int fat32_glob_match(const char* pattern, const char* name) {
+	const char *star = NULL, *resume = NULL;
+
+	// A * first matches nothing, and is made to match one more character
+	// every time what follows it fails to.
+	while (*name) {
+		if (*pattern == '*') {
+			star = ++pattern;
+			resume = name;
+			continue;
+		}
+
+		if (*pattern == '?' ||
+				(*pattern && fold_ascii((unsigned char) *pattern) ==
+				 fold_ascii((unsigned char) *name))) {
+			// A ? takes a whole UTF-8 character.
+			int is_any = *pattern == '?';
+			pattern++;
+			name++;
+			while (is_any && (*name & 0xc0) == 0x80) {
+				name++;
+			}
+			continue;
+		}
+
+		if (star == NULL) {
+			return FALSE;
+		}
+
+		pattern = star;
+		name = ++resume;
+		while ((*name & 0xc0) == 0x80) {
+			name = ++resume;
+		}
+	}
+
+	while (*pattern == '*') {
+		pattern++;
+	}
 
-	memset(&dest->creation, 0, sizeof(struct tm));
-	fat32_date_to_tm(entry->creation_date, &dest->creation);
-	fat32_time_to_tm(entry->creation_time, &dest->creation);
+	return *pattern == '\0';
 }
@@ -1,10 +1,36 @@
 #pragma once
+
+/* The on-disk format of FAT32 and the code that parses it. Nothing here
+ * depends on MINIX, so that this part of the server (fat32.c) can also be
+ * built and profiled on other systems against image files; see fatbench/ at
+ * the top of the repository. */
+
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
-#ifndef _FAT32_H_FAT32_ENTRY_T_DEFINED
-typedef struct fat32_entry_t fat32_entry_t;
+#ifndef OK
+#define OK 0
 #endif
 
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#ifdef __minix
+#include <minix/com.h>
+#else
+/* Same as in <minix/com.h>. */
+#define FAT32_ERR_NOT_FAT           -6000
+#define FAT32_ERR_INVALID_FAT       -6001
+#define FAT32_ERR_NOT_IMPLEMENTED   -6002
+#define FAT32_ERR_IO                -6003
+#define FAT32_ERR_INTERNAL          -6004
+#endif
+
+#define FAT32_MAX_NAME_LEN                  256
+
 /* Attributes that FAT32 files can have. */
 typedef enum fat32_attrs_t {
 	FAT32_ATTR_READONLY = 0x01,
@@ -15,6 +41,10 @@ typedef enum fat32_attrs_t {
 	FAT32_ATTR_ARCHIVE  = 0x20
 } fat32_attrs_t;
 
+/* The smallest sector size a FAT32 filesystem can have, which is also the
+ * sector size of the devices we can read from. */
+#define FAT32_MIN_SECTOR_SIZE 512
+
 /* Familiarity with FAT32 is needed to understand the following data structures.
  * They are mostly defined by their on-disk format. */
 
@@ -62,8 +92,27 @@ typedef struct fat32_info_t {
 	int first_data_sector;
 	int first_fat_sector;
 	int bytes_per_cluster;
+	int total_clusters;
 } fat32_info_t;
 
+/* The FSInfo sector, whose sector number is in the EBR. It caches how many
+ * clusters are free and where to start looking for one, but both may be
+ * missing or out of date, so they are only hints. */
+typedef struct fat32_fsinfo_t {
+	uint32_t  lead_signature;
+	uint8_t   reserved_1[480];
+	uint32_t  struct_signature;
+	uint32_t  free_clusters;
+	uint32_t  next_free_cluster;
+	uint8_t   reserved_2[12];
+	uint32_t  trail_signature;
+} __attribute__((packed)) fat32_fsinfo_t;
+
+#define FAT32_FSINFO_LEAD_SIGNATURE    0x41615252
+#define FAT32_FSINFO_STRUCT_SIGNATURE  0x61417272
+#define FAT32_FSINFO_TRAIL_SIGNATURE   0xAA550000
+#define FAT32_FSINFO_UNKNOWN           0xFFFFFFFF
+
 typedef struct fat32_time_t {
 	uint8_t seconds : 5;
 	uint8_t minutes : 6;
@@ -107,25 +156,168 @@ typedef union fat32_any_direntry_t {
 	fat32_lfn_direntry_t long_entry;
 } fat32_any_direntry_t;
 
+/* A directory entry in the compact form the server hands out. Times and dates
+ * are kept in their raw FAT encoding and are decoded by whoever needs them.
+ * When entries are copied out only the used part of the name goes with them,
+ * so that an entry takes FAT32_DIRENT_SIZE(name_len) bytes. */
+typedef struct fat32_dirent_t {
+	uint32_t first_cluster;
+	uint32_t size_bytes;
+	uint16_t creation_time;
+	uint16_t creation_date;
+	uint16_t access_date;
+	uint16_t modification_time;
+	uint16_t modification_date;
+	uint8_t  attributes;
+	uint8_t  name_len;
+	char     filename[FAT32_MAX_NAME_LEN];
+} fat32_dirent_t;
+
+/* Size of an entry with a name of name_len bytes, including its terminator,
+ * rounded up so that the entry after it is aligned. */
+#define FAT32_DIRENT_SIZE(name_len) \
+	((offsetof(fat32_dirent_t, filename) + (name_len) + 1 + 3) & ~(size_t) 3)
+
+/* Long name slots. Each holds 13 UTF-16 code units of the name; the ord of the
+ * slot holding the end of the name, which comes first, has FAT32_LFN_LAST set.
+ * A name of at most 255 units takes up to 20 slots. */
+#define FAT32_LFN_CHARS     13
+#define FAT32_LFN_LAST      0x40
+#define FAT32_LFN_MAX_SLOTS 20
+
+/* Puts directory entries together from the 32-byte slots of a directory, which
+ * are fed to it one at a time. Long name slots come before the short entry
+ * they belong to, in reverse order, and their code units are collected in
+ * place until the short entry comes and the name can be decoded. */
+typedef struct fat32_entry_parser_t {
+	uint16_t units[FAT32_LFN_MAX_SLOTS * FAT32_LFN_CHARS];
+	int nr_slots;       // Slots of the long name being read, 0 if none
+	int next_ord;       // The ord the next slot of the long name must have
+	uint8_t checksum;   // Checksum of the short entry the long name is for
+	int name_slots;     // Slots of the long name of the last entry, if valid
+} fat32_entry_parser_t;
+
+/* Numeric tails (the ~n of 8.3 names made up for long names) go up to this,
+ * excluded. */
+#define FAT32_MAX_SHORT_TAIL 10000
+
+/* Results of fat32_parse_slot. */
+#define FAT32_PARSE_MORE    0   /* the slot was part of a long name */
+#define FAT32_PARSE_ENTRY   1   /* the slot finished an entry */
+#define FAT32_PARSE_FREE    2   /* the slot is free; no entries follow it */
+
 /* Calculates various FAT32 constants and checks if the filesystem is valid
  * FAT32. */
 int build_fat_info(fat32_header_t* header, fat32_info_t* dst_info);
 
-/* Reads the FAT header from an fd. */
-int read_fat_header(int fd, fat32_header_t* dst);
+/* Gets the byte offset of a cluster identified by a given cluster number. */
+uint64_t cluster_offset(fat32_header_t* header, fat32_info_t* info, int cluster_nr);
+
+/* Gets the successor of a cluster from its raw FAT entry. Writes -1 to
+ * *next_cluster_nr if the cluster is the last one in its chain. */
+void decode_fat_entry(uint32_t entry, int* next_cluster_nr);
+
+/* Gets the free cluster count and the next free cluster hint from an FSInfo
+ * sector, writing FAT32_FSINFO_UNKNOWN for those that it doesn't have or that
+ * can't be right for the volume. Returns FALSE if it isn't an FSInfo sector. */
+int parse_fsinfo(const fat32_fsinfo_t* fsinfo, const fat32_info_t* info,
+		uint32_t* free_clusters, uint32_t* next_free);
+
+/* Counts the free clusters among count consecutive FAT entries, the first of
+ * which is that of cluster first_cluster. If bitmap isn't NULL, the bit of
+ * every free cluster is set in it, bit n standing for cluster n + 2. */
+uint32_t count_free_clusters(const uint32_t* fat, uint32_t first_cluster,
+		uint32_t count, uint32_t* bitmap);
+
+/* Converts an 8.3 filename as stored in a short entry to a string. dest must
+ * be at least 13 bytes long. */
+void filename_83_to_string(char* filename_83, char* dest);
+
+/* Converts a short direntry and the name of its entry to the compact format.
+ * Only the first FAT32_DIRENT_SIZE(dest->name_len) bytes of dest are written,
+ * and that size is returned. */
+size_t convert_entry(fat32_direntry_t* entry, const char* name, fat32_dirent_t* dest);
+
+/* Gets the checksum of an 8.3 name that the long name slots of its entry
+ * carry. */
+uint8_t fat32_lfn_checksum(const uint8_t* filename_83);
+
+/* Converts nr_units UTF-16 code units, or those before the first 0, to UTF-8.
+ * Surrogate pairs are combined and unpaired surrogates become '?'. dest is
+ * always terminated; if it is too small, the name is cut before the first
+ * character that doesn't fit. Returns the length of the result. */
+size_t fat32_utf16_to_utf8(const uint16_t* src, size_t nr_units, char* dest,
+		size_t dest_size);
+
+/* Converts a UTF-8 name to UTF-16. Returns the number of code units, or -1 if
+ * the name isn't valid UTF-8 or takes more than dest_units units. */
+int fat32_utf8_to_utf16(const char* src, uint16_t* dest, size_t dest_units);
+
+/* Tells whether a name can be given to a new entry: it must not be empty, "."
+ * or "..", contain characters that FAT doesn't allow in long names, or end in
+ * a dot or a space. */
+int fat32_valid_name(const char* name);
+
+/* Makes the 8.3 name of a new entry with the given name. Returns TRUE if it is
+ * the name itself, which then needs no long name slots. Otherwise it is only a
+ * basis, to which a numeric tail that no other entry of the directory has is
+ * added with fat32_set_short_tail(). */
+int fat32_make_short_name(const char* name, uint8_t* filename_83);
+
+/* Makes an 8.3 name from a basis and the numeric tail ~n, shortening the
+ * basis as needed. */
+void fat32_set_short_tail(uint8_t* filename_83, const uint8_t* basis, int n);
+
+/* Returns n if an 8.3 name is the basis with the numeric tail ~n, and 0 if it
+ * is not. */
+int fat32_short_tail(const uint8_t* filename_83, const uint8_t* basis);
+
+/* Fills the long name slots of a name of nr_units UTF-16 code units, in the
+ * order they are stored in: the end of the name first. Returns the number of
+ * slots, at most FAT32_LFN_MAX_SLOTS. */
+int fat32_make_lfn_slots(const uint16_t* units, int nr_units, uint8_t checksum,
+		fat32_lfn_direntry_t* slots);
+
+/* Encodes a time as the FAT date and time fields of a short entry, which go
+ * by local time at two second resolution. */
+void fat32_encode_time(time_t t, uint16_t* fat_time, uint16_t* fat_date);
+
+/* Prepares a parser for the first slot of an entry. */
+void fat32_parser_reset(fat32_entry_parser_t* parser);
+
+/* Feeds the next slot of a directory to the parser. When this finishes an
+ * entry (FAT32_PARSE_ENTRY), its short entry is copied to *short_dst and its
+ * long name, in UTF-8, to name, which must be at least FAT32_MAX_NAME_LEN bytes
+ * long, and the parser is ready for the next entry. The 8.3 name is used
+ * instead if the entry has no long name, or if its slots are out of order or
+ * carry the checksum of another short entry, as they do when a program that
+ * doesn't know about long names has changed the directory. */
+int fat32_parse_slot(fat32_entry_parser_t* parser, fat32_any_direntry_t* slot,
+		fat32_direntry_t* short_dst, char* name);
+
+/* Like fat32_parse_slot, but leaves the name of the entry in the parser, where
+ * fat32_entry_name and the matching functions below can get at it until the
+ * next slot is fed to it. Scans that only want some of the entries use it to
+ * skip decoding the names of the others. */
+int fat32_parse_entry(fat32_entry_parser_t* parser, fat32_any_direntry_t* slot,
+		fat32_direntry_t* short_dst);
 
-/* Seeks to a cluster identified by a given cluster numbe. */
-int seek_cluster(fat32_header_t* header, fat32_info_t* info, int fd, int cluster_nr);
+/* Writes the name of the entry that fat32_parse_entry last returned to name,
+ * as fat32_parse_slot would have, and returns its length. */
+size_t fat32_entry_name(const fat32_entry_parser_t* parser, const fat32_direntry_t* entry,
+		char* name);
 
-/* Seeks to a given cluster and reads its contents into memory. The buffer given
- * must be at least info->bytes_per_sector bytes long. */
-int seek_read_cluster(fat32_header_t* header, fat32_info_t* info, int fd, int cluster_nr, char* buf);
+/* Tells whether two 8.3 names are the same, ignoring the case of ASCII
+ * letters. */
+int fat32_short_name_equal(const uint8_t* a, const uint8_t* b);
 
-/* Looks up the given cluster in the FAT and gets its successor in the cluster
- * chain. Writes -1 to *next_cluster_nr if this is the last cluster in the chain.
- * */
-int get_next_cluster(fat32_header_t* header, fat32_info_t* info, int fd, int cluster_nr, int* next_cluster_nr);
+/* Tells whether the long name of the entry that fat32_parse_entry last
+ * returned is the given one (or starts with it, if is_prefix is set),
+ * comparing UTF-16 code units and ignoring the case of ASCII letters. The
+ * entry must have a long name (parser->name_slots != 0). */
+int fat32_long_name_match(const fat32_entry_parser_t* parser, const uint16_t* units,
+		int nr_units, int is_prefix);
 
-/* Converts a raw FAT32 entry type to a user-friendlier type. The caller must set
- * the filename. */
-void convert_entry(fat32_direntry_t* entry, fat32_entry_t* dest);
+/* Tells whether a name matches a pattern in which * stands for any number of
+ * characters and ? for a single one, ignoring the case of ASCII letters. */
+int fat32_glob_match(const char* pattern, const char* name);
@@ -0,0 +1,401 @@
+#include "inc.h"
+#include "fat32.h"
+#include "mini-printf.h"
+
+/* The FAT cache keeps whole sectors of the first FAT in memory, so that
+ * walking a cluster chain doesn't cost a device round trip per hop. Sectors
+ * are loaded on demand and evicted in LRU order once the budget is used up.
+ *
+ * The allocator changes FAT entries in the cache, which leaves their sectors
+ * dirty. Requests that allocate or free a lot of clusters change the same
+ * few sectors over and over, so they are only written when the changes of the
+ * filesystem are written back (see writeback.c), or when the cache runs out of
+ * clean pages, sorted, and with a single write per run of adjacent sectors and
+ * copy of the FAT. */
+
+static int fat_hash(fat32_fat_cache_t* cache, int sector) {
+	return sector & cache->hash_mask;
+}
+
+static void lru_unlink(fat32_fat_cache_t* cache, fat32_fat_page_t* page) {
+	if (page->lru_prev) {
+		page->lru_prev->lru_next = page->lru_next;
+	} else {
+		cache->lru_head = page->lru_next;
+	}
+
+	if (page->lru_next) {
+		page->lru_next->lru_prev = page->lru_prev;
+	} else {
+		cache->lru_tail = page->lru_prev;
+	}
+
+	page->lru_prev = page->lru_next = NULL;
+}
+
+static void lru_push_front(fat32_fat_cache_t* cache, fat32_fat_page_t* page) {
+	page->lru_prev = NULL;
+	page->lru_next = cache->lru_head;
+	if (cache->lru_head) {
+		cache->lru_head->lru_prev = page;
+	} else {
+		cache->lru_tail = page;
+	}
+
+	cache->lru_head = page;
+}
+
+static void lru_push_back(fat32_fat_cache_t* cache, fat32_fat_page_t* page) {
+	page->lru_next = NULL;
+	page->lru_prev = cache->lru_tail;
+	if (cache->lru_tail) {
+		cache->lru_tail->lru_next = page;
+	} else {
+		cache->lru_head = page;
+	}
+
+	cache->lru_tail = page;
+}
+
+static void hash_remove(fat32_fat_cache_t* cache, fat32_fat_page_t* page) {
+	fat32_fat_page_t **pp = &cache->hash[fat_hash(cache, page->sector)];
+	while (*pp && *pp != page) {
+		pp = &(*pp)->hash_next;
+	}
+
+	if (*pp) {
+		*pp = page->hash_next;
+	}
+
+	page->hash_next = NULL;
+}
+
+int fat_cache_init(fat32_fs_t* fs, size_t budget_bytes) {
+	fat32_fat_cache_t *cache = &fs->fat_cache;
+	int sector_size = fs->header.bpb.bytes_per_sector;
+
+	memset(cache, 0, sizeof(*cache));
+	if (mthread_mutex_init(&cache->lock, NULL) != 0) {
+		return ENOMEM;
+	}
+
+	// There's no point in holding more pages than the FAT has sectors, but we
+	// need at least one to be able to do anything at all.
+	long nr_pages = budget_bytes / sector_size;
+	if (nr_pages > fs->info.fat_size_sectors) {
+		nr_pages = fs->info.fat_size_sectors;
+	}
+
+	if (nr_pages < 1) {
+		nr_pages = 1;
+	}
+
+	int nr_buckets = 1;
+	while (nr_buckets < nr_pages) {
+		nr_buckets <<= 1;
+	}
+
+	cache->pages = (fat32_fat_page_t*) calloc(nr_pages, sizeof(fat32_fat_page_t));
+	cache->hash = (fat32_fat_page_t**) calloc(nr_buckets, sizeof(fat32_fat_page_t*));
+	cache->data = (uint8_t*) malloc((size_t) nr_pages * sector_size);
+	if (!cache->pages || !cache->hash || !cache->data) {
+		fat_cache_free(fs);
+		return ENOMEM;
+	}
+
+	cache->nr_pages = (int) nr_pages;
+	cache->hash_mask = nr_buckets - 1;
+	for (int i = 0; i < cache->nr_pages; i++) {
+		cache->pages[i].sector = -1;
+		cache->pages[i].data = cache->data + (size_t) i * sector_size;
+	}
+
+	FAT_LOG_PRINTF(debug, "FAT cache for fs %d holds %d sectors", fs->nr, cache->nr_pages);
+	return OK;
+}
+
+void fat_cache_free(fat32_fs_t* fs) {
+	fat32_fat_cache_t *cache = &fs->fat_cache;
+
+	free(cache->pages);
+	free(cache->hash);
+	free(cache->data);
+	mthread_mutex_destroy(&cache->lock);
+
+	cache->pages = NULL;
+	cache->hash = NULL;
+	cache->data = NULL;
+	cache->lru_head = cache->lru_tail = NULL;
+	cache->nr_pages = cache->nr_used = cache->nr_dirty = 0;
+}
+
+static fat32_fat_page_t* hash_find(fat32_fat_cache_t* cache, int sector) {
+	fat32_fat_page_t *page;
+
+	for (page = cache->hash[fat_hash(cache, sector)]; page; page = page->hash_next) {
+		if (page->sector == sector) {
+			return page;
+		}
+	}
+
+	return NULL;
+}
+
+/* Looks for a cached page and marks it as the most recently used one. */
+static fat32_fat_page_t* fat_cache_find_page(fat32_fat_cache_t* cache, int sector) {
+	fat32_fat_page_t *page = hash_find(cache, sector);
+
+	if (page != NULL && page != cache->lru_head) {
+		lru_unlink(cache, page);
+		lru_push_front(cache, page);
+	}
+
+	return page;
+}
+
+/* Finds the least recently used page that isn't dirty. */
+static fat32_fat_page_t* find_clean_page(fat32_fat_cache_t* cache) {
+	fat32_fat_page_t *page;
+
+	for (page = cache->lru_tail; page != NULL && page->is_dirty; page = page->lru_prev)
+		;
+
+	return page;
+}
+
+/* Finds the page holding the given FAT sector, reading it in (and evicting the
+ * least recently used page if needed) on a miss. */
+static int fat_cache_get_page(fat32_fs_t* fs, int sector, fat32_fat_page_t** dst) {
+	fat32_fat_cache_t *cache = &fs->fat_cache;
+	fat32_fat_page_t *page;
+	int ret;
+
+	if ((page = fat_cache_find_page(cache, sector)) != NULL) {
+		cache->hits++;
+		fat32_stats.fat_cache_hits++;
+		*dst = page;
+		return OK;
+	}
+
+	// Another worker may have read the sector in while we were waiting
+	// for the lock.
+	mthread_mutex_lock(&cache->lock);
+	if ((page = fat_cache_find_page(cache, sector)) != NULL) {
+		mthread_mutex_unlock(&cache->lock);
+		cache->hits++;
+		fat32_stats.fat_cache_hits++;
+		*dst = page;
+		return OK;
+	}
+
+	cache->misses++;
+	fat32_stats.fat_cache_misses++;
+	if (cache->nr_used < cache->nr_pages) {
+		page = &cache->pages[cache->nr_used++];
+	} else {
+		// Dirty pages have to reach the device before they can be reused,
+		// and the file data they point to before them. They may be dirtied
+		// again while the write-back waits for the device.
+		while ((page = find_clean_page(cache)) == NULL) {
+			if (writeback_is_locked(fs)) {
+				ret = writeback_sync(fs);
+			} else {
+				// Only the holder of the write lock can write back, as
+				// it may be halfway through a change. Writers take that
+				// lock before this one, so let go of this one first.
+				mthread_mutex_unlock(&cache->lock);
+				ret = do_sync(fs, NONE);
+				mthread_mutex_lock(&cache->lock);
+			}
+
+			if (ret != OK) {
+				mthread_mutex_unlock(&cache->lock);
+				return ret;
+			}
+
+			if ((page = fat_cache_find_page(cache, sector)) != NULL) {
+				mthread_mutex_unlock(&cache->lock);
+				*dst = page;
+				return OK;
+			}
+		}
+
+		hash_remove(cache, page);
+		lru_unlink(cache, page);
+		page->sector = -1;
+	}
+
+	if ((ret = read_fat_sector(&fs->header, &fs->info, &fs->dev, sector,
+					(char*) page->data)) != OK) {
+		// Keep the page around as a free one at the cold end of the list, so
+		// it's the first to be reused.
+		lru_push_back(cache, page);
+		mthread_mutex_unlock(&cache->lock);
+		return ret;
+	}
+
+	page->sector = sector;
+	page->hash_next = cache->hash[fat_hash(cache, sector)];
+	cache->hash[fat_hash(cache, sector)] = page;
+	lru_push_front(cache, page);
+	mthread_mutex_unlock(&cache->lock);
+
+	*dst = page;
+	return OK;
+}
+
+int fat_cache_lookup(fat32_fs_t* fs, int cluster_nr, uint32_t* entry) {
+	int sector_size = fs->header.bpb.bytes_per_sector;
+	fat32_fat_page_t *page;
+	int ret;
+
+	fat32_stats.fat_lookups++;
+	if (cluster_nr < 0) {
+		return FAT32_ERR_INVALID_FAT;
+	}
+
+	int sector = (int) (((uint32_t) cluster_nr * 4) / sector_size);
+	int offset = (int) (((uint32_t) cluster_nr * 4) % sector_size);
+	if (sector >= fs->info.fat_size_sectors) {
+		FAT_LOG_PRINTF(warn, "Cluster %d lies outside of the FAT", cluster_nr);
+		return FAT32_ERR_INVALID_FAT;
+	}
+
+	if ((ret = fat_cache_get_page(fs, sector, &page)) != OK) {
+		return ret;
+	}
+
+	memcpy(entry, page->data + offset, sizeof(uint32_t));
+	return OK;
+}
+
+int fat_cache_set(fat32_fs_t* fs, int cluster_nr, uint32_t value) {
+	fat32_fat_cache_t *cache = &fs->fat_cache;
+	int sector_size = fs->header.bpb.bytes_per_sector;
+	fat32_fat_page_t *page;
+	uint32_t entry;
+	int ret;
+
+	if (cluster_nr < 2 || cluster_nr >= fs->info.total_clusters + 2) {
+		return FAT32_ERR_INVALID_FAT;
+	}
+
+	int sector = (int) (((uint32_t) cluster_nr * 4) / sector_size);
+	int offset = (int) (((uint32_t) cluster_nr * 4) % sector_size);
+	if ((ret = fat_cache_get_page(fs, sector, &page)) != OK) {
+		return ret;
+	}
+
+	memcpy(&entry, page->data + offset, sizeof(uint32_t));
+	entry = (entry & 0xf0000000) | (value & 0x0fffffff);
+	memcpy(page->data + offset, &entry, sizeof(uint32_t));
+
+	if (!page->is_dirty) {
+		page->is_dirty = TRUE;
+		cache->nr_dirty++;
+	}
+
+	return OK;
+}
+
+static int compare_sectors(const void* a, const void* b) {
+	return *(const int*) a - *(const int*) b;
+}
+
+int fat_cache_flush(fat32_fs_t* fs) {
+	fat32_fat_cache_t *cache = &fs->fat_cache;
+	int sector_size = fs->header.bpb.bytes_per_sector;
+	int nr_dirty = 0, ret = OK;
+	int *sectors;
+	char *buf;
+
+	if (cache->nr_dirty == 0) {
+		return OK;
+	}
+
+	sectors = (int*) malloc(cache->nr_dirty * sizeof(int));
+	buf = (char*) malloc((size_t) cache->nr_dirty * sector_size);
+	if (!sectors || !buf) {
+		free(sectors);
+		free(buf);
+		return ENOMEM;
+	}
+
+	for (int i = 0; i < cache->nr_used; i++) {
+		if (cache->pages[i].is_dirty) {
+			sectors[nr_dirty++] = cache->pages[i].sector;
+		}
+	}
+
+	qsort(sectors, nr_dirty, sizeof(int), compare_sectors);
+
+	// Take a copy of the sectors and mark them clean before writing, as they
+	// may change again (or be evicted) while we wait for the device.
+	for (int i = 0; i < nr_dirty; i++) {
+		fat32_fat_page_t *page = hash_find(cache, sectors[i]);
+
+		memcpy(buf + (size_t) i * sector_size, page->data, sector_size);
+		page->is_dirty = FALSE;
+	}
+
+	cache->nr_dirty = 0;
+
+	int i = 0;
+	while (i < nr_dirty && ret == OK) {
+		int count = 1;
+		while (i + count < nr_dirty && sectors[i + count] == sectors[i] + count) {
+			count++;
+		}
+
+		for (int table = 0; table < fs->header.bpb.tables && ret == OK; table++) {
+			uint64_t pos = ((uint64_t) fs->info.first_fat_sector +
+					(uint64_t) table * fs->info.fat_size_sectors + sectors[i]) * sector_size;
+
+			ret = dev_write(&fs->dev, pos, buf + (size_t) i * sector_size,
+					(size_t) count * sector_size);
+			if (ret == OK) {
+				fat32_stats.fat_sectors_written += count;
+			}
+		}
+
+		if (ret == OK) {
+			i += count;
+		}
+	}
+
+	if (ret != OK) {
+		FAT_LOG_PRINTF(warn, "Writing FAT sector %d of fs %d failed: %d", sectors[i],
+				fs->nr, ret);
+
+		// Whatever wasn't written is dirty again, if it is still there.
+		for (; i < nr_dirty; i++) {
+			fat32_fat_page_t *page = hash_find(cache, sectors[i]);
+			if (page != NULL && !page->is_dirty) {
+				page->is_dirty = TRUE;
+				cache->nr_dirty++;
+			}
+		}
+	}
+
+	free(sectors);
+	free(buf);
+	return ret;
+}
+
+int get_next_cluster(fat32_fs_t* fs, int cluster_nr, int* next_cluster_nr)
+{
+	int ret;
+	uint32_t entry;
+	if ((ret = fat_cache_lookup(fs, cluster_nr, &entry)) != OK) {
+		return ret;
+	}
+
+	decode_fat_entry(entry, next_cluster_nr);
+	if (*next_cluster_nr == -1) {
+		FAT_LOG_PRINTF(debug, "No cluster follows cluster %d", cluster_nr);
+	} else {
+		FAT_LOG_PRINTF(debug, "Cluster %d follows cluster %d", *next_cluster_nr, cluster_nr);
+	}
+
+	return OK;
+}
@@ -0,0 +1,341 @@
+#include "inc.h"
+#include "mini-printf.h"
+#include <minix/minlib.h>
+
+/* Free space accounting for FAT32_STATVFS. The FSInfo sector usually has the
+ * number of free clusters, but it is only a hint: it may be missing, or out of
+ * date after the volume was used by a system that doesn't keep it. When it
+ * can't be used, the count is found by reading the whole FAT. That scan runs
+ * on the worker that got the request, after replying, so the client gets the
+ * progress of the scan and asks again later. It also builds a bitmap with a
+ * bit per cluster, from which the allocator gets its runs of free clusters
+ * the first time something is written. From then on, the allocator keeps the
+ * counts and the FSInfo hints up to date. */
+
+// Held by closing filesystems waiting for their scan, and broadcast whenever
+// a scan ends.
+static mthread_mutex_t scan_mutex;
+static mthread_cond_t scan_done;
+
+void init_freespace(void) {
+	if (mthread_mutex_init(&scan_mutex, NULL) != 0) {
+		panic("fat32: failed to initialize mutex");
+	}
+
+	if (mthread_cond_init(&scan_done, NULL) != 0) {
+		panic("fat32: failed to initialize condition variable");
+	}
+}
+
+void freespace_open(fat32_fs_t* fs) {
+	fat32_freespace_t *fsp = &fs->freespace;
+	int sector_size = fs->header.bpb.bytes_per_sector;
+	int sector = fs->header.ebr.fsinfo_cluster_nr;
+	char *buf;
+
+	memset(fsp, 0, sizeof(*fsp));
+	fsp->fsinfo_free = FAT32_FSINFO_UNKNOWN;
+	fsp->fsinfo_next = FAT32_FSINFO_UNKNOWN;
+	fsp->scan_state = FAT32_SCAN_NONE;
+
+	// 0 and 0xFFFF both mean that there is no FSInfo sector.
+	if (sector == 0 || sector == 0xFFFF || sector >= fs->info.first_fat_sector ||
+			sector_size < (int) sizeof(fat32_fsinfo_t)) {
+		return;
+	}
+
+	if ((buf = (char*) malloc(sector_size)) == NULL) {
+		return;
+	}
+
+	if (dev_read(&fs->dev, (uint64_t) sector * sector_size, buf, sector_size) == OK &&
+			parse_fsinfo((fat32_fsinfo_t*) buf, &fs->info, &fsp->fsinfo_free,
+				&fsp->fsinfo_next)) {
+		fsp->has_fsinfo = TRUE;
+		FAT_LOG_PRINTF(debug, "FSInfo of fs %d: %d free clusters, next free %d",
+				fs->nr, (int) fsp->fsinfo_free, (int) fsp->fsinfo_next);
+	}
+
+	free(buf);
+}
+
+void freespace_close(fat32_fs_t* fs) {
+	fat32_freespace_t *fsp = &fs->freespace;
+
+	mthread_mutex_lock(&scan_mutex);
+	while (fsp->scan_state == FAT32_SCAN_RUNNING) {
+		fsp->scan_cancel = TRUE;
+		mthread_cond_wait(&scan_done, &scan_mutex);
+	}
+	mthread_mutex_unlock(&scan_mutex);
+
+	free(fsp->bitmap);
+	fsp->bitmap = NULL;
+	free(fsp->runs);
+	fsp->runs = NULL;
+}
+
+/* Marks a scan as running before it is started, so that nobody else starts
+ * one in the meantime. */
+static void claim_scan(fat32_freespace_t* fsp) {
+	fsp->scan_state = FAT32_SCAN_RUNNING;
+	fsp->scan_cancel = FALSE;
+	fsp->scan_clusters = 0;
+	fsp->scan_free = 0;
+	fsp->scan_dev_reads = 0;
+	fsp->scan_bytes = 0;
+	fsp->scan_us = 0;
+}
+
+int do_statvfs(fat32_fs_t* fs, vir_bytes dst, size_t len, int flags,
+		endpoint_t who, int* start_scan)
+{
+	fat32_freespace_t *fsp = &fs->freespace;
+	fat32_statvfs_t st;
+	int ret;
+
+	*start_scan = FALSE;
+	if (len != sizeof(fat32_statvfs_t)) {
+		return EINVAL;
+	}
+
+	if (fsp->scan_state != FAT32_SCAN_RUNNING &&
+			(((flags & FAT32_STATVFS_SCAN) && fsp->scan_state != FAT32_SCAN_DONE) ||
+			 (fsp->fsinfo_free == FAT32_FSINFO_UNKNOWN &&
+			  fsp->scan_state == FAT32_SCAN_NONE))) {
+		claim_scan(fsp);
+		*start_scan = TRUE;
+	}
+
+	memset(&st, 0, sizeof(st));
+	st.bytes_per_cluster = fs->info.bytes_per_cluster;
+	st.total_clusters = fs->info.total_clusters;
+	st.next_free = fsp->fsinfo_next;
+	if (fsp->scan_state == FAT32_SCAN_DONE) {
+		st.source = FAT32_FREE_SCAN;
+		st.free_clusters = fsp->scan_free;
+	} else if (fsp->fsinfo_free != FAT32_FSINFO_UNKNOWN) {
+		st.source = FAT32_FREE_FSINFO;
+		st.free_clusters = fsp->fsinfo_free;
+	} else {
+		st.source = FAT32_FREE_UNKNOWN;
+	}
+
+	st.scan_state = fsp->scan_state;
+	st.scan_clusters = fsp->scan_clusters;
+	st.scan_dev_reads = fsp->scan_dev_reads;
+	st.scan_bytes = fsp->scan_bytes;
+	st.scan_us = fsp->scan_us;
+
+	if ((ret = sys_vircopy(FAT32_PROC_NR, (vir_bytes) &st, who, dst,
+					sizeof(st), 0)) != OK) {
+		// Nobody will be told about the scan, so don't run it.
+		if (*start_scan) {
+			fsp->scan_state = FAT32_SCAN_NONE;
+			*start_scan = FALSE;
+		}
+		return ret;
+	}
+
+	return OK;
+}
+
+void freespace_scan(fat32_fs_t* fs) {
+	fat32_freespace_t *fsp = &fs->freespace;
+	int sector_size = fs->header.bpb.bytes_per_sector;
+	uint32_t nr_entries = (uint32_t) fs->info.total_clusters + 2;
+	uint64_t fat_start = (uint64_t) fs->info.first_fat_sector * sector_size;
+	uint64_t fat_len = (uint64_t) fs->info.fat_size_sectors * sector_size;
+	uint32_t *chunk;
+	u64_t start, now;
+	int ret = OK;
+
+	read_tsc_64(&start);
+
+	// The bitmap is a bonus; the count can be had without it.
+	free(fsp->bitmap);
+	fsp->bitmap = (uint32_t*) calloc((fs->info.total_clusters + 31) / 32, sizeof(uint32_t));
+
+	if ((uint64_t) nr_entries * 4 > fat_len ||
+			(chunk = (uint32_t*) malloc(FAT32_SCAN_CHUNK_SIZE)) == NULL) {
+		ret = ENOMEM;
+		goto done;
+	}
+
+	// Entries 0 and 1 don't stand for clusters.
+	uint32_t entry = 0;
+	while (entry < nr_entries && !fsp->scan_cancel) {
+		uint64_t pos = (uint64_t) entry * 4;
+		size_t len = FAT32_SCAN_CHUNK_SIZE;
+		if (pos + len > fat_len) {
+			len = (size_t) (fat_len - pos);
+		}
+
+		if ((ret = dev_read(&fs->dev, fat_start + pos, (char*) chunk, len)) != OK) {
+			break;
+		}
+
+		uint32_t count = (uint32_t) (len / 4);
+		if (count > nr_entries - entry) {
+			count = nr_entries - entry;
+		}
+
+		uint32_t skip = entry < 2 ? 2 - entry : 0;
+		fsp->scan_free += count_free_clusters(chunk + skip, entry + skip, count - skip,
+				fsp->bitmap);
+
+		entry += count;
+		fsp->scan_clusters = entry - 2;
+		fsp->scan_dev_reads++;
+		fsp->scan_bytes += len;
+
+		read_tsc_64(&now);
+		fsp->scan_us = tsc_64_to_micros(now - start);
+	}
+
+	free(chunk);
+
+done:
+	read_tsc_64(&now);
+	fsp->scan_us = tsc_64_to_micros(now - start);
+
+	mthread_mutex_lock(&scan_mutex);
+	if (ret == OK && !fsp->scan_cancel) {
+		fsp->scan_state = FAT32_SCAN_DONE;
+		FAT_LOG_PRINTF(info, "Scanned the FAT of fs %d: %u of %u clusters free "
+				"(FSInfo said %d), %u KB in %u ms", fs->nr, fsp->scan_free,
+				(unsigned int) fs->info.total_clusters, (int) fsp->fsinfo_free,
+				(unsigned int) (fsp->scan_bytes / 1024),
+				(unsigned int) (fsp->scan_us / 1000));
+	} else {
+		fsp->scan_state = FAT32_SCAN_FAILED;
+		free(fsp->bitmap);
+		fsp->bitmap = NULL;
+	}
+	mthread_cond_broadcast(&scan_done);
+	mthread_mutex_unlock(&scan_mutex);
+}
+
+/* Adds a run to the end of the free runs. */
+static int append_run(fat32_freespace_t* fsp, uint32_t start, uint32_t length) {
+	if (fsp->nr_runs == fsp->max_runs) {
+		int max = fsp->max_runs * 2;
+		fat32_free_run_t *runs = (fat32_free_run_t*) realloc(fsp->runs,
+				max * sizeof(fat32_free_run_t));
+		if (runs == NULL) {
+			return ENOMEM;
+		}
+
+		fsp->runs = runs;
+		fsp->max_runs = max;
+	}
+
+	fsp->runs[fsp->nr_runs].start = start;
+	fsp->runs[fsp->nr_runs].length = length;
+	fsp->nr_runs++;
+	return OK;
+}
+
+int freespace_runs(fat32_fs_t* fs) {
+	fat32_freespace_t *fsp = &fs->freespace;
+	uint32_t nr_bits = (uint32_t) fs->info.total_clusters;
+	uint32_t bit = 0;
+
+	if (fsp->runs != NULL) {
+		return OK;
+	}
+
+	// Wait for a scan that is running, or run one ourselves.
+	mthread_mutex_lock(&scan_mutex);
+	while (fsp->scan_state == FAT32_SCAN_RUNNING) {
+		mthread_cond_wait(&scan_done, &scan_mutex);
+	}
+	mthread_mutex_unlock(&scan_mutex);
+
+	if (fsp->scan_state != FAT32_SCAN_DONE || fsp->bitmap == NULL) {
+		claim_scan(fsp);
+		freespace_scan(fs);
+		if (fsp->scan_state != FAT32_SCAN_DONE) {
+			return FAT32_ERR_IO;
+		}
+
+		if (fsp->bitmap == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	fsp->nr_runs = 0;
+	fsp->max_runs = 16;
+	if ((fsp->runs = (fat32_free_run_t*) malloc(fsp->max_runs *
+					sizeof(fat32_free_run_t))) == NULL) {
+		return ENOMEM;
+	}
+
+	while (bit < nr_bits) {
+		uint32_t word = fsp->bitmap[bit / 32];
+
+		// Skip over whole words of used clusters at a time.
+		if ((bit % 32) == 0 && word == 0) {
+			bit += 32;
+			continue;
+		}
+
+		if (!(word & ((uint32_t) 1 << (bit % 32)))) {
+			bit++;
+			continue;
+		}
+
+		uint32_t start = bit;
+		while (bit < nr_bits && (fsp->bitmap[bit / 32] & ((uint32_t) 1 << (bit % 32)))) {
+			bit++;
+		}
+
+		if (append_run(fsp, start + 2, bit - start) != OK) {
+			free(fsp->runs);
+			fsp->runs = NULL;
+			return ENOMEM;
+		}
+	}
+
+	// The runs say all that the bitmap did.
+	free(fsp->bitmap);
+	fsp->bitmap = NULL;
+
+	FAT_LOG_PRINTF(debug, "Free space of fs %d: %u clusters in %d runs", fs->nr,
+			fsp->scan_free, fsp->nr_runs);
+	return OK;
+}
+
+int freespace_flush(fat32_fs_t* fs) {
+	fat32_freespace_t *fsp = &fs->freespace;
+	int sector_size = fs->header.bpb.bytes_per_sector;
+	int sector = fs->header.ebr.fsinfo_cluster_nr;
+	fat32_fsinfo_t *fsinfo;
+	char *buf;
+	int ret;
+
+	if (!fsp->has_fsinfo || !fsp->fsinfo_dirty) {
+		return OK;
+	}
+
+	if ((buf = (char*) calloc(1, sector_size)) == NULL) {
+		return ENOMEM;
+	}
+
+	// Everything else in the sector is reserved, and zero.
+	fsinfo = (fat32_fsinfo_t*) buf;
+	fsinfo->lead_signature = FAT32_FSINFO_LEAD_SIGNATURE;
+	fsinfo->struct_signature = FAT32_FSINFO_STRUCT_SIGNATURE;
+	fsinfo->free_clusters = fsp->fsinfo_free;
+	fsinfo->next_free_cluster = fsp->fsinfo_next;
+	fsinfo->trail_signature = FAT32_FSINFO_TRAIL_SIGNATURE;
+
+	fsp->fsinfo_dirty = FALSE;
+	if ((ret = dev_write(&fs->dev, (uint64_t) sector * sector_size, buf,
+					sector_size)) != OK) {
+		fsp->fsinfo_dirty = TRUE;
+	}
+
+	free(buf);
+	return ret;
+}
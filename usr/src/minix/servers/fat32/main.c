@@ -1,19 +1,26 @@
 #include "inc.h"
 #include <minix/endpoint.h>
+#include <minix/bdev.h>
 #include "mini-printf.h"
 
 fat32_fs_t fs_handles[FAT32_MAX_HANDLES];
+int fs_handle_free[FAT32_MAX_HANDLES];
 int fs_handle_count;
 int fs_handle_next;
 
 fat32_dir_t dir_handles[FAT32_MAX_HANDLES];
+int dir_handle_free[FAT32_MAX_HANDLES];
 int dir_handle_count;
 int dir_handle_next;
 
 fat32_file_t file_handles[FAT32_MAX_HANDLES];
+int file_handle_free[FAT32_MAX_HANDLES];
 int file_handle_count;
 int file_handle_next;
 
+size_t fat_cache_budget;
+size_t cluster_cache_budget;
+
 /* SEF functions and variables. */
 void sef_local_startup(void);
 
@@ -23,236 +30,609 @@ int main(int argc, char **argv)
 	sef_local_startup();
 
 	while (TRUE) {
-		fat32_entry_t entry;
-		fat32_fs_t *fs;
-		fat32_dir_t *dir;
-		fat32_file_t *file;
 		fat32_request_t req;
-		int was_written;
-		void* dst_addr;
-		char* local_buf;
-		int local_len;
 		message m;
 		int result;
 
-		if (wait_request(&m, &req) != OK) {
-			result = EINVAL;
-		} else switch (req.type) {
-			case FAT32_OPEN_FS:
-				result = do_open_fs(m.m_fat32_open_fs.device, m.m_source);
-				if (result >= 0) {
-					m.m_fat32_io_handle.handle = result;
-					result = OK;
-				}
+		// Let the workers run until they are all idle or waiting for the
+		// device.
+		mthread_yield_all();
+
+		if ((result = wait_request(&m, &req)) == EDONTREPLY) {
+			continue;
+		}
+
+		if (result != OK) {
+			m.m_type = EINVAL;
+			reply(req.source, &m);
+			continue;
+		}
+
+		worker_start(&m);
+	}
+
+	return OK;
+}
+
+/* Copies a path of len bytes from the address space of who into path, which
+ * is PATH_MAX bytes long, and terminates it. */
+static int copy_path(endpoint_t who, void* src, size_t len, char* path) {
+	int ret;
+
+	if (len >= PATH_MAX) {
+		return ENAMETOOLONG;
+	}
+
+	if ((ret = sys_vircopy(who, (vir_bytes) src, FAT32_PROC_NR, (vir_bytes) path,
+					len, 0)) != OK) {
+		return ret;
+	}
+
+	path[len] = '\0';
+	return OK;
+}
+
+void handle_request(message* msg)
+{
+	fat32_dirent_t dirent;
+	fat32_dir_filter_t filter;
+	char path[PATH_MAX];
+	fat32_fs_t *fs;
+	fat32_dir_t *dir;
+	fat32_file_t *file;
+	int was_written;
+	void* dst_addr;
+	size_t local_len;
+	size_t nread;
+	int count;
+	int start_scan = FALSE;
+	message m = *msg;
+	uint64_t start = stats_request_start();
+	fat32_worker_t *worker = worker_self();
+	int result;
+
+	trace_start(worker, msg);
+	switch (m.m_type) {
+		case FAT32_OPEN_FS:
+			result = do_open_fs(m.m_fat32_open_fs.device, m.m_source);
+			if (result >= 0) {
+				m.m_fat32_io_handle.handle = result;
+				result = OK;
+			}
+			break;
+
+		case FAT32_OPEN_ROOTDIR:
+			fs = find_fs_handle(m.m_fat32_io_handle.handle);
+			if (!fs) {
+				result = EINVAL;
 				break;
+			}
 
-			case FAT32_OPEN_ROOTDIR:
-				fs = find_fs_handle(m.m_fat32_io_handle.handle);
-				if (!fs) {
-					result = EINVAL;
-					break;
-				}
+			if (fs->opened_by != m.m_source) {
+				result = EPERM;
+				break;
+			}
+
+			result = do_open_root_directory(fs, m.m_source);
+			if (result >= 0) {
+				m.m_fat32_io_handle.handle = result;
+				result = OK;
+			}
+			break;
+
+		case FAT32_OPEN_DIR:
+			dir = find_dir_handle(m.m_fat32_io_handle.handle);
+			if (!dir) {
+				result = EINVAL;
+				break;
+			}
 
-				if (fs->opened_by != m.m_source) {
-					result = EPERM;
-					break;
-				}
+			if (dir->fs->opened_by != m.m_source) {
+				result = EPERM;
+				break;
+			}
+
+			result = do_open_directory(dir, m.m_source);
+			if (result >= 0) {
+				m.m_fat32_io_handle.handle = result;
+				result = OK;
+			}
+			break;
+
+		case FAT32_OPEN_FILE:
+			dir = find_dir_handle(m.m_fat32_io_handle.handle);
+			if (!dir) {
+				result = EINVAL;
+				break;
+			}
 
-				result = do_open_root_directory(fs, m.m_source);
-				if (result >= 0) {
-					m.m_fat32_io_handle.handle = result;
-					result = OK;
-				}
+			if (dir->fs->opened_by != m.m_source) {
+				result = EPERM;
 				break;
+			}
+
+			result = do_open_file(dir, m.m_source);
+			if (result >= 0) {
+				m.m_fat32_io_handle.handle = result;
+				result = OK;
+			}
+			break;
+
+		case FAT32_READ_DIR_ENTRY:
+			dir = find_dir_handle(m.m_fat32_read_direntry.handle);
+			m.m_fat32_ret.ret = 0;
+			if (!dir) {
+				result = EINVAL;
+				break;
+			}
 
-			case FAT32_OPEN_DIR:
-				dir = find_dir_handle(m.m_fat32_io_handle.handle);
-				if (!dir) {
-					result = EINVAL;
-					break;
-				}
+			if (dir->fs->opened_by != m.m_source) {
+				result = EPERM;
+				break;
+			}
 
-				if (dir->fs->opened_by != m.m_source) {
-					result = EPERM;
-					break;
-				}
+			if ((result = do_read_dir_entry(dir, &dirent, &was_written, m.m_source)) != OK) {
+				break;
+			}
 
-				result = do_open_directory(dir, m.m_source);
-				if (result >= 0) {
-					m.m_fat32_io_handle.handle = result;
-					result = OK;
-				}
+			if (!was_written) {
+				result = OK;
 				break;
+			}
 
-			case FAT32_OPEN_FILE:
-				dir = find_dir_handle(m.m_fat32_io_handle.handle);
-				if (!dir) {
-					result = EINVAL;
-					break;
-				}
+			dst_addr = m.m_fat32_read_direntry.dest;
+			local_len = FAT32_DIRENT_SIZE(dirent.name_len);
+			if ((result = sys_vircopy(FAT32_PROC_NR, (vir_bytes)&dirent,
+							m.m_source, (vir_bytes)dst_addr, local_len, 0)) != OK) {
+				break;
+			}
 
-				if (dir->fs->opened_by != m.m_source) {
-					result = EPERM;
-					break;
-				}
+			trace_set_bytes(local_len);
+
+			// Return the buffer size for this directory entry to be
+			// read.
+			m.m_fat32_ret.ret = dir->fs->info.bytes_per_cluster;
+			break;
+
+		case FAT32_OPEN_PATH:
+			fs = find_fs_handle(m.m_fat32_open_path.handle);
+			if (!fs) {
+				result = EINVAL;
+				break;
+			}
+
+			if (fs->opened_by != m.m_source) {
+				result = EPERM;
+				break;
+			}
+
+			if ((result = copy_path(m.m_source, m.m_fat32_open_path.path,
+							m.m_fat32_open_path.path_len, path)) != OK) {
+				break;
+			}
 
-				result = do_open_file(dir, m.m_source);
-				if (result >= 0) {
-					m.m_fat32_io_handle.handle = result;
-					result = OK;
+			dst_addr = m.m_fat32_open_path.dest;
+			result = do_open_path(fs, path, m.m_fat32_open_path.flags, &dirent, m.m_source);
+			if (result < 0) {
+				break;
+			}
+
+			m.m_fat32_io_handle.handle = result;
+			result = OK;
+			if (dst_addr != NULL) {
+				result = sys_vircopy(FAT32_PROC_NR, (vir_bytes) &dirent, m.m_source,
+						(vir_bytes) dst_addr, FAT32_DIRENT_SIZE(dirent.name_len), 0);
+			}
+
+			// The client won't learn the number of the handle, so nobody
+			// could close it.
+			if (result != OK) {
+				if (msg->m_fat32_open_path.flags == FAT32_OPEN_PATH_DIR &&
+						(dir = find_dir_handle(m.m_fat32_io_handle.handle)) != NULL) {
+					do_close_directory(dir, m.m_source);
+				} else if (msg->m_fat32_open_path.flags != FAT32_OPEN_PATH_STAT &&
+						(file = find_file_handle(m.m_fat32_io_handle.handle)) != NULL) {
+					do_close_file(file, m.m_source);
 				}
+			}
+			break;
+
+		case FAT32_OPEN_ENTRY:
+			dir = find_dir_handle(m.m_fat32_open_entry.handle);
+			if (!dir) {
+				result = EINVAL;
+				break;
+			}
+
+			if (dir->fs->opened_by != m.m_source) {
+				result = EPERM;
 				break;
+			}
+
+			result = do_open_entry(dir, m.m_fat32_open_entry.first_cluster,
+					m.m_fat32_open_entry.size_bytes,
+					m.m_fat32_open_entry.attributes, m.m_source);
+			if (result >= 0) {
+				m.m_fat32_io_handle.handle = result;
+				result = OK;
+			}
+			break;
+
+		case FAT32_READ_DIR_BATCH:
+			dir = find_dir_handle(m.m_fat32_read_block.handle);
+			if (!dir) {
+				m.m_fat32_ret.ret = 0;
+				result = EINVAL;
+				break;
+			}
 
-			case FAT32_READ_DIR_ENTRY:
-				dir = find_dir_handle(m.m_fat32_read_direntry.handle);
+			if (dir->fs->opened_by != m.m_source) {
 				m.m_fat32_ret.ret = 0;
-				if (!dir) {
-					result = EINVAL;
-					break;
-				}
+				result = EPERM;
+				break;
+			}
 
-				if (dir->fs->opened_by != m.m_source) {
-					result = EPERM;
-					break;
-				}
+			result = do_read_dir_batch(dir, (vir_bytes) m.m_fat32_read_block.buf_ptr,
+					m.m_fat32_read_block.buf_size, &count, m.m_source);
+			m.m_fat32_ret.ret = (result == OK) ? count : 0;
+			break;
 
-				if ((result = do_read_dir_entry(dir, &entry, &was_written, m.m_source)) != OK) {
-					break;
-				}
+		case FAT32_READ_DIR_FILTER:
+			m.m_fat32_ret.ret = 0;
+			dir = find_dir_handle(m.m_fat32_read_filter.handle);
+			if (!dir) {
+				result = EINVAL;
+				break;
+			}
 
-				if (!was_written) {
-					result = OK;
-					break;
-				}
+			if (dir->fs->opened_by != m.m_source) {
+				result = EPERM;
+				break;
+			}
+
+			if ((result = copy_path(m.m_source, m.m_fat32_read_filter.pattern,
+							m.m_fat32_read_filter.pattern_len, path)) != OK ||
+					(result = filter_init(&filter, path, m.m_fat32_read_filter.match,
+						m.m_fat32_read_filter.attr_set,
+						m.m_fat32_read_filter.attr_clear)) != OK) {
+				break;
+			}
+
+			result = do_read_dir_filter(dir, &filter, (vir_bytes) m.m_fat32_read_filter.buf_ptr,
+					m.m_fat32_read_filter.buf_size, &count, m.m_source);
+			m.m_fat32_ret.ret = (result == OK) ? count : 0;
+			break;
+
+		case FAT32_READ_FILE_BLOCK:
+		case FAT32_READ_FILE_RANGE:
+			file = find_file_handle(m.m_fat32_read_block.handle);
+			m.m_fat32_ret.ret = 0;
+			if (!file) {
+				result = EINVAL;
+				break;
+			}
+
+			if (file->fs->opened_by != m.m_source) {
+				result = EPERM;
+				break;
+			}
 
-				dst_addr = m.m_fat32_read_direntry.dest;
-				if ((result = sys_vircopy(FAT32_PROC_NR, (vir_bytes)&entry,
-								m.m_source, (vir_bytes)dst_addr, sizeof(fat32_entry_t), 0)) != OK) {
-					break;
+			dst_addr = m.m_fat32_read_block.buf_ptr;
+			local_len = m.m_fat32_read_block.buf_size;
+
+			if (m.m_type == FAT32_READ_FILE_BLOCK) {
+				result = do_read_file_block(file, (vir_bytes) dst_addr, local_len,
+						&nread, m.m_source);
+			} else {
+				if (local_len > FAT32_MAX_READ_RANGE) {
+					local_len = FAT32_MAX_READ_RANGE;
 				}
 
-				// Return the buffer size for this directory entry to be
-				// read.
-				m.m_fat32_ret.ret = dir->fs->info.bytes_per_cluster;
+				result = do_read_file_range(file, (vir_bytes) dst_addr, local_len,
+						&nread, m.m_source);
+			}
+
+			if (result == OK) {
+				m.m_fat32_ret.ret = nread;
+				trace_set_bytes(nread);
+			}
+			break;
+
+		case FAT32_SEEK_FILE:
+		case FAT32_PREAD_FILE:
+			file = find_file_handle(m.m_fat32_pread.handle);
+			if (!file) {
+				result = EINVAL;
+				break;
+			}
+
+			if (file->fs->opened_by != m.m_source) {
+				result = EPERM;
 				break;
+			}
 
-			case FAT32_READ_FILE_BLOCK:
-				file = find_file_handle(m.m_fat32_read_block.handle);
+			if (m.m_type == FAT32_SEEK_FILE) {
+				result = do_seek_file(file, m.m_fat32_pread.offset, m.m_source);
 				m.m_fat32_ret.ret = 0;
-				if (!file) {
-					result = EINVAL;
-					break;
-				}
+				break;
+			}
+
+			dst_addr = m.m_fat32_pread.buf_ptr;
+			local_len = m.m_fat32_pread.buf_size;
+			if (local_len > FAT32_MAX_READ_RANGE) {
+				local_len = FAT32_MAX_READ_RANGE;
+			}
+
+			result = do_pread_file(file, m.m_fat32_pread.offset, (vir_bytes) dst_addr,
+					local_len, &nread, m.m_source);
+			m.m_fat32_ret.ret = (result == OK) ? nread : 0;
+			trace_set_bytes(m.m_fat32_ret.ret);
+			break;
+
+		case FAT32_CLOSE_FILE:
+			file = find_file_handle(m.m_fat32_io_handle.handle);
+			if (!file) {
+				result = EINVAL;
+				break;
+			}
 
-				if (file->fs->opened_by != m.m_source) {
-					result = EPERM;
-					break;
-				}
+			if (file->fs->opened_by != m.m_source) {
+				result = EPERM;
+				break;
+			}
 
-				dst_addr = m.m_fat32_read_block.buf_ptr;
-				local_len = m.m_fat32_read_block.buf_size;
+			result = do_close_file(file, m.m_source);
+			break;
 
-				if (local_len < file->fs->info.bytes_per_cluster) {
-					result = EINVAL;
-					break;
-				}
+		case FAT32_CLOSE_DIR:
+			dir = find_dir_handle(m.m_fat32_io_handle.handle);
+			if (!dir) {
+				result = EINVAL;
+				break;
+			}
 
-				// Allocating a new buffer every time is criminally wasteful of
-				// resources. This should be fixed one day.
-				if ((local_buf = malloc(file->fs->info.bytes_per_cluster)) == NULL) {
-					result = ENOMEM;
-					break;
-				}
+			if (dir->fs->opened_by != m.m_source) {
+				result = EPERM;
+				break;
+			}
 
-				if ((result = do_read_file_block(file, local_buf, &local_len, m.m_source)) != OK) {
-					free(local_buf);
-					break;
-				}
+			result = do_close_directory(dir, m.m_source);
+			break;
 
-				if ((result = sys_vircopy(FAT32_PROC_NR, (vir_bytes)local_buf, m.m_source,
-								(vir_bytes) dst_addr, file->fs->info.bytes_per_cluster, 0)) != OK) {
-					free(local_buf);
-					break;
-				}
+		case FAT32_CLOSE_FS:
+			fs = find_fs_handle(m.m_fat32_io_handle.handle);
+			if (!fs) {
+				result = EINVAL;
+				break;
+			}
 
-				m.m_fat32_ret.ret = local_len;
+			if (fs->opened_by != m.m_source) {
+				result = EPERM;
+				break;
+			}
 
-				free(local_buf);
+			result = do_close_fs(fs, m.m_source);
+			break;
+
+		case FAT32_CREATE_FILE:
+			fs = find_fs_handle(m.m_fat32_create.handle);
+			if (!fs) {
+				result = EINVAL;
 				break;
+			}
 
-			case FAT32_CLOSE_FILE:
-				file = find_file_handle(m.m_fat32_io_handle.handle);
-				if (!file) {
-					result = EINVAL;
-					break;
-				}
+			if (fs->opened_by != m.m_source) {
+				result = EPERM;
+				break;
+			}
 
-				if (file->fs->opened_by != m.m_source) {
-					result = EPERM;
-					break;
-				}
+			if ((result = copy_path(m.m_source, m.m_fat32_create.path,
+							m.m_fat32_create.path_len, path)) != OK) {
+				break;
+			}
+
+			result = do_create_file(fs, path, m.m_fat32_create.size_hint, m.m_source);
+			if (result >= 0) {
+				m.m_fat32_io_handle.handle = result;
+				result = OK;
+			}
+			break;
+
+		case FAT32_WRITE_FILE:
+			file = find_file_handle(m.m_fat32_write.handle);
+			m.m_fat32_ret.ret = 0;
+			if (!file) {
+				result = EINVAL;
+				break;
+			}
 
-				result = do_close_file(file, m.m_source);
+			if (file->fs->opened_by != m.m_source) {
+				result = EPERM;
 				break;
+			}
+
+			local_len = m.m_fat32_write.buf_size;
+			if (local_len > FAT32_MAX_WRITE_RANGE) {
+				local_len = FAT32_MAX_WRITE_RANGE;
+			}
+
+			result = do_write_file(file, (vir_bytes) m.m_fat32_write.buf_ptr, local_len,
+					m.m_fat32_write.flags, &nread, m.m_source);
+			if (result == OK) {
+				m.m_fat32_ret.ret = nread;
+				trace_set_bytes(nread);
+			}
+			break;
+
+		case FAT32_TRUNCATE_FILE:
+			file = find_file_handle(m.m_fat32_pread.handle);
+			if (!file) {
+				result = EINVAL;
+				break;
+			}
 
-			case FAT32_CLOSE_DIR:
-				dir = find_dir_handle(m.m_fat32_io_handle.handle);
-				if (!dir) {
-					result = EINVAL;
-					break;
-				}
+			if (file->fs->opened_by != m.m_source) {
+				result = EPERM;
+				break;
+			}
 
-				if (dir->fs->opened_by != m.m_source) {
-					result = EPERM;
-					break;
-				}
+			result = do_truncate_file(file, m.m_fat32_pread.offset, m.m_source);
+			break;
 
-				result = do_close_directory(dir, m.m_source);
+		case FAT32_UNLINK:
+			fs = find_fs_handle(m.m_fat32_open_path.handle);
+			if (!fs) {
+				result = EINVAL;
 				break;
+			}
 
-			case FAT32_CLOSE_FS:
-				fs = find_fs_handle(m.m_fat32_io_handle.handle);
-				if (!fs) {
-					result = EINVAL;
-					break;
-				}
+			if (fs->opened_by != m.m_source) {
+				result = EPERM;
+				break;
+			}
 
-				if (fs->opened_by != m.m_source) {
-					result = EPERM;
-					break;
-				}
+			if ((result = copy_path(m.m_source, m.m_fat32_open_path.path,
+							m.m_fat32_open_path.path_len, path)) != OK) {
+				break;
+			}
+
+			result = do_unlink(fs, path, m.m_source);
+			break;
+
+		case FAT32_SYNC:
+			fs = find_fs_handle(m.m_fat32_io_handle.handle);
+			if (!fs) {
+				result = EINVAL;
+				break;
+			}
+
+			// The write-back timer sends this on behalf of whoever opened
+			// the filesystem.
+			if (m.m_source == SELF) {
+				writeback_timed_sync(fs);
+				result = EDONTREPLY;
+				break;
+			}
 
-				result = do_close_fs(fs, m.m_source);
+			if (fs->opened_by != m.m_source) {
+				result = EPERM;
 				break;
+			}
 
-			default:
+			result = do_sync(fs, m.m_source);
+			break;
+
+		case FAT32_GET_STATS:
+			result = do_get_stats((vir_bytes) m.m_fat32_get_stats.dest,
+					m.m_fat32_get_stats.size, m.m_fat32_get_stats.flags, m.m_source);
+			break;
+
+		case FAT32_STATVFS:
+			fs = find_fs_handle(m.m_fat32_statvfs.handle);
+			if (!fs) {
 				result = EINVAL;
 				break;
-		}
+			}
 
-		if (result != EDONTREPLY) {
-			m.m_type = result;
-			reply(req.source, &m);
-		}
+			if (fs->opened_by != m.m_source) {
+				result = EPERM;
+				break;
+			}
+
+			result = do_statvfs(fs, (vir_bytes) m.m_fat32_statvfs.dest,
+					m.m_fat32_statvfs.size, m.m_fat32_statvfs.flags, m.m_source,
+					&start_scan);
+			break;
+
+		case FAT32_TRACE_CTL:
+			result = do_trace_ctl(m.m_fat32_trace_ctl.ctl, m.m_fat32_trace_ctl.size, &count);
+			m.m_fat32_ret.ret = count;
+			break;
+
+		case FAT32_TRACE_GET:
+			result = do_trace_get((vir_bytes) m.m_fat32_trace_get.dest,
+					m.m_fat32_trace_get.size, m.m_source, &count);
+			m.m_fat32_ret.ret = count;
+			break;
+
+		default:
+			result = EINVAL;
+			break;
 	}
 
-	return OK;
+	stats_request_done(msg->m_type, start, result);
+	trace_finish(worker, result);
+	if (result != EDONTREPLY) {
+		m.m_type = result;
+		reply(msg->m_source, &m);
+	}
+
+	// A scan of the FAT is started by a request, but only run once the
+	// client has its answer.
+	if (start_scan) {
+		freespace_scan(fs);
+	}
 }
 
 void sef_local_startup()
 {
+	long v;
+
+	v = FAT32_FAT_CACHE_DEFAULT_KB;
+	(void) env_parse("fat_cache_kb", "d", 0, &v, 1, LONG_MAX / 1024);
+	fat_cache_budget = (size_t) v * 1024;
+
+	v = FAT32_CLUSTER_CACHE_DEFAULT_KB;
+	(void) env_parse("cluster_cache_kb", "d", 0, &v, 1, LONG_MAX / 1024);
+	cluster_cache_budget = (size_t) v * 1024;
+
+	v = FAT32_DIRINDEX_DEFAULT_KB;
+	(void) env_parse("dirindex_kb", "d", 0, &v, 0, LONG_MAX / 1024);
+	dirindex_budget = (size_t) v * 1024;
+
+	v = FAT32_WRITEBACK_DEFAULT_KB;
+	(void) env_parse("writeback_kb", "d", 0, &v, 0, LONG_MAX / 1024);
+	writeback_budget = (size_t) v * 1024;
+
+	v = FAT32_WRITEBACK_DEFAULT_SEC;
+	(void) env_parse("writeback_sec", "d", 0, &v, 0, INT_MAX / 1000);
+	writeback_delay = (int) v;
+
+	v = 0;
+	(void) env_parse("image_mmap", "d", 0, &v, 0, 1);
+	image_mmap = (int) v;
+
+	init_dentry();
+	init_dirindex();
+	init_freespace();
+	stats_init();
+
 	sef_startup();
+	worker_init();
 }
 
 int wait_request(message *msg, fat32_request_t *req)
 {
-	int status = sef_receive(ANY, msg);
+	int ipc_status;
+	int status = sef_receive_status(ANY, msg, &ipc_status);
 	if (OK != status) {
 		FAT_LOG_PRINTF(warn, "Failed to receive message from pid %d: %d", msg->m_source, status);
 		return status;
 	}
 
 	req->source = msg->m_source;
+	if (is_ipc_notify(ipc_status) && msg->m_source == CLOCK) {
+		// A write-back timer went off.
+		expire_timers(msg->m_notify.timestamp);
+		return EDONTREPLY;
+	}
+
+	if (IS_BDEV_RS(msg->m_type)) {
+		// A block driver answering one of the workers.
+		bdev_reply_asyn(msg);
+		return EDONTREPLY;
+	}
+
 	if (msg->m_type < FAT32_BASE || msg->m_type >= FAT32_END) {
 		FAT_LOG_PRINTF(warn, "Invalid message type %d from pid %d", msg->m_type, msg->m_source);
 		return -1;
@@ -4,12 +4,83 @@
 #include <minix/log.h>
 #include <minix/ipc.h>
 #include <minix/com.h>
+#include <minix/mthread.h>
 #include <stdlib.h>
 
 #include <time.h>
+#include <minix/bdev.h>
+#include <minix/timers.h>
+#include <minix/fat32trace.h>
 
-#define FAT32_MAX_NAME_LEN                  256
-#define FAT32_MAX_HANDLES                   4096
+#include "fat32.h"
+
+/* Handles are a slot index in the low FAT32_HANDLE_SLOT_BITS bits and the
+ * generation of that slot above them. The generation is bumped every time the
+ * slot is reused, so that handles to closed objects are rejected instead of
+ * referring to whatever took their place. Generations start at 1, which makes
+ * 0 an invalid handle. */
+#define FAT32_HANDLE_SLOT_BITS              12
+#define FAT32_MAX_HANDLES                   (1 << FAT32_HANDLE_SLOT_BITS)
+#define FAT32_HANDLE_SLOT(h)                ((h) & (FAT32_MAX_HANDLES - 1))
+#define FAT32_HANDLE_GENERATION(h)          ((h) >> FAT32_HANDLE_SLOT_BITS)
+#define FAT32_HANDLE_MAX_GENERATION         ((1 << (31 - FAT32_HANDLE_SLOT_BITS)) - 1)
+
+/* Default memory budget for the per-filesystem FAT cache, overridable with the
+ * fat_cache_kb boot parameter. */
+#define FAT32_FAT_CACHE_DEFAULT_KB          256
+
+/* Default memory budget for the per-filesystem cluster cache, overridable with
+ * the cluster_cache_kb boot parameter. */
+#define FAT32_CLUSTER_CACHE_DEFAULT_KB      1024
+
+/* The most a single FAT32_READ_FILE_RANGE request will return, so that one
+ * client can't keep the server busy for too long. */
+#define FAT32_MAX_READ_RANGE                (16 * 1024 * 1024)
+
+/* The most a single FAT32_WRITE_FILE request will write. */
+#define FAT32_MAX_WRITE_RANGE               (16 * 1024 * 1024)
+
+/* Writes of at least this many bytes of whole, contiguous clusters go to the
+ * device right away. Smaller ones are left in the cluster cache to be written
+ * back later, together with their neighbours. */
+#define FAT32_WRITE_DIRECT_BYTES            (64 * 1024)
+
+/* Default amount of changes a filesystem may hold in memory before they are
+ * written back, overridable with the writeback_kb boot parameter, and default
+ * time after the first change that they are written back at the latest, in
+ * seconds (writeback_sec). */
+#define FAT32_WRITEBACK_DEFAULT_KB          1024
+#define FAT32_WRITEBACK_DEFAULT_SEC         5
+
+/* Size of the buffer that contiguous clusters are read into before being
+ * copied to the client. */
+#define FAT32_READ_BUFFER_SIZE              (256 * 1024)
+
+/* Bounds of the read-ahead window of a file handle. The window starts at the
+ * minimum on the first sequential read and doubles on every following one, up
+ * to the maximum (or a quarter of the cluster cache, if that is less). */
+#define FAT32_READAHEAD_MIN_CLUSTERS        2
+#define FAT32_READAHEAD_MAX_BYTES           (512 * 1024)
+
+/* How many bytes of entries FAT32_READ_DIR_BATCH collects before copying them
+ * out. */
+#define FAT32_DIRENT_BATCH_SIZE             (16 * 1024)
+
+/* Number of worker threads handling requests, and the stack size of each. */
+#define FAT32_NR_WORKERS                    8
+#define FAT32_WORKER_STACK_SIZE             (64 * 1024)
+
+/* Size of the name lookup cache shared by all filesystems. */
+#define FAT32_DENTRY_CACHE_SIZE             1024
+#define FAT32_DENTRY_HASH_SLOTS             1031
+
+/* Default memory budget for the directory name indexes, shared by all
+ * filesystems and overridable with the dirindex_kb boot parameter. */
+#define FAT32_DIRINDEX_DEFAULT_KB           (16 * 1024)
+#define FAT32_DIRINDEX_HASH_SLOTS           127
+
+/* How much of the FAT a free space scan reads at a time. */
+#define FAT32_SCAN_CHUNK_SIZE               (64 * 1024)
 
 #define FAT_LOG_PRINTF(level, fmt, ...) \
 	do { \
@@ -31,43 +102,219 @@ static struct log fat32_syslog = {
 
 /* Data structures. */
 
-typedef struct fat32_entry_t {
-	char filename[FAT32_MAX_NAME_LEN];
-	int is_directory;
-	int is_readonly;
-	int is_hidden;
-	int is_system;
-
-	// Only tm_mon, tm_mday, tm_year, tm_sec, tm_hour and tm_sec
-	// are set.
-	struct tm creation;
-
-	// Only tm_mon, tm_mday and tm_year set.
-	struct tm access;
-
-	// Only tm_mon, tm_mday, tm_year, tm_sec, tm_hour and tm_sec
-	// are set.
-	struct tm modification;
-
-	int size_bytes;
-} fat32_entry_t;
-
-// Sorry.
-#define _FAT32_H_FAT32_ENTRY_T_DEFINED
-#include "fat32.h"
+/* The counters returned by FAT32_GET_STATS. They cover all filesystems and
+ * start at zero when the server starts or the counters are reset, except for
+ * the numbers of open handles. Tables indexed by request type are indexed by
+ * type - FAT32_BASE. */
+typedef struct fat32_stats_t {
+	uint64_t requests[FAT32_NR_REQUEST_TYPES];
+	uint64_t errors[FAT32_NR_REQUEST_TYPES];     // Requests that failed
+	uint64_t service_us[FAT32_NR_REQUEST_TYPES]; // Time from start to reply
+	uint64_t dev_reads;
+	uint64_t dev_read_bytes;
+	uint64_t fat_lookups;
+	uint64_t fat_cache_hits;
+	uint64_t fat_cache_misses;
+	uint64_t cluster_cache_hits;
+	uint64_t cluster_cache_misses;
+	uint64_t cluster_cache_evictions;
+	uint64_t clusters_prefetched;
+	uint64_t dentry_hits;
+	uint64_t dentry_misses;
+	uint64_t dirindex_lookups;   // Lookups answered by a directory index
+	uint64_t dirindex_builds;
+	uint64_t dirindex_evictions;
+	uint64_t dev_writes;
+	uint64_t dev_write_bytes;
+	uint64_t fat_sectors_written; // Counting every copy of the FAT
+	uint64_t clusters_allocated;
+	uint64_t clusters_freed;
+	uint64_t syncs;               // Write-backs of all changes of a filesystem
+	uint64_t clusters_written_back;
+	uint64_t dev_mapped_bytes;    // Taken from mapped images instead of read
+	uint32_t open_fs;
+	uint32_t open_dirs;
+	uint32_t open_files;
+	uint32_t uptime_s;  // Seconds since the counters were last reset
+} fat32_stats_t;
+
+/* What FAT32_STATVFS returns. The free cluster count comes from where source
+ * says (one of FAT32_FREE_*), and the scan fields tell how far the scan of the
+ * FAT has got (one of FAT32_SCAN_*) and what it has cost so far. */
+typedef struct fat32_statvfs_t {
+	uint32_t bytes_per_cluster;
+	uint32_t total_clusters;
+	uint32_t free_clusters;
+	uint32_t next_free;        // FSInfo hint, FAT32_FSINFO_UNKNOWN if none
+	uint32_t source;
+	uint32_t scan_state;
+	uint32_t scan_clusters;    // FAT entries looked at so far
+	uint32_t scan_dev_reads;
+	uint64_t scan_bytes;       // Bytes of the FAT read so far
+	uint64_t scan_us;          // Time spent so far, including waiting for I/O
+} fat32_statvfs_t;
+
+/* A run of free clusters. */
+typedef struct fat32_free_run_t {
+	uint32_t start;
+	uint32_t length;
+} fat32_free_run_t;
+
+/* The free space of a filesystem, as far as it is known. The FSInfo hints are
+ * read when the filesystem is opened; the rest is filled in by a scan of the
+ * FAT, which runs on a worker after the request that started it has been
+ * answered. Once clusters are allocated, the free runs take over from the
+ * bitmap, and the counts and hints are kept up to date by the allocator. */
+typedef struct fat32_freespace_t {
+	int has_fsinfo;            // There is an FSInfo sector to update
+	int fsinfo_dirty;          // The hints changed since it was written
+	uint32_t fsinfo_free;      // FAT32_FSINFO_UNKNOWN if there is no hint
+	uint32_t fsinfo_next;
+	int scan_state;
+	int scan_cancel;           // Set to make a running scan stop early
+	uint32_t scan_clusters;
+	uint32_t scan_free;
+	uint32_t scan_dev_reads;
+	uint64_t scan_bytes;
+	uint64_t scan_us;
+	uint32_t *bitmap;          // Bit n set if cluster n + 2 is free
+
+	// The free clusters as runs sorted by their start, for the allocator.
+	// Adjacent runs are always merged.
+	fat32_free_run_t *runs;
+	int nr_runs;
+	int max_runs;
+} fat32_freespace_t;
+
+/* The device a filesystem lives on. Block devices are read directly from their
+ * driver through libbdev, anything else (such as an image file) through VFS.
+ * Image files that are only read are mapped into memory instead. */
+typedef struct fat32_dev_t {
+	int fd;
+	int is_bdev;
+	int is_writable;
+	dev_t dev;
+	dev_t file_dev;  // The device and inode of what was opened, to tell
+	ino_t file_ino;  // when it is opened twice; 0 if they aren't known
+	char *map;       // The whole image, if it is mapped, else NULL
+	size_t map_size;
+} fat32_dev_t;
 
 typedef struct fat32_request_t {
 	endpoint_t source;
 	int type;
 } fat32_request_t;
 
+/* One sector of the FAT, held in memory by the FAT cache. */
+typedef struct fat32_fat_page_t {
+	int sector; // Relative to the first FAT sector, -1 if unused
+	int is_dirty;
+	uint8_t *data;
+	struct fat32_fat_page_t *hash_next;
+	struct fat32_fat_page_t *lru_prev;
+	struct fat32_fat_page_t *lru_next;
+} fat32_fat_page_t;
+
+/* A cache of FAT sectors, loaded on demand and evicted in LRU order. The most
+ * recently used page sits at lru_head. Pages changed by the allocator stay
+ * dirty until they are flushed, and are not evicted before. */
+typedef struct fat32_fat_cache_t {
+	int nr_pages;
+	int nr_used;
+	int nr_dirty;
+	int hash_mask;
+	fat32_fat_page_t *pages;
+	fat32_fat_page_t **hash;
+	fat32_fat_page_t *lru_head;
+	fat32_fat_page_t *lru_tail;
+	uint8_t *data;
+
+	// Held while a sector is being read in, so that a single worker at a
+	// time fills the cache. Hits don't need it.
+	mthread_mutex_t lock;
+
+	unsigned int hits;
+	unsigned int misses;
+} fat32_fat_cache_t;
+
+/* What a changed cluster holds, which decides when it is written back: file
+ * data (and anything else that must be there before the FAT points to it)
+ * before the FAT, directory entries after it. */
+#define FAT32_DIRTY_DATA                    1
+#define FAT32_DIRTY_DIR                     2
+
+/* A cluster held in memory by the cluster cache. Clusters pinned by a handle
+ * or by a read in progress (refcount > 0) are not on the LRU list and can't be
+ * evicted, and neither can dirty ones. */
+typedef struct fat32_cluster_t {
+	int cluster_nr; // -1 if unused
+	int refcount;
+	int is_loading; // Being read in, the data isn't there yet
+	int is_private; // Not part of the cache, freed when released
+	int is_mapped;  // A private cluster whose data is in the mapped image
+	int dirty;      // FAT32_DIRTY_* if changed since it was read, else 0
+	char *data;
+	struct fat32_cluster_t *hash_next;
+	struct fat32_cluster_t *lru_prev;
+	struct fat32_cluster_t *lru_next;
+} fat32_cluster_t;
+
+/* A cache of clusters shared by all handles of a filesystem. The most recently
+ * released cluster sits at lru_head. */
+typedef struct fat32_cluster_cache_t {
+	int nr_slots;
+	int nr_used;
+	int nr_resident;
+	int hash_mask;
+	fat32_cluster_t *slots;
+	fat32_cluster_t **hash;
+	fat32_cluster_t *lru_head;
+	fat32_cluster_t *lru_tail;
+	char *data;
+
+	// Broadcast whenever a cluster is done loading, for the workers that
+	// are waiting for one.
+	mthread_mutex_t wait_mutex;
+	mthread_cond_t loaded;
+	int nr_in_flight; // Read-ahead requests the driver hasn't answered yet
+	int nr_dirty;
+
+	unsigned int hits;
+	unsigned int misses;
+	unsigned int evictions;
+	unsigned int prefetched;
+} fat32_cluster_cache_t;
+
 typedef struct fat32_fs_t {
 	int nr;
 	int is_open;
-	int fd;
+	fat32_dev_t dev;
 	endpoint_t opened_by;
 	fat32_header_t header;
 	fat32_info_t   info;
+	fat32_fat_cache_t fat_cache;
+	fat32_cluster_cache_t cluster_cache;
+
+	fat32_freespace_t freespace;
+
+	// Held by requests that change the volume, which are done one at a
+	// time, through writeback_lock. writer is the worker holding it.
+	mthread_mutex_t write_lock;
+	struct fat32_worker_t *writer;
+
+	// Bumped whenever the volume changes, which makes the directory indexes
+	// built before stale.
+	uint32_t generation;
+
+	// Goes off some time after the first change that hasn't been written
+	// back yet.
+	minix_timer_t writeback_timer;
+	int is_timer_set;
+
+	// Syncs the timer started that haven't finished yet. Closing waits for
+	// them on sync_done.
+	int nr_syncs;
+	mthread_cond_t sync_done;
 } fat32_fs_t;
 
 typedef struct fat32_dir_t {
@@ -78,33 +325,554 @@ typedef struct fat32_dir_t {
 	int last_entry_start_cluster;
 	int last_entry_was_dir;
 	int last_entry_size_bytes;
-	char *cluster_buffer;
+	fat32_cluster_t *cluster; // Pinned in the cluster cache
+	char *cluster_buffer;     // cluster->data
 } fat32_dir_t;
 
+/* What a filtered directory scan (FAT32_READ_DIR_FILTER) wants. The pattern
+ * is also kept in the forms that stored names are compared in before they are
+ * decoded. */
+typedef struct fat32_dir_filter_t {
+	int match;                   // FAT32_MATCH_*
+	char pattern[FAT32_MAX_NAME_LEN];
+	uint16_t units[FAT32_LFN_MAX_SLOTS * FAT32_LFN_CHARS]; // For long names
+	int nr_units;
+	uint8_t filename_83[11];     // For entries without one, if is_83 is set
+	int is_83;
+	uint8_t attr_set;            // Attributes that entries must have
+	uint8_t attr_clear;          // and those they must not have
+} fat32_dir_filter_t;
+
+/* A run of physically contiguous clusters in a file's cluster chain. */
+typedef struct fat32_extent_t {
+	int file_index; // Index of start_cluster within the file's chain
+	int start_cluster;
+	int length;
+} fat32_extent_t;
+
+/* The cluster chain of a file as a sorted list of extents. */
+typedef struct fat32_extent_map_t {
+	int is_built;
+	int nr_extents;
+	int capacity;
+	int nr_clusters;
+	fat32_extent_t *extents;
+} fat32_extent_map_t;
+
 typedef struct fat32_file_t {
 	int nr;
 	fat32_fs_t* fs;
-	int active_cluster;
-	int remaining_size;
+	int first_cluster;
+	uint32_t size_bytes;
+	uint32_t position;
+	fat32_extent_map_t extents;
+
+	// Where the short entry of the file is, for handles open for writing.
+	// The extent map of such handles covers the whole chain, including
+	// clusters preallocated past the end of the file, which are given back
+	// when the handle is closed.
+	int is_writable;
+	int dir_cluster;
+	int slot_cluster;
+	int slot_offset;
+
+	// Read-ahead state. A read that starts at ra_expected (where the last
+	// one stopped) counts as sequential. Clusters of the file below index
+	// ra_end have already been prefetched. A window of 0 means the access
+	// pattern looks random and nothing is prefetched.
+	uint32_t ra_expected;
+	int ra_window;
+	int ra_end;
 } fat32_file_t;
 
+/* A thread handling requests. The buffers are per worker, as a worker may
+ * have to wait for the device while another one is using them. */
+typedef struct fat32_worker_t {
+	int nr;
+	mthread_thread_t tid;
+	mthread_mutex_t event_mutex;
+	mthread_cond_t event;
+	int has_event;
+	int is_busy;
+	message msg;    // The request being handled
+	int io_result;  // Result of the last device read
+
+	// The trace entry of the request being handled, if it is traced.
+	fat32_trace_entry trace;
+	int is_tracing;
+	int trace_epoch;
+
+	char *read_buffer;
+	size_t read_buffer_size;
+	char dirent_batch[FAT32_DIRENT_BATCH_SIZE];
+} fat32_worker_t;
+
 /* main.c */
+
+/* For each handle type, *_handle_next is the number of slots that have ever
+ * been used and *_handle_count the number of those that are currently in use.
+ * The handles last given out from the other slots are kept on the
+ * *_handle_free stack, which is *_handle_next - *_handle_count deep. */
 extern fat32_fs_t fs_handles[FAT32_MAX_HANDLES];
+extern int fs_handle_free[FAT32_MAX_HANDLES];
 extern int fs_handle_count;
 extern int fs_handle_next;
 
 extern fat32_dir_t dir_handles[FAT32_MAX_HANDLES];
+extern int dir_handle_free[FAT32_MAX_HANDLES];
 extern int dir_handle_count;
 extern int dir_handle_next;
 
 extern fat32_file_t file_handles[FAT32_MAX_HANDLES];
+extern int file_handle_free[FAT32_MAX_HANDLES];
 extern int file_handle_count;
 extern int file_handle_next;
 
+extern size_t fat_cache_budget;
+extern size_t cluster_cache_budget;
+
 int main(int argc, char **argv);
+
+/* Handles a single request and replies to it. Called by the workers. */
+void handle_request(message* msg);
 void reply(endpoint_t destination, message* msg);
 int wait_request(message *msg, fat32_request_t *req);
 
+/* clustercache.c */
+
+/* Sets up an empty cluster cache for the given filesystem, using at most
+ * budget_bytes of memory for cluster data. */
+int cluster_cache_init(fat32_fs_t* fs, size_t budget_bytes);
+
+/* Releases all memory held by the filesystem's cluster cache. No clusters may
+ * be pinned anymore. */
+void cluster_cache_free(fat32_fs_t* fs);
+
+/* Pins the given cluster in memory, reading it from the device if it is not
+ * cached yet. Every successful call must be matched by cluster_cache_put. */
+int cluster_cache_get(fat32_fs_t* fs, int cluster_nr, fat32_cluster_t** dst);
+
+/* Unpins a cluster returned by cluster_cache_get or cluster_cache_find. */
+void cluster_cache_put(fat32_fs_t* fs, fat32_cluster_t* cluster);
+
+/* Pins the given cluster if it is cached, without going to the device.
+ * Returns NULL if it isn't. */
+fat32_cluster_t* cluster_cache_find(fat32_fs_t* fs, int cluster_nr);
+
+/* Tells whether the given cluster is cached, without touching it. */
+int cluster_cache_contains(fat32_fs_t* fs, int cluster_nr);
+
+/* Adds a cluster that was read by someone else (read-ahead) to the cache,
+ * unpinned. Does nothing if it's already cached or all slots are pinned. */
+void cluster_cache_fill(fat32_fs_t* fs, int cluster_nr, const char* data);
+
+/* Copies what was just written to count consecutive clusters, starting with
+ * the given one, into those of them that are cached, which are then clean. */
+void cluster_cache_update(fat32_fs_t* fs, int cluster_nr, int count, const char* data);
+
+/* Pins a cluster whose contents don't matter (such as one that was just
+ * allocated) without reading it. It is handed out zeroed. */
+int cluster_cache_zero(fat32_fs_t* fs, int cluster_nr, fat32_cluster_t** dst);
+
+/* Marks a pinned cluster as changed, to be written back by the next
+ * cluster_cache_flush of the given FAT32_DIRTY_* kind. Private copies can't
+ * wait, so they are written right away, directory clusters only after
+ * writeback_sync. The write lock must be held. */
+int cluster_cache_dirty(fat32_fs_t* fs, fat32_cluster_t* cluster, int kind);
+
+/* Forgets the changes to count consecutive clusters that were freed. */
+void cluster_cache_discard(fat32_fs_t* fs, int cluster_nr, int count);
+
+/* Copies the clusters among count consecutive ones, starting with the given
+ * one, that have changes in the cache over what was read of them from the
+ * device into buf. */
+void cluster_cache_overlay(fat32_fs_t* fs, int cluster_nr, int count, char* buf);
+
+/* Writes back the dirty clusters of the given kind, sorted, with a single
+ * write per run of adjacent clusters. */
+int cluster_cache_flush(fat32_fs_t* fs, int kind);
+
+/* Starts reading up to count clusters that are contiguous on the device into
+ * the cache, without waiting for them. Stops at the first cluster that is
+ * already cached. Returns the number of clusters being read, or an error
+ * (ENOSYS if the device can't do asynchronous reads). */
+int cluster_cache_prefetch(fat32_fs_t* fs, int cluster_nr, int count);
+
+/* Waits until all read-ahead requests of the filesystem are done. */
+void cluster_cache_drain(fat32_fs_t* fs);
+
+/* fatcache.c */
+
+/* Sets up an empty FAT cache for the given filesystem, using at most
+ * budget_bytes of memory for FAT sectors. */
+int fat_cache_init(fat32_fs_t* fs, size_t budget_bytes);
+
+/* Releases all memory held by the filesystem's FAT cache. */
+void fat_cache_free(fat32_fs_t* fs);
+
+/* Reads the raw FAT entry for the given cluster, loading its sector from the
+ * device if it is not cached yet. */
+int fat_cache_lookup(fat32_fs_t* fs, int cluster_nr, uint32_t* entry);
+
+/* Changes the FAT entry of the given cluster to value, keeping the four bits
+ * that are reserved. The sector is marked dirty in the cache, and reaches the
+ * device with the next fat_cache_flush. */
+int fat_cache_set(fat32_fs_t* fs, int cluster_nr, uint32_t value);
+
+/* Writes the dirty sectors of the FAT cache to every copy of the FAT. Runs of
+ * adjacent sectors are written with a single write per copy. */
+int fat_cache_flush(fat32_fs_t* fs);
+
+/* Looks up the given cluster in the FAT (through the filesystem's FAT cache)
+ * and gets its successor in the cluster chain. Writes -1 to *next_cluster_nr
+ * if this is the last cluster in the chain. */
+int get_next_cluster(fat32_fs_t* fs, int cluster_nr, int* next_cluster_nr);
+
+/* extents.c */
+
+/* Walks the cluster chain starting at first_cluster and records it as a list
+ * of contiguous extents. At most max_clusters clusters are recorded, so that
+ * clusters preallocated past the end of a file (or a looping chain) don't
+ * matter. */
+int extent_map_build(fat32_fs_t* fs, int first_cluster, int max_clusters,
+		fat32_extent_map_t* map);
+
+/* Adds count physically consecutive clusters, starting with the given one, to
+ * the end of an extent map. */
+int extent_map_append_run(fat32_extent_map_t* map, int cluster_nr, int count);
+
+/* Drops the clusters of an extent map from the given index on. */
+void extent_map_truncate(fat32_extent_map_t* map, int nr_clusters);
+
+/* Releases the memory held by an extent map. */
+void extent_map_free(fat32_extent_map_t* map);
+
+/* Finds the cluster at the given index of the chain with a binary search over
+ * the extents. Writes -1 to *cluster_nr if the chain is shorter than that.
+ * If run_left is not NULL, the number of clusters physically following
+ * *cluster_nr in the same extent is written to it. */
+void extent_map_lookup(fat32_extent_map_t* map, int index, int* cluster_nr,
+		int* run_left);
+
+/* worker.c */
+
+/* Starts the worker threads. */
+void worker_init(void);
+
+/* Hands a request to an idle worker, or queues it until there is one. Returns
+ * EAGAIN if the queue is full, after answering the request with it. */
+int worker_start(message* m);
+
+/* Returns the worker that is running, or NULL for the main thread. */
+fat32_worker_t* worker_self(void);
+
+/* Puts a worker to sleep until worker_io_done is called for it, and returns
+ * the result passed to it. */
+int worker_wait_io(fat32_worker_t* worker);
+
+/* Wakes up a worker waiting in worker_wait_io. */
+void worker_io_done(fat32_worker_t* worker, int result);
+
+/* Makes sure that the buffer of a worker, which reads and writes of file data
+ * go through, holds at least min_size bytes. */
+int worker_buffer(fat32_worker_t* worker, size_t min_size);
+
+/* device.c */
+
+/* If set, image files that could be written are mapped (and so only read) as
+ * well as those that can't. Set with the image_mmap boot parameter. */
+extern int image_mmap;
+
+/* Opens the device or image file at the given path. */
+int dev_open(fat32_dev_t* dev, const char* path);
+
+/* Returns where len bytes at byte offset pos of a mapped image are in memory,
+ * or NULL if the device isn't mapped or they are past its end. */
+char* dev_map(fat32_dev_t* dev, uint64_t pos, size_t len);
+
+/* Reads len bytes at byte offset pos of the device. Both must be multiples of
+ * FAT32_MIN_SECTOR_SIZE. */
+int dev_read(fat32_dev_t* dev, uint64_t pos, char* buf, size_t len);
+
+/* Starts reading into a vector of buffers at byte offset pos of the device,
+ * without waiting for the read to finish. done is called from the main thread
+ * with the number of bytes read or an error. Only works for block devices;
+ * returns ENOSYS for image files. */
+int dev_gather_async(fat32_dev_t* dev, uint64_t pos, iovec_t* vec, int count,
+		bdev_callback_t done, bdev_param_t param);
+
+/* Closes a device opened with dev_open. */
+void dev_close(fat32_dev_t* dev);
+
+/* Writes len bytes at byte offset pos of the device. Both must be multiples of
+ * FAT32_MIN_SECTOR_SIZE. Returns EROFS if the device was opened read-only. */
+int dev_write(fat32_dev_t* dev, uint64_t pos, const char* buf, size_t len);
+
+/* Reads the FAT header from the start of a device. */
+int read_fat_header(fat32_dev_t* dev, fat32_header_t* dst);
+
+/* Reads the contents of a given cluster into memory. The buffer given must be
+ * at least info->bytes_per_cluster bytes long. */
+int read_cluster(fat32_header_t* header, fat32_info_t* info, fat32_dev_t* dev, int cluster_nr, char* buf);
+
+/* Reads count physically consecutive clusters, starting with the given one,
+ * with a single device read. The buffer must be at least
+ * count * info->bytes_per_cluster bytes long. */
+int read_clusters(fat32_header_t* header, fat32_info_t* info, fat32_dev_t* dev, int cluster_nr, int count, char* buf);
+
+/* Writes count physically consecutive clusters, starting with the given one,
+ * with a single device write. */
+int write_clusters(fat32_header_t* header, fat32_info_t* info, fat32_dev_t* dev, int cluster_nr, int count, const char* buf);
+
+/* Reads a single sector of the first FAT into memory. The sector number is
+ * relative to the start of the FAT. The buffer given must be at least
+ * header->bpb.bytes_per_sector bytes long. */
+int read_fat_sector(fat32_header_t* header, fat32_info_t* info, fat32_dev_t* dev, int sector_nr, char* buf);
+
+/* dentry.c */
+
+/* Initializes the name lookup cache. */
+void init_dentry(void);
+
+/* Looks up an entry by its parent directory's first cluster and its name.
+ * Returns TRUE and copies the entry to *dst if it is cached. */
+int lookup_dentry(fat32_fs_t* fs, int parent_cluster, const char* name,
+		fat32_dirent_t* dst);
+
+/* Adds the result of a name lookup to the cache, evicting the least recently
+ * used entry if needed. The slot position is that of its short entry. */
+void add_dentry(fat32_fs_t* fs, int parent_cluster, const char* name,
+		fat32_dirent_t* entry, int slot_cluster, int slot_offset);
+
+/* Drops all cached entries of a filesystem that is being closed. */
+void purge_dentries(fat32_fs_t* fs);
+
+/* Updates the cached copies of an entry that was changed in place, whose short
+ * entry is at the given slot position. */
+void update_dentries(fat32_fs_t* fs, int parent_cluster, int slot_cluster, int slot_offset,
+		fat32_direntry_t* entry);
+
+/* Drops the cached entries of a directory that was changed. */
+void purge_dir_dentries(fat32_fs_t* fs, int parent_cluster);
+
+/* Hashes a name without regard to the case of ASCII letters. */
+unsigned int hash_name(const char* name);
+
+/* dirindex.c */
+
+typedef struct fat32_dirindex_t fat32_dirindex_t;
+
+extern size_t dirindex_budget;
+
+/* Initializes the directory indexes. */
+void init_dirindex(void);
+
+/* Looks up a name in the index of the directory whose chain starts at
+ * dir_cluster. Returns FALSE if the directory has no index, which is left to
+ * the caller to build. Otherwise returns TRUE and writes whether the name
+ * exists to *found, copying its entry to *dst and the position of its short
+ * entry to *slot_cluster and *slot_offset if it does. */
+int lookup_dirindex(fat32_fs_t* fs, int dir_cluster, const char* name,
+		fat32_dirent_t* dst, int* found, int* slot_cluster, int* slot_offset);
+
+/* Starts a new index for a directory, to which all its entries are then added
+ * in order with dirindex_add() while it is scanned. Returns NULL if there is no
+ * memory for indexes. */
+fat32_dirindex_t* dirindex_begin(fat32_fs_t* fs, int dir_cluster);
+
+/* Adds an entry to an index being built. The slot position is that of the
+ * short entry. Returns ENOMEM if the index gets too big, after which it must
+ * be given up on with dirindex_abort(). */
+int dirindex_add(fat32_dirindex_t* index, const char* name,
+		fat32_direntry_t* short_entry, int slot_cluster, int slot_offset);
+
+/* Throws away an index that couldn't be finished. */
+void dirindex_abort(fat32_dirindex_t* index);
+
+/* Makes a finished index available to lookups, evicting the least recently
+ * used indexes to make room for it. It is dropped instead if it was built for
+ * an older generation of the volume or doesn't fit at all. */
+void dirindex_commit(fat32_fs_t* fs, fat32_dirindex_t* index);
+
+/* Drops all indexes of a filesystem that is being closed. */
+void purge_dirindexes(fat32_fs_t* fs);
+
+/* Drops the index of a directory that was changed, if it has one, and makes
+ * those of it being built at the time be thrown away when they are done. */
+void drop_dir_dirindex(fat32_fs_t* fs, int dir_cluster);
+
+/* Updates the copy of an entry that was changed in place in the index of its
+ * directory, and in those being built, given the position of its short
+ * entry. */
+void update_dir_dirindex(fat32_fs_t* fs, int dir_cluster, int slot_cluster, int slot_offset,
+		fat32_direntry_t* entry);
+
+/* freespace.c */
+
+/* Initializes what the free space code shares between filesystems. */
+void init_freespace(void);
+
+/* Reads the FSInfo hints of a filesystem being opened. A missing or broken
+ * FSInfo sector only means that there are no hints. */
+void freespace_open(fat32_fs_t* fs);
+
+/* Stops the scan of a filesystem being closed, waiting for it if it is
+ * running, and frees its bitmap. */
+void freespace_close(fat32_fs_t* fs);
+
+/* Copies the free space figures of a filesystem to the buffer at dst in the
+ * address space of who. Writes TRUE to *start_scan if the caller is to run a
+ * scan of the FAT with freespace_scan() once it has replied, which is the case
+ * if the FSInfo sector has no count or the FAT32_STATVFS_SCAN flag is given,
+ * and no scan has been done or is running. */
+int do_statvfs(fat32_fs_t* fs, vir_bytes dst, size_t len, int flags,
+		endpoint_t who, int* start_scan);
+
+/* Counts the free clusters of a filesystem by reading its whole FAT, and
+ * builds its free cluster bitmap. */
+void freespace_scan(fat32_fs_t* fs);
+
+/* Makes sure that the free clusters of a filesystem are known, running a scan
+ * of the FAT (or waiting for the one that is running) if needed, and builds
+ * the free runs for the allocator from its bitmap. */
+int freespace_runs(fat32_fs_t* fs);
+
+/* Writes the free cluster count and the next free cluster hint to the FSInfo
+ * sector, if they changed since they were last written. */
+int freespace_flush(fat32_fs_t* fs);
+
+/* alloc.c */
+
+/* Allocates up to count free clusters that are consecutive on the device,
+ * preferring the run that starts at goal (if it's free), then the first run
+ * that is long enough for all of them, then the longest run. Writes the first
+ * cluster and the number of clusters to *start and *length; the FAT isn't
+ * touched. Returns ENOSPC if the volume is full. */
+int alloc_run(fat32_fs_t* fs, int goal, int count, int* start, int* length);
+
+/* Gives clusters that are no longer used back to the allocator. */
+void alloc_release(fat32_fs_t* fs, int start, int length);
+
+/* Allocates count clusters and links them to the end of the chain recorded in
+ * map, starting a new chain if it is empty. The clusters are appended to
+ * map. */
+int extend_chain(fat32_fs_t* fs, fat32_extent_map_t* map, int count);
+
+/* Frees the clusters of the chain recorded in map from the given index on,
+ * and ends the chain before them. */
+int shrink_chain(fat32_fs_t* fs, fat32_extent_map_t* map, int nr_clusters);
+
+/* Frees a whole chain, following it through the FAT. */
+int free_chain(fat32_fs_t* fs, int first_cluster);
+
+/* write.c */
+
+/* Creates an empty file at a path relative to the root directory of a
+ * filesystem, and opens it for writing. If size_hint isn't 0, as many
+ * clusters as the file will need are allocated up front, in one run if
+ * possible. Fails with EEXIST if there already is an entry with that name. */
+int do_create_file(fat32_fs_t* fs, const char* path, uint32_t size_hint, endpoint_t who);
+
+/* Opens an existing file for writing. */
+int open_file_for_writing(fat32_fs_t* fs, const char* path);
+
+/* Writes len bytes from the buffer at src in the address space of who at the
+ * current position of a file (or its end, with FAT32_WRITE_APPEND), growing it
+ * as needed, and writes the number of bytes written to *nwritten. */
+int do_write_file(fat32_file_t* file, vir_bytes src, size_t len, int flags,
+		size_t* nwritten, endpoint_t who);
+
+/* Changes the size of a file. Clusters past the new end are freed; growing
+ * the file fills the new part with zeroes. */
+int do_truncate_file(fat32_file_t* file, uint64_t size, endpoint_t who);
+
+/* Removes a file. Directories, and files that are open, can't be removed. */
+int do_unlink(fat32_fs_t* fs, const char* path, endpoint_t who);
+
+/* Gives back the clusters preallocated past the end of a file that was open
+ * for writing, when it is closed. */
+int finish_writing(fat32_file_t* file);
+
+/* writeback.c */
+
+extern size_t writeback_budget;
+extern int writeback_delay;
+
+/* Starts and stops the write-back of a filesystem that is being opened or
+ * closed. Closing writes back everything that is left. */
+void writeback_open(fat32_fs_t* fs);
+int writeback_close(fat32_fs_t* fs);
+
+/* Writes back the changes to a filesystem for the write-back timer, which
+ * sends FAT32_SYNC for it. */
+void writeback_timed_sync(fat32_fs_t* fs);
+
+/* Take and release the write lock of a filesystem, noting which worker holds
+ * it. */
+void writeback_lock(fat32_fs_t* fs);
+void writeback_unlock(fat32_fs_t* fs);
+
+/* Tells whether the running worker holds the write lock of a filesystem. */
+int writeback_is_locked(fat32_fs_t* fs);
+
+/* Writes back all changes of a filesystem, in the order that keeps it
+ * consistent at every step: file data, then the FAT (to every copy), then
+ * directory entries, then the FSInfo sector. The caller holds the write lock
+ * of the filesystem. */
+int writeback_sync(fat32_fs_t* fs);
+
+/* Called after a request changed a filesystem. Writes back its changes if
+ * there are too many of them, and otherwise makes sure that the timer that
+ * writes them back later is set. */
+void writeback_check(fat32_fs_t* fs);
+
+/* Handles FAT32_SYNC, which writes back all changes of a filesystem. */
+int do_sync(fat32_fs_t* fs, endpoint_t who);
+
+/* stats.c */
+
+/* The counters of FAT32_GET_STATS, bumped all over the server. The handle
+ * counts are filled in when they are asked for. */
+extern fat32_stats_t fat32_stats;
+
+/* Sets the time the counters count from. */
+void stats_init(void);
+
+/* Returns a timestamp to pass to stats_request_done. */
+uint64_t stats_request_start(void);
+
+/* Counts a request of the given type that was started at the given time and
+ * had the given result. */
+void stats_request_done(int type, uint64_t start, int result);
+
+/* Copies the counters to the buffer at dst in the address space of who, which
+ * must be sizeof(fat32_stats_t) bytes long, and zeroes them if flags contains
+ * FAT32_STATS_RESET. */
+int do_get_stats(vir_bytes dst, size_t len, int flags, endpoint_t who);
+
+/* trace.c */
+
+/* Starts the trace entry of a request a worker is about to handle, if tracing
+ * is on. */
+void trace_start(fat32_worker_t* worker, message* m);
+
+/* Record the first cluster used by the request being handled by the calling
+ * worker, and the number of bytes it returns. */
+void trace_set_cluster(int cluster_nr);
+void trace_set_bytes(size_t bytes);
+
+/* Finishes the trace entry of a worker's request and adds it to the buffer. */
+void trace_finish(fat32_worker_t* worker, int result);
+
+/* Handles a FAT32_TRACE_CTL directive. When tracing is stopped, the number of
+ * entries that were overwritten is stored in *lost. */
+int do_trace_ctl(int ctl, size_t size, int* lost);
+
+/* Copies as many of the trace entries that haven't been copied out yet as fit
+ * into the buffer at dst in the address space of who, oldest first, and
+ * stores their number in *count. Tracing must be stopped. */
+int do_trace_get(vir_bytes dst, size_t len, endpoint_t who, int* count);
+
 /* requests.c */
 
 fat32_fs_t* find_fs_handle(int h);
@@ -125,15 +893,65 @@ int do_open_directory(fat32_dir_t* parent, endpoint_t who);
  * parent directory, if that item is a file. */
 int do_open_file(fat32_dir_t* parent, endpoint_t who);
 
-/* Reads the next block of a file. The buffer must be at least
- * file->fs->info.bytes_per_cluster bytes long. */
-int do_read_file_block(fat32_file_t* file, char* buffer, int* len, endpoint_t who);
+/* Resolves a path relative to the root directory of a filesystem, and copies
+ * the entry it leads to into *dst. Depending on flags, it then either opens it
+ * as a directory or as a file and returns the new handle, or just returns OK
+ * (for FAT32_OPEN_PATH_STAT). */
+int do_open_path(fat32_fs_t* fs, const char* path, int flags, fat32_dirent_t* dst,
+		endpoint_t who);
+
+/* Opens the directory or file described by an entry from FAT32_READ_DIR_BATCH.
+ * The directory given is only used to find the filesystem. */
+int do_open_entry(fat32_dir_t* source, int first_cluster, uint32_t size_bytes,
+		int attributes, endpoint_t who);
+
+/* Reads the rest of the current cluster of a file into the buffer at dst in
+ * the address space of who, and writes the number of bytes read to *nread.
+ * The buffer must be at least file->fs->info.bytes_per_cluster bytes long. */
+int do_read_file_block(fat32_file_t* file, vir_bytes dst, size_t len, size_t* nread, endpoint_t who);
+
+/* Reads up to len bytes from the current position of a file into the buffer at
+ * dst in the address space of who, and writes the number of bytes read to
+ * *nread. Physically contiguous clusters are read with a single device read.
+ * *nread is 0 once the end of the file is reached. */
+int do_read_file_range(fat32_file_t* file, vir_bytes dst, size_t len, size_t* nread, endpoint_t who);
+
+/* Moves the position of a file to the given byte offset. Seeking past the end
+ * of the file is allowed, reads from there simply return nothing. */
+int do_seek_file(fat32_file_t* file, uint64_t offset, endpoint_t who);
+
+/* Reads up to len bytes starting at the given offset of a file, without
+ * moving the file's position. Otherwise behaves like do_read_file_range. */
+int do_pread_file(fat32_file_t* file, uint64_t offset, vir_bytes dst, size_t len,
+		size_t* nread, endpoint_t who);
 
 /* Reads the next directory entry for tis directory. Writes TRUE to *was_written
  * if anything was written to *dst, and FALSE otherwise. The caller may assume
  * that when the call succeeds with *was_written == FALSE, there are no more
  * directory entries in the given directory. */
-int do_read_dir_entry(fat32_dir_t* dir, fat32_entry_t* dst, int* was_written, endpoint_t who);
+int do_read_dir_entry(fat32_dir_t* dir, fat32_dirent_t* dst, int* was_written, endpoint_t who);
+
+/* Reads as many of the following entries of a directory as fit into the
+ * buffer at dst in the address space of who. The entries are packed back to
+ * back, each taking FAT32_DIRENT_SIZE of its name length, and the buffer must
+ * have room for at least one entry with the longest name. The number of
+ * entries written is stored in *count, which is 0 once there are no more
+ * entries. Afterwards the directory handle refers to the last entry
+ * read, as after do_read_dir_entry. */
+int do_read_dir_batch(fat32_dir_t* dir, vir_bytes dst, size_t len, int* count,
+		endpoint_t who);
+
+/* Prepares a filter for do_read_dir_filter from the pattern, FAT32_MATCH_*
+ * mode and attribute masks of a FAT32_READ_DIR_FILTER request. */
+int filter_init(fat32_dir_filter_t* filter, const char* pattern, int match,
+		uint8_t attr_set, uint8_t attr_clear);
+
+/* Like do_read_dir_batch, but only returns the entries that pass the filter.
+ * The others are skipped without being converted, and mostly without their
+ * names being decoded. The directory handle refers to the last entry read
+ * afterwards, which need not be one that was returned. */
+int do_read_dir_filter(fat32_dir_t* dir, const fat32_dir_filter_t* filter, vir_bytes dst,
+		size_t len, int* count, endpoint_t who);
 
 /* Closes a previously open file handle. */
 int do_close_file(fat32_file_t* file, endpoint_t who);
@@ -150,6 +968,15 @@ int do_close_fs(fat32_fs_t* fs, endpoint_t who);
  * directory's cluster buffer. */
 int advance_dir_cluster(fat32_dir_t* dir);
 
-/* Advances the given file handle one cluster forward in the cluster chain,
- * likewise. */
-int advance_file_cluster(fat32_file_t* file);
+/* Builds the extent map of a file's cluster chain if it hasn't been built yet. */
+int build_file_extents(fat32_file_t* file);
+
+/* Creates a file handle for a file of the given size whose chain starts at the
+ * given cluster. */
+int open_file_at(fat32_fs_t* fs, int cluster_nr, uint32_t size_bytes);
+
+/* Resolves the directory part of a path relative to the root directory of a
+ * filesystem. The first cluster of the directory is written to *dir_cluster,
+ * and the last component of the path to name, which must be at least
+ * FAT32_MAX_NAME_LEN bytes long. */
+int resolve_parent(fat32_fs_t* fs, const char* path, int* dir_cluster, char* name);
@@ -6,16 +6,16 @@
 #include <minix/safecopies.h>
 #include <minix/syslib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include "fat32.h"
 #include <unistd.h>
 
 #define FIND_HANDLE(type, h) \
-	for (int i = 0; i < type##_handle_count; i++) { \
-		if (type##_handles[i].nr == h) { \
-			return &type##_handles[i]; \
-		} \
+	if (h <= 0 || type##_handles[FAT32_HANDLE_SLOT(h)].nr != h) { \
+		return NULL; \
 	} \
-	return NULL
+	return &type##_handles[FAT32_HANDLE_SLOT(h)]
 
 fat32_fs_t* find_fs_handle(int h) {
 	FIND_HANDLE(fs, h);
@@ -29,17 +29,38 @@ fat32_file_t* find_file_handle(int h) {
 	FIND_HANDLE(file, h);
 }
 
+/* Returns the handle that replaces the given retired one in its slot. */
+static int next_generation(int h) {
+	int generation = FAT32_HANDLE_GENERATION(h) + 1;
+	if (generation > FAT32_HANDLE_MAX_GENERATION) {
+		generation = 1;
+	}
+
+	return (generation << FAT32_HANDLE_SLOT_BITS) | FAT32_HANDLE_SLOT(h);
+}
+
 #define DESTROY_HANDLE(type, ph) \
-	*ph = type##_handles[type##_handle_count - 1]; \
-	type##_handle_count--; \
+	do { \
+		type##_handle_free[type##_handle_next - type##_handle_count] = (ph)->nr; \
+		(ph)->nr = 0; \
+		type##_handle_count--; \
+	} while (0)
 
+// Slots that were used before are preferred over fresh ones, most recently
+// freed first, which keeps the live handles packed at the start of the table.
 #define CREATE_HANDLE(type, handle) \
 	do { \
-		if (type##_handle_count >= FAT32_MAX_HANDLES) { \
+		int nr; \
+		if (type##_handle_count < type##_handle_next) { \
+			nr = next_generation(type##_handle_free[ \
+					type##_handle_next - type##_handle_count - 1]); \
+		} else if (type##_handle_next < FAT32_MAX_HANDLES) { \
+			nr = (1 << FAT32_HANDLE_SLOT_BITS) | type##_handle_next++; \
+		} else { \
 			return -1; \
 		} \
-		int nr = type##_handle_next++; \
-		handle = &type##_handles[type##_handle_count++]; \
+		type##_handle_count++; \
+		handle = &type##_handles[FAT32_HANDLE_SLOT(nr)]; \
 		handle->nr = nr; \
 	} while (0)
 
@@ -48,140 +69,192 @@ int do_open_fs(const char* device, endpoint_t who) {
 	fat32_fs_t *handle;
 	CREATE_HANDLE(fs, handle);
 
-	int fd = open(device, O_RDONLY);
-	if (fd < 0) {
-		ret = FAT32_ERR_IO;
+	if ((ret = dev_open(&handle->dev, device)) != OK) {
 		goto destroy_handle;
 	}
 
-	if ((ret = read_fat_header(fd, &handle->header)) != OK) {
-		goto close_fd;
+	// Every handle has its own caches and free space, so two of them writing
+	// to the same volume would hand out the same clusters. Only the first
+	// one gets to write.
+	for (int i = 0; i < fs_handle_next && handle->dev.is_writable; i++) {
+		fat32_fs_t *fs = &fs_handles[i];
+
+		if (fs->nr != 0 && fs != handle && fs->is_open && fs->dev.is_writable &&
+				handle->dev.file_ino != 0 && fs->dev.file_ino == handle->dev.file_ino &&
+				fs->dev.file_dev == handle->dev.file_dev) {
+			FAT_LOG_PRINTF(info, "%s is already open for writing as fs %d, "
+					"opening it read-only", device, fs->nr);
+			handle->dev.is_writable = FALSE;
+		}
+	}
+
+	if ((ret = read_fat_header(&handle->dev, &handle->header)) != OK) {
+		goto close_dev;
 	}
 
 	if ((ret = build_fat_info(&handle->header, &handle->info)) != OK)  {
-		goto close_fd;
+		goto close_dev;
+	}
+
+	if ((ret = fat_cache_init(handle, fat_cache_budget)) != OK) {
+		goto close_dev;
 	}
 
+	// Mapped images are read from the mapping rather than the cache.
+	if ((ret = cluster_cache_init(handle, handle->dev.map ? 0 : cluster_cache_budget)) != OK) {
+		goto free_fat_cache;
+	}
+
+	if (mthread_mutex_init(&handle->write_lock, NULL) != 0) {
+		ret = ENOMEM;
+		goto free_cluster_cache;
+	}
+
+	if (mthread_cond_init(&handle->sync_done, NULL) != 0) {
+		ret = ENOMEM;
+		goto destroy_lock;
+	}
+
+	freespace_open(handle);
+	writeback_open(handle);
 	handle->is_open = TRUE;
-	handle->fd = fd;
 	handle->opened_by = who;
+	handle->generation = 0;
 
 	return handle->nr;
 
-close_fd:
-	close(fd);
+destroy_lock:
+	mthread_mutex_destroy(&handle->write_lock);
+
+free_cluster_cache:
+	cluster_cache_free(handle);
+
+free_fat_cache:
+	fat_cache_free(handle);
+
+close_dev:
+	dev_close(&handle->dev);
 
 destroy_handle:
-	fs_handle_count--;
-	fs_handle_next--;
+	DESTROY_HANDLE(fs, handle);
 
 	return ret;
 }
 
-int do_open_root_directory(fat32_fs_t* fs, endpoint_t who) {
+/* Creates a directory handle for the directory whose chain starts at the
+ * given cluster. */
+static int open_directory_at(fat32_fs_t* fs, int cluster_nr) {
 	int ret = OK;
 	fat32_dir_t *handle;
+	fat32_cluster_t *cluster;
 	CREATE_HANDLE(dir, handle);
 
-	char* buf = (char*) malloc(fs->info.bytes_per_cluster);
-	if (!buf) {
-		ret = ENOMEM;
-		goto destroy_handle;
+	// '..' entries of first-level directories point to cluster 0, which
+	// stands for the root directory.
+	if (cluster_nr == 0) {
+		cluster_nr = fs->header.ebr.root_cluster_nr;
 	}
 
-	int cluster_nr = fs->header.ebr.root_cluster_nr;
-	if ((ret = seek_read_cluster(&fs->header, &fs->info, fs->fd, cluster_nr, buf)) != OK) {
-		goto dealloc_buffer;
+	trace_set_cluster(cluster_nr);
+	if ((ret = cluster_cache_get(fs, cluster_nr, &cluster)) != OK) {
+		goto destroy_handle;
 	}
 
 	handle->fs = fs;
 	handle->active_cluster = cluster_nr;
 	handle->cluster_buffer_offset = 0;
-	handle->cluster_buffer = buf;
+	handle->cluster = cluster;
+	handle->cluster_buffer = cluster->data;
 
 	return handle->nr;
 
-dealloc_buffer:
-	free(buf);
-
 destroy_handle:
-	dir_handle_count--;
-	dir_handle_next--;
+	DESTROY_HANDLE(dir, handle);
 
 	return ret;
 }
 
+int open_file_at(fat32_fs_t* fs, int cluster_nr, uint32_t size_bytes) {
+	fat32_file_t *handle;
+	CREATE_HANDLE(file, handle);
+
+	trace_set_cluster(cluster_nr);
+	handle->fs = fs;
+	handle->first_cluster = cluster_nr;
+	handle->size_bytes = size_bytes;
+	handle->position = 0;
+	memset(&handle->extents, 0, sizeof(handle->extents));
+	handle->is_writable = FALSE;
+	handle->ra_expected = 0;
+	handle->ra_window = 0;
+	handle->ra_end = 0;
+
+	return handle->nr;
+}
+
+int do_open_root_directory(fat32_fs_t* fs, endpoint_t who) {
+	return open_directory_at(fs, fs->header.ebr.root_cluster_nr);
+}
+
+/* Unpins the cluster a directory handle is currently looking at. */
+static void release_dir_cluster(fat32_dir_t* dir) {
+	if (dir->cluster) {
+		cluster_cache_put(dir->fs, dir->cluster);
+	}
+
+	dir->cluster = NULL;
+	dir->cluster_buffer = NULL;
+}
+
 int advance_dir_cluster(fat32_dir_t* dir) {
+	fat32_cluster_t *cluster;
 	int ret, next_cluster_nr;
-	if ((ret = get_next_cluster(&dir->fs->header, &dir->fs->info, dir->fs->fd,
-					dir->active_cluster, &next_cluster_nr)) != OK) {
+	if ((ret = get_next_cluster(dir->fs, dir->active_cluster,
+					&next_cluster_nr)) != OK) {
 		return ret;
 	}
 
 	if (next_cluster_nr != -1) {
-		dir->active_cluster = next_cluster_nr;
-		dir->cluster_buffer_offset = 0;
-
-		// Advancing the directory cluster also means we have to read in the
-		// cluster's contents into the buffer.
-		if ((ret = seek_read_cluster(&dir->fs->header, &dir->fs->info,
-		                dir->fs->fd, next_cluster_nr, dir->cluster_buffer)) != OK) {
+		// Advancing the directory cluster also means we have to pin the
+		// next cluster's contents in place of the current one.
+		if ((ret = cluster_cache_get(dir->fs, next_cluster_nr, &cluster)) != OK) {
 			return ret;
 		}
+
+		release_dir_cluster(dir);
+		dir->active_cluster = next_cluster_nr;
+		dir->cluster_buffer_offset = 0;
+		dir->cluster = cluster;
+		dir->cluster_buffer = cluster->data;
 	} else {
-		// This signifies 'no more clusters' to do_read_dir_entry.
+		// This signifies 'no more clusters' to do_read_dir_entry. There's
+		// nothing left to look at, so let the cache have the cluster back.
+		release_dir_cluster(dir);
 		dir->cluster_buffer_offset = -1;
 	}
 
 	return OK;
 }
 
-int advance_file_cluster(fat32_file_t* file) {
-	int ret, next_cluster_nr;
-	if ((ret = get_next_cluster(&file->fs->header, &file->fs->info, file->fs->fd,
-					file->active_cluster, &next_cluster_nr)) != OK) {
-		return ret;
+int build_file_extents(fat32_file_t* file) {
+	if (file->extents.is_built) {
+		return OK;
 	}
 
-	file->active_cluster = next_cluster_nr;
-	return OK;
-}
-
-void filename_83_to_string(char* filename_83, char* dest) {
-	// Copy the filename portion to the new string.
-	strncpy(dest, filename_83, 8);
-
-	// Find the first space in the filename and put a dot after it.
-	int first_space;
-	for (first_space = 0;
-		 first_space < 8 && filename_83[first_space] != ' ';
-		 first_space++)
-		;
-
-	dest[first_space] = '.';
-
-	// Copy the extension right after the dot.
-	strncpy(dest + first_space + 1, filename_83 + 8, 3);
+	int bpc = file->fs->info.bytes_per_cluster;
+	int nr_clusters = (int) (((uint64_t) file->size_bytes + bpc - 1) / bpc);
 
-	// Find the first space in the extension and put a null terminator after
-	// it.
-	int dot_position = first_space;
-	for (first_space = 8;
-		 first_space < 11 && filename_83[first_space] != ' ';
-		 first_space++)
-		;
-
-	// If there's no extension, don't put the dot, just overwrite it with
-	// a null terminator.
-	if (first_space == 8) {
-		dest[dot_position] = '\0';
-	} else {
-		dest[dot_position + first_space - 8 + 1] = '\0';
-	}
+	return extent_map_build(file->fs, file->first_cluster, nr_clusters,
+			&file->extents);
 }
 
-int do_read_dir_entry(fat32_dir_t* dir, fat32_entry_t* dst, int* was_written,
-		endpoint_t who)
+/* Reads the next entry of a directory, writing a copy of its short direntry to
+ * *short_dst and its (long, if it has one) name to name, which must be at
+ * least FAT32_MAX_NAME_LEN bytes long. If name is NULL, the name is left in
+ * the parser instead, to be decoded only if it's needed. Writes TRUE to
+ * *was_written if there was an entry to read. */
+static int read_next_entry(fat32_dir_t* dir, fat32_entry_parser_t* parser,
+		fat32_direntry_t* short_dst, char* name, int* was_written)
 {
 	*was_written = FALSE;
 	dir->last_entry_start_cluster = -1;
@@ -192,25 +265,12 @@ int do_read_dir_entry(fat32_dir_t* dir, fat32_entry_t* dst, int* was_written,
 		return OK;
 	}
 
-	// We'll build the filename from behind, in this buffer, as we encounter the long
-	// direntries in opposite order.
-	char filename_buf[FAT32_MAX_NAME_LEN];
-	memset(filename_buf, 0, FAT32_MAX_NAME_LEN);
-	char *pfname = filename_buf + FAT32_MAX_NAME_LEN - 2; // Leave space for a single null terminator
-
-	int seen_long_direntry = FALSE; // Whether we've seen a single long direntry. If we have, then we
-	                                // should use the filenames given there. If not, we must use the
-									// 8.3 filename given in the short entry.
-
-	fat32_direntry_t* short_entry = NULL;
+	trace_set_cluster(dir->active_cluster);
 
-	int is_long_direntry; // Flag to control the outer loop
+	fat32_parser_reset(parser);
 
-	// Loop until we get to the short direntry corresponding to long direntries
-	// that we might encounter
+	int result;
 	do {
-		is_long_direntry = FALSE;
-
 		// If we've reached the end, we must get to the next clustah
 		if (dir->cluster_buffer_offset + 32 > dir->fs->info.bytes_per_cluster) {
 			FAT_LOG_PRINTF(debug, "Reached end of cluster %d", (int)dir->active_cluster);
@@ -230,7 +290,8 @@ int do_read_dir_entry(fat32_dir_t* dir, fat32_entry_t* dst, int* was_written,
 			(fat32_any_direntry_t*) &dir->cluster_buffer[dir->cluster_buffer_offset];
 		dir->cluster_buffer_offset += 32;
 
-		if (direntry->short_entry.filename_83[0] == '\0') {
+		result = fat32_parse_entry(parser, direntry, short_dst);
+		if (result == FAT32_PARSE_FREE) {
 			// Last directory entry in this cluster
 			FAT_LOG_PRINTF(debug, "Reached end of direntry in cluster %d", (int)dir->active_cluster);
 			int ret;
@@ -246,201 +307,786 @@ int do_read_dir_entry(fat32_dir_t* dir, fat32_entry_t* dst, int* was_written,
 			// If the previous calls were successful, we'll re-enter the loop
 			// with a current_buffer_offset of 0 and a new cluster inside the
 			// buffer.
-		} else if (direntry->short_entry.attributes == 0x0f) {
-			// 0x0F as attributes field means this is a long direntry.
+		}
+	} while (result != FAT32_PARSE_ENTRY);
 
-			is_long_direntry = TRUE;
-			seen_long_direntry = TRUE;
+	if (short_dst->attributes & FAT32_ATTR_DIR) {
+		dir->last_entry_was_dir = TRUE;
+	}
 
-			if (pfname < filename_buf) { // Truncated filename in a previous direntry?
-				continue;
-			}
+	int first_cluster_nr =
+		(short_dst->first_cluster_nr_high << 16) |
+		short_dst->first_cluster_nr_low;
 
-			// Copy the filename into a temporary buffer for easier handling
-			// because its bytes are scattered around the struct
-			uint16_t temp_lfn_buf[16];
-			uint16_t *pbuf = temp_lfn_buf;
-			memset(temp_lfn_buf, 0, sizeof(temp_lfn_buf));
+	// This is needed so that do_open_dir and do_open_file on this fs_dir_t can
+	// get to the correct info about the just-read file.
+	dir->last_entry_start_cluster = first_cluster_nr;
+	dir->last_entry_size_bytes = short_dst->size_bytes;
 
-			for (int i = 0; i < 5; i++) {
-				*pbuf++ = direntry->long_entry.chars_1[i];
-			}
-			for (int i = 0; i < 6; i++) {
-				*pbuf++ = direntry->long_entry.chars_2[i];
+	if (name != NULL) {
+		fat32_entry_name(parser, short_dst, name);
+		FAT_LOG_PRINTF(debug, "Read %s '%s'", dir->last_entry_was_dir ? "dir" : "file", name);
+	}
+
+	*was_written = TRUE;
+
+	return OK;
+}
+
+int do_read_dir_entry(fat32_dir_t* dir, fat32_dirent_t* dst, int* was_written,
+		endpoint_t who)
+{
+	fat32_entry_parser_t parser;
+	fat32_direntry_t short_entry;
+	char name[FAT32_MAX_NAME_LEN];
+	int ret;
+
+	if ((ret = read_next_entry(dir, &parser, &short_entry, name, was_written)) != OK) {
+		return ret;
+	}
+
+	if (*was_written) {
+		convert_entry(&short_entry, name, dst);
+	}
+
+	return OK;
+}
+
+/* Looks up a single name in the directory whose chain starts at dir_cluster,
+ * going through the dentry cache and the index of the directory first. If the
+ * directory has no index yet, it is scanned in full to build one. Returns
+ * ENOENT if there is no such entry. */
+static int lookup_name(fat32_fs_t* fs, int dir_cluster, const char* name,
+		fat32_dirent_t* dst)
+{
+	fat32_entry_parser_t parser;
+	fat32_direntry_t short_entry;
+	char entry_name[FAT32_MAX_NAME_LEN];
+	fat32_dirindex_t *index;
+	fat32_dir_t dir;
+	int was_written, found, slot_cluster, slot_offset, ret;
+
+	if (lookup_dentry(fs, dir_cluster, name, dst)) {
+		return OK;
+	}
+
+	if (lookup_dirindex(fs, dir_cluster, name, dst, &found, &slot_cluster, &slot_offset)) {
+		if (!found) {
+			return ENOENT;
+		}
+
+		add_dentry(fs, dir_cluster, name, dst, slot_cluster, slot_offset);
+		return OK;
+	}
+
+	// Scan with a directory that isn't in the handle table, as it never
+	// leaves this function.
+	memset(&dir, 0, sizeof(dir));
+	dir.nr = -1;
+	dir.fs = fs;
+	dir.active_cluster = dir_cluster;
+	if ((ret = cluster_cache_get(fs, dir_cluster, &dir.cluster)) != OK) {
+		return ret;
+	}
+
+	dir.cluster_buffer = dir.cluster->data;
+	index = dirindex_begin(fs, dir_cluster);
+
+	// Without an index, the scan can stop at the name.
+	ret = ENOENT;
+	do {
+		if (read_next_entry(&dir, &parser, &short_entry, entry_name, &was_written) != OK) {
+			ret = FAT32_ERR_IO;
+			break;
+		}
+
+		if (!was_written) {
+			break;
+		}
+
+		if (ret == ENOENT && strcasecmp(entry_name, name) == 0) {
+			convert_entry(&short_entry, entry_name, dst);
+			add_dentry(fs, dir_cluster, name, dst, dir.active_cluster,
+					dir.cluster_buffer_offset - 32);
+			ret = OK;
+		}
+
+		// Deleted entries and the volume label can't be looked up.
+		if (index != NULL && short_entry.filename_83[0] != 0xE5 &&
+				!(short_entry.attributes & FAT32_ATTR_VOLUMEID) &&
+				dirindex_add(index, entry_name, &short_entry, dir.active_cluster,
+					dir.cluster_buffer_offset - 32) != OK) {
+			dirindex_abort(index);
+			index = NULL;
+		}
+	} while (index != NULL || ret == ENOENT);
+
+	if (index != NULL) {
+		if (ret == FAT32_ERR_IO) {
+			dirindex_abort(index);
+		} else {
+			dirindex_commit(fs, index);
+		}
+	}
+
+	release_dir_cluster(&dir);
+	return ret;
+}
+
+int resolve_parent(fat32_fs_t* fs, const char* path, int* dir_cluster, char* name) {
+	fat32_dirent_t entry;
+	char *parent;
+	int ret;
+
+	// Trailing slashes don't make a name of their own.
+	size_t len = strlen(path);
+	while (len > 0 && path[len - 1] == '/') {
+		len--;
+	}
+
+	size_t start = len;
+	while (start > 0 && path[start - 1] != '/') {
+		start--;
+	}
+
+	if (len - start >= FAT32_MAX_NAME_LEN) {
+		return ENAMETOOLONG;
+	}
+
+	memcpy(name, path + start, len - start);
+	name[len - start] = '\0';
+
+	if ((parent = (char*) malloc(start + 1)) == NULL) {
+		return ENOMEM;
+	}
+
+	memcpy(parent, path, start);
+	parent[start] = '\0';
+	ret = do_open_path(fs, parent, FAT32_OPEN_PATH_STAT, &entry, NONE);
+	free(parent);
+	if (ret != OK) {
+		return ret;
+	}
+
+	if (!(entry.attributes & FAT32_ATTR_DIR)) {
+		return ENOTDIR;
+	}
+
+	*dir_cluster = entry.first_cluster;
+	return OK;
+}
+
+int do_open_path(fat32_fs_t* fs, const char* path, int flags, fat32_dirent_t* dst,
+		endpoint_t who)
+{
+	char name[FAT32_MAX_NAME_LEN];
+	int cluster_nr = fs->header.ebr.root_cluster_nr;
+	int ret;
+
+	// The root directory has no entry of its own, so make one up.
+	memset(dst, 0, sizeof(*dst));
+	dst->first_cluster = cluster_nr;
+	dst->attributes = FAT32_ATTR_DIR;
+
+	const char *p = path;
+	while (*p) {
+		if (*p == '/') {
+			p++;
+			continue;
+		}
+
+		const char *end = strchr(p, '/');
+		size_t len = end ? (size_t) (end - p) : strlen(p);
+		if (len >= FAT32_MAX_NAME_LEN) {
+			return ENAMETOOLONG;
+		}
+
+		memcpy(name, p, len);
+		name[len] = '\0';
+		p += len;
+
+		if (!(dst->attributes & FAT32_ATTR_DIR)) {
+			return ENOTDIR;
+		}
+
+		if (strcmp(name, ".") == 0) {
+			continue;
+		}
+
+		if ((ret = lookup_name(fs, cluster_nr, name, dst)) != OK) {
+			return ret;
+		}
+
+		cluster_nr = dst->first_cluster;
+		if ((dst->attributes & FAT32_ATTR_DIR) && cluster_nr == 0) {
+			// '..' pointing back to the root directory.
+			cluster_nr = fs->header.ebr.root_cluster_nr;
+			dst->first_cluster = cluster_nr;
+		}
+	}
+
+	switch (flags) {
+		case FAT32_OPEN_PATH_STAT:
+			return OK;
+
+		case FAT32_OPEN_PATH_DIR:
+			if (!(dst->attributes & FAT32_ATTR_DIR)) {
+				return ENOTDIR;
 			}
-			for (int i = 0; i < 2; i++) {
-				*pbuf++ = direntry->long_entry.chars_3[i];
+
+			return open_directory_at(fs, cluster_nr);
+
+		case FAT32_OPEN_PATH_FILE:
+			if (dst->attributes & FAT32_ATTR_DIR) {
+				return EISDIR;
 			}
 
-			// Find the length of this buffer. Even if the original string has no
-			// null terminator (i.e. its length fills the direntry char fields
-			// completely), we have a bit of leeway inside the buffer and we
-			// memset'd it to zero, so we're guaranteed to get to it.
-			int len = 0;
-			for (uint16_t* len_pbuf = temp_lfn_buf; *len_pbuf; len_pbuf++) {
-				len++;
+			return open_file_at(fs, cluster_nr, dst->size_bytes);
+
+		case FAT32_OPEN_PATH_WRITE:
+			if (dst->attributes & FAT32_ATTR_DIR) {
+				return EISDIR;
 			}
 
-			for (uint16_t* pbuf_r = temp_lfn_buf + len - 1; pbuf_r >= temp_lfn_buf; pbuf_r--) {
-				// Truncate 16 bits to only ASCII.
-				*pfname-- = (char)(*pbuf_r & 0xff);
-				if (pfname < filename_buf) {
-					// The filename is too big for our buffer.
-					FAT_LOG_PUTS(warn, "Long filename is too big for the buffer. Truncating.");
-					break;
+			return open_file_for_writing(fs, path);
+
+		default:
+			return EINVAL;
+	}
+}
+
+int filter_init(fat32_dir_filter_t* filter, const char* pattern, int match,
+		uint8_t attr_set, uint8_t attr_clear)
+{
+	char upper[FAT32_MAX_NAME_LEN];
+	size_t len = strlen(pattern);
+
+	if (match < FAT32_MATCH_ALL || match > FAT32_MATCH_GLOB) {
+		return EINVAL;
+	}
+
+	if (len >= FAT32_MAX_NAME_LEN) {
+		return ENAMETOOLONG;
+	}
+
+	memset(filter, 0, sizeof(*filter));
+	filter->match = match;
+	filter->attr_set = attr_set;
+	filter->attr_clear = attr_clear;
+	memcpy(filter->pattern, pattern, len + 1);
+
+	if (match == FAT32_MATCH_EXACT || match == FAT32_MATCH_PREFIX) {
+		filter->nr_units = fat32_utf8_to_utf16(pattern, filter->units,
+				FAT32_LFN_MAX_SLOTS * FAT32_LFN_CHARS);
+		if (filter->nr_units < 0) {
+			return EINVAL;
+		}
+	}
+
+	// Entries without a long name are shown by their 8.3 name, which can
+	// only be the pattern if the pattern is a valid 8.3 name, once in upper
+	// case.
+	if (match == FAT32_MATCH_EXACT) {
+		for (size_t i = 0; i <= len; i++) {
+			upper[i] = (char) toupper((unsigned char) pattern[i]);
+		}
+
+		filter->is_83 = fat32_make_short_name(upper, filter->filename_83);
+	}
+
+	return OK;
+}
+
+/* Tells whether an entry that read_next_entry left the name of in the parser
+ * passes a filter, and if it does, decodes its name into name. Names are
+ * compared in the form they are stored in as far as possible, so that most of
+ * those that don't match are never decoded. */
+static int filter_match(const fat32_dir_filter_t* filter, const fat32_entry_parser_t* parser,
+		const fat32_direntry_t* entry, char* name)
+{
+	int has_long_name = parser->name_slots != 0;
+
+	if ((entry->attributes & filter->attr_set) != filter->attr_set ||
+			(entry->attributes & filter->attr_clear) != 0) {
+		return FALSE;
+	}
+
+	switch (filter->match) {
+		case FAT32_MATCH_EXACT:
+			if (has_long_name) {
+				if (!fat32_long_name_match(parser, filter->units, filter->nr_units, FALSE)) {
+					return FALSE;
 				}
+			} else if (!filter->is_83 ||
+					!fat32_short_name_equal(entry->filename_83, filter->filename_83)) {
+				return FALSE;
 			}
-		} else {
-			short_entry = (fat32_direntry_t*) direntry;
-		}
-	} while (is_long_direntry);
+			break;
 
-	if (short_entry->attributes & FAT32_ATTR_DIR) {
-		dir->last_entry_was_dir = TRUE;
+		case FAT32_MATCH_PREFIX:
+			if (has_long_name &&
+					!fat32_long_name_match(parser, filter->units, filter->nr_units, TRUE)) {
+				return FALSE;
+			}
+			break;
 	}
 
-	int first_cluster_nr =
-		(short_entry->first_cluster_nr_high << 16) |
-		short_entry->first_cluster_nr_low;
+	fat32_entry_name(parser, entry, name);
+	if (filter->match == FAT32_MATCH_PREFIX && !has_long_name) {
+		return strncasecmp(name, filter->pattern, strlen(filter->pattern)) == 0;
+	}
 
-	// This is needed so that do_open_dir and do_open_file on this fs_dir_t can
-	// get to the correct info about the just-read file.
-	dir->last_entry_start_cluster = first_cluster_nr;
-	dir->last_entry_size_bytes = short_entry->size_bytes;
+	if (filter->match == FAT32_MATCH_GLOB) {
+		return fat32_glob_match(filter->pattern, name);
+	}
 
-	memset(dst, 0, sizeof(fat32_entry_t));
-	if (seen_long_direntry) {
-		strncpy(dst->filename, pfname + 1, FAT32_MAX_NAME_LEN);
-		dst->filename[FAT32_MAX_NAME_LEN - 1] = '\0';
-	} else {
-		filename_83_to_string(short_entry->filename_83, dst->filename);
+	return TRUE;
+}
+
+/* Does the work of do_read_dir_batch and do_read_dir_filter. filter is NULL
+ * if every entry is wanted. */
+static int read_dir_batch(fat32_dir_t* dir, const fat32_dir_filter_t* filter, vir_bytes dst,
+		size_t len, int* count, endpoint_t who)
+{
+	char *batch = worker_self()->dirent_batch;
+	fat32_entry_parser_t parser;
+	fat32_direntry_t short_entry;
+	char name[FAT32_MAX_NAME_LEN];
+	int was_written = TRUE;
+	size_t copied = 0;
+	int ret;
+
+	// An entry is only read once it is sure to fit, as there is no putting it
+	// back, so leave room for the longest name.
+	const size_t max_size = FAT32_DIRENT_SIZE(FAT32_MAX_NAME_LEN - 1);
+
+	*count = 0;
+	if (len < max_size) {
+		return EINVAL;
 	}
 
-	convert_entry(short_entry, dst);
+	// Entries are collected in a local batch, which is copied out whenever it
+	// fills up, so that a large buffer doesn't cost a copy per entry.
+	while (len - copied >= max_size && was_written) {
+		size_t used = 0;
+		int nr = 0;
+		while (FAT32_DIRENT_BATCH_SIZE - used >= max_size
+				&& len - copied - used >= max_size) {
+			if ((ret = read_next_entry(dir, &parser, &short_entry,
+							filter != NULL ? NULL : name, &was_written)) != OK) {
+				return ret;
+			}
 
-	FAT_LOG_PRINTF(debug, "Read %s '%s'", dst->is_directory ? "dir" : "file", dst->filename);
-	*was_written = TRUE;
+			if (!was_written) {
+				break;
+			}
 
+			if (filter != NULL && !filter_match(filter, &parser, &short_entry, name)) {
+				continue;
+			}
+
+			used += convert_entry(&short_entry, name, (fat32_dirent_t*) &batch[used]);
+			nr++;
+		}
+
+		if (nr == 0) {
+			break;
+		}
+
+		if ((ret = sys_vircopy(FAT32_PROC_NR, (vir_bytes) batch, who,
+						dst + copied, used, 0)) != OK) {
+			return ret;
+		}
+
+		copied += used;
+		*count += nr;
+	}
+
+	trace_set_bytes(copied);
 	return OK;
 }
 
+int do_read_dir_batch(fat32_dir_t* dir, vir_bytes dst, size_t len, int* count,
+		endpoint_t who)
+{
+	return read_dir_batch(dir, NULL, dst, len, count, who);
+}
+
+int do_read_dir_filter(fat32_dir_t* dir, const fat32_dir_filter_t* filter, vir_bytes dst,
+		size_t len, int* count, endpoint_t who)
+{
+	return read_dir_batch(dir, filter, dst, len, count, who);
+}
+
 int do_open_directory(fat32_dir_t* source, endpoint_t who) {
 	if (!source->last_entry_was_dir || source->last_entry_start_cluster < 0) {
 		return EINVAL;
 	}
 
-	int ret = OK;
-	fat32_dir_t *handle;
-	CREATE_HANDLE(dir, handle);
-
-	char* buf = (char*) malloc(source->fs->info.bytes_per_cluster);
-	if (!buf) {
-		ret = ENOMEM;
-		goto destroy_handle;
-	}
-
 	// do_open_directory opens the directory that was last returned from
 	// do_read_dir_entry, so we use this memoized cluster number now.
-	int cluster_nr = source->last_entry_start_cluster;
-	if ((ret = seek_read_cluster(&source->fs->header, &source->fs->info, source->fs->fd, cluster_nr, buf)) != OK) {
-		goto dealloc_buffer;
+	return open_directory_at(source->fs, source->last_entry_start_cluster);
+}
+
+int do_open_file(fat32_dir_t* source, endpoint_t who) {
+	if (source->last_entry_was_dir || source->last_entry_start_cluster < 0) {
+		return EINVAL;
 	}
 
-	handle->fs = source->fs;
-	handle->active_cluster = cluster_nr;
-	handle->cluster_buffer_offset = 0;
-	handle->cluster_buffer = buf;
+	return open_file_at(source->fs, source->last_entry_start_cluster,
+			(uint32_t) source->last_entry_size_bytes);
+}
 
-	return handle->nr;
+int do_open_entry(fat32_dir_t* source, int first_cluster, uint32_t size_bytes,
+		int attributes, endpoint_t who)
+{
+	fat32_fs_t *fs = source->fs;
 
-dealloc_buffer:
-	free(buf);
+	// The entry comes from the client, so make sure it at least points to a
+	// cluster that exists. Cluster 0 is only valid for the root directory
+	// (as seen in '..' entries) and for empty files.
+	if (first_cluster < 0 || first_cluster >= fs->info.total_clusters + 2) {
+		return EINVAL;
+	}
 
-destroy_handle:
-	dir_handle_count--;
-	dir_handle_next--;
+	if (first_cluster < 2) {
+		if (first_cluster != 0) {
+			return EINVAL;
+		}
 
-	return ret;
+		if (!(attributes & FAT32_ATTR_DIR) && size_bytes != 0) {
+			return EINVAL;
+		}
+	}
+
+	if (attributes & FAT32_ATTR_DIR) {
+		return open_directory_at(fs, first_cluster);
+	} else {
+		return open_file_at(fs, first_cluster, size_bytes);
+	}
 }
 
-int do_open_file(fat32_dir_t* source, endpoint_t who) {
-	if (source->last_entry_was_dir || source->last_entry_start_cluster < 0) {
+int do_read_file_block(fat32_file_t* file, vir_bytes dst, size_t len, size_t* nread,
+		endpoint_t who)
+{
+	int bpc = file->fs->info.bytes_per_cluster;
+	if (len < bpc) {
 		return EINVAL;
 	}
 
-	fat32_file_t *handle;
-	CREATE_HANDLE(file, handle);
+	// A block is whatever is left of the current cluster, which is the whole
+	// cluster unless a range read stopped in the middle of one.
+	return do_read_file_range(file, dst, bpc - file->position % bpc, nread, who);
+}
 
-	handle->fs = source->fs;
-	handle->active_cluster = source->last_entry_start_cluster;
-	handle->remaining_size = source->last_entry_size_bytes;
+/* Updates the read-ahead window of a file for a read starting at its current
+ * position, in the manner of rahead() in MFS: sequential reads grow the
+ * window, anything else collapses it. */
+static void update_read_ahead_window(fat32_file_t* file) {
+	fat32_fs_t *fs = file->fs;
+	int max_window = FAT32_READAHEAD_MAX_BYTES / fs->info.bytes_per_cluster;
 
-	return handle->nr;
+	// Don't let read-ahead push everything else out of the cache.
+	if (max_window > fs->cluster_cache.nr_slots / 4) {
+		max_window = fs->cluster_cache.nr_slots / 4;
+	}
+
+	if (file->position != file->ra_expected || max_window < 1) {
+		file->ra_window = 0;
+		file->ra_end = 0;
+		return;
+	}
+
+	if (file->ra_window == 0) {
+		file->ra_window = FAT32_READAHEAD_MIN_CLUSTERS;
+	} else {
+		file->ra_window *= 2;
+	}
+
+	if (file->ra_window > max_window) {
+		file->ra_window = max_window;
+	}
 }
 
-int do_read_file_block(fat32_file_t* file, char* buffer, int* len, endpoint_t who) {
-	if (*len < file->fs->info.bytes_per_cluster) {
-		return EINVAL;
+/* Prefetches the clusters of the read-ahead window that follow the current
+ * position into the cluster cache, a run of contiguous clusters at a time. On
+ * block devices the reads are only started, and the reply to the client
+ * doesn't wait for them. */
+static void read_ahead(fat32_file_t* file, char* buf, size_t buf_size) {
+	fat32_fs_t *fs = file->fs;
+	int bpc = fs->info.bytes_per_cluster;
+	int nr_clusters = (int) ((file->size_bytes + bpc - 1) / bpc);
+
+	int index = (int) (file->position / bpc);
+	int end = index + file->ra_window;
+	if (end > nr_clusters) {
+		end = nr_clusters;
 	}
 
-	*len = 0;
-	if (file->active_cluster == -1 || file->remaining_size == 0) {
-		// Means we have reached the end of this file and there are no more
-		// clusters. file->remaining_size may be 0 even if file->active_cluster
-		// is not -1 in some strange cases where new clusters are preallocated
-		// and the file ends exactly on a cluster boundary.
-		return OK;
+	int i = file->ra_end > index ? file->ra_end : index;
+	while (i < end) {
+		int cluster_nr, run_left;
+
+		extent_map_lookup(&file->extents, i, &cluster_nr, &run_left);
+		if (cluster_nr == -1) {
+			break;
+		}
+
+		if (cluster_cache_contains(fs, cluster_nr)) {
+			i++;
+			continue;
+		}
+
+		int count = run_left + 1;
+		if (count > end - i) {
+			count = end - i;
+		}
+
+		if (fs->dev.is_bdev) {
+			int started = cluster_cache_prefetch(fs, cluster_nr, count);
+			if (started <= 0) {
+				break;
+			}
+
+			i += started;
+			continue;
+		}
+
+		if (count > (int) (buf_size / bpc)) {
+			count = (int) (buf_size / bpc);
+		}
+
+		// Read-ahead is only a hint, so errors are left for the read that
+		// actually needs the data to report.
+		if (read_clusters(&fs->header, &fs->info, &fs->dev, cluster_nr, count, buf) != OK) {
+			break;
+		}
+
+		for (int j = 0; j < count; j++) {
+			cluster_cache_fill(fs, cluster_nr + j, buf + (size_t) j * bpc);
+		}
+
+		i += count;
 	}
 
+	file->ra_end = i;
+}
+
+int do_read_file_range(fat32_file_t* file, vir_bytes dst, size_t len, size_t* nread,
+		endpoint_t who)
+{
+	fat32_worker_t *worker = worker_self();
+	fat32_fs_t *fs = file->fs;
+	int bpc = fs->info.bytes_per_cluster;
 	int ret;
-	if ((ret = seek_read_cluster(&file->fs->header, &file->fs->info, file->fs->fd, file->active_cluster, buffer)) != OK) {
+
+	*nread = 0;
+	if (file->position >= file->size_bytes || len == 0) {
+		return OK;
+	}
+
+	if ((ret = worker_buffer(worker, bpc)) != OK) {
 		return ret;
 	}
 
-	if (file->remaining_size < file->fs->info.bytes_per_cluster) {
-		// The size remaining is less than what we've read, ensure that we don't
-		// read anything for this file anymore.
-		*len = file->remaining_size;
-		file->remaining_size = 0;
-		file->active_cluster = -1;
-	} else {
-		// The size remaining is 
-		*len = file->fs->info.bytes_per_cluster;
-		file->remaining_size -= file->fs->info.bytes_per_cluster;
+	char *read_buffer = worker->read_buffer;
+	size_t read_buffer_size = worker->read_buffer_size;
 
-		int prev_cluster = file->active_cluster;
-		if ((ret = advance_file_cluster(file)) != OK) {
-			return ret;
+	if ((ret = build_file_extents(file)) != OK) {
+		return ret;
+	}
+
+	update_read_ahead_window(file);
+
+	int max_clusters = read_buffer_size / bpc;
+	while (*nread < len && file->position < file->size_bytes) {
+		int index = file->position / bpc;
+		int offset = file->position % bpc;
+		int cluster_nr, run_left;
+
+		extent_map_lookup(&file->extents, index, &cluster_nr, &run_left);
+		trace_set_cluster(cluster_nr);
+		if (cluster_nr == -1) {
+			FAT_LOG_PRINTF(warn, "There is no cluster %d for file handle %d, but there are %d "
+					"bytes remaining to read", index, file->nr,
+					(int) (file->size_bytes - file->position));
+			break;
+		}
+
+		// Everything we still want that lies in this run of contiguous
+		// clusters is read at once, limited by the size of the buffer.
+		size_t want = len - *nread;
+		if (want > file->size_bytes - file->position) {
+			want = file->size_bytes - file->position;
+		}
+
+		int count = (int) ((offset + want + bpc - 1) / bpc);
+		if (count > run_left + 1) {
+			count = run_left + 1;
+		}
+		if (count > max_clusters) {
+			count = max_clusters;
+		}
+
+		if (want > (size_t) count * bpc - offset) {
+			want = (size_t) count * bpc - offset;
+		}
+
+		// Mapped images are copied from straight to the client.
+		char *mapped = dev_map(&fs->dev, cluster_offset(&fs->header, &fs->info, cluster_nr),
+				(size_t) count * bpc);
+		if (mapped != NULL) {
+			if ((ret = sys_vircopy(FAT32_PROC_NR, (vir_bytes) mapped + offset, who,
+							dst + *nread, want, 0)) != OK) {
+				return ret;
+			}
+
+			*nread += want;
+			file->position += want;
+			continue;
+		}
+
+		// Clusters that are cached (because another handle read them, or
+		// read-ahead got to them first) are taken from there. Other single
+		// clusters (small files, fragmented ones and block reads) are read
+		// through the cache, so that handles reading the same data share
+		// it. Longer runs are streamed past it, as they would only evict
+		// everything else.
+		fat32_cluster_t *cluster = cluster_cache_find(fs, cluster_nr);
+		if (cluster) {
+			if (want > (size_t) (bpc - offset)) {
+				want = bpc - offset;
+			}
 		}
 
-		if (file->active_cluster == -1 && file->remaining_size > 0) {
-			FAT_LOG_PRINTF(warn, "There is no next cluster after %d for file handle %d, but there are %d "
-					             "bytes remaining to read", prev_cluster, file->nr, file->remaining_size);
+		if (cluster || count == 1) {
+			if (!cluster && (ret = cluster_cache_get(fs, cluster_nr, &cluster)) != OK) {
+				return ret;
+			}
+
+			ret = sys_vircopy(FAT32_PROC_NR, (vir_bytes) cluster->data + offset, who,
+					dst + *nread, want, 0);
+			cluster_cache_put(fs, cluster);
+			if (ret != OK) {
+				return ret;
+			}
+		} else {
+			if ((ret = read_clusters(&fs->header, &fs->info, &fs->dev, cluster_nr,
+							count, read_buffer)) != OK) {
+				return ret;
+			}
+
+			// Changes that haven't been written back yet are only in the cache.
+			cluster_cache_overlay(fs, cluster_nr, count, read_buffer);
+			if ((ret = sys_vircopy(FAT32_PROC_NR, (vir_bytes) read_buffer + offset, who,
+							dst + *nread, want, 0)) != OK) {
+				return ret;
+			}
 		}
+
+		*nread += want;
+		file->position += want;
+	}
+
+	file->ra_expected = file->position;
+	if (file->ra_window > 0) {
+		read_ahead(file, read_buffer, read_buffer_size);
 	}
 
 	return OK;
 }
 
-int do_close_file(fat32_file_t* file, endpoint_t who) {
-	DESTROY_HANDLE(file, file);
-	FAT_LOG_PRINTF(debug, "destroying file %d", file->nr);
-	for (int i = 0; i < file_handle_count; i++) {
-		FAT_LOG_PRINTF(debug, "handle = %d", file_handles[i].nr);
+int do_seek_file(fat32_file_t* file, uint64_t offset, endpoint_t who) {
+	// FAT32 files can't be 4 GB or larger, so neither can positions in them.
+	if (offset > UINT32_MAX) {
+		return EINVAL;
 	}
 
+	file->position = (uint32_t) offset;
 	return OK;
 }
 
+int do_pread_file(fat32_file_t* file, uint64_t offset, vir_bytes dst, size_t len,
+		size_t* nread, endpoint_t who)
+{
+	int ret;
+	uint32_t position = file->position;
+	uint32_t ra_expected = file->ra_expected;
+	int ra_window = file->ra_window, ra_end = file->ra_end;
+
+	if ((ret = do_seek_file(file, offset, who)) != OK) {
+		return ret;
+	}
+
+	// Neither the position nor the read-ahead of the sequential reads
+	// around it are changed by a read at a given offset.
+	ret = do_read_file_range(file, dst, len, nread, who);
+	file->position = position;
+	file->ra_expected = ra_expected;
+	file->ra_window = ra_window;
+	file->ra_end = ra_end;
+
+	return ret;
+}
+
+int do_close_file(fat32_file_t* file, endpoint_t who) {
+	int ret = OK;
+
+	// The handle goes away even if the file can't be finished, as there is
+	// nothing the client could do about it.
+	if (file->is_writable) {
+		ret = finish_writing(file);
+	}
+
+	extent_map_free(&file->extents);
+	FAT_LOG_PRINTF(debug, "destroying file %d", file->nr);
+	DESTROY_HANDLE(file, file);
+
+	return ret;
+}
+
 int do_close_directory(fat32_dir_t* dir, endpoint_t who) {
-	free(dir->cluster_buffer);
+	release_dir_cluster(dir);
 	DESTROY_HANDLE(dir, dir);
 
 	return OK;
 }
 
 int do_close_fs(fat32_fs_t* fs, endpoint_t who) {
-	close(fs->fd);
+	// Directories and files that are still open would be left pointing at
+	// a filesystem that's gone (and pinning clusters of its cache), so they
+	// are closed along with it.
+	for (int i = 0; i < dir_handle_next; i++) {
+		if (dir_handles[i].nr != 0 && dir_handles[i].fs == fs) {
+			do_close_directory(&dir_handles[i], who);
+		}
+	}
+
+	for (int i = 0; i < file_handle_next; i++) {
+		if (file_handles[i].nr != 0 && file_handles[i].fs == fs) {
+			do_close_file(&file_handles[i], who);
+		}
+	}
+
+	writeback_close(fs);
+	freespace_close(fs);
+	cluster_cache_drain(fs);
+	mthread_cond_destroy(&fs->sync_done);
+	mthread_mutex_destroy(&fs->write_lock);
+	purge_dentries(fs);
+	purge_dirindexes(fs);
+	FAT_LOG_PRINTF(info, "FAT cache for fs %d: %u hits, %u misses, %d/%d sectors used",
+			fs->nr, fs->fat_cache.hits, fs->fat_cache.misses,
+			fs->fat_cache.nr_used, fs->fat_cache.nr_pages);
+	FAT_LOG_PRINTF(info, "Cluster cache for fs %d: %u hits, %u misses, %u evictions, "
+			"%u read ahead, %u KB resident", fs->nr, fs->cluster_cache.hits,
+			fs->cluster_cache.misses, fs->cluster_cache.evictions,
+			fs->cluster_cache.prefetched,
+			(unsigned int) ((size_t) fs->cluster_cache.nr_resident *
+				fs->info.bytes_per_cluster / 1024));
+	fat_cache_free(fs);
+	cluster_cache_free(fs);
+	dev_close(&fs->dev);
 	DESTROY_HANDLE(fs, fs);
 
 	return OK;
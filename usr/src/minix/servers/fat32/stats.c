@@ -0,0 +1,72 @@
+#include "inc.h"
+#include "mini-printf.h"
+#include <minix/minlib.h>
+
+/* Counters for FAT32_GET_STATS. They are plain variables, as workers don't
+ * preempt each other. Service times are measured with the TSC, as in the
+ * tracing of libblockdriver, from the moment a worker starts on a request to
+ * the moment it replies, so they include the time spent waiting for the
+ * device but not the time spent in the request queue. */
+
+fat32_stats_t fat32_stats;
+
+static clock_t stats_since;
+
+void stats_init(void) {
+	memset(&fat32_stats, 0, sizeof(fat32_stats));
+	if (getticks(&stats_since) != OK) {
+		stats_since = 0;
+	}
+}
+
+uint64_t stats_request_start(void) {
+	u64_t tsc;
+
+	read_tsc_64(&tsc);
+	return tsc;
+}
+
+void stats_request_done(int type, uint64_t start, int result) {
+	u64_t now;
+	int i = type - FAT32_BASE;
+
+	if (i < 0 || i >= FAT32_NR_REQUEST_TYPES) {
+		return;
+	}
+
+	read_tsc_64(&now);
+	fat32_stats.requests[i]++;
+	fat32_stats.service_us[i] += tsc_64_to_micros(now - start);
+	if (result != OK && result != EDONTREPLY) {
+		fat32_stats.errors[i]++;
+	}
+}
+
+int do_get_stats(vir_bytes dst, size_t len, int flags, endpoint_t who) {
+	clock_t ticks;
+	int ret;
+
+	if (len != sizeof(fat32_stats_t)) {
+		return EINVAL;
+	}
+
+	fat32_stats.open_fs = fs_handle_count;
+	fat32_stats.open_dirs = dir_handle_count;
+	fat32_stats.open_files = file_handle_count;
+	fat32_stats.uptime_s = 0;
+	if (getticks(&ticks) == OK) {
+		fat32_stats.uptime_s = (uint32_t) ((ticks - stats_since) / sys_hz());
+	}
+
+	if ((ret = sys_vircopy(FAT32_PROC_NR, (vir_bytes) &fat32_stats, who, dst,
+					sizeof(fat32_stats), 0)) != OK) {
+		return ret;
+	}
+
+	if (flags & FAT32_STATS_RESET) {
+		FAT_LOG_PRINTF(debug, "Statistics reset by %d", who);
+		stats_init();
+	}
+
+	return OK;
+}
@@ -0,0 +1,199 @@
+#include "inc.h"
+#include "mini-printf.h"
+#include <minix/minlib.h>
+
+/* Request tracing, in the manner of the block trace support of
+ * libblockdriver. While tracing is on, every request gets an entry with its
+ * type, handle, the first cluster it used, the number of bytes it returned,
+ * its result and its start and finish times. A worker fills in the entry of
+ * the request it is handling and adds it to the ring buffer when it replies,
+ * so entries never point into the buffer while it can be overwritten. */
+
+static int trace_enabled = FALSE;
+static fat32_trace_entry *trace_buf = NULL;
+static size_t trace_size = 0;
+static uint64_t trace_pos;  // Entries added since tracing was started
+static uint64_t trace_next; // Next entry to be copied out
+static u64_t trace_tsc;
+static int trace_epoch;     // Bumped on start, to drop requests from before
+
+/* Returns the current time, in microseconds since the start of the trace. */
+static u32_t trace_gettime(void) {
+	u64_t tsc;
+
+	read_tsc_64(&tsc);
+	return tsc_64_to_micros(tsc - trace_tsc);
+}
+
+/* Gets the handle a request is for, from the message it came in. */
+static uint32_t request_handle(message* m) {
+	switch (m->m_type) {
+		case FAT32_OPEN_FS:
+		case FAT32_GET_STATS:
+			return 0;
+
+		case FAT32_SEEK_FILE:
+		case FAT32_PREAD_FILE:
+		case FAT32_TRUNCATE_FILE:
+			return m->m_fat32_pread.handle;
+
+		default:
+			// All the other requests have the handle first.
+			return m->m_fat32_io_handle.handle;
+	}
+}
+
+void trace_start(fat32_worker_t* worker, message* m) {
+	fat32_trace_entry *entry = &worker->trace;
+
+	worker->is_tracing = FALSE;
+	if (!trace_enabled || m->m_type == FAT32_TRACE_CTL || m->m_type == FAT32_TRACE_GET) {
+		return;
+	}
+
+	entry->request = m->m_type - FAT32_BASE;
+	entry->handle = request_handle(m);
+	entry->cluster = 0;
+	entry->bytes = 0;
+	entry->result = FAT32_TRACE_INPROGRESS;
+	entry->worker = worker->nr;
+	entry->start_time = trace_gettime();
+	entry->finish_time = 0;
+
+	worker->trace_epoch = trace_epoch;
+	worker->is_tracing = TRUE;
+}
+
+void trace_set_cluster(int cluster_nr) {
+	fat32_worker_t *worker = worker_self();
+
+	if (worker && worker->is_tracing && worker->trace.cluster == 0 && cluster_nr > 0) {
+		worker->trace.cluster = cluster_nr;
+	}
+}
+
+void trace_set_bytes(size_t bytes) {
+	fat32_worker_t *worker = worker_self();
+
+	if (worker && worker->is_tracing) {
+		worker->trace.bytes = bytes;
+	}
+}
+
+void trace_finish(fat32_worker_t* worker, int result) {
+	if (!worker->is_tracing) {
+		return;
+	}
+
+	worker->is_tracing = FALSE;
+
+	// Tracing may have been stopped, or restarted, while we were waiting for
+	// the device.
+	if (!trace_enabled || worker->trace_epoch != trace_epoch) {
+		return;
+	}
+
+	worker->trace.result = result;
+	worker->trace.finish_time = trace_gettime();
+	trace_buf[trace_pos % trace_size] = worker->trace;
+	trace_pos++;
+}
+
+int do_trace_ctl(int ctl, size_t size, int* lost) {
+	*lost = 0;
+
+	switch (ctl) {
+		case FAT32_TRACE_START:
+			if (trace_enabled) {
+				return EBUSY;
+			}
+
+			if (size == 0 || size >= INT_MAX / sizeof(fat32_trace_entry)) {
+				return EINVAL;
+			}
+
+			free(trace_buf);
+			trace_size = 0;
+			if ((trace_buf = (fat32_trace_entry*) malloc(size * sizeof(fat32_trace_entry)))
+					== NULL) {
+				return ENOMEM;
+			}
+
+			trace_size = size;
+			trace_pos = 0;
+			trace_next = 0;
+			trace_epoch++;
+			read_tsc_64(&trace_tsc);
+			trace_enabled = TRUE;
+
+			FAT_LOG_PRINTF(debug, "Tracing started with %d entries", (int) size);
+			return OK;
+
+		case FAT32_TRACE_STOP:
+			if (!trace_enabled) {
+				return EINVAL;
+			}
+
+			trace_enabled = FALSE;
+			if (trace_pos > trace_size) {
+				*lost = (int) (trace_pos - trace_size);
+			}
+			return OK;
+
+		case FAT32_TRACE_FREE:
+			trace_enabled = FALSE;
+			free(trace_buf);
+			trace_buf = NULL;
+			trace_size = 0;
+			trace_pos = 0;
+			trace_next = 0;
+			return OK;
+
+		default:
+			return EINVAL;
+	}
+}
+
+int do_trace_get(vir_bytes dst, size_t len, endpoint_t who, int* count) {
+	size_t max_entries = len / sizeof(fat32_trace_entry);
+	int ret;
+
+	*count = 0;
+	if (trace_enabled) {
+		return EBUSY;
+	}
+
+	if (trace_buf == NULL) {
+		return EINVAL;
+	}
+
+	// Only the last trace_size entries are still there.
+	if (trace_pos - trace_next > trace_size) {
+		trace_next = trace_pos - trace_size;
+	}
+
+	while (*count < (int) max_entries && trace_next < trace_pos) {
+		size_t first = trace_next % trace_size;
+		size_t nr = trace_pos - trace_next;
+
+		// Copy up to the end of the buffer, and from its start in the next
+		// round.
+		if (nr > trace_size - first) {
+			nr = trace_size - first;
+		}
+		if (nr > max_entries - *count) {
+			nr = max_entries - *count;
+		}
+
+		if ((ret = sys_vircopy(FAT32_PROC_NR, (vir_bytes) &trace_buf[first], who,
+						dst + *count * sizeof(fat32_trace_entry),
+						nr * sizeof(fat32_trace_entry), 0)) != OK) {
+			return ret;
+		}
+
+		trace_next += nr;
+		*count += nr;
+	}
+
+	return OK;
+}
@@ -0,0 +1,168 @@
+#include "inc.h"
+#include "mini-printf.h"
+
+/* Requests are handled by a pool of libmthread worker threads, in the manner
+ * of VFS, so that a request that waits for the disk doesn't hold up those of
+ * other clients, which can often be answered from the caches. The main thread
+ * only receives messages: requests are handed to an idle worker (or queued if
+ * there is none) and replies from block drivers are passed on to libbdev,
+ * which wakes up the worker that is waiting for them.
+ *
+ * libmthread threads are not preemptive. A worker only gives up the CPU when
+ * it waits for the device or for a lock, and everything it does in between
+ * happens without interruption. */
+
+static fat32_worker_t workers[FAT32_NR_WORKERS];
+static mthread_attr_t worker_attr;
+
+// Requests that came in while all workers were busy. A client can only have
+// a single request outstanding, so there can never be more than NR_PROCS.
+static message request_queue[NR_PROCS];
+static int queue_head;
+static int queue_len;
+
+static void worker_sleep(fat32_worker_t* worker) {
+	mthread_mutex_lock(&worker->event_mutex);
+	while (!worker->has_event) {
+		mthread_cond_wait(&worker->event, &worker->event_mutex);
+	}
+
+	worker->has_event = FALSE;
+	mthread_mutex_unlock(&worker->event_mutex);
+}
+
+static void worker_wake(fat32_worker_t* worker) {
+	mthread_mutex_lock(&worker->event_mutex);
+	worker->has_event = TRUE;
+	mthread_cond_signal(&worker->event);
+	mthread_mutex_unlock(&worker->event_mutex);
+}
+
+/* Takes the oldest queued request, if there is one. */
+static int dequeue_request(message* dst) {
+	if (queue_len == 0) {
+		return FALSE;
+	}
+
+	*dst = request_queue[queue_head];
+	queue_head = (queue_head + 1) % NR_PROCS;
+	queue_len--;
+
+	return TRUE;
+}
+
+static void* worker_main(void* arg) {
+	fat32_worker_t *worker = (fat32_worker_t*) arg;
+
+	while (TRUE) {
+		worker_sleep(worker);
+
+		do {
+			handle_request(&worker->msg);
+		} while (dequeue_request(&worker->msg));
+
+		worker->is_busy = FALSE;
+	}
+
+	return NULL;
+}
+
+void worker_init(void) {
+	if (mthread_attr_init(&worker_attr) != 0) {
+		panic("fat32: failed to initialize thread attributes");
+	}
+
+	if (mthread_attr_setstacksize(&worker_attr, FAT32_WORKER_STACK_SIZE) != 0) {
+		panic("fat32: couldn't set the thread stack size");
+	}
+
+	if (mthread_attr_setdetachstate(&worker_attr, MTHREAD_CREATE_DETACHED) != 0) {
+		panic("fat32: couldn't set the thread detach state");
+	}
+
+	for (int i = 0; i < FAT32_NR_WORKERS; i++) {
+		fat32_worker_t *worker = &workers[i];
+
+		memset(worker, 0, sizeof(*worker));
+		worker->nr = i;
+		if (mthread_mutex_init(&worker->event_mutex, NULL) != 0) {
+			panic("fat32: failed to initialize mutex");
+		}
+
+		if (mthread_cond_init(&worker->event, NULL) != 0) {
+			panic("fat32: failed to initialize condition variable");
+		}
+
+		if (mthread_create(&worker->tid, &worker_attr, worker_main, worker) != 0) {
+			panic("fat32: unable to start worker thread");
+		}
+	}
+
+	// Let all workers get ready to accept work.
+	mthread_yield_all();
+	FAT_LOG_PRINTF(debug, "Started %d worker threads", FAT32_NR_WORKERS);
+}
+
+int worker_start(message* m) {
+	for (int i = 0; i < FAT32_NR_WORKERS; i++) {
+		fat32_worker_t *worker = &workers[i];
+		if (!worker->is_busy) {
+			worker->is_busy = TRUE;
+			worker->msg = *m;
+			worker_wake(worker);
+			return OK;
+		}
+	}
+
+	if (queue_len == NR_PROCS) {
+		FAT_LOG_PRINTF(warn, "Request queue is full, dropping request from %d", m->m_source);
+		if (m->m_source != SELF) {
+			m->m_type = EAGAIN;
+			reply(m->m_source, m);
+		}
+		return EAGAIN;
+	}
+
+	request_queue[(queue_head + queue_len) % NR_PROCS] = *m;
+	queue_len++;
+	return OK;
+}
+
+fat32_worker_t* worker_self(void) {
+	mthread_thread_t tid = mthread_self();
+
+	for (int i = 0; i < FAT32_NR_WORKERS; i++) {
+		if (mthread_equal(workers[i].tid, tid)) {
+			return &workers[i];
+		}
+	}
+
+	return NULL;
+}
+
+int worker_wait_io(fat32_worker_t* worker) {
+	worker_sleep(worker);
+	return worker->io_result;
+}
+
+void worker_io_done(fat32_worker_t* worker, int result) {
+	worker->io_result = result;
+	worker_wake(worker);
+}
+
+int worker_buffer(fat32_worker_t* worker, size_t min_size) {
+	// The buffer is shared by all files and only ever grows, so that it can
+	// hold at least a single cluster of any filesystem.
+	if (worker->read_buffer_size < min_size) {
+		size_t size = FAT32_READ_BUFFER_SIZE < min_size ? min_size : FAT32_READ_BUFFER_SIZE;
+		char *buf = (char*) realloc(worker->read_buffer, size);
+		if (!buf) {
+			return ENOMEM;
+		}
+
+		worker->read_buffer = buf;
+		worker->read_buffer_size = size;
+	}
+
+	return OK;
+}
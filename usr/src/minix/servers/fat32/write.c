@@ -0,0 +1,896 @@
+#include "inc.h"
+#include "fat32.h"
+#include "mini-printf.h"
+#include <strings.h>
+#include <ctype.h>
+
+/* Creating, writing, truncating and removing files. Requests that change a
+ * volume hold its write lock, so they are done one at a time, while requests
+ * that only read go on around them.
+ *
+ * Clusters are allocated before anything is written to them, and as many at
+ * once as the request needs (see alloc.c). Changes stay in the caches until
+ * they are written back (see writeback.c), which writes file data first, then
+ * the FAT, then the directory entries that point into it. A crash in between
+ * leaves at worst clusters that are allocated but not used by any file. The
+ * few changes that need the opposite order, such as removing a file, write
+ * back the directory entry before they free any clusters. The directory
+ * entries of open files are kept up to date by every request that changes
+ * them. */
+
+/* The most slots a FAT directory can have, as the ~n tails of short names
+ * and the 16 bit entry numbers of some systems assume. */
+#define FAT32_MAX_DIR_SLOTS 65536
+
+/* What scan_dir() found in a directory. */
+typedef struct dir_scan_t {
+	fat32_extent_map_t map; // The chain of the directory
+	int slots_per_cluster;
+	int nr_slots;
+
+	// The entry with the name looked for: the slot its long name starts at
+	// (or its short entry, if it has no long name) and its short entry.
+	int found;
+	int entry_start;
+	int entry_slot;
+	fat32_direntry_t short_entry;
+
+	// The first free slot and the first run of nr_free free slots, and
+	// where the free slots at the end of the directory start. -1 if there
+	// are none. Every slot from the end marker (a slot starting with 0x00)
+	// on is free, whatever is left in it.
+	int nr_free;
+	int first_free;
+	int free_start;
+	int free_tail;
+	int end;
+
+	// For a new entry, whether its 8.3 name is taken as it is, and which
+	// numeric tails of it are (a bit per n).
+	const uint8_t *basis;
+	int basis_taken;
+	uint8_t *tails;
+} dir_scan_t;
+
+/* The time of day, as clock_time() in MFS. */
+static time_t clock_time(void) {
+	clock_t uptime, realtime;
+	time_t boottime;
+
+	if (getuptime(&uptime, &realtime, &boottime) != OK) {
+		return 0;
+	}
+
+	return boottime + realtime / sys_hz();
+}
+
+/* Forgets what the caches know about the names of a directory that changed. */
+static void forget_dir(fat32_fs_t* fs, int dir_cluster) {
+	purge_dir_dentries(fs, dir_cluster);
+	drop_dir_dirindex(fs, dir_cluster);
+}
+
+/* Looks at every slot of a directory, for the entry with the given name (if
+ * name isn't NULL), for free slots and for the short names that a new entry
+ * can't have. Entries stop at the end marker, as they do for readers. The scan
+ * must be freed with extent_map_free(&scan->map). */
+static int scan_dir(fat32_fs_t* fs, int dir_cluster, const char* name, dir_scan_t* scan) {
+	fat32_entry_parser_t parser;
+	fat32_direntry_t short_entry;
+	char entry_name[FAT32_MAX_NAME_LEN];
+	uint8_t name_83[11];
+	char upper[13];
+	int long_start = -1, run_start = -1, is_83 = FALSE;
+	int ret;
+
+	// An entry with a long name is also known by its 8.3 name, which the
+	// name can only be if it is a valid 8.3 name once in upper case.
+	size_t len = name != NULL ? strlen(name) : sizeof(upper);
+	if (len < sizeof(upper)) {
+		for (size_t i = 0; i <= len; i++) {
+			upper[i] = (char) toupper((unsigned char) name[i]);
+		}
+
+		is_83 = fat32_make_short_name(upper, name_83);
+	}
+
+	scan->slots_per_cluster = fs->info.bytes_per_cluster / 32;
+	scan->found = FALSE;
+	scan->first_free = scan->free_start = scan->free_tail = scan->end = -1;
+	scan->basis_taken = FALSE;
+
+	memset(&scan->map, 0, sizeof(scan->map));
+	if ((ret = extent_map_build(fs, dir_cluster, fs->info.total_clusters, &scan->map)) != OK) {
+		return ret;
+	}
+
+	scan->nr_slots = scan->map.nr_clusters * scan->slots_per_cluster;
+	fat32_parser_reset(&parser);
+
+	for (int i = 0; i < scan->map.nr_clusters; i++) {
+		fat32_cluster_t *cluster;
+		int cluster_nr;
+
+		extent_map_lookup(&scan->map, i, &cluster_nr, NULL);
+		if ((ret = cluster_cache_get(fs, cluster_nr, &cluster)) != OK) {
+			return ret;
+		}
+
+		for (int j = 0; j < scan->slots_per_cluster; j++) {
+			int slot = i * scan->slots_per_cluster + j;
+			fat32_any_direntry_t *direntry = (fat32_any_direntry_t*) &cluster->data[j * 32];
+			uint8_t first = direntry->short_entry.filename_83[0];
+
+			if (first == 0x00 && scan->end == -1) {
+				scan->end = slot;
+			}
+
+			if (first == 0x00 || first == 0xE5 || scan->end != -1) {
+				if (run_start == -1) {
+					run_start = slot;
+				}
+
+				if (scan->first_free == -1) {
+					scan->first_free = slot;
+				}
+
+				if (scan->free_start == -1 && slot - run_start + 1 >= scan->nr_free) {
+					scan->free_start = run_start;
+				}
+
+				fat32_parser_reset(&parser);
+				continue;
+			}
+
+			run_start = -1;
+			if (direntry->short_entry.attributes == 0x0f) {
+				if (direntry->long_entry.ord & FAT32_LFN_LAST) {
+					long_start = slot;
+				}
+
+				fat32_parse_slot(&parser, direntry, &short_entry, entry_name);
+				continue;
+			}
+
+			// Whether the long name read so far goes with this entry.
+			int has_long = parser.nr_slots != 0 && parser.next_ord == 0 &&
+				parser.checksum == fat32_lfn_checksum(direntry->short_entry.filename_83);
+			fat32_parse_slot(&parser, direntry, &short_entry, entry_name);
+			if (short_entry.attributes & FAT32_ATTR_VOLUMEID) {
+				continue;
+			}
+
+			if (scan->basis != NULL) {
+				int n = fat32_short_tail(short_entry.filename_83, scan->basis);
+				if (n > 0 && n < FAT32_MAX_SHORT_TAIL) {
+					scan->tails[n / 8] |= (uint8_t) (1 << (n % 8));
+				} else if (memcmp(short_entry.filename_83, scan->basis, 11) == 0) {
+					scan->basis_taken = TRUE;
+				}
+			}
+
+			if (name != NULL && !scan->found && (strcasecmp(entry_name, name) == 0 ||
+						(is_83 && fat32_short_name_equal(short_entry.filename_83, name_83)))) {
+				scan->found = TRUE;
+				scan->entry_start = has_long ? long_start : slot;
+				scan->entry_slot = slot;
+				scan->short_entry = short_entry;
+			}
+		}
+
+		cluster_cache_put(fs, cluster);
+	}
+
+	scan->free_tail = run_start;
+	return OK;
+}
+
+/* Gets the cluster and the offset in it of a slot found by scan_dir(). */
+static void slot_position(dir_scan_t* scan, int slot, int* cluster_nr, int* offset) {
+	extent_map_lookup(&scan->map, slot / scan->slots_per_cluster, cluster_nr, NULL);
+	*offset = (slot % scan->slots_per_cluster) * 32;
+}
+
+/* Writes count slots of a directory starting at the given one, or marks them
+ * as deleted if slots is NULL. */
+static int change_slots(fat32_fs_t* fs, dir_scan_t* scan, int first, int count,
+		const fat32_any_direntry_t* slots)
+{
+	int ret = OK;
+
+	for (int i = 0; i < count && ret == OK; ) {
+		fat32_cluster_t *cluster;
+		int cluster_nr, offset;
+
+		slot_position(scan, first + i, &cluster_nr, &offset);
+		int n = (fs->info.bytes_per_cluster - offset) / 32;
+		if (n > count - i) {
+			n = count - i;
+		}
+
+		if ((ret = cluster_cache_get(fs, cluster_nr, &cluster)) != OK) {
+			break;
+		}
+
+		for (int j = 0; j < n; j++) {
+			fat32_any_direntry_t *slot = (fat32_any_direntry_t*) &cluster->data[offset + j * 32];
+			if (slots != NULL) {
+				*slot = slots[i + j];
+			} else {
+				slot->short_entry.filename_83[0] = 0xE5;
+			}
+		}
+
+		ret = cluster_cache_dirty(fs, cluster, FAT32_DIRTY_DIR);
+		cluster_cache_put(fs, cluster);
+		i += n;
+	}
+
+	return ret;
+}
+
+/* Adds zeroed clusters to a directory until there is room for nr_slots
+ * consecutive slots at its end, and writes the first of them to *start. The
+ * clusters are written right away, as the FAT will point to them before the
+ * entries in them are written back. */
+static int grow_dir(fat32_fs_t* fs, dir_scan_t* scan, int nr_slots, int* start) {
+	int bpc = fs->info.bytes_per_cluster;
+	int old_clusters = scan->map.nr_clusters;
+	char *zero;
+	int ret;
+
+	*start = scan->free_tail != -1 ? scan->free_tail : scan->nr_slots;
+	int count = (*start + nr_slots - scan->nr_slots + scan->slots_per_cluster - 1) /
+		scan->slots_per_cluster;
+	if (scan->nr_slots + count * scan->slots_per_cluster > FAT32_MAX_DIR_SLOTS) {
+		return ENOSPC;
+	}
+
+	if ((zero = (char*) calloc(1, bpc)) == NULL) {
+		return ENOMEM;
+	}
+
+	if ((ret = extend_chain(fs, &scan->map, count)) == OK) {
+		for (int i = old_clusters; i < scan->map.nr_clusters && ret == OK; i++) {
+			int cluster_nr;
+
+			extent_map_lookup(&scan->map, i, &cluster_nr, NULL);
+			if ((ret = write_clusters(&fs->header, &fs->info, &fs->dev, cluster_nr, 1,
+							zero)) == OK) {
+				cluster_cache_update(fs, cluster_nr, 1, zero);
+			}
+		}
+	}
+
+	if (ret != OK) {
+		shrink_chain(fs, &scan->map, old_clusters);
+	}
+
+	free(zero);
+	scan->nr_slots = scan->map.nr_clusters * scan->slots_per_cluster;
+	return ret;
+}
+
+/* Writes the size, first cluster and modification time of a file open for
+ * writing to its directory entry. */
+static int update_entry(fat32_file_t* file) {
+	fat32_fs_t *fs = file->fs;
+	fat32_cluster_t *cluster;
+	fat32_direntry_t *entry;
+	uint16_t fat_time, fat_date;
+	int first_cluster = file->first_cluster >= 2 ? file->first_cluster : 0;
+	int ret;
+
+	if ((ret = cluster_cache_get(fs, file->slot_cluster, &cluster)) != OK) {
+		return ret;
+	}
+
+	fat32_encode_time(clock_time(), &fat_time, &fat_date);
+	entry = (fat32_direntry_t*) &cluster->data[file->slot_offset];
+	entry->size_bytes = file->size_bytes;
+	entry->first_cluster_nr_high = (uint16_t) (first_cluster >> 16);
+	entry->first_cluster_nr_low = (uint16_t) (first_cluster & 0xffff);
+	entry->attributes |= FAT32_ATTR_ARCHIVE;
+	memcpy(&entry->last_modified_time, &fat_time, sizeof(uint16_t));
+	memcpy(&entry->last_modified_date, &fat_date, sizeof(uint16_t));
+	memcpy(&entry->last_access_date, &fat_date, sizeof(uint16_t));
+
+	// The names of the directory stay the same, so what the caches know
+	// about them only needs this one entry updated.
+	update_dentries(fs, file->dir_cluster, file->slot_cluster, file->slot_offset, entry);
+	update_dir_dirindex(fs, file->dir_cluster, file->slot_cluster, file->slot_offset, entry);
+	ret = cluster_cache_dirty(fs, cluster, FAT32_DIRTY_DIR);
+	cluster_cache_put(fs, cluster);
+
+	return ret;
+}
+
+/* Tells whether a file has handles open on it, other than except. Files are
+ * told apart by their first cluster and, for empty files being written, by
+ * the position of their entry. */
+static int file_is_open(fat32_fs_t* fs, int first_cluster, int slot_cluster, int slot_offset,
+		fat32_file_t* except)
+{
+	for (int i = 0; i < file_handle_next; i++) {
+		fat32_file_t *file = &file_handles[i];
+
+		if (file->nr == 0 || file->fs != fs || file == except) {
+			continue;
+		}
+
+		if ((first_cluster >= 2 && file->first_cluster == first_cluster) ||
+				(file->is_writable && file->slot_cluster == slot_cluster &&
+				 file->slot_offset == slot_offset)) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/* Copies n bytes from the address space of who into buf, or zeroes them if
+ * who is NONE. */
+static int copy_in(endpoint_t who, vir_bytes src, char* buf, size_t n) {
+	if (who == NONE) {
+		memset(buf, 0, n);
+		return OK;
+	}
+
+	return sys_vircopy(who, src, FAT32_PROC_NR, (vir_bytes) buf, n, 0);
+}
+
+/* Writes len bytes at the given position of a file, allocating the clusters
+ * it still needs first. If the volume fills up, as much as there is room for
+ * is written. The size of the file is updated, but not its entry. */
+static int write_range(fat32_file_t* file, uint32_t pos, size_t len, vir_bytes src,
+		endpoint_t who, size_t* nwritten)
+{
+	fat32_worker_t *worker = worker_self();
+	fat32_fs_t *fs = file->fs;
+	int bpc = fs->info.bytes_per_cluster;
+	int ret;
+
+	*nwritten = 0;
+	if (len == 0) {
+		return OK;
+	}
+
+	if ((ret = worker_buffer(worker, bpc)) != OK) {
+		return ret;
+	}
+
+	// Clusters past the end of the file hold nothing worth reading.
+	int fresh_from = (int) (((uint64_t) file->size_bytes + bpc - 1) / bpc);
+	int needed = (int) (((uint64_t) pos + len + bpc - 1) / bpc);
+	if (needed > file->extents.nr_clusters) {
+		ret = extend_chain(fs, &file->extents, needed - file->extents.nr_clusters);
+		if (file->first_cluster < 2 && file->extents.nr_clusters > 0) {
+			file->first_cluster = file->extents.extents[0].start_cluster;
+		}
+
+		if (ret != OK) {
+			uint64_t room = (uint64_t) file->extents.nr_clusters * bpc;
+			if (ret != ENOSPC || room <= pos) {
+				return ret;
+			}
+
+			len = (size_t) (room - pos);
+		}
+	}
+
+	int max_clusters = worker->read_buffer_size / bpc;
+	ret = OK;
+	while (*nwritten < len) {
+		uint32_t at = pos + *nwritten;
+		int offset = at % bpc;
+		size_t left = len - *nwritten;
+		int cluster_nr, run_left;
+
+		extent_map_lookup(&file->extents, at / bpc, &cluster_nr, &run_left);
+		trace_set_cluster(cluster_nr);
+
+		// Whole clusters that are consecutive on the device are written at
+		// once, limited by the size of the buffer.
+		int count = (int) (left / bpc);
+		if (count > run_left + 1) {
+			count = run_left + 1;
+		}
+		if (count > max_clusters) {
+			count = max_clusters;
+		}
+
+		// Part of a cluster, or a few whole ones, go into the cache and are
+		// written back later, so that small writes that follow each other
+		// end up in the same write to the device.
+		if (offset != 0 || left < (size_t) bpc ||
+				(size_t) count * bpc < FAT32_WRITE_DIRECT_BYTES) {
+			fat32_cluster_t *cluster;
+			size_t n = bpc - offset;
+			if (n > left) {
+				n = left;
+			}
+
+			if ((int) (at / bpc) >= fresh_from) {
+				ret = cluster_cache_zero(fs, cluster_nr, &cluster);
+			} else {
+				ret = cluster_cache_get(fs, cluster_nr, &cluster);
+			}
+			if (ret != OK) {
+				break;
+			}
+
+			if ((ret = copy_in(who, src + *nwritten, cluster->data + offset, n)) == OK) {
+				ret = cluster_cache_dirty(fs, cluster, FAT32_DIRTY_DATA);
+			}
+
+			cluster_cache_put(fs, cluster);
+			if (ret != OK) {
+				break;
+			}
+
+			*nwritten += n;
+			continue;
+		}
+
+		size_t n = (size_t) count * bpc;
+		if ((ret = copy_in(who, src + *nwritten, worker->read_buffer, n)) != OK) {
+			break;
+		}
+
+		if ((ret = write_clusters(&fs->header, &fs->info, &fs->dev, cluster_nr, count,
+						worker->read_buffer)) != OK) {
+			break;
+		}
+
+		cluster_cache_update(fs, cluster_nr, count, worker->read_buffer);
+		*nwritten += n;
+	}
+
+	if (pos + *nwritten > file->size_bytes) {
+		file->size_bytes = pos + *nwritten;
+	}
+
+	return ret;
+}
+
+int do_create_file(fat32_fs_t* fs, const char* path, uint32_t size_hint, endpoint_t who) {
+	uint16_t units[FAT32_LFN_MAX_SLOTS * FAT32_LFN_CHARS];
+	fat32_any_direntry_t slots[FAT32_LFN_MAX_SLOTS + 1];
+	char name[FAT32_MAX_NAME_LEN];
+	uint8_t basis[11];
+	fat32_extent_map_t map;
+	fat32_direntry_t *entry;
+	fat32_file_t *file;
+	dir_scan_t scan;
+	uint16_t fat_time, fat_date;
+	int bpc = fs->info.bytes_per_cluster;
+	int dir_cluster, nr_units, nr_slots, start, cluster_nr, offset, ret;
+
+	if (!fs->dev.is_writable) {
+		return EROFS;
+	}
+
+	if ((ret = resolve_parent(fs, path, &dir_cluster, name)) != OK) {
+		return ret;
+	}
+
+	if (!fat32_valid_name(name) ||
+			(nr_units = fat32_utf8_to_utf16(name, units, FAT32_LFN_MAX_SLOTS * FAT32_LFN_CHARS)) < 0) {
+		return EINVAL;
+	}
+
+	if (nr_units > FAT32_MAX_NAME_LEN - 1) {
+		return ENAMETOOLONG;
+	}
+
+	int is_exact = fat32_make_short_name(name, basis);
+
+	memset(&scan, 0, sizeof(scan));
+	memset(&map, 0, sizeof(map));
+	scan.nr_free = (nr_units + FAT32_LFN_CHARS - 1) / FAT32_LFN_CHARS + 1;
+	scan.basis = basis;
+	if ((scan.tails = (uint8_t*) calloc(FAT32_MAX_SHORT_TAIL / 8 + 1, 1)) == NULL) {
+		return ENOMEM;
+	}
+
+	writeback_lock(fs);
+	if ((ret = scan_dir(fs, dir_cluster, name, &scan)) != OK) {
+		goto unlock;
+	}
+
+	if (scan.found) {
+		ret = EEXIST;
+		goto unlock;
+	}
+
+	// Names that don't fit 8.3 as they are, or whose 8.3 form is taken, get
+	// the first free numeric tail and keep their name in long name slots.
+	memset(slots, 0, sizeof(slots));
+	entry = &slots[0].short_entry;
+	nr_slots = 0;
+	if (is_exact && !scan.basis_taken) {
+		memcpy(entry->filename_83, basis, 11);
+	} else {
+		int n = 1;
+		while (n < FAT32_MAX_SHORT_TAIL && (scan.tails[n / 8] & (1 << (n % 8)))) {
+			n++;
+		}
+
+		if (n == FAT32_MAX_SHORT_TAIL) {
+			ret = ENOSPC;
+			goto unlock;
+		}
+
+		uint8_t filename_83[11];
+		fat32_set_short_tail(filename_83, basis, n);
+		nr_slots = fat32_make_lfn_slots(units, nr_units, fat32_lfn_checksum(filename_83),
+				&slots[0].long_entry);
+		entry = &slots[nr_slots].short_entry;
+		memcpy(entry->filename_83, filename_83, 11);
+	}
+	nr_slots++;
+
+	// Files whose size is known up front get all their clusters at once.
+	// That's only a hint, so a volume that is too full for them is no
+	// reason to fail.
+	map.is_built = TRUE;
+	if (size_hint > 0) {
+		ret = extend_chain(fs, &map, (int) (((uint64_t) size_hint + bpc - 1) / bpc));
+		if (ret != OK && ret != ENOSPC) {
+			goto free_clusters;
+		}
+	}
+
+	start = nr_slots == 1 ? scan.first_free : scan.free_start;
+	if (start == -1 && (ret = grow_dir(fs, &scan, nr_slots, &start)) != OK) {
+		goto free_clusters;
+	}
+
+	fat32_encode_time(clock_time(), &fat_time, &fat_date);
+	int first_cluster = map.nr_clusters > 0 ? map.extents[0].start_cluster : 0;
+	entry->attributes = FAT32_ATTR_ARCHIVE;
+	entry->first_cluster_nr_high = (uint16_t) (first_cluster >> 16);
+	entry->first_cluster_nr_low = (uint16_t) (first_cluster & 0xffff);
+	memcpy(&entry->creation_time, &fat_time, sizeof(uint16_t));
+	memcpy(&entry->creation_date, &fat_date, sizeof(uint16_t));
+	memcpy(&entry->last_modified_time, &fat_time, sizeof(uint16_t));
+	memcpy(&entry->last_modified_date, &fat_date, sizeof(uint16_t));
+	memcpy(&entry->last_access_date, &fat_date, sizeof(uint16_t));
+
+	// Write-back puts the clusters into the FAT before the entry that points
+	// to them.
+	ret = change_slots(fs, &scan, start, nr_slots, slots);
+
+	// An entry that goes past the end marker moves it to the slot after it,
+	// or whatever was left after the marker would show up.
+	if (ret == OK && scan.end != -1 && start + nr_slots > scan.end &&
+			start + nr_slots < scan.nr_slots) {
+		fat32_any_direntry_t end_slot;
+
+		memset(&end_slot, 0, sizeof(end_slot));
+		ret = change_slots(fs, &scan, start + nr_slots, 1, &end_slot);
+	}
+	forget_dir(fs, dir_cluster);
+	if (ret != OK) {
+		goto free_clusters;
+	}
+
+	writeback_check(fs);
+	slot_position(&scan, start + nr_slots - 1, &cluster_nr, &offset);
+	if ((ret = open_file_at(fs, first_cluster, 0)) < 0) {
+		// The file is there, but the client will have to open it. Only
+		// finish_writing() would give back what was preallocated, so the
+		// file is left empty.
+		if (map.nr_clusters > 0) {
+			entry->first_cluster_nr_high = 0;
+			entry->first_cluster_nr_low = 0;
+			if (change_slots(fs, &scan, start + nr_slots - 1, 1, &slots[nr_slots - 1]) == OK) {
+				shrink_chain(fs, &map, 0);
+			}
+			forget_dir(fs, dir_cluster);
+			writeback_check(fs);
+		}
+
+		extent_map_free(&map);
+		goto unlock;
+	}
+
+	file = find_file_handle(ret);
+	file->is_writable = TRUE;
+	file->dir_cluster = dir_cluster;
+	file->slot_cluster = cluster_nr;
+	file->slot_offset = offset;
+	file->extents = map;
+	FAT_LOG_PRINTF(debug, "Created '%s' in %d slots at %d, %d clusters at %d", name,
+			nr_slots, start, map.nr_clusters, first_cluster);
+	goto unlock;
+
+free_clusters:
+	shrink_chain(fs, &map, 0);
+	writeback_check(fs);
+	extent_map_free(&map);
+
+unlock:
+	writeback_unlock(fs);
+	extent_map_free(&scan.map);
+	free(scan.tails);
+
+	return ret;
+}
+
+int open_file_for_writing(fat32_fs_t* fs, const char* path) {
+	char name[FAT32_MAX_NAME_LEN];
+	fat32_file_t *file;
+	dir_scan_t scan;
+	int dir_cluster, cluster_nr, offset, ret;
+
+	if (!fs->dev.is_writable) {
+		return EROFS;
+	}
+
+	if ((ret = resolve_parent(fs, path, &dir_cluster, name)) != OK) {
+		return ret;
+	}
+
+	memset(&scan, 0, sizeof(scan));
+	writeback_lock(fs);
+	if ((ret = scan_dir(fs, dir_cluster, name, &scan)) != OK) {
+		goto unlock;
+	}
+
+	if (!scan.found) {
+		ret = ENOENT;
+		goto unlock;
+	}
+
+	if (scan.short_entry.attributes & FAT32_ATTR_DIR) {
+		ret = EISDIR;
+		goto unlock;
+	}
+
+	if (scan.short_entry.attributes & FAT32_ATTR_READONLY) {
+		ret = EACCES;
+		goto unlock;
+	}
+
+	// A file is written through one handle at a time.
+	int first_cluster = ((int) scan.short_entry.first_cluster_nr_high << 16) |
+		scan.short_entry.first_cluster_nr_low;
+	slot_position(&scan, scan.entry_slot, &cluster_nr, &offset);
+	for (int i = 0; i < file_handle_next; i++) {
+		if (file_handles[i].nr != 0 && file_handles[i].fs == fs && file_handles[i].is_writable &&
+				file_handles[i].slot_cluster == cluster_nr &&
+				file_handles[i].slot_offset == offset) {
+			ret = EBUSY;
+			goto unlock;
+		}
+	}
+
+	if ((ret = open_file_at(fs, first_cluster, scan.short_entry.size_bytes)) < 0) {
+		goto unlock;
+	}
+
+	// The extent map of the handle covers the whole chain, so that clusters
+	// past the end of the file are used before new ones are allocated.
+	file = find_file_handle(ret);
+	if (first_cluster >= 2) {
+		int build_ret = extent_map_build(fs, first_cluster, fs->info.total_clusters,
+				&file->extents);
+		if (build_ret != OK) {
+			do_close_file(file, NONE);
+			ret = build_ret;
+			goto unlock;
+		}
+	} else {
+		file->extents.is_built = TRUE;
+	}
+
+	file->is_writable = TRUE;
+	file->dir_cluster = dir_cluster;
+	file->slot_cluster = cluster_nr;
+	file->slot_offset = offset;
+
+unlock:
+	writeback_unlock(fs);
+	extent_map_free(&scan.map);
+
+	return ret;
+}
+
+int do_write_file(fat32_file_t* file, vir_bytes src, size_t len, int flags,
+		size_t* nwritten, endpoint_t who)
+{
+	fat32_fs_t *fs = file->fs;
+	size_t filled = 0;
+	int ret = OK;
+
+	*nwritten = 0;
+	if (!file->is_writable) {
+		return EBADF;
+	}
+
+	writeback_lock(fs);
+	if (flags & FAT32_WRITE_APPEND) {
+		file->position = file->size_bytes;
+	}
+
+	// FAT32 files can't be 4 GB or larger.
+	if (len > UINT32_MAX - file->position) {
+		len = UINT32_MAX - file->position;
+		if (len == 0) {
+			writeback_unlock(fs);
+			return EFBIG;
+		}
+	}
+
+	// Writing past the end leaves a gap, which reads as zeroes.
+	if (file->position > file->size_bytes) {
+		size_t gap = file->position - file->size_bytes;
+
+		ret = write_range(file, file->size_bytes, gap, 0, NONE, &filled);
+		if (ret == OK && filled < gap) {
+			ret = ENOSPC;
+		}
+	}
+
+	if (ret == OK) {
+		ret = write_range(file, file->position, len, src, who, nwritten);
+		file->position += *nwritten;
+
+		// What could be written counts, like a short write.
+		if (*nwritten > 0) {
+			ret = OK;
+		} else if (ret == OK && len > 0) {
+			ret = ENOSPC;
+		}
+	}
+
+	if (*nwritten > 0 || filled > 0) {
+		int update_ret = update_entry(file);
+		if (ret == OK) {
+			ret = update_ret;
+		}
+	}
+
+	writeback_check(fs);
+	writeback_unlock(fs);
+
+	return ret;
+}
+
+int do_truncate_file(fat32_file_t* file, uint64_t size, endpoint_t who) {
+	fat32_fs_t *fs = file->fs;
+	int bpc = fs->info.bytes_per_cluster;
+	int ret = OK;
+
+	if (!file->is_writable) {
+		return EBADF;
+	}
+
+	if (size > UINT32_MAX) {
+		return EFBIG;
+	}
+
+	writeback_lock(fs);
+	if (size < file->size_bytes) {
+		int nr_clusters = (int) ((size + bpc - 1) / bpc);
+
+		// The entry has to stop pointing past the new end before the
+		// clusters there are freed.
+		file->size_bytes = (uint32_t) size;
+		if (nr_clusters == 0) {
+			file->first_cluster = 0;
+		}
+
+		ret = update_entry(file);
+		if (ret == OK && nr_clusters < file->extents.nr_clusters &&
+				(ret = writeback_sync(fs)) == OK) {
+			ret = shrink_chain(fs, &file->extents, nr_clusters);
+		}
+	} else if (size > file->size_bytes) {
+		size_t filled, gap = (size_t) (size - file->size_bytes);
+
+		ret = write_range(file, file->size_bytes, gap, 0, NONE, &filled);
+		if (ret == OK && filled < gap) {
+			ret = ENOSPC;
+		}
+
+		int update_ret = update_entry(file);
+		if (ret == OK) {
+			ret = update_ret;
+		}
+	}
+
+	writeback_check(fs);
+	writeback_unlock(fs);
+
+	return ret;
+}
+
+int do_unlink(fat32_fs_t* fs, const char* path, endpoint_t who) {
+	char name[FAT32_MAX_NAME_LEN];
+	dir_scan_t scan;
+	int dir_cluster, cluster_nr, offset, ret;
+
+	if (!fs->dev.is_writable) {
+		return EROFS;
+	}
+
+	if ((ret = resolve_parent(fs, path, &dir_cluster, name)) != OK) {
+		return ret;
+	}
+
+	if (!fat32_valid_name(name)) {
+		return EINVAL;
+	}
+
+	memset(&scan, 0, sizeof(scan));
+	writeback_lock(fs);
+	if ((ret = scan_dir(fs, dir_cluster, name, &scan)) != OK) {
+		goto unlock;
+	}
+
+	if (!scan.found) {
+		ret = ENOENT;
+		goto unlock;
+	}
+
+	if (scan.short_entry.attributes & FAT32_ATTR_DIR) {
+		ret = EISDIR;
+		goto unlock;
+	}
+
+	if (scan.short_entry.attributes & FAT32_ATTR_READONLY) {
+		ret = EACCES;
+		goto unlock;
+	}
+
+	int first_cluster = ((int) scan.short_entry.first_cluster_nr_high << 16) |
+		scan.short_entry.first_cluster_nr_low;
+	slot_position(&scan, scan.entry_slot, &cluster_nr, &offset);
+	if (file_is_open(fs, first_cluster, cluster_nr, offset, NULL)) {
+		ret = EBUSY;
+		goto unlock;
+	}
+
+	// The entry is written back first, so that a crash can only leave
+	// clusters that nothing uses.
+	ret = change_slots(fs, &scan, scan.entry_start, scan.entry_slot - scan.entry_start + 1, NULL);
+	forget_dir(fs, dir_cluster);
+	if (ret != OK || (ret = writeback_sync(fs)) != OK) {
+		goto unlock;
+	}
+
+	ret = free_chain(fs, first_cluster);
+	writeback_check(fs);
+
+unlock:
+	writeback_unlock(fs);
+	extent_map_free(&scan.map);
+
+	return ret;
+}
+
+int finish_writing(fat32_file_t* file) {
+	fat32_fs_t *fs = file->fs;
+	int bpc = fs->info.bytes_per_cluster;
+	int nr_clusters = (int) (((uint64_t) file->size_bytes + bpc - 1) / bpc);
+	int ret = OK;
+
+	writeback_lock(fs);
+	if (nr_clusters == 0 && file->first_cluster >= 2) {
+		file->first_cluster = 0;
+		if ((ret = update_entry(file)) == OK) {
+			ret = writeback_sync(fs);
+		}
+	}
+
+	if (ret == OK) {
+		ret = shrink_chain(fs, &file->extents, nr_clusters);
+	}
+
+	writeback_check(fs);
+	writeback_unlock(fs);
+
+	return ret;
+}
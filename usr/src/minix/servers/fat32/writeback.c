@@ -0,0 +1,168 @@
+#include "inc.h"
+#include "mini-printf.h"
+#include <minix/endpoint.h>
+
+/* Write-back of the changes to a filesystem. Requests that change a volume
+ * only change the FAT cache and the cluster cache, and those changes are
+ * written back together: when a client asks for it with FAT32_SYNC, when a
+ * filesystem holds more of them than writeback_budget (or than its caches
+ * can take), some time after the first one, and when it is closed. Appending
+ * to a file a little at a time costs a few large writes that way, rather than
+ * a write of its last cluster, its FAT sector (for every copy of the FAT) and
+ * its directory entry each time.
+ *
+ * The timer goes off in the main thread, which can't wait for the device, so
+ * it hands a FAT32_SYNC request to a worker as if a client had sent it. */
+
+size_t writeback_budget;
+int writeback_delay;
+
+/* Bytes of changes a filesystem holds that aren't on the device yet. */
+static size_t dirty_bytes(fat32_fs_t* fs) {
+	return (size_t) fs->cluster_cache.nr_dirty * fs->info.bytes_per_cluster +
+		(size_t) fs->fat_cache.nr_dirty * fs->header.bpb.bytes_per_sector;
+}
+
+static void writeback_expired(minix_timer_t* tp) {
+	fat32_fs_t *fs = find_fs_handle(tmr_arg(tp)->ta_int);
+	message m;
+
+	if (fs == NULL) {
+		return;
+	}
+
+	fs->is_timer_set = FALSE;
+	fs->nr_syncs++;
+	memset(&m, 0, sizeof(m));
+	m.m_source = SELF;
+	m.m_type = FAT32_SYNC;
+	m.m_fat32_io_handle.handle = fs->nr;
+	if (worker_start(&m) != OK) {
+		fs->nr_syncs--;
+	}
+}
+
+void writeback_open(fat32_fs_t* fs) {
+	init_timer(&fs->writeback_timer);
+	fs->is_timer_set = FALSE;
+	fs->writer = NULL;
+	fs->nr_syncs = 0;
+}
+
+int writeback_close(fat32_fs_t* fs) {
+	int ret;
+
+	if (fs->is_timer_set) {
+		cancel_timer(&fs->writeback_timer);
+		fs->is_timer_set = FALSE;
+	}
+
+	if ((ret = do_sync(fs, NONE)) != OK) {
+		FAT_LOG_PRINTF(warn, "Changes to fs %d couldn't be written back: %d", fs->nr, ret);
+	}
+
+	// A sync the timer started before may still be waiting for a worker or
+	// for the write lock, and the filesystem must outlive it.
+	writeback_lock(fs);
+	while (fs->nr_syncs > 0) {
+		fs->writer = NULL;
+		mthread_cond_wait(&fs->sync_done, &fs->write_lock);
+		fs->writer = worker_self();
+	}
+	writeback_unlock(fs);
+
+	return ret;
+}
+
+void writeback_timed_sync(fat32_fs_t* fs) {
+	int ret;
+
+	writeback_lock(fs);
+	if ((ret = writeback_sync(fs)) != OK) {
+		FAT_LOG_PRINTF(warn, "Changes to fs %d couldn't be written back: %d", fs->nr, ret);
+	}
+
+	if (--fs->nr_syncs == 0) {
+		mthread_cond_signal(&fs->sync_done);
+	}
+	writeback_unlock(fs);
+}
+
+void writeback_lock(fat32_fs_t* fs) {
+	mthread_mutex_lock(&fs->write_lock);
+	fs->writer = worker_self();
+}
+
+void writeback_unlock(fat32_fs_t* fs) {
+	fs->writer = NULL;
+	mthread_mutex_unlock(&fs->write_lock);
+}
+
+int writeback_is_locked(fat32_fs_t* fs) {
+	return fs->writer != NULL && fs->writer == worker_self();
+}
+
+int writeback_sync(fat32_fs_t* fs) {
+	int ret;
+
+	if ((ret = cluster_cache_flush(fs, FAT32_DIRTY_DATA)) != OK) {
+		return ret;
+	}
+
+	if ((ret = fat_cache_flush(fs)) != OK) {
+		return ret;
+	}
+
+	if ((ret = cluster_cache_flush(fs, FAT32_DIRTY_DIR)) != OK) {
+		return ret;
+	}
+
+	if ((ret = freespace_flush(fs)) != OK) {
+		return ret;
+	}
+
+	fat32_stats.syncs++;
+	return OK;
+}
+
+void writeback_check(fat32_fs_t* fs) {
+	size_t limit = writeback_budget;
+	size_t bytes = dirty_bytes(fs);
+	int ret;
+
+	if (bytes == 0 && !fs->freespace.fsinfo_dirty) {
+		return;
+	}
+
+	// Dirty clusters and FAT sectors can't be evicted, so they mustn't take
+	// up more than half of either cache. A budget of 0 writes everything
+	// through.
+	if (limit > (size_t) fs->cluster_cache.nr_slots * fs->info.bytes_per_cluster / 2) {
+		limit = (size_t) fs->cluster_cache.nr_slots * fs->info.bytes_per_cluster / 2;
+	}
+
+	if (limit == 0 || bytes > limit || fs->fat_cache.nr_dirty > fs->fat_cache.nr_pages / 2) {
+		if ((ret = writeback_sync(fs)) != OK) {
+			FAT_LOG_PRINTF(warn, "Changes to fs %d couldn't be written back: %d",
+					fs->nr, ret);
+		}
+
+		return;
+	}
+
+	if (!fs->is_timer_set && writeback_delay > 0) {
+		set_timer(&fs->writeback_timer, writeback_delay * sys_hz(), writeback_expired,
+				fs->nr);
+		fs->is_timer_set = TRUE;
+	}
+}
+
+int do_sync(fat32_fs_t* fs, endpoint_t who) {
+	int ret;
+
+	writeback_lock(fs);
+	ret = writeback_sync(fs);
+	writeback_unlock(fs);
+
+	return ret;
+}